@@ -0,0 +1,599 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Compression benchmark for the chat server.  Starts the server built
+  by the makefile in framed event loop mode, puts a number of receivers
+  and one sender in the lobby, and has the sender paste long messages
+  made of log-like lines, which compress about as well as real pastes.
+
+  This is done twice: once with receivers that take plain frames only,
+  and once with receivers that said hello with FRAME_FEATURE_DEFLATE,
+  so the server compresses every message once and sends all of them
+  the compressed frame.  For each it prints the bytes on the wire per
+  delivered message, and the CPU time per delivered message spent by
+  the server and by the receivers (which inflate what they get).
+
+  Usage:
+    compression_bench [--receivers count] [--messages count]
+      [--size bytes] [--server path] [-- server options]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../src/server.h"
+#include "../src/frame.h"
+
+char *PROG_NAME;
+
+const int DEFAULT_RECEIVERS = 50;
+const int DEFAULT_MESSAGES = 200;
+const int DEFAULT_MESSAGE_SIZE = 16384;
+const char *DEFAULT_SERVER = "./server";
+
+// The longest message the server takes by default.
+const int MAX_MESSAGE_SIZE = 1024 * 1024;
+
+// Big enough for any message with its room name in front.
+#define MAX_PAYLOAD_SIZE (1024 * 1024 + FRAME_MAX_ROOM_NAME_LENGTH + 2)
+
+// How much is read from a connection at a time.
+#define READ_BUFFER_SIZE 262144
+
+// How long the server gets to start listening, and to take everyone's
+// hellos before we start sending.
+const int SERVER_START_TIMEOUT_MS = 5000;
+const int SETTLE_MS = 500;
+
+// How long we wait for stragglers once sending stops.
+const int DRAIN_TIMEOUT_MS = 10000;
+
+// Every receiver has to be able to hold everything sent, since the
+// benchmark is about the bytes and not about keeping up.
+const char *SEND_QUEUE_LENGTH = "100000";
+
+const int MAX_EPOLL_EVENTS = 256;
+
+struct bench_options_t {
+  int numReceivers;
+  int numMessages;
+  int messageSize;
+  const char *server;
+  // Extra arguments for the server.
+  char **serverArgs;
+  int numServerArgs;
+};
+
+struct receiver_t {
+  int fd;
+  struct frame_parser_t parser;
+  char *payload;
+};
+
+// What one run measured.
+struct result_t {
+  unsigned long deliveries;
+  unsigned long wireBytes;
+  // Messages that didn't come out the length they went in.
+  unsigned long corrupt;
+  long serverMicros;
+  long receiverMicros;
+};
+
+static pid_t serverPid = 0;
+static int serverPort;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void parseArguments(int argc, char **argv, struct bench_options_t *options);
+int parsePositiveOption(const char *name, const char *value);
+void displayUsageString();
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+long nowNanos();
+
+/*
+  Returns the CPU time, user and system, in rusage in microseconds.
+*/
+long cpuMicros(struct rusage *usage);
+
+/*
+  Returns a port on the loopback interface that nobody is using.
+*/
+int findFreePort();
+
+/*
+  Starts the server in framed event loop mode on serverPort, with its
+  output thrown away.
+*/
+void startServer(struct bench_options_t *options);
+
+/*
+  Stops the server, and returns the CPU time it used in microseconds.
+*/
+long stopServer();
+void killServer();
+
+/*
+  Connects to the server, retrying until it is listening or timeoutMs
+  has passed.
+
+  Terminates the program on failure.
+*/
+int connectToServer(int timeoutMs);
+
+/*
+  Writes a whole frame to fd, which must be blocking.
+*/
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length);
+
+/*
+  Fills text with length bytes of log lines.
+*/
+void makePaste(char *text, int length, unsigned seed);
+
+/*
+  Reads what is ready on every receiver for up to timeoutMs, counting
+  deliveries and wire bytes in result.
+*/
+void pollReceivers(int epollFd, struct epoll_event *events, int timeoutMs,
+  int messageSize, struct result_t *result);
+
+/*
+  Reads what is ready on receiver, inflating compressed messages.
+*/
+void readReceiver(struct receiver_t *receiver, int messageSize, struct result_t *result);
+
+/*
+  Runs the benchmark once, with receivers that take compressed messages
+  if compress is set.
+*/
+struct result_t runOnce(struct bench_options_t *options, bool compress);
+
+void printResult(const char *name, struct result_t *result, struct bench_options_t *options);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench_options_t options = {
+    .numReceivers = DEFAULT_RECEIVERS,
+    .numMessages = DEFAULT_MESSAGES,
+    .messageSize = DEFAULT_MESSAGE_SIZE,
+    .server = DEFAULT_SERVER,
+  };
+  parseArguments(argc, argv, &options);
+  atexit(killServer);
+
+  fprintf(stdout, "%d receivers, %d messages of %d bytes\n",
+    options.numReceivers, options.numMessages, options.messageSize);
+  struct result_t plain = runOnce(&options, false);
+  printResult("plain", &plain, &options);
+  struct result_t compressed = runOnce(&options, true);
+  printResult("deflate", &compressed, &options);
+  if (plain.wireBytes > 0 && compressed.deliveries > 0) {
+    fprintf(stdout, "deflate sends %.1f%% of the bytes\n",
+      100.0 * ((double)compressed.wireBytes / compressed.deliveries) /
+      ((double)plain.wireBytes / plain.deliveries));
+  }
+
+  unsigned long expected = (unsigned long)options.numReceivers * options.numMessages;
+  if (plain.deliveries != expected || compressed.deliveries != expected ||
+    plain.corrupt > 0 || compressed.corrupt > 0) {
+    fputs("FAIL: messages were lost or garbled\n", stdout);
+    return 1;
+  }
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void parseArguments(int argc, char **argv, struct bench_options_t *options) {
+  // Skip the first item, since that points to the executable.
+  for (--argc, ++argv; argc > 0; --argc, ++argv) {
+    if (strcmp(*argv, "--") == 0) {
+      options->serverArgs = argv + 1;
+      options->numServerArgs = argc - 1;
+      return;
+    } else if (argc > 1 && strcmp(*argv, "--server") == 0) {
+      options->server = *(++argv);
+      --argc;
+    } else if (argc > 1 && strcmp(*argv, "--receivers") == 0) {
+      options->numReceivers = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--messages") == 0) {
+      options->numMessages = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--size") == 0) {
+      options->messageSize = parsePositiveOption(*argv, *(argv + 1));
+      if (options->messageSize > MAX_MESSAGE_SIZE) {
+        options->messageSize = MAX_MESSAGE_SIZE;
+      }
+      --argc;
+      ++argv;
+    } else {
+      fprintf(stderr, "%s: Unknown option '%s'\n", PROG_NAME, *argv);
+      displayUsageString();
+      exit(EXIT_ERROR_ARGUMENT);
+    }
+  }
+}
+
+int parsePositiveOption(const char *name, const char *value) {
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || parsed <= 0 || parsed > 1000000000L) {
+    fprintf(stderr, "%s: %s must be a positive number, not '%s'\n", PROG_NAME, name, value);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  return (int)parsed;
+}
+
+void displayUsageString() {
+  fputs("Usage:\n\
+    compression_bench [--receivers count] [--messages count]\n\
+      [--size bytes] [--server path] [-- server options]\n", stderr);
+}
+
+long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+long cpuMicros(struct rusage *usage) {
+  return (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000L +
+    usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+int findFreePort() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  // Let the kernel pick one.
+  socklen_t addressLength = sizeof(address);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    getsockname(fd, (struct sockaddr *)&address, &addressLength) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+void startServer(struct bench_options_t *options) {
+  serverPort = findFreePort();
+  char port[16];
+  snprintf(port, sizeof(port), "%d", serverPort);
+  char **argv = calloc(options->numServerArgs + 7, sizeof(char *));
+  if (argv == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  int argc = 0;
+  argv[argc++] = (char *)options->server;
+  argv[argc++] = "--epoll";
+  argv[argc++] = "--framed";
+  argv[argc++] = "--send-queue";
+  argv[argc++] = (char *)SEND_QUEUE_LENGTH;
+  for (int i = 0; i < options->numServerArgs; ++i) {
+    argv[argc++] = options->serverArgs[i];
+  }
+  argv[argc++] = port;
+  argv[argc] = NULL;
+
+  serverPid = fork();
+  if (serverPid < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  if (serverPid == 0) {
+    // The server prints every message it passes on.
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0) {
+      dup2(devNull, STDOUT_FILENO);
+      close(devNull);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(EXIT_ERROR_ARGUMENT);
+  }
+  free(argv);
+}
+
+long stopServer() {
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  kill(serverPid, SIGTERM);
+  wait4(serverPid, NULL, 0, &usage);
+  serverPid = 0;
+  return cpuMicros(&usage);
+}
+
+void killServer() {
+  if (serverPid > 0) {
+    kill(serverPid, SIGKILL);
+    waitpid(serverPid, NULL, 0);
+    serverPid = 0;
+  }
+}
+
+int connectToServer(int timeoutMs) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(serverPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  long giveUp = nowNanos() + timeoutMs * 1000000L;
+  while (true) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+      return fd;
+    }
+    int connectErrno = errno;
+    close(fd);
+    if (connectErrno != ECONNREFUSED || nowNanos() > giveUp) {
+      errno = connectErrno;
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    // The server may not be listening yet; it may also have died.
+    if (waitpid(serverPid, NULL, WNOHANG) == serverPid) {
+      serverPid = 0;
+      fprintf(stderr, "%s: The server exited\n", PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    usleep(10000);
+  }
+}
+
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length) {
+  char header[FRAME_MAX_HEADER_LENGTH];
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = frame_encode_header(header, type, length);
+  iov[1].iov_base = (char *)payload;
+  iov[1].iov_len = length;
+
+  int numIov = 2;
+  struct iovec *next = iov;
+  while (numIov > 0) {
+    ssize_t written = writev(fd, next, numIov);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    while (numIov > 0 && (size_t)written >= next->iov_len) {
+      written -= next->iov_len;
+      ++next;
+      --numIov;
+    }
+    if (numIov > 0) {
+      next->iov_base = (char *)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+}
+
+void makePaste(char *text, int length, unsigned seed) {
+  static const char *LEVELS[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+  int position = 0;
+  for (int line = 0; position < length; ++line) {
+    seed = seed * 1103515245 + 12345;
+    char buffer[160];
+    int lineLength = snprintf(buffer, sizeof(buffer),
+      "2026-10-16 12:%02d:%02d.%03u %s worker-%u processed request id=%08x in %ums\n",
+      line / 60 % 60, line % 60, seed % 1000, LEVELS[(seed >> 8) % 5],
+      (seed >> 12) % 16, seed, (seed >> 4) % 500);
+    if (lineLength > length - position) {
+      lineLength = length - position;
+    }
+    memcpy(text + position, buffer, lineLength);
+    position += lineLength;
+  }
+}
+
+void pollReceivers(int epollFd, struct epoll_event *events, int timeoutMs,
+  int messageSize, struct result_t *result) {
+  int ready = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeoutMs);
+  if (ready < 0) {
+    if (errno == EINTR) {
+      return;
+    }
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  for (int i = 0; i < ready; ++i) {
+    readReceiver(events[i].data.ptr, messageSize, result);
+  }
+}
+
+void readReceiver(struct receiver_t *receiver, int messageSize, struct result_t *result) {
+  static char buffer[READ_BUFFER_SIZE];
+  static char inflated[MAX_PAYLOAD_SIZE];
+
+  while (true) {
+    ssize_t chars = read(receiver->fd, buffer, READ_BUFFER_SIZE);
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+      return;
+    }
+    if (chars == 0) {
+      fprintf(stderr, "%s: The server closed a connection\n", PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    result->wireBytes += chars;
+
+    const char *data = buffer;
+    size_t length = chars;
+    while (length > 0) {
+      size_t consumed;
+      enum FRAME_RESULT_T parsed = frame_parse(&receiver->parser, data, length, &consumed);
+      data += consumed;
+      length -= consumed;
+      if (parsed == FRAME_ERROR) {
+        fprintf(stderr, "%s: Bad frame from the server\n", PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+      if (parsed == FRAME_INCOMPLETE) {
+        break;
+      }
+
+      // Skip the room name.
+      struct frame_parser_t *parser = &receiver->parser;
+      const char *room = receiver->payload;
+      size_t roomLength = strnlen(room, parser->length);
+      const char *text = room + roomLength + 1;
+      size_t textLength = (roomLength < parser->length) ? parser->length - roomLength - 1 : 0;
+      if (parser->type == FRAME_ROOM_MESSAGE_DEFLATE) {
+        uLongf inflatedLength = sizeof(inflated);
+        if (uncompress((Bytef *)inflated, &inflatedLength, (const Bytef *)text, textLength) != Z_OK) {
+          inflatedLength = 0;
+        }
+        textLength = inflatedLength;
+      }
+      if (parser->type == FRAME_ROOM_MESSAGE || parser->type == FRAME_ROOM_MESSAGE_DEFLATE) {
+        ++result->deliveries;
+        if (textLength != (size_t)messageSize) {
+          ++result->corrupt;
+        }
+      }
+      frame_parser_reset(&receiver->parser, receiver->payload, MAX_PAYLOAD_SIZE - 1);
+    }
+  }
+}
+
+struct result_t runOnce(struct bench_options_t *options, bool compress) {
+  struct result_t result;
+  memset(&result, 0, sizeof(result));
+
+  startServer(options);
+  struct receiver_t *receivers = calloc(options->numReceivers, sizeof(struct receiver_t));
+  struct epoll_event *events = calloc(MAX_EPOLL_EVENTS, sizeof(struct epoll_event));
+  char *text = malloc(options->messageSize);
+  if (receivers == NULL || events == NULL || text == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  // Everyone starts out in the lobby, which is all we need.
+  int sender = connectToServer(SERVER_START_TIMEOUT_MS);
+  for (int i = 0; i < options->numReceivers; ++i) {
+    struct receiver_t *receiver = &receivers[i];
+    receiver->fd = connectToServer(0);
+    receiver->payload = malloc(MAX_PAYLOAD_SIZE);
+    if (receiver->payload == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    frame_parser_reset(&receiver->parser, receiver->payload, MAX_PAYLOAD_SIZE - 1);
+    if (compress) {
+      sendFrame(receiver->fd, FRAME_HELLO, FRAME_FEATURE_DEFLATE, strlen(FRAME_FEATURE_DEFLATE));
+    }
+    if (fcntl(receiver->fd, F_SETFL, O_NONBLOCK) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = receiver;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, receiver->fd, &event) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+  usleep(SETTLE_MS * 1000);
+
+  struct rusage before;
+  getrusage(RUSAGE_SELF, &before);
+  unsigned long expected = (unsigned long)options->numReceivers * options->numMessages;
+  for (int i = 0; i < options->numMessages; ++i) {
+    makePaste(text, options->messageSize, i);
+    sendFrame(sender, FRAME_MESSAGE, text, options->messageSize);
+    pollReceivers(epollFd, events, 0, options->messageSize, &result);
+  }
+  long drainStart = nowNanos();
+  while (result.deliveries < expected && nowNanos() - drainStart < DRAIN_TIMEOUT_MS * 1000000L) {
+    pollReceivers(epollFd, events, 10, options->messageSize, &result);
+  }
+  struct rusage after;
+  getrusage(RUSAGE_SELF, &after);
+  // Generating the messages is counted too, but is the same both times.
+  result.receiverMicros = cpuMicros(&after) - cpuMicros(&before);
+
+  result.serverMicros = stopServer();
+  close(sender);
+  for (int i = 0; i < options->numReceivers; ++i) {
+    close(receivers[i].fd);
+    free(receivers[i].payload);
+  }
+  close(epollFd);
+  free(text);
+  free(events);
+  free(receivers);
+  return result;
+}
+
+void printResult(const char *name, struct result_t *result, struct bench_options_t *options) {
+  unsigned long deliveries = (result->deliveries > 0) ? result->deliveries : 1;
+  fprintf(stdout, "%-8s %lu of %lu delivered, %.0f bytes/delivery, server %.1fus CPU/delivery, "
+    "receivers %.1fus CPU/delivery\n",
+    name, result->deliveries, (unsigned long)options->numReceivers * options->numMessages,
+    (double)result->wireBytes / deliveries, (double)result->serverMicros / deliveries,
+    (double)result->receiverMicros / deliveries);
+  if (result->corrupt > 0) {
+    fprintf(stdout, "%-8s %lu messages came out the wrong length\n", name, result->corrupt);
+  }
+}
@@ -0,0 +1,448 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Measures what idle connections cost the chat server in memory.
+  Starts the server built by the makefile in framed event loop mode,
+  opens a number of connections that each say hello, join a room and
+  then go quiet, and reports how much the server's resident set grew
+  per connection.  A fresh server is started for each count, 10000 and
+  100000 by default.
+
+  Every connection needs a file descriptor on each side, so the hard
+  limit on open files has to allow for the largest count; counts it
+  doesn't allow for are skipped.  Connections come from several
+  loopback addresses, so the ephemeral ports don't run out.
+
+  Usage:
+    idle_bench [--connections count]... [--rooms count] [--server path]
+      [-- server options]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../src/server.h"
+#include "../src/frame.h"
+
+char *PROG_NAME;
+
+const int DEFAULT_ROOMS = 100;
+const char *DEFAULT_SERVER = "./server";
+
+// The counts measured unless given on the command line.
+static const int DEFAULT_CONNECTIONS[] = {10000, 100000};
+#define MAX_COUNTS 16
+
+// File descriptors we keep for ourselves, besides the connections.
+const int SPARE_FILES = 32;
+
+// How many connections come from each loopback address, well within
+// the ephemeral port range.
+const int CONNECTIONS_PER_ADDRESS = 20000;
+
+// How long the server gets to start listening, and how often its
+// resident set is sampled while it settles.  It has settled once
+// SETTLED_SAMPLES samples in a row agree, or after SETTLE_TIMEOUT_MS.
+const int SERVER_START_TIMEOUT_MS = 5000;
+const int SAMPLE_INTERVAL_MS = 100;
+const int SETTLED_SAMPLES = 5;
+const int SETTLE_TIMEOUT_MS = 10000;
+
+struct bench_options_t {
+  int counts[MAX_COUNTS];
+  int numCounts;
+  int numRooms;
+  const char *server;
+  // Extra arguments for the server.
+  char **serverArgs;
+  int numServerArgs;
+};
+
+static pid_t serverPid = 0;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void parseArguments(int argc, char **argv, struct bench_options_t *options);
+int parsePositiveOption(const char *name, const char *value);
+void displayUsageString();
+
+/*
+  Raises the soft limit on open files up to the hard limit, and returns
+  how many connections that leaves room for.
+*/
+int raiseConnectionLimit();
+
+/*
+  Returns a port on the loopback interface that nobody is using.
+*/
+int findFreePort();
+
+/*
+  Starts the server in framed event loop mode on port, taking up to
+  maxClients, with its output thrown away.
+*/
+void startServer(struct bench_options_t *options, int port, int maxClients);
+void stopServer();
+
+/*
+  Returns the server's resident set in bytes.
+*/
+long serverRss();
+
+/*
+  Samples the server's resident set until it stops changing, and
+  returns it.
+*/
+long settledRss();
+
+/*
+  Connects connection number index to the server on port, from the
+  loopback address its number picks, retrying for up to timeoutMs
+  while the server isn't listening yet.
+
+  Terminates the program on failure.
+*/
+int connectToServer(int port, int index, int timeoutMs);
+
+/*
+  Writes a whole frame to the blocking socket fd.
+*/
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length);
+
+/*
+  Measures count idle connections against a fresh server, and prints
+  what they cost.
+*/
+void measure(struct bench_options_t *options, int count);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench_options_t options = {
+    .numCounts = 0,
+    .numRooms = DEFAULT_ROOMS,
+    .server = DEFAULT_SERVER,
+  };
+  parseArguments(argc, argv, &options);
+  if (options.numCounts == 0) {
+    options.numCounts = sizeof(DEFAULT_CONNECTIONS) / sizeof(DEFAULT_CONNECTIONS[0]);
+    memcpy(options.counts, DEFAULT_CONNECTIONS, sizeof(DEFAULT_CONNECTIONS));
+  }
+
+  int maxConnections = raiseConnectionLimit();
+  fprintf(stdout, "Idle connections, server run with --epoll --framed");
+  for (int i = 0; i < options.numServerArgs; ++i) {
+    fprintf(stdout, " %s", options.serverArgs[i]);
+  }
+  fprintf(stdout, ":\n");
+
+  for (int i = 0; i < options.numCounts; ++i) {
+    if (options.counts[i] > maxConnections) {
+      fprintf(stdout, "  %7d connections: skipped, the open file limit only allows %d\n",
+        options.counts[i], maxConnections);
+      continue;
+    }
+    measure(&options, options.counts[i]);
+  }
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void parseArguments(int argc, char **argv, struct bench_options_t *options) {
+  // Skip the first item, since that points to the executable.
+  for (--argc, ++argv; argc > 0; --argc, ++argv) {
+    if (strcmp(*argv, "--") == 0) {
+      options->serverArgs = argv + 1;
+      options->numServerArgs = argc - 1;
+      return;
+    } else if (argc > 1 && strcmp(*argv, "--server") == 0) {
+      options->server = *(++argv);
+      --argc;
+    } else if (argc > 1 && strcmp(*argv, "--connections") == 0) {
+      if (options->numCounts == MAX_COUNTS) {
+        fprintf(stderr, "%s: At most %d --connections\n", PROG_NAME, MAX_COUNTS);
+        exit(EXIT_ERROR_ARGUMENT);
+      }
+      options->counts[options->numCounts++] = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--rooms") == 0) {
+      options->numRooms = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else {
+      fprintf(stderr, "%s: Unknown option '%s'\n", PROG_NAME, *argv);
+      displayUsageString();
+      exit(EXIT_ERROR_ARGUMENT);
+    }
+  }
+}
+
+int parsePositiveOption(const char *name, const char *value) {
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || parsed <= 0 || parsed > 1000000000L) {
+    fprintf(stderr, "%s: %s must be a positive number, not '%s'\n", PROG_NAME, name, value);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  return (int)parsed;
+}
+
+void displayUsageString() {
+  fputs("Usage:\n\
+    idle_bench [--connections count]... [--rooms count] [--server path]\n\
+      [-- server options]\n", stderr);
+}
+
+int raiseConnectionLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+  }
+  // The server gets the same limit, and needs a few more of its own.
+  long connections = (long)limit.rlim_cur - SPARE_FILES;
+  return (connections > 1000000000L) ? 1000000000 : (int)connections;
+}
+
+int findFreePort() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  // Let the kernel pick one.
+  socklen_t addressLength = sizeof(address);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    getsockname(fd, (struct sockaddr *)&address, &addressLength) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+void startServer(struct bench_options_t *options, int port, int maxClients) {
+  char portString[16];
+  char maxClientsString[16];
+  snprintf(portString, sizeof(portString), "%d", port);
+  snprintf(maxClientsString, sizeof(maxClientsString), "%d", maxClients);
+  char **argv = calloc(options->numServerArgs + 7, sizeof(char *));
+  if (argv == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  int argc = 0;
+  argv[argc++] = (char *)options->server;
+  argv[argc++] = "--epoll";
+  argv[argc++] = "--framed";
+  argv[argc++] = "--max-clients";
+  argv[argc++] = maxClientsString;
+  for (int i = 0; i < options->numServerArgs; ++i) {
+    argv[argc++] = options->serverArgs[i];
+  }
+  argv[argc++] = portString;
+  argv[argc] = NULL;
+
+  serverPid = fork();
+  if (serverPid < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  if (serverPid == 0) {
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0) {
+      dup2(devNull, STDOUT_FILENO);
+      close(devNull);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(EXIT_ERROR_ARGUMENT);
+  }
+  free(argv);
+  static bool stopRegistered = false;
+  if (!stopRegistered) {
+    atexit(stopServer);
+    stopRegistered = true;
+  }
+}
+
+void stopServer() {
+  if (serverPid > 0) {
+    kill(serverPid, SIGTERM);
+    waitpid(serverPid, NULL, 0);
+    serverPid = 0;
+  }
+}
+
+long serverRss() {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)serverPid);
+  FILE *status = fopen(path, "r");
+  if (status == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  char line[256];
+  long rss = -1;
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) {
+      break;
+    }
+  }
+  fclose(status);
+  if (rss < 0) {
+    fprintf(stderr, "%s: Couldn't read the server's resident set\n", PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  return rss * 1024;
+}
+
+long settledRss() {
+  long rss = serverRss();
+  int sameSamples = 0;
+  for (int waited = 0; sameSamples < SETTLED_SAMPLES && waited < SETTLE_TIMEOUT_MS;
+    waited += SAMPLE_INTERVAL_MS) {
+    usleep(SAMPLE_INTERVAL_MS * 1000);
+    long sample = serverRss();
+    sameSamples = (sample == rss) ? sameSamples + 1 : 0;
+    rss = sample;
+  }
+  return rss;
+}
+
+int connectToServer(int port, int index, int timeoutMs) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Every address in 127/8 is loopback.
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = 0;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / CONNECTIONS_PER_ADDRESS);
+
+  int waited = 0;
+  while (true) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    // Leave the port to connect, so that it only has to be unique for
+    // the server's address and port.
+    int noPort = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &noPort, sizeof(noPort));
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+      return fd;
+    }
+    int connectErrno = errno;
+    close(fd);
+    if (connectErrno != ECONNREFUSED || waited > timeoutMs) {
+      errno = connectErrno;
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    // The server may not be listening yet; it may also have died.
+    if (waitpid(serverPid, NULL, WNOHANG) == serverPid) {
+      serverPid = 0;
+      fprintf(stderr, "%s: The server exited\n", PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    usleep(10000);
+    waited += 10;
+  }
+}
+
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length) {
+  char frame[FRAME_MAX_HEADER_LENGTH + FRAME_MAX_ROOM_NAME_LENGTH + 16];
+  size_t headerLength = frame_encode_header(frame, type, length);
+  memcpy(frame + headerLength, payload, length);
+  size_t frameLength = headerLength + length;
+  for (size_t written = 0; written < frameLength; ) {
+    ssize_t chars = write(fd, frame + written, frameLength - written);
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    written += chars;
+  }
+}
+
+void measure(struct bench_options_t *options, int count) {
+  int *fds = calloc(count, sizeof(int));
+  if (fds == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  int port = findFreePort();
+  startServer(options, port, count);
+  // Wait for it to listen, and for it to set up everything the first
+  // client needs.
+  close(connectToServer(port, 0, SERVER_START_TIMEOUT_MS));
+  long baseline = settledRss();
+
+  for (int i = 0; i < count; ++i) {
+    fds[i] = connectToServer(port, i, 0);
+    sendFrame(fds[i], FRAME_HELLO, FRAME_FEATURE_DEFLATE, strlen(FRAME_FEATURE_DEFLATE));
+    char room[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+    int roomLength = snprintf(room, sizeof(room), "idle-%d", i % options->numRooms);
+    sendFrame(fds[i], FRAME_JOIN, room, roomLength);
+  }
+  // There is no reply to a join, so wait for the server to go quiet.
+  long rss = settledRss();
+
+  fprintf(stdout, "  %7d connections: RSS %.1f MB, up %.1f MB from %.1f MB, %ld bytes per connection\n",
+    count, rss / 1048576.0, (rss - baseline) / 1048576.0, baseline / 1048576.0,
+    (rss - baseline) / count);
+  fflush(stdout);
+
+  stopServer();
+  for (int i = 0; i < count; ++i) {
+    close(fds[i]);
+  }
+  free(fds);
+}
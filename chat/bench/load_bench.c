@@ -0,0 +1,930 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Load generator for the chat server.  Starts the server built by the
+  makefile in framed event loop mode, opens thousands of connections to
+  it, spreads them over a number of rooms and sends chat messages at a
+  fixed rate.  Every message carries the time it was due to be sent, so
+  each delivery gives one end-to-end fan-out latency.
+
+  Messages are sent on schedule whether or not the server keeps up, so
+  a server that falls behind shows up as latency rather than as a lower
+  send rate.
+
+  Prints the throughput and the p50/p99/p999 latencies.  Exits with 1
+  if a threshold given on the command line was crossed, and with 8 if
+  any message was lost.  The server is started with --slow-clients
+  block, so that it never drops a message for a slow client, and a
+  lost one is always a bug; the thresholds, on the other hand, depend
+  on how fast the host is.
+
+  With --count-syscalls, the server runs under ptrace and every system
+  call any of its threads makes while messages are being sent is
+  counted, which shows how many it takes per message and per delivery
+  (compare --io-uring with the default of epoll).  Tracing slows the
+  server down a great deal, so the latencies are meaningless then, and
+  the rate should be kept low.
+
+  Usage:
+    load_bench [--connections count] [--rooms count] [--rate messages/s]
+      [--duration seconds] [--size bytes] [--port port]
+      [--server path | --no-server] [--max-p99 us] [--max-p999 us]
+      [--min-throughput deliveries/s] [--count-syscalls]
+      [-- server options]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../src/server.h"
+#include "../src/frame.h"
+
+// What the benchmark exits with when a threshold is crossed, and when
+// a message is lost.  Losing one takes priority.
+const int EXIT_REGRESSION = 1;
+const int EXIT_LOST = 8;
+
+char *PROG_NAME;
+
+const int DEFAULT_CONNECTIONS = 2000;
+const int DEFAULT_ROOMS = 20;
+const int DEFAULT_RATE = 2000;
+const int DEFAULT_DURATION = 5;
+const int DEFAULT_MESSAGE_SIZE = 64;
+const char *DEFAULT_SERVER = "./server";
+
+// The longest message the server passes on.
+const int MAX_MESSAGE_SIZE = 1000;
+
+// Big enough for a message from any room, with its header.
+#define MAX_FRAME_SIZE 2048
+
+// How much is read from a connection at a time.
+#define READ_BUFFER_SIZE 65536
+
+// Latencies are counted per microsecond up to a second.  Anything
+// slower lands in the last bucket.
+#define MAX_RECORDED_LATENCY_US 1000000
+
+// How long the server gets to start listening, and to take everyone's
+// joins before we start sending.
+const int SERVER_START_TIMEOUT_MS = 5000;
+const int SETTLE_MS = 1000;
+
+// How long we wait for stragglers once sending stops.
+const int DRAIN_TIMEOUT_MS = 2000;
+
+const int MAX_EPOLL_EVENTS = 256;
+
+// Enough for every system call number on x86-64 and aarch64.
+#define MAX_SYSCALL 512
+
+// How many of the most frequent system calls are listed by name.
+const int TOP_SYSCALLS = 6;
+
+struct bench_options_t {
+  int numConnections;
+  int numRooms;
+  int rate;
+  int duration;
+  int messageSize;
+  // Where the server listens; 0 picks a free port.
+  int port;
+  // The server binary, or NULL if one is already running on port.
+  const char *server;
+  // Extra arguments for the server, NULL terminated.
+  char **serverArgs;
+  int numServerArgs;
+  // Thresholds; 0 means unchecked.
+  long maxP99;
+  long maxP999;
+  long minThroughput;
+  // Count the server's system calls.
+  bool countSyscalls;
+};
+
+struct connection_t {
+  int fd;
+  int room;
+  struct frame_parser_t parser;
+  char payload[MAX_FRAME_SIZE];
+  // The rest of a message the socket had no room for.
+  char pending[MAX_FRAME_SIZE];
+  size_t pendingOffset;
+  size_t pendingLength;
+};
+
+static struct connection_t *connections;
+// With --count-syscalls, this is the tracer, which the server dies with.
+static pid_t serverPid = 0;
+
+// The end of a pipe the tracer reports its counts on.
+static int syscallCountsFd = -1;
+
+// Set by the tracer's signal handlers.
+static volatile sig_atomic_t startCounting = 0;
+static volatile sig_atomic_t stopCounting = 0;
+
+// Delivery latencies, in microseconds.
+static unsigned long latencyHistogram[MAX_RECORDED_LATENCY_US + 1];
+static unsigned long numDeliveries;
+static long maxLatency;
+
+// Messages that were due but went out late, because the sender's socket
+// was still full with its last one.
+static unsigned long delayedSends;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void parseArguments(int argc, char **argv, struct bench_options_t *options);
+int parsePositiveOption(const char *name, const char *value);
+void displayUsageString();
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+long nowNanos();
+
+/*
+  Raises the soft limit on open files up to the hard limit, since every
+  connection needs its own file descriptor.
+*/
+void raiseFileLimit();
+
+/*
+  Returns a port on the loopback interface that nobody is using.
+*/
+int findFreePort();
+
+/*
+  Starts the server in framed event loop mode on options->port, with
+  its output thrown away.  It is killed when we exit.
+*/
+void startServer(struct bench_options_t *options);
+void stopServer();
+
+/*
+  Runs server under ptrace until it exits, counting each system call
+  its threads enter between SIGUSR1 and SIGUSR2.  On SIGUSR2 the counts,
+  MAX_SYSCALL unsigned longs, are written to reportFd and the server is
+  killed.
+
+  Never returns.
+*/
+void traceServer(pid_t server, int reportFd);
+void handleStartCounting(int signal);
+void handleStopCounting(int signal);
+
+/*
+  Stops the count of the server's system calls and prints it, per
+  message sent and per delivery.
+*/
+void reportSyscalls(long messages, unsigned long deliveries);
+
+/*
+  Returns the name of system call number, or NULL if it isn't one we
+  expect the server to make.
+*/
+const char *syscallName(int number);
+
+/*
+  Connects to the server on port, retrying until it is listening or
+  timeoutMs has passed.
+
+  Terminates the program on failure.
+*/
+int connectToServer(int port, int timeoutMs);
+
+/*
+  Writes a whole frame to connection, or keeps what didn't fit in
+  pending.  Returns false if the connection is still busy with an
+  earlier frame.
+*/
+bool sendFrame(struct connection_t *connection, enum FRAME_TYPE_T type,
+  const char *payload, size_t length);
+
+/*
+  Writes as much of connection's pending frame as its socket will take.
+*/
+void flushPending(struct connection_t *connection);
+
+/*
+  Reads everything available on connection and records a latency for
+  every message in it.
+*/
+void readMessages(struct connection_t *connection);
+
+/*
+  Returns the latency, in microseconds, under which fraction of the
+  deliveries arrived.
+*/
+long latencyPercentile(double fraction);
+
+/*
+  Reads from every ready connection for up to timeoutMs.
+*/
+void pollConnections(int epollFd, struct epoll_event *events, int timeoutMs);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+  // A server that disconnects us should show up as lost messages.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench_options_t options = {
+    .numConnections = DEFAULT_CONNECTIONS,
+    .numRooms = DEFAULT_ROOMS,
+    .rate = DEFAULT_RATE,
+    .duration = DEFAULT_DURATION,
+    .messageSize = DEFAULT_MESSAGE_SIZE,
+    .port = 0,
+    .server = DEFAULT_SERVER,
+  };
+  parseArguments(argc, argv, &options);
+  if (options.numRooms > options.numConnections) {
+    options.numRooms = options.numConnections;
+  }
+
+  raiseFileLimit();
+  if (options.server != NULL) {
+    if (options.port == 0) {
+      options.port = findFreePort();
+    }
+    startServer(&options);
+  } else if (options.port == 0) {
+    fprintf(stderr, "%s: --no-server needs a --port\n", PROG_NAME);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+
+  connections = calloc(options.numConnections, sizeof(struct connection_t));
+  int *roomSizes = calloc(options.numRooms, sizeof(int));
+  struct epoll_event *events = calloc(MAX_EPOLL_EVENTS, sizeof(struct epoll_event));
+  if (connections == NULL || roomSizes == NULL || events == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  // Connect everybody and put them in their rooms.
+  for (int i = 0; i < options.numConnections; ++i) {
+    struct connection_t *connection = &connections[i];
+    connection->fd = connectToServer(options.port, (i == 0) ? SERVER_START_TIMEOUT_MS : 0);
+    connection->room = i % options.numRooms;
+    ++roomSizes[connection->room];
+    frame_parser_reset(&connection->parser, connection->payload, MAX_FRAME_SIZE - 1);
+
+    char room[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+    int roomLength = snprintf(room, sizeof(room), "bench-%d", connection->room);
+    sendFrame(connection, FRAME_JOIN, room, roomLength);
+
+    if (fcntl(connection->fd, F_SETFL, O_NONBLOCK) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection->fd, &event) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+
+  // There is no reply to a join, so give the server a moment with them.
+  pollConnections(epollFd, events, SETTLE_MS);
+  if (options.countSyscalls) {
+    kill(serverPid, SIGUSR1);
+  }
+
+  fprintf(stdout, "%d connections in %d rooms, %d messages/s of %d bytes for %ds\n",
+    options.numConnections, options.numRooms, options.rate, options.messageSize, options.duration);
+
+  char text[MAX_FRAME_SIZE];
+  long totalMessages = (long)options.rate * options.duration;
+  long expectedDeliveries = 0;
+  long start = nowNanos();
+
+  for (long sent = 0; sent < totalMessages; ) {
+    long now = nowNanos();
+    // Send everything that has come due, stamped with when it was due.
+    for (; sent < totalMessages; ++sent) {
+      long due = start + sent * 1000000000L / options.rate;
+      if (due > now) {
+        break;
+      }
+      struct connection_t *connection = &connections[sent % options.numConnections];
+      int length = snprintf(text, sizeof(text), "%ld %ld ", sent, due);
+      memset(text + length, 'x', (length < options.messageSize) ? options.messageSize - length : 0);
+      if (length < options.messageSize) {
+        length = options.messageSize;
+      }
+      while (!sendFrame(connection, FRAME_MESSAGE, text, length)) {
+        ++delayedSends;
+        pollConnections(epollFd, events, 1);
+      }
+      expectedDeliveries += roomSizes[connection->room] - 1;
+    }
+    pollConnections(epollFd, events, 1);
+  }
+
+  // Wait for what is still on its way.
+  long sendTime = nowNanos() - start;
+  long drainStart = nowNanos();
+  while ((long)numDeliveries < expectedDeliveries &&
+    nowNanos() - drainStart < DRAIN_TIMEOUT_MS * 1000000L) {
+    pollConnections(epollFd, events, 10);
+  }
+  long totalTime = nowNanos() - start;
+  if (options.countSyscalls) {
+    reportSyscalls(totalMessages, numDeliveries);
+  }
+
+  long p50 = latencyPercentile(0.50);
+  long p99 = latencyPercentile(0.99);
+  long p999 = latencyPercentile(0.999);
+  long throughput = (long)(numDeliveries / (totalTime / 1e9));
+  long lost = expectedDeliveries - (long)numDeliveries;
+
+  fprintf(stdout, "sent %ld messages in %.2fs (%lu late), delivered %lu of %ld\n",
+    totalMessages, sendTime / 1e9, delayedSends, numDeliveries, expectedDeliveries);
+  fprintf(stdout, "throughput %ld deliveries/s\n", throughput);
+  fprintf(stdout, "latency p50 %ldus  p99 %ldus  p999 %ldus  max %ldus\n",
+    p50, p99, p999, maxLatency);
+  fprintf(stdout, "lost %ld deliveries\n", lost);
+
+  int result = EXIT_NORMAL;
+  if (options.maxP99 > 0 && p99 > options.maxP99) {
+    fprintf(stdout, "FAIL: p99 %ldus is over %ldus\n", p99, options.maxP99);
+    result = EXIT_REGRESSION;
+  }
+  if (options.maxP999 > 0 && p999 > options.maxP999) {
+    fprintf(stdout, "FAIL: p999 %ldus is over %ldus\n", p999, options.maxP999);
+    result = EXIT_REGRESSION;
+  }
+  if (options.minThroughput > 0 && throughput < options.minThroughput) {
+    fprintf(stdout, "FAIL: throughput %ld deliveries/s is under %ld\n", throughput, options.minThroughput);
+    result = EXIT_REGRESSION;
+  }
+  // The server doesn't drop messages for slow clients here, so this is
+  // a bug whatever the latencies were.
+  if (lost != 0) {
+    fprintf(stdout, "FAIL: %ld deliveries lost\n", lost);
+    result = EXIT_LOST;
+  }
+
+  for (int i = 0; i < options.numConnections; ++i) {
+    close(connections[i].fd);
+  }
+  close(epollFd);
+  free(events);
+  free(roomSizes);
+  free(connections);
+  return result;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void parseArguments(int argc, char **argv, struct bench_options_t *options) {
+  // Skip the first item, since that points to the executable.
+  for (--argc, ++argv; argc > 0; --argc, ++argv) {
+    if (strcmp(*argv, "--") == 0) {
+      options->serverArgs = argv + 1;
+      options->numServerArgs = argc - 1;
+      return;
+    } else if (strcmp(*argv, "--no-server") == 0) {
+      options->server = NULL;
+    } else if (argc > 1 && strcmp(*argv, "--server") == 0) {
+      options->server = *(++argv);
+      --argc;
+    } else if (argc > 1 && strcmp(*argv, "--connections") == 0) {
+      options->numConnections = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--rooms") == 0) {
+      options->numRooms = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--rate") == 0) {
+      options->rate = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--duration") == 0) {
+      options->duration = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--size") == 0) {
+      options->messageSize = parsePositiveOption(*argv, *(argv + 1));
+      if (options->messageSize > MAX_MESSAGE_SIZE) {
+        options->messageSize = MAX_MESSAGE_SIZE;
+      }
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--port") == 0) {
+      options->port = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--max-p99") == 0) {
+      options->maxP99 = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--max-p999") == 0) {
+      options->maxP999 = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (argc > 1 && strcmp(*argv, "--min-throughput") == 0) {
+      options->minThroughput = parsePositiveOption(*argv, *(argv + 1));
+      --argc;
+      ++argv;
+    } else if (strcmp(*argv, "--count-syscalls") == 0) {
+      options->countSyscalls = true;
+    } else {
+      fprintf(stderr, "%s: Unknown option '%s'\n", PROG_NAME, *argv);
+      displayUsageString();
+      exit(EXIT_ERROR_ARGUMENT);
+    }
+  }
+}
+
+int parsePositiveOption(const char *name, const char *value) {
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || parsed <= 0 || parsed > 1000000000L) {
+    fprintf(stderr, "%s: %s must be a positive number, not '%s'\n", PROG_NAME, name, value);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  return (int)parsed;
+}
+
+void displayUsageString() {
+  fputs("Usage:\n\
+    load_bench [--connections count] [--rooms count] [--rate messages/s]\n\
+      [--duration seconds] [--size bytes] [--port port]\n\
+      [--server path | --no-server] [--max-p99 us] [--max-p999 us]\n\
+      [--min-throughput deliveries/s] [--count-syscalls]\n\
+      [-- server options]\n", stderr);
+}
+
+long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void raiseFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+  }
+}
+
+int findFreePort() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  // Let the kernel pick one.
+  socklen_t addressLength = sizeof(address);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    getsockname(fd, (struct sockaddr *)&address, &addressLength) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+void startServer(struct bench_options_t *options) {
+  // Our arguments, then the server's own, which win, then the port.
+  char port[16];
+  snprintf(port, sizeof(port), "%d", options->port);
+  char **argv = calloc(options->numServerArgs + 7, sizeof(char *));
+  if (argv == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  int argc = 0;
+  argv[argc++] = (char *)options->server;
+  argv[argc++] = "--epoll";
+  argv[argc++] = "--framed";
+  argv[argc++] = "--slow-clients";
+  argv[argc++] = "block";
+  for (int i = 0; i < options->numServerArgs; ++i) {
+    argv[argc++] = options->serverArgs[i];
+  }
+  argv[argc++] = port;
+  argv[argc] = NULL;
+
+  int report[2];
+  if (options->countSyscalls && pipe(report) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  serverPid = fork();
+  if (serverPid < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  if (serverPid == 0) {
+    // The server prints every message it passes on.
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0) {
+      dup2(devNull, STDOUT_FILENO);
+      close(devNull);
+    }
+    if (options->countSyscalls) {
+      // We become the tracer, and the server our child.
+      close(report[0]);
+      pid_t server = fork();
+      if (server < 0) {
+        perror(PROG_NAME);
+        _exit(EXIT_ERROR_IO);
+      }
+      if (server != 0) {
+        traceServer(server, report[1]);
+      }
+      close(report[1]);
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+        perror(PROG_NAME);
+        _exit(EXIT_ERROR_IO);
+      }
+      // Wait for the tracer to set its options.
+      raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(EXIT_ERROR_ARGUMENT);
+  }
+  if (options->countSyscalls) {
+    close(report[1]);
+    syscallCountsFd = report[0];
+  }
+  free(argv);
+  atexit(stopServer);
+}
+
+void stopServer() {
+  if (serverPid > 0) {
+    kill(serverPid, SIGTERM);
+    waitpid(serverPid, NULL, 0);
+    serverPid = 0;
+  }
+}
+
+void traceServer(pid_t server, int reportFd) {
+  static unsigned long counts[MAX_SYSCALL];
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = handleStartCounting;
+  sigaction(SIGUSR1, &action, NULL);
+  action.sa_handler = handleStopCounting;
+  sigaction(SIGUSR2, &action, NULL);
+
+  int status;
+  if (waitpid(server, &status, 0) != server || !WIFSTOPPED(status) ||
+    ptrace(PTRACE_SETOPTIONS, server, NULL,
+      PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL) != 0 ||
+    ptrace(PTRACE_SYSCALL, server, NULL, NULL) != 0) {
+    perror(PROG_NAME);
+    kill(server, SIGKILL);
+    _exit(EXIT_ERROR_IO);
+  }
+
+  bool counting = false;
+  while (true) {
+    if (startCounting) {
+      startCounting = 0;
+      memset(counts, 0, sizeof(counts));
+      counting = true;
+    }
+    if (stopCounting) {
+      if (write(reportFd, counts, sizeof(counts)) != sizeof(counts)) {
+        perror(PROG_NAME);
+      }
+      kill(server, SIGKILL);
+      _exit(EXIT_NORMAL);
+    }
+
+    pid_t thread = waitpid(-1, &status, __WALL);
+    if (thread < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      _exit(EXIT_ERROR_IO);
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (thread == server) {
+        _exit(EXIT_ERROR_IO);
+      }
+      continue;
+    }
+    if (!WIFSTOPPED(status)) {
+      continue;
+    }
+
+    // Pass on real signals, but not the ones ptrace makes up.
+    int deliver = WSTOPSIG(status);
+    if (deliver == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      if (counting &&
+        ptrace(PTRACE_GET_SYSCALL_INFO, thread, sizeof(info), &info) > 0 &&
+        info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAX_SYSCALL) {
+        ++counts[info.entry.nr];
+      }
+      deliver = 0;
+    } else if ((status >> 16) != 0 || deliver == SIGSTOP) {
+      // The exec, or a new thread, which starts out stopped.
+      deliver = 0;
+    }
+    ptrace(PTRACE_SYSCALL, thread, NULL, deliver);
+  }
+}
+
+void handleStartCounting(int signal) {
+  startCounting = 1;
+}
+
+void handleStopCounting(int signal) {
+  stopCounting = 1;
+}
+
+void reportSyscalls(long messages, unsigned long deliveries) {
+  static unsigned long counts[MAX_SYSCALL];
+
+  kill(serverPid, SIGUSR2);
+  size_t received = 0;
+  while (received < sizeof(counts)) {
+    ssize_t chars = read(syscallCountsFd, (char *)counts + received, sizeof(counts) - received);
+    if (chars <= 0) {
+      if (chars < 0 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s: The tracer didn't report\n", PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    received += chars;
+  }
+  close(syscallCountsFd);
+  waitpid(serverPid, NULL, 0);
+  serverPid = 0;
+
+  unsigned long total = 0;
+  for (int i = 0; i < MAX_SYSCALL; ++i) {
+    total += counts[i];
+  }
+  fprintf(stdout, "server made %lu system calls: %.2f per message, %.3f per delivery\n",
+    total, (double)total / messages, deliveries ? (double)total / deliveries : 0.0);
+
+  // The most frequent ones, most frequent first.
+  for (int shown = 0; shown < TOP_SYSCALLS; ++shown) {
+    int top = 0;
+    for (int i = 1; i < MAX_SYSCALL; ++i) {
+      if (counts[i] > counts[top]) {
+        top = i;
+      }
+    }
+    if (counts[top] == 0) {
+      break;
+    }
+    const char *name = syscallName(top);
+    if (name != NULL) {
+      fprintf(stdout, "  %-16s %10lu  %.2f per message\n", name, counts[top], (double)counts[top] / messages);
+    } else {
+      fprintf(stdout, "  syscall %-8d %10lu  %.2f per message\n", top, counts[top], (double)counts[top] / messages);
+    }
+    counts[top] = 0;
+  }
+}
+
+const char *syscallName(int number) {
+  switch (number) {
+    case SYS_read: return "read";
+    case SYS_write: return "write";
+    case SYS_readv: return "readv";
+    case SYS_writev: return "writev";
+    case SYS_recvfrom: return "recvfrom";
+    case SYS_sendto: return "sendto";
+    case SYS_close: return "close";
+    case SYS_ioctl: return "ioctl";
+    case SYS_newfstatat: return "newfstatat";
+    case SYS_accept4: return "accept4";
+    case SYS_epoll_ctl: return "epoll_ctl";
+    case SYS_epoll_pwait: return "epoll_pwait";
+#ifdef SYS_epoll_wait
+    case SYS_epoll_wait: return "epoll_wait";
+#endif
+#ifdef SYS_poll
+    case SYS_poll: return "poll";
+#endif
+    case SYS_ppoll: return "ppoll";
+    case SYS_futex: return "futex";
+    case SYS_io_uring_enter: return "io_uring_enter";
+    case SYS_mmap: return "mmap";
+    case SYS_munmap: return "munmap";
+    case SYS_madvise: return "madvise";
+    case SYS_brk: return "brk";
+    case SYS_msync: return "msync";
+    case SYS_fdatasync: return "fdatasync";
+    case SYS_clock_gettime: return "clock_gettime";
+    case SYS_sched_yield: return "sched_yield";
+    default: return NULL;
+  }
+}
+
+int connectToServer(int port, int timeoutMs) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  long giveUp = nowNanos() + timeoutMs * 1000000L;
+  while (true) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+      return fd;
+    }
+    int connectErrno = errno;
+    close(fd);
+    if (connectErrno != ECONNREFUSED || nowNanos() > giveUp) {
+      errno = connectErrno;
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    // The server may not be listening yet; it may also have died.
+    if (serverPid > 0 && waitpid(serverPid, NULL, WNOHANG) == serverPid) {
+      serverPid = 0;
+      fprintf(stderr, "%s: The server exited\n", PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    usleep(10000);
+  }
+}
+
+bool sendFrame(struct connection_t *connection, enum FRAME_TYPE_T type,
+  const char *payload, size_t length) {
+  if (connection->pendingLength > 0) {
+    flushPending(connection);
+    if (connection->pendingLength > 0) {
+      return false;
+    }
+  }
+
+  char *frame = connection->pending;
+  size_t headerLength = frame_encode_header(frame, type, length);
+  memcpy(frame + headerLength, payload, length);
+  connection->pendingOffset = 0;
+  connection->pendingLength = headerLength + length;
+  flushPending(connection);
+  return true;
+}
+
+void flushPending(struct connection_t *connection) {
+  while (connection->pendingLength > 0) {
+    ssize_t written = write(connection->fd,
+      connection->pending + connection->pendingOffset, connection->pendingLength);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+      return;
+    }
+    connection->pendingOffset += written;
+    connection->pendingLength -= written;
+  }
+}
+
+void readMessages(struct connection_t *connection) {
+  static char buffer[READ_BUFFER_SIZE];
+
+  while (true) {
+    ssize_t chars = read(connection->fd, buffer, READ_BUFFER_SIZE);
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+      return;
+    }
+    if (chars == 0) {
+      fprintf(stderr, "%s: The server closed a connection\n", PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+
+    long now = nowNanos();
+    const char *data = buffer;
+    size_t length = chars;
+    while (length > 0) {
+      size_t consumed;
+      enum FRAME_RESULT_T result = frame_parse(&connection->parser, data, length, &consumed);
+      data += consumed;
+      length -= consumed;
+      if (result == FRAME_ERROR) {
+        fprintf(stderr, "%s: Bad frame from the server\n", PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+      if (result == FRAME_INCOMPLETE) {
+        break;
+      }
+      if (connection->parser.type == FRAME_ROOM_MESSAGE) {
+        // Skip the room name to get at the sequence number and due time.
+        connection->payload[connection->parser.length] = '\0';
+        const char *text = connection->payload + strlen(connection->payload) + 1;
+        long sequence, due;
+        if (sscanf(text, "%ld %ld", &sequence, &due) == 2) {
+          long latency = (now - due) / 1000;
+          if (latency > maxLatency) {
+            maxLatency = latency;
+          }
+          ++latencyHistogram[(latency < MAX_RECORDED_LATENCY_US) ? latency : MAX_RECORDED_LATENCY_US];
+          ++numDeliveries;
+        }
+      }
+      frame_parser_reset(&connection->parser, connection->payload, MAX_FRAME_SIZE - 1);
+    }
+  }
+}
+
+long latencyPercentile(double fraction) {
+  unsigned long target = (unsigned long)(numDeliveries * fraction);
+  unsigned long seen = 0;
+  for (long i = 0; i <= MAX_RECORDED_LATENCY_US; ++i) {
+    seen += latencyHistogram[i];
+    if (seen > target) {
+      return i;
+    }
+  }
+  return MAX_RECORDED_LATENCY_US;
+}
+
+void pollConnections(int epollFd, struct epoll_event *events, int timeoutMs) {
+  long giveUp = nowNanos() + timeoutMs * 1000000L;
+  do {
+    int ready = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeoutMs);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    for (int i = 0; i < ready; ++i) {
+      readMessages(events[i].data.ptr);
+    }
+    if (ready < MAX_EPOLL_EVENTS) {
+      return;
+    }
+  } while (nowNanos() < giveUp);
+}
@@ -0,0 +1,244 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Compares the throughput of the lock-free MPSC queue against the
+  mutex/condition variable message queue with 1, 8 and 64 producers
+  feeding a single consumer.
+
+  Usage:
+    mpsc_bench [total messages]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "../src/server.h"
+#include "../src/message.h"
+#include "../src/message_queue.h"
+#include "../src/mpsc_queue.h"
+
+char *PROG_NAME;
+bool DEBUG = false;
+
+// Where producers get their messages from.
+static struct message_pool_t messagePool;
+
+const int BENCH_QUEUE_SIZE = 256;
+const int BENCH_MESSAGE_LENGTH = 64;
+const int DEFAULT_TOTAL_MESSAGES = 2000000;
+
+// The sender ID that tells the consumer a producer is done.
+const int SENDER_STOP = -1;
+
+// The operations being benchmarked, so both queues can share the same
+// driver.
+struct queue_ops_t {
+  const char *name;
+  void *queue;
+  void (*put)(void *queue, struct message_t *message);
+  struct message_t *(*get)(void *queue);
+};
+
+struct producer_args_t {
+  struct queue_ops_t *ops;
+  int id;
+  int numMessages;
+};
+
+struct consumer_args_t {
+  struct queue_ops_t *ops;
+  int numProducers;
+  long received;
+};
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void mutex_queue_put(void *queue, struct message_t *message);
+struct message_t *mutex_queue_get(void *queue);
+void lockfree_queue_put(void *queue, struct message_t *message);
+struct message_t *lockfree_queue_get(void *queue);
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+long nowNanos();
+
+/*
+  Returns the user + system CPU time used by this process, in
+  nanoseconds.
+*/
+long cpuNanos();
+
+/*
+  Pushes totalMessages through the queue, split evenly between
+  numProducers producers, and prints the throughput.
+*/
+void measureThroughput(struct queue_ops_t *ops, int numProducers, int totalMessages);
+
+void *produce(void *args);
+void *consume(void *args);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+
+  int totalMessages = DEFAULT_TOTAL_MESSAGES;
+  if (argc > 1) {
+    totalMessages = strtol(argv[1], NULL, 10);
+    if (totalMessages <= 0) {
+      fputs("Usage: mpsc_bench [total messages]\n", stderr);
+      return EXIT_ERROR_ARGUMENT;
+    }
+  }
+
+  message_pool_init(&messagePool, BENCH_MESSAGE_LENGTH, BENCH_QUEUE_SIZE);
+
+  struct message_queue_t mutexQueue;
+  message_queue_init(&mutexQueue, BENCH_QUEUE_SIZE);
+  static struct mpsc_queue_t lockfreeQueue;
+  mpsc_queue_init(&lockfreeQueue, BENCH_QUEUE_SIZE);
+
+  struct queue_ops_t queues[] = {
+    {"mutex", &mutexQueue, mutex_queue_put, mutex_queue_get},
+    {"mpsc", &lockfreeQueue, lockfree_queue_put, lockfree_queue_get},
+  };
+
+  int producerCounts[] = {1, 8, 64};
+  for (size_t p = 0; p < sizeof(producerCounts) / sizeof(int); ++p) {
+    for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); ++i) {
+      measureThroughput(&queues[i], producerCounts[p], totalMessages);
+    }
+  }
+
+  message_queue_cleanup(&mutexQueue);
+  mpsc_queue_cleanup(&lockfreeQueue);
+  message_pool_cleanup(&messagePool);
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+long cpuNanos() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L;
+}
+
+void *produce(void *args) {
+  struct producer_args_t *producer = args;
+  const char text[] = "the quick brown fox jumps over the lazy dog";
+
+  for (int i = 0; i <= producer->numMessages; ++i) {
+    struct message_t *message = message_alloc(&messagePool);
+    if (i < producer->numMessages) {
+      memcpy(message->data, text, sizeof(text));
+      message->length = sizeof(text) - 1;
+      message->sender = producer->id;
+    } else {
+      message->sender = SENDER_STOP;
+    }
+    producer->ops->put(producer->ops->queue, message);
+  }
+  return NULL;
+}
+
+void *consume(void *args) {
+  struct consumer_args_t *consumer = args;
+  int producersLeft = consumer->numProducers;
+
+  while (producersLeft > 0) {
+    struct message_t *message = consumer->ops->get(consumer->ops->queue);
+    if (message->sender == SENDER_STOP) {
+      --producersLeft;
+    } else {
+      ++consumer->received;
+    }
+    message_unref(message);
+  }
+  return NULL;
+}
+
+void measureThroughput(struct queue_ops_t *ops, int numProducers, int totalMessages) {
+  struct consumer_args_t consumerArgs = {ops, numProducers, 0};
+  struct producer_args_t *producerArgs = calloc(numProducers, sizeof(struct producer_args_t));
+  pthread_t *producers = calloc(numProducers, sizeof(pthread_t));
+  if (producerArgs == NULL || producers == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  long cpuBefore = cpuNanos();
+  long wallBefore = nowNanos();
+
+  pthread_t consumer;
+  if (pthread_create(&consumer, NULL, consume, &consumerArgs) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+  for (int i = 0; i < numProducers; ++i) {
+    producerArgs[i] = (struct producer_args_t){ops, i, totalMessages / numProducers};
+    if (pthread_create(&producers[i], NULL, produce, &producerArgs[i]) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_THREAD);
+    }
+  }
+  for (int i = 0; i < numProducers; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  pthread_join(consumer, NULL);
+
+  double wallSeconds = (nowNanos() - wallBefore) / 1e9;
+  double cpuSeconds = (cpuNanos() - cpuBefore) / 1e9;
+
+  long expected = (long)(totalMessages / numProducers) * numProducers;
+  if (consumerArgs.received != expected) {
+    fprintf(stderr, "%s: %s lost messages (%ld of %ld received)\n",
+      PROG_NAME, ops->name, consumerArgs.received, expected);
+    exit(EXIT_ERROR_IO);
+  }
+
+  fprintf(stdout, "%-6s %2d producer(s)  %7.2f M msg/s  %7.1f ns/msg  cpu %5.2fs / wall %5.2fs\n",
+    ops->name, numProducers,
+    consumerArgs.received / wallSeconds / 1e6,
+    wallSeconds * 1e9 / consumerArgs.received,
+    cpuSeconds, wallSeconds);
+
+  free(producers);
+  free(producerArgs);
+}
+
+void mutex_queue_put(void *queue, struct message_t *message) {
+  message_queue_put(queue, message);
+}
+
+struct message_t *mutex_queue_get(void *queue) {
+  return message_queue_get(queue);
+}
+
+void lockfree_queue_put(void *queue, struct message_t *message) {
+  mpsc_queue_put(queue, message);
+}
+
+struct message_t *lockfree_queue_get(void *queue) {
+  return mpsc_queue_get(queue);
+}
@@ -0,0 +1,372 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Benchmarks the server's message queue against the old queue, which
+  spun on pthread_yield() whenever it was full or empty.
+
+  For each queue this reports:
+    * The CPU used while the consumer waits on an empty queue.
+    * Enqueue-to-dequeue latency (p50/p99/max) with producers sending
+      at a steady pace, and with producers sending as fast as they can.
+
+  Usage:
+    queue_bench [messages per producer]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "../src/server.h"
+#include "../src/message.h"
+#include "../src/message_queue.h"
+
+char *PROG_NAME;
+bool DEBUG = false;
+
+// Where producers get their messages from.
+static struct message_pool_t messagePool;
+
+const int BENCH_QUEUE_SIZE = 256;
+const int BENCH_MESSAGE_LENGTH = 64;
+const int DEFAULT_MESSAGES_PER_PRODUCER = 20000;
+
+// How long the consumer is left waiting on an empty queue.
+const int IDLE_MEASURE_MILLIS = 1000;
+
+// Delay between messages for the steady-pace run.
+const long PACED_DELAY_NANOS = 20000;
+
+// The sender ID that tells the consumer to stop.
+const int SENDER_STOP = -1;
+
+/*
+  The old message queue, kept here as the baseline.  Identical to the
+  new one except that it yields in a loop instead of waiting on a
+  condition variable.
+*/
+struct spin_queue_t {
+  struct message_t **messages;
+  size_t pushOffset;
+  size_t popOffset;
+  size_t maxNumMessages;
+  pthread_mutex_t lock;
+};
+
+// The operations being benchmarked, so both queues can share the same
+// driver.
+struct queue_ops_t {
+  const char *name;
+  void *queue;
+  void (*put)(void *queue, struct message_t *message);
+  struct message_t *(*get)(void *queue);
+};
+
+struct producer_args_t {
+  struct queue_ops_t *ops;
+  int id;
+  int numMessages;
+  long delayNanos;
+};
+
+struct consumer_args_t {
+  struct queue_ops_t *ops;
+  int numProducers;
+  // Latency of each received message, in nanoseconds.
+  long *latencies;
+  size_t numLatencies;
+};
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void spin_queue_init(struct spin_queue_t *queue, size_t bufferSize);
+void spin_queue_cleanup(struct spin_queue_t *queue);
+void spin_queue_put(void *queue, struct message_t *message);
+struct message_t *spin_queue_get(void *queue);
+
+void condvar_queue_put(void *queue, struct message_t *message);
+struct message_t *condvar_queue_get(void *queue);
+
+/*
+  Sends the message that tells the consumer to stop.
+*/
+void putStop(struct queue_ops_t *ops);
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+long nowNanos();
+
+/*
+  Returns the user + system CPU time used by this process, in
+  nanoseconds.
+*/
+long cpuNanos();
+
+/*
+  Measures the CPU used while a consumer waits on an empty queue.
+  Returns the percentage of one core used.
+*/
+double measureIdleCpu(struct queue_ops_t *ops);
+
+/*
+  Runs numProducers producers against one consumer and prints the
+  latency percentiles.
+*/
+void measureLatency(struct queue_ops_t *ops, int numProducers,
+  int messagesPerProducer, long delayNanos);
+
+void *produce(void *args);
+void *consume(void *args);
+void *waitForStop(void *args);
+
+int compareLongs(const void *a, const void *b);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+
+  int messagesPerProducer = DEFAULT_MESSAGES_PER_PRODUCER;
+  if (argc > 1) {
+    messagesPerProducer = strtol(argv[1], NULL, 10);
+    if (messagesPerProducer <= 0) {
+      fputs("Usage: queue_bench [messages per producer]\n", stderr);
+      return EXIT_ERROR_ARGUMENT;
+    }
+  }
+
+  message_pool_init(&messagePool, BENCH_MESSAGE_LENGTH, BENCH_QUEUE_SIZE);
+
+  struct spin_queue_t spinQueue;
+  spin_queue_init(&spinQueue, BENCH_QUEUE_SIZE);
+  struct message_queue_t condvarQueue;
+  message_queue_init(&condvarQueue, BENCH_QUEUE_SIZE);
+
+  struct queue_ops_t queues[] = {
+    {"spin", &spinQueue, spin_queue_put, spin_queue_get},
+    {"condvar", &condvarQueue, condvar_queue_put, condvar_queue_get},
+  };
+  const size_t numQueues = sizeof(queues) / sizeof(queues[0]);
+
+  for (size_t i = 0; i < numQueues; ++i) {
+    fprintf(stdout, "%-8s idle consumer cpu: %6.2f%%\n",
+      queues[i].name, measureIdleCpu(&queues[i]));
+  }
+
+  int producerCounts[] = {1, 4};
+  for (size_t p = 0; p < sizeof(producerCounts) / sizeof(int); ++p) {
+    for (size_t i = 0; i < numQueues; ++i) {
+      measureLatency(&queues[i], producerCounts[p], messagesPerProducer, PACED_DELAY_NANOS);
+      measureLatency(&queues[i], producerCounts[p], messagesPerProducer, 0);
+    }
+  }
+
+  spin_queue_cleanup(&spinQueue);
+  message_queue_cleanup(&condvarQueue);
+  message_pool_cleanup(&messagePool);
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+long cpuNanos() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L;
+}
+
+void putStop(struct queue_ops_t *ops) {
+  struct message_t *message = message_alloc(&messagePool);
+  message->sender = SENDER_STOP;
+  ops->put(ops->queue, message);
+}
+
+void *waitForStop(void *args) {
+  struct queue_ops_t *ops = args;
+  message_unref(ops->get(ops->queue));
+  return NULL;
+}
+
+double measureIdleCpu(struct queue_ops_t *ops) {
+  pthread_t consumer;
+  if (pthread_create(&consumer, NULL, waitForStop, ops) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+
+  long cpuBefore = cpuNanos();
+  long wallBefore = nowNanos();
+
+  struct timespec idle = {IDLE_MEASURE_MILLIS / 1000, (IDLE_MEASURE_MILLIS % 1000) * 1000000L};
+  nanosleep(&idle, NULL);
+
+  long cpuUsed = cpuNanos() - cpuBefore;
+  long wallUsed = nowNanos() - wallBefore;
+
+  putStop(ops);
+  pthread_join(consumer, NULL);
+
+  return 100.0 * cpuUsed / wallUsed;
+}
+
+void *produce(void *args) {
+  struct producer_args_t *producer = args;
+  struct timespec delay = {0, producer->delayNanos};
+
+  for (int i = 0; i < producer->numMessages; ++i) {
+    if (producer->delayNanos > 0) {
+      nanosleep(&delay, NULL);
+    }
+    // The message carries the time it was sent.
+    struct message_t *message = message_alloc(&messagePool);
+    message->length = snprintf(message->data, messagePool.maxMessageSize, "%ld", nowNanos());
+    message->sender = producer->id;
+    producer->ops->put(producer->ops->queue, message);
+  }
+  putStop(producer->ops);
+  return NULL;
+}
+
+void *consume(void *args) {
+  struct consumer_args_t *consumer = args;
+  int producersLeft = consumer->numProducers;
+
+  while (producersLeft > 0) {
+    struct message_t *message = consumer->ops->get(consumer->ops->queue);
+    if (message->sender == SENDER_STOP) {
+      --producersLeft;
+    } else {
+      consumer->latencies[consumer->numLatencies++] =
+        nowNanos() - strtol(message->data, NULL, 10);
+    }
+    message_unref(message);
+  }
+  return NULL;
+}
+
+void measureLatency(struct queue_ops_t *ops, int numProducers,
+  int messagesPerProducer, long delayNanos) {
+
+  struct consumer_args_t consumerArgs = {ops, numProducers, NULL, 0};
+  consumerArgs.latencies = calloc((size_t)numProducers * messagesPerProducer, sizeof(long));
+  struct producer_args_t *producerArgs = calloc(numProducers, sizeof(struct producer_args_t));
+  pthread_t *producers = calloc(numProducers, sizeof(pthread_t));
+  if (consumerArgs.latencies == NULL || producerArgs == NULL || producers == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  long cpuBefore = cpuNanos();
+  long wallBefore = nowNanos();
+
+  pthread_t consumer;
+  if (pthread_create(&consumer, NULL, consume, &consumerArgs) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+  for (int i = 0; i < numProducers; ++i) {
+    producerArgs[i] = (struct producer_args_t){ops, i, messagesPerProducer, delayNanos};
+    if (pthread_create(&producers[i], NULL, produce, &producerArgs[i]) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_THREAD);
+    }
+  }
+  for (int i = 0; i < numProducers; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  pthread_join(consumer, NULL);
+
+  double cpuSeconds = (cpuNanos() - cpuBefore) / 1e9;
+  double wallSeconds = (nowNanos() - wallBefore) / 1e9;
+
+  qsort(consumerArgs.latencies, consumerArgs.numLatencies, sizeof(long), compareLongs);
+  size_t n = consumerArgs.numLatencies;
+  fprintf(stdout,
+    "%-8s %2d producer(s) %-6s p50 %8.1fus  p99 %8.1fus  max %9.1fus  cpu %5.2fs / wall %5.2fs\n",
+    ops->name, numProducers, delayNanos > 0 ? "paced" : "burst",
+    consumerArgs.latencies[n / 2] / 1e3,
+    consumerArgs.latencies[n * 99 / 100] / 1e3,
+    consumerArgs.latencies[n - 1] / 1e3,
+    cpuSeconds, wallSeconds);
+
+  free(producers);
+  free(producerArgs);
+  free(consumerArgs.latencies);
+}
+
+int compareLongs(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+void condvar_queue_put(void *queue, struct message_t *message) {
+  message_queue_put(queue, message);
+}
+
+struct message_t *condvar_queue_get(void *queue) {
+  return message_queue_get(queue);
+}
+
+void spin_queue_init(struct spin_queue_t *queue, size_t bufferSize) {
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->messages = calloc(bufferSize, sizeof(struct message_t *));
+  if (queue->messages == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  queue->pushOffset = 0;
+  queue->popOffset = 0;
+  queue->maxNumMessages = bufferSize;
+}
+
+void spin_queue_cleanup(struct spin_queue_t *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->messages);
+}
+
+void spin_queue_put(void *args, struct message_t *message) {
+  struct spin_queue_t *queue = args;
+  pthread_mutex_lock(&queue->lock);
+  while ((queue->pushOffset + 1) % queue->maxNumMessages == queue->popOffset) {
+    pthread_mutex_unlock(&queue->lock);
+    sched_yield();
+    pthread_mutex_lock(&queue->lock);
+  }
+  queue->messages[queue->pushOffset] = message;
+  queue->pushOffset = (queue->pushOffset + 1) % queue->maxNumMessages;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+struct message_t *spin_queue_get(void *args) {
+  struct spin_queue_t *queue = args;
+  pthread_mutex_lock(&queue->lock);
+  while (queue->popOffset == queue->pushOffset) {
+    pthread_mutex_unlock(&queue->lock);
+    sched_yield();
+    pthread_mutex_lock(&queue->lock);
+  }
+  struct message_t *message = queue->messages[queue->popOffset];
+  queue->popOffset = (queue->popOffset + 1) % queue->maxNumMessages;
+  pthread_mutex_unlock(&queue->lock);
+  return message;
+}
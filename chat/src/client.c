@@ -7,8 +7,35 @@ Purpose:
   you only wish to perform a 1:1 chat.  This program will default to
   client mode if the mode is not specified.
 
+  The client waits on the terminal and the remote end with epoll.
+  Whatever arrives from the remote end is read into a large buffer, and
+  every message it holds is printed with a single write, so a busy room
+  costs a couple of system calls per wakeup rather than a few per
+  message.
+
+  With --headless the client runs without a terminal, for bots: what
+  comes in on stdin, which may be a pipe or a file, is sent as usual,
+  but running out of it doesn't end the chat.
+
+  With --compress (in framed mode) the client tells the server that
+  it takes compressed messages, which the server then sends long ones
+  as.
+
+  With --reconnect (in framed mode) the client connects again, backing
+  off, whenever the server hangs up, and asks for every message it
+  missed in each of its rooms since the last one it saw, going by the
+  sequence number the server sends ahead of each message.  Messages it
+  already saw are skipped if they come again.
+
+  With --soak the client plays many users at once to soak test the
+  server; see soak.c.
+
   Usage:
-    client [--server] [--debug] [interface] port username
+    client [--server] [--debug] [--framed [--compress] [--reconnect]]
+      [--headless] [interface] port username
+    client --soak users [--rooms count] [--rate messages/s | --script file]
+      [--duration seconds] [--report seconds] [--size bytes] [interface]
+      port username
 
 */
 
@@ -20,8 +47,15 @@ Purpose:
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "client.h"
+#include "frame.h"
 
 char *PROG_NAME;
 bool DEBUG = false;
@@ -30,25 +64,69 @@ const int MAX_CLIENTS = 1;
 const int MESSAGE_BUFSIZE = 4096;
 const int USERNAME_BUFSIZE = 4096;
 
+// How much is read from the remote end at a time.  Big enough to take
+// whatever a socket buffer holds in one go.
+const int RECEIVE_BUFSIZE = 262144;
+
+// How much input is read at a time, and so the longest line that goes
+// out as one message.
+const int INPUT_BUFSIZE = 65536;
+
+// The longest message we take from the server, which is the longest it
+// accepts by default, plus the room name in front and a null
+// terminator.
+const size_t MAX_PAYLOAD_SIZE = 1024 * 1024 + FRAME_MAX_ROOM_NAME_LENGTH + 2;
+
 char *SEPARATOR = ": ";
 size_t SEPARATOR_LENGTH = 2;
 
+// Commands that are sent as frames of their own in framed mode.
+char *JOIN_COMMAND = "/join ";
+size_t JOIN_COMMAND_LENGTH = 6;
+char *LEAVE_COMMAND = "/leave ";
+size_t LEAVE_COMMAND_LENGTH = 7;
+
 // Sentinel value to indicate an invalid or otherwise NULL file
 // descriptor.
 const int FD_NULL = -1;
 
-// The set of valid exit values.
-enum EXIT_T {
-  EXIT_NORMAL = 0,
-  EXIT_ERROR_ARGUMENT,
-  EXIT_ERROR_SOCKET,
-  EXIT_ERROR_MEMORY,
-  EXIT_ERROR_IO,
-};
+// How long --reconnect waits before trying again, at first and at
+// most, in milliseconds.  The wait doubles with every failed try.
+const int RECONNECT_MIN_DELAY_MS = 250;
+const int RECONNECT_MAX_DELAY_MS = 8000;
+
+// The most rooms kept track of for --reconnect.
+#define MAX_TRACKED_ROOMS 64
 
 // The socket to the remote server/client.
 static int remoteSocket;
 
+// What the client knows about a room it is in, so that it can catch up
+// on the room after reconnecting.
+struct tracked_room_t {
+  char name[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+  // The sequence number of the last message seen from the room, or 0.
+  uint64_t lastSeen;
+  // Set from reconnecting until the server says it has resent what was
+  // missed.  Until then, messages up to lastSeen are repeats.
+  bool resyncing;
+};
+
+// Every room the client is in, in the order they were joined, so the
+// last one is where its messages go.
+static struct tracked_room_t trackedRooms[MAX_TRACKED_ROOMS];
+static int numTrackedRooms = 0;
+
+// The sequence number of the next room message, if the server sent one.
+static uint64_t nextSequence = 0;
+
+// Text waiting to be written to the terminal.
+struct output_t {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
 /* --------------------------------------------------------------------
 Function declarations
 -------------------------------------------------------------------- */
@@ -61,6 +139,12 @@ Function declarations
   progName is the string pointer that should hold the executable's name.
   servermode indicates that the client should operate in server mode.
   debug corresponds to whether the user is requesting debug output.
+  framed indicates that messages should be sent and received in frames.
+  headless indicates that the end of input shouldn't end the chat.
+  compress indicates that we should ask for compressed messages.
+  reconnect indicates that we should reconnect when the server hangs up.
+  soak holds the soak mode settings; soak->numUsers is left alone unless
+  --soak is given.
 
   If there is an unexpected argument in argv, this will cause the
   program to *TERMINATE*.
@@ -68,7 +152,19 @@ Function declarations
 void parseArguments(
   int argc, char **argv,
   char **progName, char *username,
-  struct sockaddr_in *socketAddress, bool *servermode, bool *debug);
+  struct sockaddr_in *socketAddress, bool *servermode, bool *debug,
+  bool *framed, bool *headless, bool *compress, bool *reconnect,
+  struct soak_options_t *soak);
+
+/*
+  Parses the value of a command line option that must be a positive
+  integer.
+
+  option is the name of the option, used in error messages.
+
+  Terminates the program if value is not a positive integer.
+*/
+int parsePositiveOption(char *option, char *value);
 
 
 /*
@@ -82,27 +178,103 @@ void parseArguments(
 void getClientConnection(struct sockaddr_in socketAddress, int *remotesocket);
 
 /*
-  Connect to the server.
+  Close any remote connections before exiting.
+*/
+void closeRemoteConnection();
+
+/*
+  Tells the server we take compressed messages.
 
-  socketAddress is the remote server to connect to.
+  Returns 0 on success, 1 on error.
+*/
+int sendHello(int file);
 
-  remotesocket is the file descriptor used to communicate to/from the
-  server.
+/*
+  Connects to the server again once it has hung up on remoteSocket,
+  trying until it works, and asks it to resync every tracked room.
+  The new socket replaces remoteSocket, in epollFd too.  parser starts
+  over, with its payload in payload.
 */
-void connectToServer(struct sockaddr_in *socketAddress, int *remotesocket);
+void reconnectToServer(struct sockaddr_in *socketAddress, int epollFd, bool compress,
+  struct frame_parser_t *parser, char *payload);
 
 /*
-  Close any remote connections before exiting.
+  Sends a FRAME_RESYNC for every tracked room to file, current room
+  last, so that it stays the current one, and leaves the lobby again if
+  we had left it.
+
+  Returns 0 on success, 1 on error.
 */
-void closeRemoteConnection();
+int resyncRooms(int file);
+
+/*
+  Returns the tracked room called name, which is length bytes long, or
+  NULL if we aren't in it.
+*/
+struct tracked_room_t *findTrackedRoom(const char *name, size_t length);
+
+/*
+  Keep track of joining and leaving the room called name, which is
+  length bytes long.
+*/
+void trackJoin(const char *name, size_t length);
+void trackLeave(const char *name, size_t length);
+
+/*
+  Notes that a message numbered sequence came from the room called
+  name, and returns whether it was seen before.
+*/
+bool isRepeat(const char *name, uint64_t sequence);
+
+/*
+  Sends every line of input to file in a frame of its own.  Lines of
+  the form "/join room" and "/leave room" are sent as requests to join
+  or leave that room rather than as messages.
+
+  frame is a buffer that already holds the username and separator,
+  starting FRAME_MAX_HEADER_LENGTH bytes in; prefixLength is their
+  length.  It must have room for INPUT_BUFSIZE more bytes.
+
+  Returns 0 on success, 1 on error.
+*/
+int writeFramedLines(int file, char *input, size_t chars, char *frame, size_t prefixLength);
 
 /*
-  Writes a message to the specified file.
+  Sends chars bytes of input to file: framed with writeFramedLines if
+  outframe isn't NULL, otherwise as is after the username, which
+  outmessage already starts with.
 
   Returns 0 on success, 1 on error.
+*/
+int sendInput(int file, char *input, size_t chars, char *outmessage, char *outframe,
+  size_t prefixLength);
+
+/*
+  Parses chars bytes of data received from the remote end, and adds
+  every message that they complete to output, one per line, inflating
+  compressed ones.  Messages from rooms other than FRAME_DEFAULT_ROOM
+  are prefixed with the room's name.  parser keeps track of the frame being received between calls;
+  its payload buffer is payload.
+
+  Returns 0 on success, 1 if data is not a valid frame or doesn't
+  inflate.
+*/
+int printFrames(struct frame_parser_t *parser, char *payload, char *data, size_t chars,
+  struct output_t *output);
+
+/*
+  Adds chars bytes of data to the end of output.
 
+  Terminates the program if out of memory.
 */
-int writeToFile(int file, char *message, size_t chars);
+void appendOutput(struct output_t *output, const char *data, size_t chars);
+
+/*
+  Writes everything in output to stdout and empties it.
+
+  Returns 0 on success, 1 on error.
+*/
+int flushOutput(struct output_t *output);
 
 /*
   Prints out the usage string for this program.
@@ -115,6 +287,10 @@ Main
 -------------------------------------------------------------------- */
 int main(int argc, char **argv) {
   bool servermode = false;
+  bool framed = false;
+  bool headless = false;
+  bool compress = false;
+  bool reconnect = false;
 
   remoteSocket = FD_NULL;
   // We should close the remote connection so that the remote end does
@@ -131,7 +307,22 @@ int main(int argc, char **argv) {
     exit(EXIT_ERROR_MEMORY);
   }
 
-  parseArguments(argc, argv, &PROG_NAME, username, &socketAddress, &servermode, &DEBUG);
+  struct soak_options_t soak = {
+    .numUsers = 0,
+    .numRooms = 10,
+    .rate = 100,
+    .script = NULL,
+    .duration = 60,
+    .reportInterval = 10,
+    .messageSize = 64,
+  };
+  parseArguments(argc, argv, &PROG_NAME, username, &socketAddress, &servermode, &DEBUG, &framed, &headless, &compress, &reconnect, &soak);
+
+  if (soak.numUsers > 0) {
+    int result = runSoak(&socketAddress, username, &soak);
+    free(username);
+    return result;
+  }
 
   if (servermode) {
     getClientConnection(socketAddress, &remoteSocket);
@@ -139,17 +330,19 @@ int main(int argc, char **argv) {
     connectToServer(&socketAddress, &remoteSocket);
   }
 
-  // Read data from remote
-  int chars;
-  char *message = malloc(sizeof(char) * MESSAGE_BUFSIZE);
-  if (message == NULL) {
+  // Read data from the terminal, and from remote.
+  ssize_t chars;
+  char *message = malloc(sizeof(char) * INPUT_BUFSIZE);
+  char *received = malloc(sizeof(char) * RECEIVE_BUFSIZE);
+  if (message == NULL || received == NULL) {
     perror(PROG_NAME);
     exit(EXIT_ERROR_MEMORY);
   }
 
   // Permit enough space to fit the username and SEPARATOR (": ")
   size_t usernameLength = strlen(username);
-  char *outmessage = malloc(sizeof(char) * (MESSAGE_BUFSIZE + usernameLength + SEPARATOR_LENGTH));
+  size_t prefixLength = usernameLength + SEPARATOR_LENGTH;
+  char *outmessage = malloc(sizeof(char) * (INPUT_BUFSIZE + prefixLength));
   if (outmessage == NULL) {
     perror(PROG_NAME);
     exit(EXIT_ERROR_MEMORY);
@@ -162,68 +355,142 @@ int main(int argc, char **argv) {
   strncpy(outmessage + usernameLength, SEPARATOR,
     SEPARATOR_LENGTH);
 
-  fd_set dataSourceFds;
-  int dataSourceFdsCount = remoteSocket + 1;
+  // In framed mode the same goes for outgoing frames, which also need
+  // room for a header in front.
+  char *outframe = NULL;
+  char *inpayload = NULL;
+  struct frame_parser_t parser;
+  if (framed) {
+    outframe = malloc(sizeof(char) * (FRAME_MAX_HEADER_LENGTH + prefixLength + INPUT_BUFSIZE));
+    inpayload = malloc(sizeof(char) * MAX_PAYLOAD_SIZE);
+    if (outframe == NULL || inpayload == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    memcpy(outframe + FRAME_MAX_HEADER_LENGTH, outmessage, prefixLength);
+    // Leave room for a null terminator after the payload.
+    frame_parser_reset(&parser, inpayload, MAX_PAYLOAD_SIZE - 1);
+
+    if (compress && sendHello(remoteSocket) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    // Everyone starts out in the lobby.
+    trackJoin(FRAME_DEFAULT_ROOM, strlen(FRAME_DEFAULT_ROOM));
+  }
+  reconnect = reconnect && framed && !servermode;
+
+  struct output_t output = {NULL, 0, 0};
+
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = remoteSocket;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, remoteSocket, &event) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  bool inputOpen = true;
+  event.data.fd = STDIN_FILENO;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event) != 0) {
+    if (errno != EPERM) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    // Input is a file, which epoll won't watch since it is always
+    // ready; send all of it now.
+    while ((chars = read(STDIN_FILENO, message, INPUT_BUFSIZE - 1)) > 0) {
+      message[chars] = '\0';
+      if (sendInput(remoteSocket, message, chars, outmessage, outframe, prefixLength) != 0) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_IO);
+      }
+    }
+    inputOpen = false;
+  }
 
-  // The file descriptors that we need to look at.
-  int inputFds[] = {0, remoteSocket, FD_NULL};
-  int outputFds[] = {remoteSocket, 1, FD_NULL};
-  do {
-    FD_ZERO(&dataSourceFds);
-    FD_SET(0, &dataSourceFds);
-    FD_SET(remoteSocket, &dataSourceFds);
+  // From here on stdout is written to directly.
+  fflush(stdout);
 
-    int selected = select(dataSourceFdsCount, &dataSourceFds, NULL, NULL, NULL);
-    if (selected < 0) {
+  bool remoteOpen = true;
+  while (remoteOpen && (inputOpen || headless)) {
+    struct epoll_event events[2];
+    int ready = epoll_wait(epollFd, events, 2, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       perror(PROG_NAME);
       exit(EXIT_ERROR_IO);
     }
 
     if (DEBUG) {
-      fprintf(stdout, "Received input from %d source(s).\n", selected);
+      fprintf(stderr, "Received input from %d source(s).\n", ready);
     }
 
-    for (int *in = inputFds, *out = outputFds;
-      *in != -1;
-      ++in, ++out) {
-
-      if (FD_ISSET(*in, &dataSourceFds)) {
-        chars = read(*in, message, MESSAGE_BUFSIZE);
-        message[chars] = '\0';
-        if (*out != 1) {
-          // Build the message to send to the remote socket.
-          strncpy(outmessage + usernameLength + SEPARATOR_LENGTH,
-            message, MESSAGE_BUFSIZE);
-
-          size_t outmessageLength = usernameLength +
-            SEPARATOR_LENGTH + chars;
-          // Just for good measure, null terminate the string.
-          outmessage[outmessageLength] = '\0';
-
-          if (DEBUG) {
-            fprintf(stderr, "Outgoing message: '%s'\n", outmessage);
+    for (int i = 0; i < ready; ++i) {
+      if (events[i].data.fd == STDIN_FILENO) {
+        chars = read(STDIN_FILENO, message, INPUT_BUFSIZE - 1);
+        if (chars <= 0) {
+          if (chars < 0 && errno == EINTR) {
+            continue;
           }
-
-          if (writeToFile(*out, outmessage, outmessageLength) != 0) {
-            perror(PROG_NAME);
-            exit(EXIT_ERROR_IO);
+          epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+          inputOpen = false;
+          continue;
+        }
+        message[chars] = '\0';
+        if (sendInput(remoteSocket, message, chars, outmessage, outframe, prefixLength) != 0) {
+          perror(PROG_NAME);
+          exit(EXIT_ERROR_IO);
+        }
+      } else {
+        chars = read(remoteSocket, received, RECEIVE_BUFSIZE);
+        if (chars <= 0) {
+          if (chars < 0 && errno == EINTR) {
+            continue;
           }
-        } else {
-          if (writeToFile(*out, message, chars) != 0) {
-            perror(PROG_NAME);
-            exit(EXIT_ERROR_IO);
+          if (reconnect) {
+            flushOutput(&output);
+            reconnectToServer(&socketAddress, epollFd, compress, &parser, inpayload);
+            continue;
           }
-          fputs("\n", stdout);
+          remoteOpen = false;
+          continue;
+        }
+        if (!framed) {
+          appendOutput(&output, received, chars);
+          appendOutput(&output, "\n", 1);
+        } else if (printFrames(&parser, inpayload, received, chars, &output) != 0) {
+          flushOutput(&output);
+          fputs("Received a corrupt frame.\n", stderr);
+          exit(EXIT_ERROR_IO);
         }
       }
     }
-  } while (chars > 0);
+
+    // Everything that came in on this wakeup goes out in one write.
+    if (flushOutput(&output) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
 
   if (DEBUG) {
-    fputs("Remote end closed.\n", stdout);
+    fputs(remoteOpen ? "Input closed.\n" : "Remote end closed.\n", stderr);
   }
 
+  close(epollFd);
+  free(output.data);
+  free(inpayload);
+  free(outframe);
   free(outmessage);
+  free(received);
   free(message);
   return 0;
 }
@@ -234,7 +501,9 @@ Function definitions
 void parseArguments(
   int argc, char **argv,
   char **progName, char *username,
-  struct sockaddr_in *socketAddress, bool *servermode, bool *debug) {
+  struct sockaddr_in *socketAddress, bool *servermode, bool *debug,
+  bool *framed, bool *headless, bool *compress, bool *reconnect,
+  struct soak_options_t *soak) {
 
   *progName = *(argv++);
 
@@ -244,6 +513,42 @@ void parseArguments(
       *servermode = true;
     } else if (strcmp(*argv, "--debug") == 0) {
       *debug = true;
+    } else if (strcmp(*argv, "--framed") == 0) {
+      *framed = true;
+    } else if (strcmp(*argv, "--headless") == 0) {
+      *headless = true;
+    } else if (strcmp(*argv, "--compress") == 0) {
+      *compress = true;
+    } else if (strcmp(*argv, "--reconnect") == 0) {
+      *reconnect = true;
+    } else if (strcmp(*argv, "--soak") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->numUsers = parsePositiveOption("--soak", *argv);
+    } else if (strcmp(*argv, "--rooms") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->numRooms = parsePositiveOption("--rooms", *argv);
+    } else if (strcmp(*argv, "--rate") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->rate = parsePositiveOption("--rate", *argv);
+    } else if (strcmp(*argv, "--script") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->script = *argv;
+    } else if (strcmp(*argv, "--duration") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->duration = (strcmp(*argv, "0") == 0) ? 0 : parsePositiveOption("--duration", *argv);
+    } else if (strcmp(*argv, "--report") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->reportInterval = parsePositiveOption("--report", *argv);
+    } else if (strcmp(*argv, "--size") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      soak->messageSize = parsePositiveOption("--size", *argv);
     } else {
       // This is not a valid option... maybe its an expected argument.
       break;
@@ -334,6 +639,17 @@ void parseArguments(
 }
 
 
+int parsePositiveOption(char *option, char *value) {
+  char *afterValue = value;
+  long parsed = strtol(value, &afterValue, 10);
+  if (*value == '\0' || *afterValue != '\0' || parsed <= 0 || parsed > INT_MAX) {
+    fprintf(stderr, "%s: %s expects a positive number, not '%s'\n", PROG_NAME, option, value);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  return parsed;
+}
+
 void getClientConnection(struct sockaddr_in socketAddress, int *remotesocket) {
   // Used only if we're in server mode. This is where we'll listen for
   // incoming connections.
@@ -379,15 +695,187 @@ void getClientConnection(struct sockaddr_in socketAddress, int *remotesocket) {
 }
 
 int writeToFile(int file, char *message, size_t chars) {
-  ssize_t bytesWritten = 0;
-  while ((bytesWritten = write(file, message + bytesWritten, chars - bytesWritten))) {
+  size_t totalWritten = 0;
+  while (totalWritten < chars) {
+    ssize_t bytesWritten = write(file, message + totalWritten, chars - totalWritten);
     if (bytesWritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    totalWritten += bytesWritten;
+  }
+  return 0;
+}
+
+int writeFramedLines(int file, char *input, size_t chars, char *frame, size_t prefixLength) {
+  char *payload = frame + FRAME_MAX_HEADER_LENGTH;
+  char *end = input + chars;
+
+  while (input < end) {
+    char *newline = memchr(input, '\n', end - input);
+    char *lineEnd = (newline != NULL) ? newline : end;
+    size_t lineLength = lineEnd - input;
+
+    // Commands are sent on their own, without the username.
+    enum FRAME_TYPE_T type = FRAME_MESSAGE;
+    char *body = payload;
+    size_t bodyLength = prefixLength + lineLength;
+    if (lineLength > JOIN_COMMAND_LENGTH &&
+      strncmp(input, JOIN_COMMAND, JOIN_COMMAND_LENGTH) == 0) {
+      type = FRAME_JOIN;
+      body = input + JOIN_COMMAND_LENGTH;
+      bodyLength = lineLength - JOIN_COMMAND_LENGTH;
+    } else if (lineLength > LEAVE_COMMAND_LENGTH &&
+      strncmp(input, LEAVE_COMMAND, LEAVE_COMMAND_LENGTH) == 0) {
+      type = FRAME_LEAVE;
+      body = input + LEAVE_COMMAND_LENGTH;
+      bodyLength = lineLength - LEAVE_COMMAND_LENGTH;
+    } else {
+      memcpy(payload + prefixLength, input, lineLength);
+    }
+
+    char header[FRAME_MAX_HEADER_LENGTH];
+    size_t headerLength = frame_encode_header(header, type, bodyLength);
+
+    if (DEBUG) {
+      fprintf(stderr, "Outgoing frame: '%.*s'\n", (int)bodyLength, body);
+    }
+    if (type == FRAME_JOIN) {
+      trackJoin(body, bodyLength);
+    } else if (type == FRAME_LEAVE) {
+      trackLeave(body, bodyLength);
+    }
+    if (body == payload) {
+      // Put the header right in front of the payload, so that the whole
+      // frame goes out in one write.
+      memcpy(payload - headerLength, header, headerLength);
+      if (writeToFile(file, payload - headerLength, headerLength + bodyLength) != 0) {
+        return 1;
+      }
+    } else if (writeToFile(file, header, headerLength) != 0 ||
+      writeToFile(file, body, bodyLength) != 0) {
+      return 1;
+    }
+
+    input = (newline != NULL) ? newline + 1 : end;
+  }
+  return 0;
+}
+
+int sendInput(int file, char *input, size_t chars, char *outmessage, char *outframe,
+  size_t prefixLength) {
+  if (outframe != NULL) {
+    return writeFramedLines(file, input, chars, outframe, prefixLength);
+  }
+
+  // Build the message to send to the remote socket.
+  memcpy(outmessage + prefixLength, input, chars);
+  size_t outmessageLength = prefixLength + chars;
+  // Just for good measure, null terminate the string.
+  outmessage[outmessageLength] = '\0';
+
+  if (DEBUG) {
+    fprintf(stderr, "Outgoing message: '%s'\n", outmessage);
+  }
+  return writeToFile(file, outmessage, outmessageLength);
+}
+
+int printFrames(struct frame_parser_t *parser, char *payload, char *data, size_t chars,
+  struct output_t *output) {
+  static char *inflated = NULL;
+
+  while (chars > 0) {
+    size_t consumed;
+    enum FRAME_RESULT_T result = frame_parse(parser, data, chars, &consumed);
+    data += consumed;
+    chars -= consumed;
+
+    if (result == FRAME_ERROR) {
       return 1;
     }
+    if (result == FRAME_COMPLETE) {
+      char *text = payload;
+      size_t textLength = parser->length;
+      bool repeat = false;
+      if (parser->type == FRAME_SEQUENCE &&
+        frame_decode_varint(payload, parser->length, &nextSequence) == 0) {
+        return 1;
+      }
+      if (parser->type == FRAME_RESYNC) {
+        struct tracked_room_t *room = findTrackedRoom(payload, parser->length);
+        if (room != NULL) {
+          room->resyncing = false;
+        }
+      }
+      if (parser->type == FRAME_ROOM_MESSAGE || parser->type == FRAME_ROOM_MESSAGE_DEFLATE) {
+        char *roomEnd = memchr(payload, '\0', parser->length);
+        if (roomEnd == NULL) {
+          return 1;
+        }
+        repeat = nextSequence != 0 && isRepeat(payload, nextSequence);
+        nextSequence = 0;
+        text = roomEnd + 1;
+        textLength = parser->length - (text - payload);
+        if (parser->type == FRAME_ROOM_MESSAGE_DEFLATE && !repeat) {
+          if (inflated == NULL && (inflated = malloc(MAX_PAYLOAD_SIZE)) == NULL) {
+            perror(PROG_NAME);
+            exit(EXIT_ERROR_MEMORY);
+          }
+          uLongf inflatedLength = MAX_PAYLOAD_SIZE;
+          if (uncompress((Bytef *)inflated, &inflatedLength, (Bytef *)text, textLength) != Z_OK) {
+            return 1;
+          }
+          text = inflated;
+          textLength = inflatedLength;
+        }
+        if (strcmp(payload, FRAME_DEFAULT_ROOM) != 0 && !repeat) {
+          appendOutput(output, "[", 1);
+          appendOutput(output, payload, roomEnd - payload);
+          appendOutput(output, "] ", 2);
+        }
+      }
+      // Skip anything that isn't a message, and messages we already
+      // printed before reconnecting.
+      if ((parser->type == FRAME_MESSAGE || parser->type == FRAME_ROOM_MESSAGE ||
+        parser->type == FRAME_ROOM_MESSAGE_DEFLATE) && !repeat) {
+        appendOutput(output, text, textLength);
+        appendOutput(output, "\n", 1);
+      }
+      frame_parser_reset(parser, payload, parser->capacity);
+    }
   }
   return 0;
 }
 
+void appendOutput(struct output_t *output, const char *data, size_t chars) {
+  if (output->length + chars > output->capacity) {
+    size_t capacity = (output->capacity > 0) ? output->capacity : RECEIVE_BUFSIZE;
+    while (output->length + chars > capacity) {
+      capacity *= 2;
+    }
+    char *grown = realloc(output->data, capacity);
+    if (grown == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    output->data = grown;
+    output->capacity = capacity;
+  }
+  memcpy(output->data + output->length, data, chars);
+  output->length += chars;
+}
+
+int flushOutput(struct output_t *output) {
+  if (output->length == 0) {
+    return 0;
+  }
+  int result = writeToFile(STDOUT_FILENO, output->data, output->length);
+  output->length = 0;
+  return result;
+}
+
 void connectToServer(struct sockaddr_in *socketAddress, int *remotesocket) {
   // Used only if we're in client mode. Connect to the remote server.
   if (DEBUG) {
@@ -424,7 +912,143 @@ void closeRemoteConnection() {
   }
 }
 
+int sendHello(int file) {
+  char hello[FRAME_MAX_HEADER_LENGTH];
+  size_t helloLength = strlen(FRAME_FEATURE_DEFLATE);
+  size_t headerLength = frame_encode_header(hello, FRAME_HELLO, helloLength);
+  if (writeToFile(file, hello, headerLength) != 0 ||
+    writeToFile(file, FRAME_FEATURE_DEFLATE, helloLength) != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+void reconnectToServer(struct sockaddr_in *socketAddress, int epollFd, bool compress,
+  struct frame_parser_t *parser, char *payload) {
+  // Closing the socket takes it out of epollFd.
+  close(remoteSocket);
+  remoteSocket = FD_NULL;
+
+  int delay = RECONNECT_MIN_DELAY_MS;
+  while (remoteSocket == FD_NULL) {
+    fprintf(stderr, "Lost the connection; reconnecting in %dms.\n", delay);
+    // Spread out clients that lost the server at the same moment.
+    usleep((delay / 2 + rand() % (delay / 2 + 1)) * 1000);
+    delay = (delay * 2 < RECONNECT_MAX_DELAY_MS) ? delay * 2 : RECONNECT_MAX_DELAY_MS;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (connect(fd, (struct sockaddr *)socketAddress, sizeof(*socketAddress)) != 0 ||
+      (compress && sendHello(fd) != 0) || resyncRooms(fd) != 0) {
+      close(fd);
+      continue;
+    }
+    remoteSocket = fd;
+  }
+  fputs("Reconnected.\n", stderr);
+
+  // Whatever was left of a frame went with the old connection.
+  frame_parser_reset(parser, payload, parser->capacity);
+  nextSequence = 0;
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = remoteSocket;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, remoteSocket, &event) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+}
+
+int resyncRooms(int file) {
+  if (findTrackedRoom(FRAME_DEFAULT_ROOM, strlen(FRAME_DEFAULT_ROOM)) == NULL) {
+    char frame[FRAME_MAX_HEADER_LENGTH + FRAME_MAX_ROOM_NAME_LENGTH];
+    size_t length = frame_encode_header(frame, FRAME_LEAVE, strlen(FRAME_DEFAULT_ROOM));
+    memcpy(frame + length, FRAME_DEFAULT_ROOM, strlen(FRAME_DEFAULT_ROOM));
+    if (writeToFile(file, frame, length + strlen(FRAME_DEFAULT_ROOM)) != 0) {
+      return 1;
+    }
+  }
+  for (int i = 0; i < numTrackedRooms; ++i) {
+    struct tracked_room_t *room = &trackedRooms[i];
+    char frame[FRAME_MAX_HEADER_LENGTH + FRAME_MAX_VARINT_LENGTH + FRAME_MAX_ROOM_NAME_LENGTH];
+    char *payload = frame + FRAME_MAX_HEADER_LENGTH;
+    size_t nameLength = strlen(room->name);
+    size_t payloadLength = frame_encode_varint(payload, room->lastSeen);
+    memcpy(payload + payloadLength, room->name, nameLength);
+    payloadLength += nameLength;
+
+    char header[FRAME_MAX_HEADER_LENGTH];
+    size_t headerLength = frame_encode_header(header, FRAME_RESYNC, payloadLength);
+    memcpy(payload - headerLength, header, headerLength);
+    if (writeToFile(file, payload - headerLength, headerLength + payloadLength) != 0) {
+      return 1;
+    }
+    room->resyncing = true;
+  }
+  return 0;
+}
+
+struct tracked_room_t *findTrackedRoom(const char *name, size_t length) {
+  for (int i = 0; i < numTrackedRooms; ++i) {
+    if (strlen(trackedRooms[i].name) == length && memcmp(trackedRooms[i].name, name, length) == 0) {
+      return &trackedRooms[i];
+    }
+  }
+  return NULL;
+}
+
+void trackJoin(const char *name, size_t length) {
+  if (length > FRAME_MAX_ROOM_NAME_LENGTH) {
+    // The server won't take it either.
+    return;
+  }
+  struct tracked_room_t room = {{0}, 0, false};
+  struct tracked_room_t *tracked = findTrackedRoom(name, length);
+  if (tracked != NULL) {
+    room = *tracked;
+    trackLeave(name, length);
+  } else {
+    memcpy(room.name, name, length);
+  }
+  if (numTrackedRooms == MAX_TRACKED_ROOMS) {
+    // Forget the room joined longest ago.
+    trackLeave(trackedRooms[0].name, strlen(trackedRooms[0].name));
+  }
+  trackedRooms[numTrackedRooms++] = room;
+}
+
+void trackLeave(const char *name, size_t length) {
+  struct tracked_room_t *room = findTrackedRoom(name, length);
+  if (room == NULL) {
+    return;
+  }
+  memmove(room, room + 1, (trackedRooms + numTrackedRooms - (room + 1)) * sizeof(*room));
+  --numTrackedRooms;
+}
+
+bool isRepeat(const char *name, uint64_t sequence) {
+  struct tracked_room_t *room = findTrackedRoom(name, strlen(name));
+  if (room == NULL) {
+    return false;
+  }
+  if (room->resyncing && sequence <= room->lastSeen) {
+    return true;
+  }
+  if (sequence > room->lastSeen) {
+    room->lastSeen = sequence;
+  }
+  return false;
+}
+
 void displayUsageString() {
   fputs("Usage:\n\
-    client [--server] [--debug] [interface] port username\n", stdout);
+    client [--server] [--debug] [--framed [--compress] [--reconnect]]\n\
+      [--headless] [interface] port username\n\
+    client --soak users [--rooms count] [--rate messages/s | --script file]\n\
+      [--duration seconds] [--report seconds] [--size bytes] [interface]\n\
+      port username\n", stdout);
 }
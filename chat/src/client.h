@@ -0,0 +1,83 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Declarations shared between the chat client's source files.
+
+*/
+
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/ip.h>
+
+extern char *PROG_NAME;
+extern bool DEBUG;
+
+extern const int MESSAGE_BUFSIZE;
+extern const int RECEIVE_BUFSIZE;
+
+// The set of valid exit values.
+enum EXIT_T {
+  EXIT_NORMAL = 0,
+  EXIT_ERROR_ARGUMENT,
+  EXIT_ERROR_SOCKET,
+  EXIT_ERROR_MEMORY,
+  EXIT_ERROR_IO,
+  // A soak test saw messages lost, duplicated or out of order.
+  EXIT_ERROR_DELIVERY,
+};
+
+// Settings for soak mode, where one process plays many users to test
+// the server.  See soak.c.
+struct soak_options_t {
+  // How many users to play; 0 if not in soak mode.
+  int numUsers;
+  // How many rooms the users are spread over.
+  int numRooms;
+  // How many messages all the users send per second between them, on
+  // average, when there is no script.
+  int rate;
+  // A file of lines for every user to send, or NULL to send at rate.
+  const char *script;
+  // How long to send for, in seconds; 0 until interrupted.
+  int duration;
+  // How often to report progress, in seconds.
+  int reportInterval;
+  // What every message is padded to, in bytes.
+  int messageSize;
+};
+
+/*
+  Connect to the server.
+
+  socketAddress is the remote server to connect to.
+
+  remotesocket is the file descriptor used to communicate to/from the
+  server.
+*/
+void connectToServer(struct sockaddr_in *socketAddress, int *remotesocket);
+
+/*
+  Writes a message to the specified file.
+
+  Returns 0 on success, 1 on error.
+
+*/
+int writeToFile(int file, char *message, size_t chars);
+
+/*
+  Plays options->numUsers users named after username on the server at
+  socketAddress, in the framed protocol, and checks that each of them
+  is sent every message from its room exactly once and in order.
+
+  Returns EXIT_NORMAL, or EXIT_ERROR_DELIVERY if any message went
+  missing, arrived twice or arrived out of order.
+*/
+int runSoak(struct sockaddr_in *socketAddress, const char *username,
+  struct soak_options_t *options);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A table of connections.  See connection_table.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "connection_table.h"
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Adds a chunk of slots to table and puts them on the free list.
+
+  Terminates the program if out of memory.
+*/
+static void growTable(struct connection_table_t *table);
+
+/*
+  Resizes the array at *array to hold count ints.
+
+  Terminates the program if out of memory.
+*/
+static void resizeInts(int **array, int count);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void connection_table_init(struct connection_table_t *table, size_t elementSize,
+  int maxConnections, void (*initElement)(void *element)) {
+  int maxChunks = (maxConnections + CONNECTION_CHUNK_SIZE - 1) / CONNECTION_CHUNK_SIZE;
+  table->chunks = calloc(maxChunks, sizeof(char *));
+  if (table->chunks == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  table->elementSize = elementSize;
+  table->maxConnections = maxConnections;
+  table->initElement = initElement;
+  table->numSlots = 0;
+  table->freeSlots = NULL;
+  table->numFree = 0;
+  table->active = NULL;
+  table->numActive = 0;
+  table->activeIndex = NULL;
+}
+
+void connection_table_cleanup(struct connection_table_t *table) {
+  for (int i = 0; i < table->numSlots / CONNECTION_CHUNK_SIZE; ++i) {
+    free(table->chunks[i]);
+  }
+  free(table->chunks);
+  free(table->freeSlots);
+  free(table->active);
+  free(table->activeIndex);
+  table->chunks = NULL;
+  table->numSlots = 0;
+}
+
+int connection_table_add(struct connection_table_t *table) {
+  // The last chunk may have more slots than are allowed.
+  if (table->numActive >= table->maxConnections) {
+    return -1;
+  }
+  if (table->numFree == 0) {
+    growTable(table);
+  }
+  int slot = table->freeSlots[--table->numFree];
+  table->activeIndex[slot] = table->numActive;
+  table->active[table->numActive++] = slot;
+  return slot;
+}
+
+void connection_table_remove(struct connection_table_t *table, int slot) {
+  // Move the last active slot into the hole.
+  int index = table->activeIndex[slot];
+  int last = table->active[--table->numActive];
+  table->active[index] = last;
+  table->activeIndex[last] = index;
+  table->activeIndex[slot] = -1;
+
+  table->freeSlots[table->numFree++] = slot;
+}
+
+static void growTable(struct connection_table_t *table) {
+  char *chunk = calloc(CONNECTION_CHUNK_SIZE, table->elementSize);
+  if (chunk == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  if (table->initElement != NULL) {
+    for (int i = 0; i < CONNECTION_CHUNK_SIZE; ++i) {
+      table->initElement(chunk + i * table->elementSize);
+    }
+  }
+
+  int firstSlot = table->numSlots;
+  int numSlots = firstSlot + CONNECTION_CHUNK_SIZE;
+  resizeInts(&table->freeSlots, numSlots);
+  resizeInts(&table->active, numSlots);
+  resizeInts(&table->activeIndex, numSlots);
+
+  // The lowest slot goes on top, so slots are handed out in order.
+  for (int slot = numSlots - 1; slot >= firstSlot; --slot) {
+    table->freeSlots[table->numFree++] = slot;
+    table->activeIndex[slot] = -1;
+  }
+  // Only publish the chunk once it is ready; threads that look elements
+  // up without the owner's lock find it through a slot handed out
+  // after this.
+  table->chunks[firstSlot / CONNECTION_CHUNK_SIZE] = chunk;
+  table->numSlots = numSlots;
+}
+
+static void resizeInts(int **array, int count) {
+  int *resized = realloc(*array, count * sizeof(int));
+  if (resized == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  *array = resized;
+}
@@ -0,0 +1,95 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A table of connections, indexed by slot.  Each slot holds one element
+  of whatever the server keeps per connection.
+
+  Taking a slot pops it off a free list, and giving it back pushes it
+  on again, so neither has to look for anything.  The slots in use are
+  also kept in a dense array, so going over every connection costs as
+  much as there are connections, not slots.
+
+  The table starts out empty and grows a chunk of
+  CONNECTION_CHUNK_SIZE slots at a time, up to maxConnections.  Chunks
+  are never moved or freed while the table exists, so a pointer to an
+  element, or its slot, stays good for as long as it is in use.  Only
+  the chunk directory is allocated up front, at one pointer per chunk.
+
+  A table is not thread safe.  Taking and giving back slots needs the
+  owner's lock, if it has one, but any thread that was handed a slot
+  may look its element up without it.
+
+*/
+
+#ifndef CHAT_CONNECTION_TABLE_H
+#define CHAT_CONNECTION_TABLE_H
+
+#include <stddef.h>
+
+// How many slots the table grows by at a time.  A power of two, so
+// that looking up an element is a shift and a mask.
+#define CONNECTION_CHUNK_SHIFT 8
+#define CONNECTION_CHUNK_SIZE (1 << CONNECTION_CHUNK_SHIFT)
+
+struct connection_table_t {
+  size_t elementSize;
+  int maxConnections;
+
+  // Called on every element of a new chunk, which starts out zeroed.
+  // May be NULL.
+  void (*initElement)(void *element);
+
+  // One pointer per chunk that maxConnections needs; the ones past
+  // numSlots / CONNECTION_CHUNK_SIZE are NULL.
+  char **chunks;
+  int numSlots;
+
+  // Slots that are free, the next one to hand out last.
+  int *freeSlots;
+  int numFree;
+
+  // Every slot in use, in no particular order, and where in active each
+  // slot is (-1 if it is free).
+  int *active;
+  int numActive;
+  int *activeIndex;
+};
+
+/*
+  Initializes an empty table of elements of elementSize bytes, which
+  will hold at most maxConnections of them.  initElement, if not NULL,
+  is called once on every element when its chunk is allocated.
+*/
+void connection_table_init(struct connection_table_t *table, size_t elementSize,
+  int maxConnections, void (*initElement)(void *element));
+
+/*
+  Frees every chunk.  Elements aren't cleaned up.
+*/
+void connection_table_cleanup(struct connection_table_t *table);
+
+/*
+  Takes a free slot, growing the table if there is none.  The element
+  is left as it was when the slot was given back.
+
+  Returns the slot, or -1 if the table already holds maxConnections.
+*/
+int connection_table_add(struct connection_table_t *table);
+
+/*
+  Gives slot back, so that it can be handed out again.
+*/
+void connection_table_remove(struct connection_table_t *table, int slot);
+
+/*
+  Returns the element in slot, which must have been handed out at some
+  point.
+*/
+static inline void *connection_table_get(struct connection_table_t *table, int slot) {
+  return table->chunks[slot >> CONNECTION_CHUNK_SHIFT] +
+    (size_t)(slot & (CONNECTION_CHUNK_SIZE - 1)) * table->elementSize;
+}
+
+#endif
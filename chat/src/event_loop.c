@@ -0,0 +1,1711 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  The epoll based server mode.  See event_loop.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "server.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "uring.h"
+
+const int MAX_EVENT_LOOP_CLIENTS = 65536;
+
+// How many ready sockets we handle per call to epoll_wait.
+const int MAX_EPOLL_EVENTS = 256;
+
+// The most messages handed to a single writev call.
+#define MAX_WRITE_BATCH 64
+
+// How much is read from a client at a time in framed mode.
+#define FRAMED_READ_BUFFER_SIZE 65536
+
+// How many messages from other workers may be waiting for a worker.
+const int WORKER_INBOX_LENGTH = 4096;
+
+// The most messages taken out of an inbox at a time.
+#define MAX_INBOX_BATCH 64
+
+// With io_uring: how many requests can be submitted at once, and how
+// many recv buffers each worker has.  A buffer holds a whole raw
+// message, or FRAMED_RECV_BUFFER_SIZE bytes of frames.
+const unsigned URING_ENTRIES = 4096;
+const unsigned URING_RECV_BUFFERS = 4096;
+const size_t FRAMED_RECV_BUFFER_SIZE = 4096;
+const unsigned short URING_RECV_BUFFER_GROUP = 0;
+
+// What a completion is for, kept in the low bits of its user_data.  The
+// rest is the client, or NULL for the listening socket and the worker
+// for its inbox, as with epoll.
+enum URING_REQUEST_T {
+  URING_ACCEPT,
+  URING_INBOX,
+  URING_RECV,
+  URING_SEND,
+  // Cancelling everything else, when handing over.
+  URING_CANCEL,
+};
+#define URING_REQUEST_MASK 7
+
+// Most clients sit idle most of the time, and there can be a great many
+// of them, so this is kept small.  Anything that is only needed while
+// there is something to send is borrowed from a pool and given back
+// once it has been sent.
+struct client_t {
+  // The client's socket.  0 indicates an unused slot.
+  int fd;
+
+  // With io_uring: how many requests for this client the kernel still
+  // has.  A closed client's socket is shut down and its slot only given
+  // back, with closingFd closed, once they have all completed.
+  int pendingRequests;
+  int closingFd;
+
+  // Under SLOW_CLIENT_BACKPRESSURE: the send queue filled up, and has
+  // not yet drained back down to half full.
+  bool congested;
+  // Under SLOW_CLIENT_BACKPRESSURE: this slot is in pausedReaders, since
+  // we stopped reading from it while someone was congested.  This stays
+  // set if the client is closed, so a slot is never listed twice.
+  bool readPaused;
+  // With io_uring: a recv is pending.
+  bool recvArmed;
+  // With io_uring: this slot is in pendingSends.  Like readPaused, this
+  // stays set if the client is closed.
+  bool sendListed;
+
+  // Messages waiting to be written to fd, oldest first.  This is a
+  // circular buffer of sendQueueCapacity entries, borrowed from
+  // sendQueuePool while anything is queued, and NULL otherwise.  It
+  // only grows past g_options.sendQueueLength when the slow client
+  // policy allows it to.
+  struct message_t **sendQueue;
+  uint32_t sendQueueCapacity;
+  uint32_t sendQueueHead;
+  uint32_t sendQueueCount;
+  // How many bytes of the oldest message were already written.
+  uint32_t sendOffset;
+
+  // With io_uring: how many messages at the front of the send queue the
+  // kernel is sending from, out of sendIov, which is borrowed from
+  // sendIovPool while it does.  They can't be dropped until it is done.
+  uint32_t numSending;
+  struct iovec *sendIov;
+
+  // The rooms it is in, and any frame it is half way through sending.
+  struct session_t session;
+};
+
+// Equally sized blocks that clients borrow while they have something to
+// send.  A block given back is kept for the next client that needs one,
+// linked through its first bytes.
+struct block_pool_t {
+  size_t blockSize;
+  void *freeBlocks;
+};
+
+// There are g_options.numWorkers event loops, each running on its own
+// thread.  This is the part of a worker the others can see.
+struct worker_t {
+  pthread_t thread;
+
+  // Chat messages from other workers, to be sent to this worker's
+  // members of their rooms.
+  struct mpsc_queue_t inbox;
+
+  // Becomes readable when messages are put in inbox.
+  int inboxFd;
+  // Non-zero once inboxFd has been written to and not read since, so
+  // that a burst of messages costs the worker a single wake-up.
+  int inboxSignalled;
+};
+
+static struct worker_t *workers;
+
+// Where every worker listens.
+static struct sockaddr_in listenAddress;
+
+// How many client slots each worker has.
+static int clientsPerWorker;
+
+// What was taken over from another server, if anything.  Each worker
+// takes every g_options.numWorkers-th client, starting at its own index.
+static struct handoff_state_t *inheritedState;
+
+// When handing over to a newer server: where the workers put what they
+// hand over, which is NULL until then; how many of them have stopped
+// reading; and a post from each worker once it has added its clients.
+static struct handoff_state_t *handoffState = NULL;
+static int numWorkersStopped = 0;
+static sem_t workersHandedOff;
+static pthread_mutex_t handoffLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Everything below belongs to a single worker, and is only touched from
+// its thread.
+
+static __thread struct worker_t *self;
+
+// Every client slot, as struct client_t.  There are at most
+// clientsPerWorker of them.
+static __thread struct connection_table_t clients;
+
+// Every room this worker's clients are in.  Members are slots in
+// clients.
+static __thread struct room_table_t rooms;
+
+// Where a room's member list is copied before sending to it, since
+// sending can disconnect members.
+static __thread int *roomMembers;
+
+// How many slots roomMembers, pausedReaders and pendingSends have room
+// for; grown along with clients.
+static __thread int numScratchSlots;
+
+// With io_uring, the worker's ring and the buffers recvs read into.
+static __thread bool useRing;
+static __thread struct uring_t ring;
+static __thread struct uring_buffers_t recvBuffers;
+
+// With io_uring: clients with messages waiting and no send in flight.
+// Their sends are all submitted together before the next wait.
+static __thread struct client_t **pendingSends;
+static __thread size_t numPendingSends;
+
+static __thread int epollFd;
+
+// Under SLOW_CLIENT_BACKPRESSURE, nobody is read from while this is
+// non-zero.
+static __thread int numCongestedClients;
+
+// Clients that may have unread data because of backpressure.
+static __thread struct client_t **pausedReaders;
+static __thread size_t numPausedReaders;
+
+// Where clients borrow their send queues of g_options.sendQueueLength
+// entries, and, with io_uring, the iovecs their writevs send from.
+static __thread struct block_pool_t sendQueuePool;
+static __thread struct block_pool_t sendIovPool;
+
+// Set once this worker has seen that we are handing over, and stopped
+// accepting and reading; with io_uring, once it has asked for every
+// request to be cancelled.  stoppedReading is set once they all have.
+static __thread bool handingOff;
+static __thread bool stoppedReading;
+// With io_uring, whether the multishot accept is still pending.
+static __thread bool acceptArmed;
+
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Runs one worker's event loop.  worker points to its struct worker_t.
+
+  Does not return.
+*/
+static void *runWorker(void *worker);
+
+/*
+  Returns whether this kernel lets us use io_uring the way runRing
+  does.  Leaves errno set if not.
+*/
+static bool probeRing();
+
+/*
+  Sets up the calling worker's ring and recv buffers.
+
+  Terminates the program on failure.
+*/
+static void openRing();
+
+/*
+  Runs the calling worker's event loop on its ring instead of epoll:
+  clients are accepted with a multishot accept, read with (multishot,
+  unless under SLOW_CLIENT_BACKPRESSURE) recvs into recvBuffers, and
+  written with one writev request each per wait, all submitted at once.
+
+  Does not return.
+*/
+static void runRing(int serversocket);
+
+/*
+  Carries out what a completion from the ring says happened.
+*/
+static void handleCompletion(struct io_uring_cqe *cqe, int serversocket);
+
+/*
+  Handles a recv completion for client: ingests what was read, and
+  makes sure a recv stays pending.
+*/
+static void handleRecv(struct client_t *client, struct io_uring_cqe *cqe);
+
+/*
+  Queue requests on the ring: a multishot accept on serversocket, a
+  multishot poll of the worker's inbox, a recv from client, and the
+  cancellation of every request pending.
+*/
+static void armAccept(int serversocket);
+static void armInbox();
+static void armRecv(struct client_t *client);
+static void cancelRequests();
+
+/*
+  Submits a writev for every client in pendingSends.
+*/
+static void submitSends();
+
+/*
+  Returns the listening socket taken over for the calling worker, made
+  non-blocking, or -1 if none were taken over.  Workers beyond the old
+  server's share a duplicate of one of its sockets.
+*/
+static int takeListeningSocket();
+
+/*
+  Serves the calling worker's share of the clients taken over from
+  another server.
+*/
+static void adoptClients();
+
+/*
+  Once a handoff has been asked for, stops the calling worker accepting
+  and reading, and once every worker has, hands its clients over.  Called
+  at the end of every pass of the loop.
+*/
+static void checkHandoff(int serversocket);
+
+/*
+  With io_uring, returns whether the kernel is done with every request
+  but the inbox poll.
+*/
+static bool ringIsIdle();
+
+/*
+  Adds serversocket and every client to handoffState, and blocks for
+  good.
+*/
+static void handOffWorker(int serversocket);
+
+/*
+  Creates a non-blocking socket listening on socketAddress.  With more
+  than one worker the socket is opened with SO_REUSEPORT, so that every
+  worker can have its own and the kernel spreads connections over them.
+
+  Terminates the program on failure.
+*/
+static int openListeningSocket(struct sockaddr_in *socketAddress);
+
+/*
+  Sends a chat message to every member of its room on this worker,
+  except the client in slot senderSlot, and adds it to the room's
+  history.  senderSlot is -1 for messages from other workers.
+*/
+static void sendToMembers(struct message_t *message, int senderSlot);
+
+/*
+  Puts a reference to message in every other worker's inbox.
+
+  Inboxes are bounded.  While one is full we work through our own, so
+  that two workers sending to each other can't both wait forever.
+*/
+static void forwardToWorkers(struct message_t *message);
+
+/*
+  Wakes worker up to look at its inbox, unless it was already woken.
+*/
+static void signalWorker(struct worker_t *worker);
+
+/*
+  Sends every message in this worker's inbox to its members.
+*/
+static void drainInbox();
+
+/*
+  Takes an unused client slot, or returns NULL if this worker already
+  has clientsPerWorker clients.
+*/
+static struct client_t *getNextUnusedClient();
+
+/*
+  Accepts every pending connection on serversocket.
+*/
+static void acceptClients(int serversocket);
+
+/*
+  Gives the new client on socket fd a slot, registers it with epollFd
+  unless we are using a ring, and starts its session.  handoff is what
+  was carried over for it, if it was taken over from another server, or
+  NULL.
+
+  Returns NULL, having closed fd, if it can't be served.
+*/
+static struct client_t *addClient(int fd, struct handoff_client_t *handoff);
+
+/*
+  Under SLOW_CLIENT_BACKPRESSURE, if anybody is congested, puts client
+  in pausedReaders to be read from later and returns true.
+*/
+static bool pauseIfCongested(struct client_t *client);
+
+/*
+  Reads everything that is currently available from client into pooled
+  messages, and broadcasts them.
+
+  Closes the connection if the client has hung up.
+*/
+static void readFromClient(struct client_t *client);
+
+/*
+  Adds message to client's send queue, applying the slow client policy
+  if the queue is full, and tries to send it right away.
+*/
+static void sendToClient(struct client_t *client, struct message_t *message);
+
+/*
+  Makes room in client's send queue as g_options.slowClientPolicy says.
+  Returns false if that meant disconnecting it.
+*/
+static bool makeRoom(struct client_t *client);
+
+/*
+  Copies length bytes at data into pooled messages at the back of
+  client's send queue.  The slow client policy doesn't apply.
+*/
+static void queueCopy(struct client_t *client, const char *data, size_t length);
+
+/*
+  Sends client the numIov buffers in iov, which point into a room's
+  history: what it is owed on joining the room, or on resyncing it.
+  This is a single writev unless client already has messages queued or
+  its socket fills up, in which case the rest is copied into pooled
+  messages and queued, since the history will have moved on by the time
+  it can be sent.
+*/
+static void replayHistory(struct client_t *client, struct iovec *iov, int numIov);
+
+/*
+  Writes as much of client's send queue as its socket will take.  With
+  io_uring, puts client in pendingSends instead.
+
+  Closes the connection if writing fails.
+*/
+static void flushClient(struct client_t *client);
+
+/*
+  Take a block from pool, allocating one if it is empty, and give one
+  back to it.
+*/
+static void *borrowBlock(struct block_pool_t *pool);
+static void returnBlock(struct block_pool_t *pool, void *block);
+
+/*
+  Gives client's send queue back, once it is empty.  A queue that grew
+  is freed instead.
+*/
+static void returnSendQueue(struct client_t *client);
+
+/*
+  Takes the first written bytes of client's send queue off it.
+*/
+static void retireWritten(struct client_t *client, size_t written);
+
+/*
+  Removes the oldest message from client's send queue, giving the queue
+  back if that empties it.
+*/
+static void popSendQueue(struct client_t *client);
+
+/*
+  Throws away the oldest message in client's send queue that hasn't
+  started being written.
+*/
+static void dropOldestMessage(struct client_t *client);
+
+/*
+  Doubles the size of client's send queue, or borrows one if it has
+  none.
+*/
+static void growSendQueue(struct client_t *client);
+
+/*
+  Marks client as no longer congested, possibly lifting backpressure.
+*/
+static void clearCongestion(struct client_t *client);
+
+/*
+  Reads from every client that was paused by backpressure.
+*/
+static void resumePausedReaders();
+
+/*
+  Closes client's connection, releases everything in its send queue and
+  marks the slot as unused.  With io_uring, the last two wait until the
+  kernel is done with the client's requests.
+*/
+static void closeClient(struct client_t *client);
+
+/*
+  Closes fd, which was client's socket, releases everything in its send
+  queue and gives back its slot.
+*/
+static void releaseClient(struct client_t *client, int fd);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void runEventLoop(struct sockaddr_in socketAddress, struct handoff_state_t *inherited) {
+  int numWorkers = g_options.numWorkers;
+  if (DEBUG) {
+    fprintf(stdout, "Running in event loop mode with %d worker(s).\n", numWorkers);
+  }
+  raiseFileLimit();
+
+  if (g_options.ioUring && !probeRing()) {
+    fprintf(stderr, "%s: io_uring is unavailable (%s); using epoll instead.\n",
+      PROG_NAME, strerror(errno));
+    g_options.ioUring = false;
+  }
+
+  listenAddress = socketAddress;
+  clientsPerWorker = (g_options.maxClients + numWorkers - 1) / numWorkers;
+  inheritedState = inherited;
+  // Workers only take the listening sockets they have a use for.
+  for (int i = numWorkers; i < inherited->numListeners; ++i) {
+    close(inherited->listeners[i]);
+  }
+
+  // Every inbox has to exist before any worker can forward to it.
+  workers = calloc(numWorkers, sizeof(struct worker_t));
+  if (workers == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  for (int i = 0; i < numWorkers; ++i) {
+    mpsc_queue_init(&workers[i].inbox, WORKER_INBOX_LENGTH);
+    workers[i].inboxFd = eventfd(0, EFD_NONBLOCK);
+    if (workers[i].inboxFd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+
+  if (sem_init(&workersHandedOff, 0, 0) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+  listenForHandoff();
+
+  // The calling thread becomes the first worker.
+  for (int i = 1; i < numWorkers; ++i) {
+    if (pthread_create(&workers[i].thread, NULL, runWorker, (void *)&workers[i]) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_THREAD);
+    }
+  }
+  runWorker(&workers[0]);
+}
+
+void routeMessage(struct message_t *message) {
+  switch (message->kind) {
+    case MESSAGE_JOIN:
+      if (room_join(&rooms, message->room, message->senderSlot)) {
+        struct iovec iov[HISTORY_MAX_IOV];
+        int numIov = gatherHistory(room_table_find(&rooms, message->room), iov);
+        replayHistory(connection_table_get(&clients, message->senderSlot), iov, numIov);
+      }
+      break;
+    case MESSAGE_RESYNC: {
+      room_join(&rooms, message->room, message->senderSlot);
+      struct iovec iov[RESYNC_MAX_IOV];
+      int numIov = gatherResync(room_table_find(&rooms, message->room), message, iov);
+      replayHistory(connection_table_get(&clients, message->senderSlot), iov, numIov);
+      break;
+    }
+    case MESSAGE_LEAVE:
+      room_leave(&rooms, message->room, message->senderSlot);
+      break;
+    case MESSAGE_DISCONNECT:
+      room_leave_all(&rooms, message->senderSlot);
+      break;
+    case MESSAGE_BARRIER:
+      break;
+    case MESSAGE_CHAT:
+      // Print out locally so that server can see what is going on.
+      fprintf(stdout, "%s\n", message->data);
+      logMessage(message);
+      stampSequence(message);
+
+      sendToMembers(message, message->senderSlot);
+      // Rooms are per worker, so the room's other members may be on any
+      // of the other workers.
+      if (g_options.numWorkers > 1) {
+        forwardToWorkers(message);
+      }
+      break;
+  }
+
+  // Every send queue holds its own reference now.
+  message_unref(message);
+}
+
+void eventLoopHandOff(struct handoff_state_t *state) {
+  __atomic_store_n(&handoffState, state, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < g_options.numWorkers; ++i) {
+    signalWorker(&workers[i]);
+  }
+  for (int i = 0; i < g_options.numWorkers; ++i) {
+    while (sem_wait(&workersHandedOff) != 0) {
+      // Interrupted; try again.
+    }
+  }
+}
+
+size_t eventLoopInboxDepth(int worker) {
+  // Scrapes can come in before the workers are set up.
+  if (workers == NULL) {
+    return 0;
+  }
+  return mpsc_queue_depth(&workers[worker].inbox);
+}
+
+static void *runWorker(void *worker) {
+  self = worker;
+  metrics_register_thread();
+
+  // Client slots, and the scratch space that goes with them, are only
+  // allocated as clients arrive.
+  connection_table_init(&clients, sizeof(struct client_t), clientsPerWorker, NULL);
+  struct epoll_event *events = calloc(MAX_EPOLL_EVENTS, sizeof(struct epoll_event));
+  if (events == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  room_table_init(&rooms, ROOM_TABLE_BUCKETS,
+    g_options.keptLength, g_options.historyArenaSize);
+  sendQueuePool.blockSize = g_options.sendQueueLength * sizeof(struct message_t *);
+  sendIovPool.blockSize = MAX_WRITE_BATCH * sizeof(struct iovec);
+
+  int serversocket = takeListeningSocket();
+  if (serversocket < 0) {
+    serversocket = openListeningSocket(&listenAddress);
+  }
+  if (g_options.ioUring) {
+    runRing(serversocket);
+  }
+
+  epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  // The listening socket is the only one without a client, so it is
+  // identified by a NULL pointer.  The inbox is identified by the
+  // worker itself.
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serversocket, &event) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = self;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, self->inboxFd, &event) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  adoptClients();
+
+  while (true) {
+    int ready = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+
+    for (int i = 0; i < ready; ++i) {
+      if (events[i].data.ptr == NULL) {
+        acceptClients(serversocket);
+        continue;
+      }
+      if (events[i].data.ptr == self) {
+        drainInbox();
+        continue;
+      }
+      struct client_t *client = events[i].data.ptr;
+      // The client may have been closed by an earlier event in this
+      // batch.
+      if (client->fd != 0 && (events[i].events & EPOLLOUT)) {
+        flushClient(client);
+      }
+      if (client->fd != 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        readFromClient(client);
+      }
+    }
+
+    // Backpressure is only lifted here, rather than as soon as the last
+    // congested client drains, so that reads never nest inside writes.
+    if (numCongestedClients == 0 && numPausedReaders > 0) {
+      resumePausedReaders();
+    }
+    checkHandoff(serversocket);
+  }
+
+  free(events);
+  close(epollFd);
+  close(serversocket);
+  return NULL;
+}
+
+static bool probeRing() {
+  struct uring_t probe;
+  struct uring_buffers_t buffers;
+  if (!uring_init(&probe, 8)) {
+    return false;
+  }
+  bool usable = uring_buffers_init(&buffers, &probe, URING_RECV_BUFFER_GROUP, 8, 64);
+  int error = errno;
+  if (usable) {
+    uring_buffers_cleanup(&buffers, &probe);
+  }
+  uring_cleanup(&probe);
+  errno = error;
+  return usable;
+}
+
+static void openRing() {
+  size_t bufferSize = g_options.framed ? FRAMED_RECV_BUFFER_SIZE : g_messagePool.maxMessageSize - 1;
+  if (!uring_init(&ring, URING_ENTRIES) ||
+    !uring_buffers_init(&recvBuffers, &ring, URING_RECV_BUFFER_GROUP, URING_RECV_BUFFERS, bufferSize)) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  useRing = true;
+}
+
+static void runRing(int serversocket) {
+  openRing();
+
+  // The ring waits for the sockets itself; left non-blocking, they
+  // would just hand back EAGAIN.
+  int flags = fcntl(serversocket, F_GETFL);
+  if (flags < 0 || fcntl(serversocket, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  armAccept(serversocket);
+  armInbox();
+  adoptClients();
+
+  while (true) {
+    // Once handing over, whatever is queued goes to the new server.
+    if (!handingOff) {
+      submitSends();
+    }
+    int result = uring_submit_and_wait(&ring, 1);
+    if (result < 0) {
+      errno = -result;
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+      handleCompletion(cqe, serversocket);
+      uring_cqe_seen(&ring);
+    }
+
+    if (numCongestedClients == 0 && numPausedReaders > 0) {
+      resumePausedReaders();
+    }
+    checkHandoff(serversocket);
+  }
+}
+
+static void handleCompletion(struct io_uring_cqe *cqe, int serversocket) {
+  enum URING_REQUEST_T request = cqe->user_data & URING_REQUEST_MASK;
+  bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+  if (request == URING_CANCEL) {
+    return;
+  }
+  if (request == URING_ACCEPT) {
+    if (cqe->res >= 0) {
+      if (DEBUG) {
+        fprintf(stderr, "Client connected to socket.\n");
+      }
+      struct client_t *client = addClient(cqe->res, NULL);
+      if (client != NULL) {
+        armRecv(client);
+      }
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+      errno = -cqe->res;
+      perror(PROG_NAME);
+    }
+    if (!more) {
+      acceptArmed = false;
+      armAccept(serversocket);
+    }
+    return;
+  }
+  if (request == URING_INBOX) {
+    drainInbox();
+    if (!more) {
+      armInbox();
+    }
+    return;
+  }
+
+  struct client_t *client = (struct client_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_REQUEST_MASK);
+  if (request == URING_RECV) {
+    if (!more) {
+      client->recvArmed = false;
+      --client->pendingRequests;
+    }
+    handleRecv(client, cqe);
+  } else {
+    client->numSending = 0;
+    returnBlock(&sendIovPool, client->sendIov);
+    client->sendIov = NULL;
+    --client->pendingRequests;
+    if (client->fd != 0 && cqe->res != -ECANCELED) {
+      // Otherwise we are handing over, and the queue goes with the
+      // client as it is.
+      if (cqe->res < 0) {
+        if (DEBUG) {
+          errno = -cqe->res;
+          perror(PROG_NAME);
+        }
+        closeClient(client);
+      } else {
+        metrics_add(METRIC_BYTES_OUT, cqe->res);
+        retireWritten(client, cqe->res);
+        // Whatever wasn't written, or was queued meanwhile, goes next.
+        if (client->fd != 0 && client->sendQueueCount > 0) {
+          flushClient(client);
+        }
+      }
+    }
+  }
+
+  if (client->fd == 0 && client->closingFd != 0 && client->pendingRequests == 0) {
+    int fd = client->closingFd;
+    client->closingFd = 0;
+    releaseClient(client, fd);
+  }
+}
+
+static void handleRecv(struct client_t *client, struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    char *data = uring_buffer(&recvBuffers, cqe);
+    if (client->fd != 0 && cqe->res > 0) {
+      if (g_options.framed) {
+        if (!ingestFrames(&client->session, data, cqe->res)) {
+          if (DEBUG) {
+            fprintf(stderr, "Bad frame from socket #%d.\n", client->fd);
+          }
+          closeClient(client);
+        }
+      } else {
+        // Each recv is a message, as with read.  The buffer goes back to
+        // the kernel, so it has to be copied.
+        struct message_t *message = message_alloc(&g_messagePool);
+        memcpy(message->data, data, cqe->res);
+        message->data[cqe->res] = '\0';
+        message->length = cqe->res;
+        if (!ingestMessage(&client->session, message)) {
+          closeClient(client);
+        }
+      }
+    }
+    uring_buffers_recycle(&recvBuffers, cqe);
+  }
+  if (client->fd == 0) {
+    return;
+  }
+
+  if (cqe->res == 0) {
+    // Remote end closed.
+    closeClient(client);
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+    if (DEBUG) {
+      errno = -cqe->res;
+      perror(PROG_NAME);
+    }
+    closeClient(client);
+  } else if (!client->recvArmed) {
+    // Single shot, or every buffer was in use; the ones we just gave
+    // back will do.
+    armRecv(client);
+  }
+}
+
+static void armAccept(int serversocket) {
+  if (handingOff) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = serversocket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT;
+  acceptArmed = true;
+}
+
+static void armInbox() {
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = self->inboxFd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (uintptr_t)self | URING_INBOX;
+}
+
+static void armRecv(struct client_t *client) {
+  if (client->recvArmed || handingOff || pauseIfCongested(client)) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_BUFFER_GROUP;
+  // Backpressure has to be able to stop reading, so each recv is asked
+  // for separately.
+  if (g_options.slowClientPolicy != SLOW_CLIENT_BACKPRESSURE) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  }
+  sqe->user_data = (uintptr_t)client | URING_RECV;
+  client->recvArmed = true;
+  ++client->pendingRequests;
+}
+
+static void cancelRequests() {
+  // The inbox poll is cancelled too, and armed again when it completes.
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = URING_CANCEL;
+}
+
+static void submitSends() {
+  for (size_t i = 0; i < numPendingSends; ++i) {
+    struct client_t *client = pendingSends[i];
+    client->sendListed = false;
+    if (client->fd == 0 || client->sendQueueCount == 0) {
+      continue;
+    }
+    if (client->numSending > 0) {
+      // The last writev is still waiting for room in the socket, so the
+      // client isn't keeping up.  Hold it to its queue length; what is
+      // being sent has to stay.
+      while (g_options.slowClientPolicy != SLOW_CLIENT_BACKPRESSURE &&
+        client->sendQueueCount > (size_t)g_options.sendQueueLength &&
+        client->sendQueueCount > client->numSending) {
+        if (!makeRoom(client)) {
+          break;
+        }
+      }
+      continue;
+    }
+    client->sendIov = borrowBlock(&sendIovPool);
+
+    size_t numIov = 0;
+    for (; numIov < client->sendQueueCount && numIov < MAX_WRITE_BATCH; ++numIov) {
+      struct message_t *message = client->sendQueue[(client->sendQueueHead + numIov) % client->sendQueueCapacity];
+      size_t offset = (numIov == 0) ? client->sendOffset : 0;
+      size_t length;
+      char *wire = message_wire(message, client->session.compression, &length);
+      client->sendIov[numIov].iov_base = wire + offset;
+      client->sendIov[numIov].iov_len = length - offset;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = client->fd;
+    sqe->addr = (uintptr_t)client->sendIov;
+    sqe->len = numIov;
+    sqe->user_data = (uintptr_t)client | URING_SEND;
+    client->numSending = numIov;
+    ++client->pendingRequests;
+  }
+  numPendingSends = 0;
+}
+
+static int takeListeningSocket() {
+  int worker = self - workers;
+  if (inheritedState->numListeners == 0) {
+    return -1;
+  }
+  int serversocket;
+  if (worker < inheritedState->numListeners) {
+    serversocket = inheritedState->listeners[worker];
+  } else {
+    // The old server had fewer workers, and its sockets may not let
+    // another one bind the port, so the extra workers share theirs.
+    serversocket = dup(inheritedState->listeners[worker % inheritedState->numListeners]);
+    if (serversocket < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+  }
+  int flags = fcntl(serversocket, F_GETFL);
+  if (flags < 0 || fcntl(serversocket, F_SETFL, flags | O_NONBLOCK) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  return serversocket;
+}
+
+static void adoptClients() {
+  for (int i = self - workers; i < inheritedState->numClients; i += g_options.numWorkers) {
+    struct handoff_client_t *handoff = &inheritedState->clients[i];
+    // The ring waits for sockets itself, as with the ones it accepts.
+    int flags = fcntl(handoff->fd, F_GETFL);
+    if (flags >= 0) {
+      fcntl(handoff->fd, F_SETFL, useRing ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+    }
+    struct client_t *client = addClient(handoff->fd, handoff);
+    if (client != NULL && useRing) {
+      armRecv(client);
+    }
+    handoff_client_cleanup(handoff);
+  }
+}
+
+static void checkHandoff(int serversocket) {
+  if (__atomic_load_n(&handoffState, __ATOMIC_SEQ_CST) == NULL) {
+    return;
+  }
+  if (!handingOff) {
+    handingOff = true;
+    if (useRing) {
+      cancelRequests();
+    }
+  }
+
+  if (!stoppedReading) {
+    // Anything a cancelled recv had already read still has to be
+    // passed on.
+    if (useRing && !ringIsIdle()) {
+      return;
+    }
+    stoppedReading = true;
+    __atomic_add_fetch(&numWorkersStopped, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < g_options.numWorkers; ++i) {
+      signalWorker(&workers[i]);
+    }
+  }
+  if (__atomic_load_n(&numWorkersStopped, __ATOMIC_SEQ_CST) < g_options.numWorkers) {
+    return;
+  }
+  // Nobody reads any more, so once the inbox is empty, nothing else
+  // will come.
+  drainInbox();
+  handOffWorker(serversocket);
+}
+
+static bool ringIsIdle() {
+  if (acceptArmed) {
+    return false;
+  }
+  for (int i = 0; i < clients.numActive; ++i) {
+    struct client_t *client = connection_table_get(&clients, clients.active[i]);
+    if (client->pendingRequests > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void handOffWorker(int serversocket) {
+  int *indices = calloc(clients.numSlots, sizeof(int));
+  if (indices == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  pthread_mutex_lock(&handoffLock);
+  handoff_add_listener(handoffState, serversocket);
+  for (int i = 0; i < clients.numActive; ++i) {
+    int slot = clients.active[i];
+    struct client_t *client = connection_table_get(&clients, slot);
+    if (client->fd == 0) {
+      // Closed, and waiting for the ring.
+      continue;
+    }
+    indices[slot] = handoffState->numClients;
+    struct handoff_client_t *handoff = handoff_add_client(handoffState, client->fd);
+    saveSession(&client->session, handoff);
+    // The client is owed everything left in its queue, from where
+    // writing stopped.
+    for (size_t j = 0; j < client->sendQueueCount; ++j) {
+      struct message_t *message = client->sendQueue[(client->sendQueueHead + j) % client->sendQueueCapacity];
+      size_t offset = (j == 0) ? client->sendOffset : 0;
+      size_t length;
+      char *wire = message_wire(message, client->session.compression, &length);
+      handoff_add_output(handoff, wire + offset, length - offset);
+    }
+  }
+  saveRooms(&rooms, handoffState, indices);
+  pthread_mutex_unlock(&handoffLock);
+  free(indices);
+
+  sem_post(&workersHandedOff);
+  // The sockets belong to the new server now.
+  while (true) {
+    pause();
+  }
+}
+
+static int openListeningSocket(struct sockaddr_in *socketAddress) {
+  int serversocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (serversocket < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+
+  int reusePort = 1;
+  if (g_options.numWorkers > 1 &&
+    setsockopt(serversocket, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+
+  if (DEBUG) {
+    fputs("Binding to socket.\n", stdout);
+  }
+  if (bind(serversocket, (struct sockaddr *)(socketAddress), sizeof(*socketAddress)) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+
+  // Let the kernel cap the backlog at somaxconn; with this many clients
+  // a backlog of MAX_CLIENTS is far too small for connection bursts.
+  if (listen(serversocket, SOMAXCONN) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  return serversocket;
+}
+
+static struct client_t *getNextUnusedClient() {
+  int slot = connection_table_add(&clients);
+  if (slot < 0) {
+    return NULL;
+  }
+  if (clients.numSlots > numScratchSlots) {
+    pausedReaders = realloc(pausedReaders, clients.numSlots * sizeof(struct client_t *));
+    pendingSends = realloc(pendingSends, clients.numSlots * sizeof(struct client_t *));
+    roomMembers = realloc(roomMembers, clients.numSlots * sizeof(int));
+    if (pausedReaders == NULL || pendingSends == NULL || roomMembers == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    numScratchSlots = clients.numSlots;
+  }
+  struct client_t *client = connection_table_get(&clients, slot);
+  client->session.slot = slot;
+  return client;
+}
+
+static void acceptClients(int serversocket) {
+  // Connections left waiting go to the new server.
+  while (!handingOff) {
+    int acceptedSocket = accept4(serversocket, NULL, NULL, SOCK_NONBLOCK);
+    if (acceptedSocket < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Accepted everything that was pending.
+        return;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      // Most likely out of file descriptors.  The rest of the pending
+      // clients will be picked up on the next connection attempt.
+      perror(PROG_NAME);
+      return;
+    }
+    if (DEBUG) {
+      fprintf(stderr, "Client connected to socket.\n");
+    }
+    addClient(acceptedSocket, NULL);
+  }
+}
+
+static struct client_t *addClient(int fd, struct handoff_client_t *handoff) {
+  struct client_t *client = getNextUnusedClient();
+  if (client == NULL) {
+    // We couldn't find an open slot... reject this client.
+    if (DEBUG) {
+      fprintf(stderr, "No more free slots.\n");
+    }
+    close(fd);
+    return NULL;
+  }
+
+  client->sendQueue = NULL;
+  client->sendQueueCapacity = 0;
+  client->sendQueueHead = 0;
+  client->sendQueueCount = 0;
+  client->sendOffset = 0;
+  client->congested = false;
+  client->pendingRequests = 0;
+  client->closingFd = 0;
+  client->recvArmed = false;
+  client->numSending = 0;
+
+  if (!useRing) {
+    // Always ask for both directions.  Being edge-triggered, EPOLLOUT
+    // only fires when a full socket gets room again, which is exactly
+    // when a non-empty send queue needs flushing.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = client;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      perror(PROG_NAME);
+      connection_table_remove(&clients, client->session.slot);
+      close(fd);
+      return NULL;
+    }
+  }
+  client->fd = fd;
+  if (handoff != NULL) {
+    // What the client is owed goes out before it is back in any room.
+    queueCopy(client, handoff->output, handoff->outputLength);
+    if (client->sendQueueCount > 0) {
+      flushClient(client);
+    }
+    resumeSession(&client->session, fd, client->session.slot, handoff);
+  } else {
+    startSession(&client->session, fd, client->session.slot);
+  }
+  return client;
+}
+
+static bool pauseIfCongested(struct client_t *client) {
+  if (numCongestedClients == 0) {
+    return false;
+  }
+  // Someone can't keep up.  Leave the data in the socket until they do;
+  // nothing will tell us about it again, so remember to come back.
+  if (!client->readPaused) {
+    client->readPaused = true;
+    pausedReaders[numPausedReaders++] = client;
+  }
+  return true;
+}
+
+static void readFromClient(struct client_t *client) {
+  int fd = client->fd;
+
+  // Edge-triggered sockets are read until they would block, so the last
+  // read of every wake-up comes back empty.  Keep that message around
+  // for next time instead of returning it to the pool.
+  static __thread struct message_t *spare = NULL;
+
+  if (useRing) {
+    // The ring reads by itself once a recv is pending.
+    armRecv(client);
+    return;
+  }
+  if (handingOff) {
+    // What hasn't been read yet is for the new server.
+    return;
+  }
+
+  while (client->fd == fd) {
+    if (pauseIfCongested(client)) {
+      return;
+    }
+
+    ssize_t chars;
+    if (g_options.framed) {
+      // Frames are parsed out of one shared buffer, and their payloads
+      // copied into pooled messages.
+      static __thread char readBuffer[FRAMED_READ_BUFFER_SIZE];
+      chars = read(fd, readBuffer, FRAMED_READ_BUFFER_SIZE);
+      if (chars > 0 && !ingestFrames(&client->session, readBuffer, chars)) {
+        if (DEBUG) {
+          fprintf(stderr, "Bad frame from socket #%d.\n", fd);
+        }
+        closeClient(client);
+        return;
+      }
+    } else {
+      if (spare == NULL) {
+        spare = message_alloc(&g_messagePool);
+      }
+      // Read straight into the pooled message so that it never has to
+      // be copied on its way to the other clients.
+      chars = read(fd, spare->data, g_messagePool.maxMessageSize - 1);
+      if (chars > 0) {
+        spare->data[chars] = '\0';
+        spare->length = chars;
+        bool keep = ingestMessage(&client->session, spare);
+        spare = NULL;
+        if (!keep) {
+          closeClient(client);
+          return;
+        }
+      }
+    }
+
+    if (chars > 0) {
+      continue;
+    } else if (chars == 0) {
+      // Remote end closed.
+      closeClient(client);
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Drained everything for now; epoll will tell us when there is
+      // more.
+      return;
+    } else if (errno != EINTR) {
+      perror(PROG_NAME);
+      closeClient(client);
+      return;
+    }
+  }
+}
+
+static void sendToMembers(struct message_t *message, int senderSlot) {
+  struct room_t *room = room_table_find(&rooms, message->room);
+  if (room == NULL) {
+    return;
+  }
+  recordHistory(room, message);
+
+  // A member may be disconnected while we send, which changes the room,
+  // or even frees it.
+  size_t numMembers = room->numMembers;
+  memcpy(roomMembers, room->members, numMembers * sizeof(int));
+
+  for (size_t i = 0; i < numMembers; ++i) {
+    struct client_t *client = connection_table_get(&clients, roomMembers[i]);
+    // Don't send a message back to the same client we received it from
+    if (client->fd != 0 && roomMembers[i] != senderSlot) {
+      sendToClient(client, message);
+    }
+  }
+}
+
+static void forwardToWorkers(struct message_t *message) {
+  for (int i = 0; i < g_options.numWorkers; ++i) {
+    struct worker_t *worker = &workers[i];
+    if (worker == self) {
+      continue;
+    }
+    message_ref(message);
+    while (!mpsc_queue_try_put(&worker->inbox, message)) {
+      signalWorker(worker);
+      drainInbox();
+      sched_yield();
+    }
+    signalWorker(worker);
+  }
+}
+
+static void signalWorker(struct worker_t *worker) {
+  // The message has to be in the inbox before this is read, or the
+  // worker could clear it, find nothing, and never be woken again.
+  if (__atomic_exchange_n(&worker->inboxSignalled, 1, __ATOMIC_SEQ_CST) != 0) {
+    return;
+  }
+  uint64_t count = 1;
+  if (write(worker->inboxFd, &count, sizeof(count)) < 0) {
+    perror(PROG_NAME);
+  }
+}
+
+static void drainInbox() {
+  // Reset the eventfd before looking at the inbox, so that anything put
+  // in after we find it empty wakes us up again.
+  uint64_t count;
+  if (read(self->inboxFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror(PROG_NAME);
+  }
+  __atomic_store_n(&self->inboxSignalled, 0, __ATOMIC_SEQ_CST);
+
+  struct message_t *messages[MAX_INBOX_BATCH];
+  size_t numMessages;
+  while ((numMessages = mpsc_queue_poll_batch(&self->inbox, messages, MAX_INBOX_BATCH)) > 0) {
+    for (size_t i = 0; i < numMessages; ++i) {
+      sendToMembers(messages[i], -1);
+      message_unref(messages[i]);
+    }
+  }
+}
+
+static void sendToClient(struct client_t *client, struct message_t *message) {
+  size_t sendQueueLength = g_options.sendQueueLength;
+
+  if (client->sendQueue == NULL) {
+    growSendQueue(client);
+  } else if (client->sendQueueCount == client->sendQueueCapacity) {
+    if (useRing) {
+      // Nothing is written until the ring's next wait, so whether the
+      // client is keeping up is only known then; see submitSends.
+      growSendQueue(client);
+    } else if (!makeRoom(client)) {
+      return;
+    }
+  }
+
+  message_ref(message);
+  client->sendQueue[(client->sendQueueHead + client->sendQueueCount) % client->sendQueueCapacity] = message;
+  ++client->sendQueueCount;
+
+  if (g_options.slowClientPolicy == SLOW_CLIENT_BACKPRESSURE &&
+    client->sendQueueCount >= sendQueueLength && !client->congested) {
+    client->congested = true;
+    ++numCongestedClients;
+  }
+
+  // If there was already something queued, the socket is full and
+  // EPOLLOUT will tell us when to carry on.  The ring has to see every
+  // client whose queue grew, to hold it to its length.
+  if (client->sendQueueCount == 1 || useRing) {
+    flushClient(client);
+  }
+}
+
+static bool makeRoom(struct client_t *client) {
+  if (g_options.slowClientPolicy == SLOW_CLIENT_DISCONNECT) {
+    if (DEBUG) {
+      fprintf(stderr, "Disconnecting slow client. FD: %d\n", client->fd);
+    }
+    metrics_add(METRIC_SLOW_CLIENTS_DISCONNECTED, 1);
+    closeClient(client);
+    return false;
+  }
+  if (g_options.slowClientPolicy == SLOW_CLIENT_BACKPRESSURE) {
+    // Reading stops as soon as a queue fills up, but the rest of a
+    // framed read that is already in hand still has to go somewhere.
+    growSendQueue(client);
+  } else {
+    dropOldestMessage(client);
+  }
+  return true;
+}
+
+static void replayHistory(struct client_t *client, struct iovec *iov, int numIov) {
+  if (numIov == 0) {
+    return;
+  }
+
+  size_t written = 0;
+  // The ring's sockets block, so it always goes through the queue.
+  if (client->sendQueueCount == 0 && !useRing) {
+    ssize_t result = writev(client->fd, iov, numIov);
+    // If the socket failed, epoll will tell us and we close it then.
+    if (result < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return;
+      }
+    } else {
+      written = result;
+      metrics_add(METRIC_BYTES_OUT, written);
+    }
+  }
+
+  for (int i = 0; i < numIov; ++i) {
+    char *data = iov[i].iov_base;
+    size_t length = iov[i].iov_len;
+    if (written >= length) {
+      written -= length;
+      continue;
+    }
+    // The slow client policy doesn't apply, since dropping part of the
+    // history could cut a frame in half.
+    queueCopy(client, data + written, length - written);
+    written = 0;
+  }
+  // Anything queued waits for EPOLLOUT, or is behind messages that do.
+  if (useRing && client->sendQueueCount > 0) {
+    flushClient(client);
+  }
+}
+
+static void queueCopy(struct client_t *client, const char *data, size_t length) {
+  while (length > 0) {
+    struct message_t *message = message_alloc(&g_messagePool);
+    size_t chunk = length < g_messagePool.maxMessageSize ? length : g_messagePool.maxMessageSize;
+    memcpy(message->data, data, chunk);
+    message->length = chunk;
+    message->wire = message->data;
+    message->wireLength = chunk;
+    data += chunk;
+    length -= chunk;
+
+    // The queue takes over our reference.
+    if (client->sendQueueCount == client->sendQueueCapacity) {
+      growSendQueue(client);
+    }
+    client->sendQueue[(client->sendQueueHead + client->sendQueueCount) % client->sendQueueCapacity] = message;
+    ++client->sendQueueCount;
+  }
+}
+
+static void flushClient(struct client_t *client) {
+  if (useRing) {
+    if (!client->sendListed) {
+      client->sendListed = true;
+      pendingSends[numPendingSends++] = client;
+    }
+    return;
+  }
+
+  struct iovec iov[MAX_WRITE_BATCH];
+
+  while (client->sendQueueCount > 0) {
+    int numIov = 0;
+    for (size_t i = 0; i < client->sendQueueCount && numIov < MAX_WRITE_BATCH; ++i) {
+      struct message_t *message = client->sendQueue[(client->sendQueueHead + i) % client->sendQueueCapacity];
+      size_t offset = (i == 0) ? client->sendOffset : 0;
+      size_t length;
+      char *wire = message_wire(message, client->session.compression, &length);
+      iov[numIov].iov_base = wire + offset;
+      iov[numIov].iov_len = length - offset;
+      ++numIov;
+    }
+
+    ssize_t written = writev(client->fd, iov, numIov);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (DEBUG) {
+          perror(PROG_NAME);
+        }
+        closeClient(client);
+      }
+      // Otherwise the socket is full; wait for EPOLLOUT.
+      return;
+    }
+    metrics_add(METRIC_BYTES_OUT, written);
+    retireWritten(client, written);
+  }
+}
+
+static void retireWritten(struct client_t *client, size_t written) {
+  // Retire everything that was completely written.
+  while (client->sendQueueCount > 0) {
+    struct message_t *message = client->sendQueue[client->sendQueueHead];
+    size_t length;
+    message_wire(message, client->session.compression, &length);
+    size_t remaining = length - client->sendOffset;
+    if (written < remaining) {
+      client->sendOffset += written;
+      break;
+    }
+    written -= remaining;
+    popSendQueue(client);
+    metrics_add(METRIC_MESSAGES_OUT, 1);
+  }
+
+  if (client->congested && client->sendQueueCount <= (size_t)g_options.sendQueueLength / 2) {
+    clearCongestion(client);
+  }
+}
+
+static void popSendQueue(struct client_t *client) {
+  message_unref(client->sendQueue[client->sendQueueHead]);
+  client->sendQueue[client->sendQueueHead] = NULL;
+  client->sendQueueHead = (client->sendQueueHead + 1) % client->sendQueueCapacity;
+  --client->sendQueueCount;
+  client->sendOffset = 0;
+  if (client->sendQueueCount == 0) {
+    returnSendQueue(client);
+  }
+}
+
+static void *borrowBlock(struct block_pool_t *pool) {
+  void *block = pool->freeBlocks;
+  if (block != NULL) {
+    pool->freeBlocks = *(void **)block;
+    *(void **)block = NULL;
+    return block;
+  }
+  block = calloc(1, pool->blockSize);
+  if (block == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  return block;
+}
+
+static void returnBlock(struct block_pool_t *pool, void *block) {
+  if (block == NULL) {
+    return;
+  }
+  *(void **)block = pool->freeBlocks;
+  pool->freeBlocks = block;
+}
+
+static void returnSendQueue(struct client_t *client) {
+  if (client->sendQueueCapacity == (uint32_t)g_options.sendQueueLength) {
+    returnBlock(&sendQueuePool, client->sendQueue);
+  } else {
+    free(client->sendQueue);
+  }
+  client->sendQueue = NULL;
+  client->sendQueueCapacity = 0;
+  client->sendQueueHead = 0;
+}
+
+static void dropOldestMessage(struct client_t *client) {
+  size_t capacity = client->sendQueueCapacity;
+
+  // Messages the ring is sending from have to stay, and so does a half
+  // written head, or the client would see its frame cut short.  Queues
+  // are at least MIN_SEND_QUEUE_LENGTH long, so a full one always has
+  // a message behind it to drop.
+  size_t keep = client->numSending;
+  if (keep == 0 && client->sendOffset > 0) {
+    keep = 1;
+  }
+
+  // Drop the message after the ones we keep, and move those up into
+  // its slot.
+  size_t dropped = (client->sendQueueHead + keep) % capacity;
+  message_unref(client->sendQueue[dropped]);
+  for (size_t i = keep; i > 0; --i) {
+    client->sendQueue[(client->sendQueueHead + i) % capacity] =
+      client->sendQueue[(client->sendQueueHead + i - 1) % capacity];
+  }
+  client->sendQueue[client->sendQueueHead] = NULL;
+  client->sendQueueHead = (client->sendQueueHead + 1) % capacity;
+  --client->sendQueueCount;
+  if (keep == 0) {
+    client->sendOffset = 0;
+  }
+
+  metrics_add(METRIC_DROPPED_MESSAGES, 1);
+  if (DEBUG) {
+    fprintf(stderr, "Dropped a message for slow client. FD: %d\n", client->fd);
+  }
+}
+
+static void growSendQueue(struct client_t *client) {
+  if (client->sendQueue == NULL) {
+    client->sendQueue = borrowBlock(&sendQueuePool);
+    client->sendQueueCapacity = g_options.sendQueueLength;
+    client->sendQueueHead = 0;
+    return;
+  }
+  size_t capacity = client->sendQueueCapacity * 2;
+  struct message_t **sendQueue = calloc(capacity, sizeof(struct message_t *));
+  if (sendQueue == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  // Unwrap the old ring so the oldest message is first.
+  for (size_t i = 0; i < client->sendQueueCount; ++i) {
+    sendQueue[i] = client->sendQueue[(client->sendQueueHead + i) % client->sendQueueCapacity];
+  }
+  returnSendQueue(client);
+  client->sendQueue = sendQueue;
+  client->sendQueueCapacity = capacity;
+  client->sendQueueHead = 0;
+}
+
+static void clearCongestion(struct client_t *client) {
+  client->congested = false;
+  --numCongestedClients;
+}
+
+static void resumePausedReaders() {
+  // Take the list, since readers may be paused again while we go
+  // through it.
+  size_t numReaders = numPausedReaders;
+  struct client_t **readers = calloc(numReaders, sizeof(struct client_t *));
+  if (readers == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  memcpy(readers, pausedReaders, numReaders * sizeof(struct client_t *));
+  numPausedReaders = 0;
+
+  for (size_t i = 0; i < numReaders; ++i) {
+    struct client_t *client = readers[i];
+    client->readPaused = false;
+    // The client may have hung up while it was paused.
+    if (client->fd != 0) {
+      readFromClient(client);
+    }
+  }
+  free(readers);
+}
+
+static void closeClient(struct client_t *client) {
+  if (DEBUG) {
+    fprintf(stderr, "Closing socket. FD: %d\n", client->fd);
+  }
+  int fd = client->fd;
+  client->fd = 0;
+
+  endSession(&client->session);
+
+  if (client->congested) {
+    clearCongestion(client);
+  }
+
+  if (client->pendingRequests > 0) {
+    // The kernel still has requests for the socket, and may be sending
+    // from the queue.  Shutting the socket down makes them finish, and
+    // the rest is done when they have.
+    shutdown(fd, SHUT_RDWR);
+    client->closingFd = fd;
+    return;
+  }
+  releaseClient(client, fd);
+}
+
+static void releaseClient(struct client_t *client, int fd) {
+  // Closing the socket also removes it from the epoll set.
+  if (close(fd) < 0) {
+    perror(PROG_NAME);
+  }
+
+  while (client->sendQueueCount > 0) {
+    popSendQueue(client);
+  }
+  // Dropping messages can empty the queue without giving it back.
+  if (client->sendQueue != NULL) {
+    returnSendQueue(client);
+  }
+  returnBlock(&sendIovPool, client->sendIov);
+  client->sendIov = NULL;
+
+  connection_table_remove(&clients, client->session.slot);
+}
@@ -0,0 +1,78 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  The epoll based server mode.  Rather than starting a thread per
+  client, a single thread waits on every client socket at once, reads
+  whatever is available and sends it on to the other clients in the
+  same room.  Every room lives in the event loop's own room table.
+
+  With g_options.numWorkers above one, there is an event loop per
+  worker thread, each with its own SO_REUSEPORT listening socket, client
+  slots and room table; the kernel decides which worker a new client
+  goes to.  A chat message is sent to the room's members on its own
+  worker straight away, and put in the other workers' inboxes for
+  theirs.  Joins and leaves never leave the worker.
+
+  Each client has its own bounded queue of messages waiting to be sent.
+  Messages are only written while the client's socket has room, so a
+  client that reads slowly never holds up anybody else.  What happens
+  when its queue fills up is decided by g_options.slowClientPolicy.
+
+*/
+
+#ifndef CHAT_EVENT_LOOP_H
+#define CHAT_EVENT_LOOP_H
+
+#include <netinet/ip.h>
+
+#include "handoff.h"
+#include "message.h"
+
+// How many clients are served at once by default in event loop mode.
+// Since a client only costs us an fd and a little state, this can be
+// much larger than MAX_CLIENTS.
+extern const int MAX_EVENT_LOOP_CLIENTS;
+
+/*
+  Listens for clients, reads their messages and sends them to everyone
+  else.  The calling thread becomes the first worker.
+
+  socketAddress is the address where we should listen on.  inherited
+  holds the listening sockets and clients taken over from another
+  server, which are spread over the workers, if any.
+
+  Client sockets are non-blocking and registered edge-triggered, so
+  every socket is drained until it would block.
+
+  Does not return.
+*/
+void runEventLoop(struct sockaddr_in socketAddress, struct handoff_state_t *inherited);
+
+/*
+  Carries out what message asks of its room: queues a chat message to
+  be sent to everyone in the room except its sender, or adds or removes
+  the sender.
+
+  Must be called from the thread of the event loop that serves the
+  sender.  This takes over the caller's reference to message.
+*/
+void routeMessage(struct message_t *message);
+
+/*
+  Stops every worker reading and accepting, waits until they have sent
+  or queued everything that was read, and adds their listening sockets
+  and clients to state.  The workers never run again.
+
+  Called from the thread handing over.
+*/
+void eventLoopHandOff(struct handoff_state_t *state);
+
+/*
+  Returns how many chat messages are waiting in worker's inbox.  Safe
+  to call from any thread.
+*/
+size_t eventLoopInboxDepth(int worker);
+
+#endif
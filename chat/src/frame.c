@@ -0,0 +1,157 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  The framed chat protocol.  See frame.h.
+
+*/
+
+#include <string.h>
+
+#include "frame.h"
+
+// Lengths are at most 32 bits, so a varint never needs more than five
+// bytes.
+const int FRAME_MAX_LENGTH_SHIFT = 28;
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void frame_parser_reset(struct frame_parser_t *parser, char *payload, size_t capacity) {
+  parser->state = FRAME_PARSING_LENGTH;
+  parser->lengthShift = 0;
+  parser->type = 0;
+  parser->length = 0;
+  parser->payload = payload;
+  parser->capacity = capacity;
+  parser->limit = capacity;
+  parser->received = 0;
+}
+
+void frame_parser_set_limit(struct frame_parser_t *parser, size_t limit) {
+  parser->limit = (limit > parser->capacity) ? limit : parser->capacity;
+}
+
+void frame_parser_move(struct frame_parser_t *parser, char *payload, size_t capacity) {
+  parser->payload = payload;
+  parser->capacity = capacity;
+}
+
+bool frame_parser_is_idle(const struct frame_parser_t *parser) {
+  return parser->state == FRAME_PARSING_LENGTH && parser->lengthShift == 0;
+}
+
+enum FRAME_RESULT_T frame_parse(struct frame_parser_t *parser,
+  const char *data, size_t length, size_t *consumed) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  size_t position = 0;
+
+  while (position < length) {
+    switch (parser->state) {
+      case FRAME_PARSING_LENGTH:
+        // The last group only has room for the top 4 bits.
+        if (parser->lengthShift == FRAME_MAX_LENGTH_SHIFT && (bytes[position] & 0x70) != 0) {
+          *consumed = position + 1;
+          return FRAME_ERROR;
+        }
+        parser->length |= (uint32_t)(bytes[position] & 0x7f) << parser->lengthShift;
+        if ((bytes[position++] & 0x80) == 0) {
+          if (parser->length > parser->limit) {
+            *consumed = position;
+            return FRAME_ERROR;
+          }
+          parser->state = FRAME_PARSING_TYPE;
+          if (parser->length > parser->capacity) {
+            *consumed = position;
+            return FRAME_NEEDS_BUFFER;
+          }
+        } else if ((parser->lengthShift += 7) > FRAME_MAX_LENGTH_SHIFT) {
+          *consumed = position;
+          return FRAME_ERROR;
+        }
+        break;
+
+      case FRAME_PARSING_TYPE:
+        parser->type = bytes[position++];
+        parser->state = FRAME_PARSING_PAYLOAD;
+        break;
+
+      case FRAME_PARSING_PAYLOAD: {
+        // Copy as much of the payload as we have in one go.
+        size_t wanted = parser->length - parser->received;
+        size_t available = length - position;
+        size_t chunk = (wanted < available) ? wanted : available;
+        memcpy(parser->payload + parser->received, data + position, chunk);
+        parser->received += chunk;
+        position += chunk;
+        break;
+      }
+    }
+
+    if (parser->state == FRAME_PARSING_PAYLOAD && parser->received == parser->length) {
+      *consumed = position;
+      return FRAME_COMPLETE;
+    }
+  }
+
+  *consumed = position;
+  return FRAME_INCOMPLETE;
+}
+
+size_t frame_parser_encode_partial(const struct frame_parser_t *parser, char *header) {
+  if (parser->state != FRAME_PARSING_LENGTH) {
+    size_t headerLength = frame_encode_header(header, parser->type, parser->length);
+    // Without the type, if it hasn't arrived yet.
+    return (parser->state == FRAME_PARSING_TYPE) ? headerLength - 1 : headerLength;
+  }
+  // Part of the length: every group so far, each with more to follow.
+  unsigned char *bytes = (unsigned char *)header;
+  size_t headerLength = 0;
+  for (int shift = 0; shift < parser->lengthShift; shift += 7) {
+    bytes[headerLength++] = ((parser->length >> shift) & 0x7f) | 0x80;
+  }
+  return headerLength;
+}
+
+size_t frame_encode_header(char *header, enum FRAME_TYPE_T type, size_t length) {
+  size_t headerLength = frame_encode_varint(header, length);
+  header[headerLength++] = type;
+  return headerLength;
+}
+
+size_t frame_encode_varint(char *data, uint64_t value) {
+  unsigned char *bytes = (unsigned char *)data;
+  size_t length = 0;
+
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    bytes[length++] = byte;
+  } while (value != 0);
+
+  return length;
+}
+
+size_t frame_decode_varint(const char *data, size_t length, uint64_t *value) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  *value = 0;
+  for (size_t i = 0; i < length && i < FRAME_MAX_VARINT_LENGTH; ++i) {
+    *value |= (uint64_t)(bytes[i] & 0x7f) << (7 * i);
+    if ((bytes[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+size_t frame_encode_sequence(char *frame, uint64_t sequence) {
+  char varint[FRAME_MAX_VARINT_LENGTH];
+  size_t varintLength = frame_encode_varint(varint, sequence);
+  size_t headerLength = frame_encode_header(frame, FRAME_SEQUENCE, varintLength);
+  memcpy(frame + headerLength, varint, varintLength);
+  return headerLength + varintLength;
+}
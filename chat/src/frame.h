@@ -0,0 +1,214 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  The framed chat protocol.  Instead of treating whatever one read()
+  returns as a message, every message travels in a frame:
+
+    length   varint   the number of payload bytes, 7 bits per byte,
+                      least significant group first.  The high bit of
+                      each byte is set if another byte follows.
+    type     1 byte   one of FRAME_TYPE_T.
+    payload  length bytes
+
+  so messages can be pipelined back to back, or split across packets,
+  without being merged or cut up.  The parser is incremental: it can be
+  fed any number of bytes at a time and picks up where it left off.
+
+  This is shared by the client and the server, so it reports errors
+  rather than terminating the program.
+
+*/
+
+#ifndef CHAT_FRAME_H
+#define CHAT_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The longest header frame_encode_header can produce: a five byte
+// varint, which covers any 32 bit length, and the type.
+#define FRAME_MAX_HEADER_LENGTH 6
+
+// The longest varint, which covers any 64 bit number.
+#define FRAME_MAX_VARINT_LENGTH 10
+
+// The longest FRAME_SEQUENCE frame: its payload is a single varint, so
+// its length always fits in one byte.
+#define FRAME_MAX_SEQUENCE_LENGTH (2 + FRAME_MAX_VARINT_LENGTH)
+
+// Room names are 1 to FRAME_MAX_ROOM_NAME_LENGTH bytes, without any
+// null bytes.
+#define FRAME_MAX_ROOM_NAME_LENGTH 32
+
+// Every client starts out in this room.
+#define FRAME_DEFAULT_ROOM "lobby"
+
+enum FRAME_TYPE_T {
+  // Client to server: a chat message for everyone else in the room the
+  // client joined last.
+  FRAME_MESSAGE = 1,
+  // Client to server: join the room named by the payload, and send
+  // messages there from now on.
+  FRAME_JOIN = 2,
+  // Client to server: leave the room named by the payload.
+  FRAME_LEAVE = 3,
+  // Server to client: a chat message from a room.  The payload is the
+  // room name, a null byte, and then the message.
+  FRAME_ROOM_MESSAGE = 4,
+  // Client to server, first thing after connecting: the optional
+  // features the client understands, separated by spaces.  The server
+  // uses whichever it knows about from then on, and never answers, so
+  // a server that ignores this frame is fine too.
+  FRAME_HELLO = 5,
+  // Server to client, only to clients that said hello with
+  // FRAME_FEATURE_DEFLATE: FRAME_ROOM_MESSAGE with the message
+  // compressed.  The payload is the room name, a null byte, and then
+  // the message as a zlib stream.
+  FRAME_ROOM_MESSAGE_DEFLATE = 6,
+  // Server to client, right before every FRAME_ROOM_MESSAGE and
+  // FRAME_ROOM_MESSAGE_DEFLATE: that message's sequence number, as a
+  // varint.  A room's messages are numbered in the order they are sent
+  // out, though not necessarily one apart.  Clients that don't care
+  // skip it.
+  FRAME_SEQUENCE = 7,
+  // Client to server: a varint sequence number followed by a room
+  // name.  Joins the room as FRAME_JOIN does, then resends every
+  // message of the room the server still has that came after that
+  // sequence number, so a client that reconnects can catch up on what
+  // it missed.
+  //
+  // Server to client: the room name.  Everything resent for a
+  // FRAME_RESYNC of that room has been sent.
+  FRAME_RESYNC = 8,
+};
+
+// The hello feature for FRAME_ROOM_MESSAGE_DEFLATE.
+#define FRAME_FEATURE_DEFLATE "deflate"
+
+enum FRAME_RESULT_T {
+  // Every byte given was consumed, and the frame isn't finished yet.
+  FRAME_INCOMPLETE,
+  // A whole frame has been parsed; see type, payload and length.
+  FRAME_COMPLETE,
+  // The stream is corrupt, or the frame is longer than allowed.
+  FRAME_ERROR,
+  // The frame's length is known, and it is longer than fits in
+  // payload but within the limit; see frame_parser_set_limit.  Give
+  // the parser somewhere that it fits with frame_parser_move before
+  // parsing on.
+  FRAME_NEEDS_BUFFER,
+};
+
+enum FRAME_PARSER_STATE_T {
+  FRAME_PARSING_LENGTH,
+  FRAME_PARSING_TYPE,
+  FRAME_PARSING_PAYLOAD,
+};
+
+// The server keeps one of these for every connection, so it is kept
+// small: frame lengths fit in 32 bits, and the rest in a byte.
+struct frame_parser_t {
+  // An enum FRAME_PARSER_STATE_T.
+  unsigned char state;
+
+  // How far into the length varint we are.
+  unsigned char lengthShift;
+
+  // The frame being parsed.  Only complete once frame_parse returns
+  // FRAME_COMPLETE.
+  unsigned char type;
+  uint32_t length;
+
+  // How many payload bytes fit where the payload goes, and how many
+  // were received so far.  The parser never writes a null terminator.
+  uint32_t capacity;
+  uint32_t received;
+  // The longest frame allowed, which is at least capacity.
+  uint32_t limit;
+  char *payload;
+};
+
+/*
+  Gets parser ready for a new frame, whose payload will be stored in
+  payload.  Frames longer than capacity are an error.
+
+  Call this before parsing the first frame, and after every complete
+  frame.  The parser holds no other state, so a frame's payload can be
+  placed in a different buffer each time.
+*/
+void frame_parser_reset(struct frame_parser_t *parser, char *payload, size_t capacity);
+
+/*
+  Allows the frame being parsed to be up to limit bytes long, rather
+  than capacity.  If it turns out to be longer than capacity,
+  frame_parse stops with FRAME_NEEDS_BUFFER as soon as its length is
+  known.
+
+  frame_parser_reset goes back to allowing only capacity.
+*/
+void frame_parser_set_limit(struct frame_parser_t *parser, size_t limit);
+
+/*
+  Has parser store the payload of the current frame in payload, which
+  has room for capacity bytes, from now on.  Only valid before any of
+  the payload has been received.
+*/
+void frame_parser_move(struct frame_parser_t *parser, char *payload, size_t capacity);
+
+/*
+  Returns whether parser has been fed nothing of the frame after the
+  last complete one, so that its payload buffer isn't needed yet.
+*/
+bool frame_parser_is_idle(const struct frame_parser_t *parser);
+
+/*
+  Feeds up to length bytes of data to parser.
+
+  Stops at the end of a frame, so that the caller can deal with it
+  before reading on.  *consumed is set to how many bytes of data were
+  used; anything after that belongs to the next frame.
+*/
+enum FRAME_RESULT_T frame_parse(struct frame_parser_t *parser,
+  const char *data, size_t length, size_t *consumed);
+
+/*
+  Writes what parser has been fed of the frame it is in the middle of,
+  up to the start of its payload, to header, which must have room for
+  FRAME_MAX_HEADER_LENGTH bytes, and returns its length.  Feeding that,
+  followed by the first parser->received bytes of the payload, to a
+  freshly reset parser brings it to where this one is.
+*/
+size_t frame_parser_encode_partial(const struct frame_parser_t *parser, char *header);
+
+/*
+  Writes the header for a frame of type with length payload bytes to
+  header, which must have room for FRAME_MAX_HEADER_LENGTH bytes.
+
+  Returns the length of the header.
+*/
+size_t frame_encode_header(char *header, enum FRAME_TYPE_T type, size_t length);
+
+/*
+  Writes value as a varint to data, which must have room for
+  FRAME_MAX_VARINT_LENGTH bytes, and returns its length.
+*/
+size_t frame_encode_varint(char *data, uint64_t value);
+
+/*
+  Reads a varint from the first length bytes of data into *value.
+
+  Returns how many bytes it took up, or 0 if data doesn't start with a
+  whole varint.
+*/
+size_t frame_decode_varint(const char *data, size_t length, uint64_t *value);
+
+/*
+  Writes a FRAME_SEQUENCE frame for sequence to frame, which must have
+  room for FRAME_MAX_SEQUENCE_LENGTH bytes, and returns its length.
+*/
+size_t frame_encode_sequence(char *frame, uint64_t sequence);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Hot restart.  See handoff.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "handoff.h"
+
+static const char *handoffPath;
+static bool handoffFramed;
+static void (*stopServing)(struct handoff_state_t *state);
+static int handoffSocket;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Fills in address for the UNIX socket at path.
+
+  Terminates the program if path is too long.
+*/
+static void makeAddress(struct sockaddr_un *address, const char *path);
+
+/*
+  Waits for a new server to connect, and hands over to the first one
+  that can take over.
+
+  Does not return.
+*/
+static void *serveHandoff(void *args);
+
+/*
+  Sends the record for one socket, with fd attached unless it is -1,
+  followed by the length bytes at data.
+
+  Returns false if the new server went away.
+*/
+static bool sendRecord(int connection, struct handoff_record_t *record, int fd,
+  const char *data, size_t length);
+
+/*
+  Reads the next record into record, and the socket that came with it
+  into *fd (-1 if none).
+
+  Terminates the program on failure.
+*/
+static void receiveRecord(int connection, struct handoff_record_t *record, int *fd);
+
+/*
+  Reads the next length bytes into a buffer of their own, with a null
+  terminator after them, and returns it, or NULL if length is 0.
+
+  Terminates the program on failure.
+*/
+static char *receivePart(int connection, size_t length);
+
+/*
+  Reads exactly length bytes into data.  Returns false on failure or
+  end of file.
+*/
+static bool readFully(int connection, char *data, size_t length);
+
+/*
+  Appends length bytes at data to the buffer at *buffer, which holds
+  *bufferLength bytes.
+*/
+static void append(char **buffer, size_t *bufferLength, const char *data, size_t length);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void handoff_state_init(struct handoff_state_t *state) {
+  memset(state, 0, sizeof(*state));
+}
+
+void handoff_add_listener(struct handoff_state_t *state, int fd) {
+  if (state->numListeners == state->maxListeners) {
+    state->maxListeners = (state->maxListeners == 0) ? 4 : state->maxListeners * 2;
+    state->listeners = realloc(state->listeners, state->maxListeners * sizeof(int));
+    if (state->listeners == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+  }
+  state->listeners[state->numListeners++] = fd;
+}
+
+struct handoff_client_t *handoff_add_client(struct handoff_state_t *state, int fd) {
+  if (state->numClients == state->maxClients) {
+    state->maxClients = (state->maxClients == 0) ? 64 : state->maxClients * 2;
+    state->clients = realloc(state->clients, state->maxClients * sizeof(struct handoff_client_t));
+    if (state->clients == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+  }
+  struct handoff_client_t *client = &state->clients[state->numClients++];
+  memset(client, 0, sizeof(*client));
+  client->fd = fd;
+  return client;
+}
+
+void handoff_add_room(struct handoff_client_t *client, const char *room) {
+  append(&client->rooms, &client->roomsLength, room, strlen(room) + 1);
+}
+
+void handoff_add_input(struct handoff_client_t *client, const char *data, size_t length) {
+  append(&client->input, &client->inputLength, data, length);
+}
+
+void handoff_add_output(struct handoff_client_t *client, const char *data, size_t length) {
+  append(&client->output, &client->outputLength, data, length);
+}
+
+void handoff_client_cleanup(struct handoff_client_t *client) {
+  free(client->rooms);
+  free(client->input);
+  free(client->output);
+  client->rooms = NULL;
+  client->input = NULL;
+  client->output = NULL;
+}
+
+bool handoff_receive(const char *path, bool framed, struct handoff_state_t *state) {
+  handoff_state_init(state);
+  struct sockaddr_un address;
+  makeAddress(&address, path);
+
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  if (connect(connection, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    // Nobody to take over from, or a socket file left behind by a
+    // server that is gone.
+    if (errno != ENOENT && errno != ECONNREFUSED) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    close(connection);
+    return false;
+  }
+  if (DEBUG) {
+    fprintf(stdout, "Taking over from the server on %s.\n", path);
+  }
+
+  struct handoff_hello_t hello = {HANDOFF_VERSION, framed};
+  if (write(connection, &hello, sizeof(hello)) != sizeof(hello)) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+
+  while (true) {
+    struct handoff_record_t record;
+    int fd;
+    receiveRecord(connection, &record, &fd);
+    if (record.kind == HANDOFF_END) {
+      break;
+    }
+    if (record.kind == HANDOFF_REFUSED) {
+      fprintf(stderr, "%s: The server on %s can't hand over to this one; "
+        "check that both are the same version and agree on --framed.\n", PROG_NAME, path);
+      exit(EXIT_ERROR_ARGUMENT);
+    }
+    if (fd < 0) {
+      fprintf(stderr, "%s: A socket went missing in the handoff\n", PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (record.kind == HANDOFF_LISTENER) {
+      handoff_add_listener(state, fd);
+      continue;
+    }
+
+    struct handoff_client_t *client = handoff_add_client(state, fd);
+    client->compression = record.compression != 0;
+    memcpy(client->room, record.room, sizeof(client->room));
+    client->room[FRAME_MAX_ROOM_NAME_LENGTH] = '\0';
+    client->roomsLength = record.roomsLength;
+    client->inputLength = record.inputLength;
+    client->outputLength = record.outputLength;
+    client->rooms = receivePart(connection, client->roomsLength);
+    client->input = receivePart(connection, client->inputLength);
+    client->output = receivePart(connection, client->outputLength);
+  }
+
+  // The old server exits once it has sent everything; wait for it, so
+  // that only one of us has the message log open.
+  char end;
+  ssize_t chars;
+  while ((chars = read(connection, &end, 1)) > 0 || (chars < 0 && errno == EINTR)) {
+  }
+  close(connection);
+  if (DEBUG) {
+    fprintf(stdout, "Took over %d listening socket(s) and %d client(s).\n",
+      state->numListeners, state->numClients);
+  }
+  return true;
+}
+
+void handoff_listen(const char *path, bool framed, void (*stop)(struct handoff_state_t *state)) {
+  struct sockaddr_un address;
+  makeAddress(&address, path);
+
+  handoffSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (handoffSocket < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  // Whoever was listening here before has handed over to us, or is gone.
+  unlink(path);
+  if (bind(handoffSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    listen(handoffSocket, 1) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  handoffPath = path;
+  handoffFramed = framed;
+  stopServing = stop;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, serveHandoff, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+  pthread_detach(thread);
+}
+
+static void makeAddress(struct sockaddr_un *address, const char *path) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "%s: Handoff socket path is too long: %s\n", PROG_NAME, path);
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  strcpy(address->sun_path, path);
+}
+
+static void *serveHandoff(void *args) {
+  while (true) {
+    int connection = accept(handoffSocket, NULL, NULL);
+    if (connection < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror(PROG_NAME);
+      }
+      continue;
+    }
+
+    struct handoff_hello_t hello;
+    struct handoff_record_t record;
+    memset(&record, 0, sizeof(record));
+    if (!readFully(connection, (char *)&hello, sizeof(hello))) {
+      close(connection);
+      continue;
+    }
+    if (hello.version != HANDOFF_VERSION || (hello.framed != 0) != handoffFramed) {
+      fprintf(stderr, "%s: Refused to hand over to an incompatible server.\n", PROG_NAME);
+      record.kind = HANDOFF_REFUSED;
+      sendRecord(connection, &record, -1, NULL, 0);
+      close(connection);
+      continue;
+    }
+
+    fprintf(stderr, "%s: Handing over to a new server.\n", PROG_NAME);
+    struct handoff_state_t state;
+    handoff_state_init(&state);
+    stopServing(&state);
+
+    // From here on nothing is served, so if the new server goes away
+    // its clients go with it.
+    bool sent = true;
+    for (int i = 0; sent && i < state.numListeners; ++i) {
+      record.kind = HANDOFF_LISTENER;
+      sent = sendRecord(connection, &record, state.listeners[i], NULL, 0);
+    }
+    for (int i = 0; sent && i < state.numClients; ++i) {
+      struct handoff_client_t *client = &state.clients[i];
+      record.kind = HANDOFF_CLIENT;
+      record.compression = client->compression;
+      memcpy(record.room, client->room, sizeof(record.room));
+      record.roomsLength = client->roomsLength;
+      record.inputLength = client->inputLength;
+      record.outputLength = client->outputLength;
+      sent = sendRecord(connection, &record, client->fd, client->rooms, client->roomsLength) &&
+        sendRecord(connection, NULL, -1, client->input, client->inputLength) &&
+        sendRecord(connection, NULL, -1, client->output, client->outputLength);
+    }
+    if (sent) {
+      memset(&record, 0, sizeof(record));
+      record.kind = HANDOFF_END;
+      sent = sendRecord(connection, &record, -1, NULL, 0);
+    }
+    if (!sent) {
+      perror(PROG_NAME);
+    }
+
+    // Skip the exit handlers: the metrics socket, for one, belongs to
+    // the new server now.
+    fflush(stdout);
+    _exit(sent ? EXIT_NORMAL : EXIT_ERROR_SOCKET);
+  }
+  return NULL;
+}
+
+static bool sendRecord(int connection, struct handoff_record_t *record, int fd,
+  const char *data, size_t length) {
+  if (record != NULL) {
+    struct iovec iov = {record, sizeof(*record)};
+    union {
+      struct cmsghdr header;
+      char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+      memset(&control, 0, sizeof(control));
+      message.msg_control = control.buffer;
+      message.msg_controllen = sizeof(control.buffer);
+      struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    // A UNIX stream socket takes the whole record, which is small, in
+    // one go or not at all.
+    ssize_t sent;
+    while ((sent = sendmsg(connection, &message, 0)) < 0 && errno == EINTR) {
+    }
+    if (sent != sizeof(*record)) {
+      return false;
+    }
+  }
+  struct iovec iov = {(char *)data, length};
+  return length == 0 || writevToFile(connection, &iov, 1) == 0;
+}
+
+static void receiveRecord(int connection, struct handoff_record_t *record, int *fd) {
+  struct iovec iov = {record, sizeof(*record)};
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  // The socket comes with the first byte of its record.
+  ssize_t received;
+  while ((received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  if (received <= 0 ||
+    !readFully(connection, (char *)record + received, sizeof(*record) - received)) {
+    fprintf(stderr, "%s: The handoff was cut short\n", PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  if (message.msg_flags & MSG_CTRUNC) {
+    fprintf(stderr, "%s: Ran out of file descriptors taking over\n", PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+
+  *fd = -1;
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(header), sizeof(int));
+  }
+}
+
+static char *receivePart(int connection, size_t length) {
+  if (length == 0) {
+    return NULL;
+  }
+  char *data = malloc(length + 1);
+  if (data == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  if (!readFully(connection, data, length)) {
+    fprintf(stderr, "%s: The handoff was cut short\n", PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  data[length] = '\0';
+  return data;
+}
+
+static bool readFully(int connection, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t chars = read(connection, data, length);
+    if (chars < 0 && errno == EINTR) {
+      continue;
+    }
+    if (chars <= 0) {
+      return false;
+    }
+    data += chars;
+    length -= chars;
+  }
+  return true;
+}
+
+static void append(char **buffer, size_t *bufferLength, const char *data, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  *buffer = realloc(*buffer, *bufferLength + length);
+  if (*buffer == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  memcpy(*buffer + *bufferLength, data, length);
+  *bufferLength += length;
+}
@@ -0,0 +1,152 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Hot restart.  A server started with --handoff path first tries to
+  take over from a server already listening on that UNIX socket.  The
+  running server stops reading from its clients, finishes sending
+  everything it had already read, and passes its listening sockets and
+  every client socket to the new server with SCM_RIGHTS, along with
+  what it knew about each client:
+
+    - the rooms it is in, and the one its messages go to
+    - whether it takes compressed messages
+    - the start of any frame it was half way through sending
+    - anything that was queued for it but not yet written
+
+  and then exits.  The new server carries on serving the same
+  connections, so the clients never notice, and listens on path in turn
+  for the server that replaces it.
+
+  On the socket, the new server sends a struct handoff_hello_t, and the
+  old one answers with a struct handoff_record_t for every socket, each
+  followed by the variable length parts of its state, and one with
+  HANDOFF_END.  The socket's file descriptor travels with its record.
+
+  Room history is not carried over.
+
+*/
+
+#ifndef CHAT_HANDOFF_H
+#define CHAT_HANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+// Bumped whenever the records change, so that servers that would
+// misunderstand each other refuse instead.
+#define HANDOFF_VERSION 1
+
+enum HANDOFF_RECORD_T {
+  // A listening socket.
+  HANDOFF_LISTENER,
+  // A client socket, followed by its state.
+  HANDOFF_CLIENT,
+  // Everything was sent; the old server exits.
+  HANDOFF_END,
+  // The old server can't hand over to this one, and carries on.
+  HANDOFF_REFUSED,
+};
+
+struct handoff_hello_t {
+  uint32_t version;
+  // Whether the new server speaks the framed protocol, which the old
+  // one has to as well.
+  uint32_t framed;
+};
+
+struct handoff_record_t {
+  uint32_t kind;
+  uint32_t compression;
+  // How many bytes of room names, input and output follow, in that
+  // order.
+  uint32_t roomsLength;
+  uint32_t inputLength;
+  uint64_t outputLength;
+  char room[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+};
+
+// What is carried over for a client.
+struct handoff_client_t {
+  int fd;
+  bool compression;
+  // The room its messages go to, or empty if it has left it.
+  char room[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+
+  // Every room it is in, as null terminated names one after another.
+  char *rooms;
+  size_t roomsLength;
+  // What it sent of a frame that isn't finished, to be parsed again
+  // before anything else it sends.
+  char *input;
+  size_t inputLength;
+  // What it is owed, to be written to it before anything else.
+  char *output;
+  size_t outputLength;
+};
+
+struct handoff_state_t {
+  int *listeners;
+  int numListeners;
+  int maxListeners;
+
+  struct handoff_client_t *clients;
+  int numClients;
+  int maxClients;
+};
+
+/*
+  Initializes an empty state.
+*/
+void handoff_state_init(struct handoff_state_t *state);
+
+/*
+  Adds listening socket fd to state.
+*/
+void handoff_add_listener(struct handoff_state_t *state, int fd);
+
+/*
+  Adds client socket fd to state and returns where its state goes,
+  which is zeroed.  The pointer is only good until the next client is
+  added.
+*/
+struct handoff_client_t *handoff_add_client(struct handoff_state_t *state, int fd);
+
+/*
+  Add to what is carried over for client: a room it is in, the start of
+  an unfinished frame it sent, and what it is owed.
+*/
+void handoff_add_room(struct handoff_client_t *client, const char *room);
+void handoff_add_input(struct handoff_client_t *client, const char *data, size_t length);
+void handoff_add_output(struct handoff_client_t *client, const char *data, size_t length);
+
+/*
+  Frees what handoff_add_room, handoff_add_input and
+  handoff_add_output allocated for client, once it has been taken up.
+*/
+void handoff_client_cleanup(struct handoff_client_t *client);
+
+/*
+  Takes over from the server listening on the UNIX socket at path, if
+  there is one, filling in state with everything it hands over.  Waits
+  until the old server has exited.
+
+  Returns false, leaving state empty, if nothing is listening on path.
+  Terminates the program if the old server refuses, or the handoff
+  fails part way.
+*/
+bool handoff_receive(const char *path, bool framed, struct handoff_state_t *state);
+
+/*
+  Starts a thread that listens on the UNIX socket at path for a newer
+  server to take over.  When one connects, stop is called to stop
+  serving clients and fill in the state to hand over, which is sent to
+  the new server before the program exits.
+*/
+void handoff_listen(const char *path, bool framed, void (*stop)(struct handoff_state_t *state));
+
+#endif
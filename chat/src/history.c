@@ -0,0 +1,188 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Room message history.  See history.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+#include "history.h"
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Returns the time in milliseconds.  The coarse clock is plenty for
+  ageing out history, and far cheaper to read.
+*/
+static long nowMillis();
+
+/*
+  Returns the index'th oldest entry.
+*/
+static struct history_entry_t *entryAt(struct history_t *history, size_t index);
+
+/*
+  Throws away the oldest messages for as long as they use any of the
+  arena's bytes from start up to end.
+*/
+static void evictOverlapping(struct history_t *history, size_t start, size_t end);
+
+/*
+  Points iov at every message from the first'th oldest onwards, and
+  returns how many iovecs were filled in.
+*/
+static int gatherFrom(struct history_t *history, size_t first, struct iovec *iov);
+
+/*
+  Returns the index of the oldest of the last maxMessages messages.
+*/
+static size_t firstOfLast(struct history_t *history, size_t maxMessages);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void history_init(struct history_t *history, size_t maxEntries, size_t arenaSize) {
+  history->arena = NULL;
+  history->arenaSize = arenaSize;
+  history->arenaHead = 0;
+  history->entries = NULL;
+  history->maxEntries = maxEntries;
+  history->firstEntry = 0;
+  history->numEntries = 0;
+}
+
+void history_cleanup(struct history_t *history) {
+  free(history->arena);
+  free(history->entries);
+  history->arena = NULL;
+  history->entries = NULL;
+  history->numEntries = 0;
+}
+
+void history_append(struct history_t *history, const struct iovec *parts, int numParts,
+  uint64_t sequence) {
+  size_t length = 0;
+  for (int i = 0; i < numParts; ++i) {
+    length += parts[i].iov_len;
+  }
+  if (history->maxEntries == 0 || length == 0 || length > history->arenaSize) {
+    return;
+  }
+
+  if (history->arena == NULL) {
+    history->arena = malloc(history->arenaSize);
+    history->entries = calloc(history->maxEntries, sizeof(struct history_entry_t));
+    if (history->arena == NULL || history->entries == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+  }
+
+  // Messages never wrap around the end of the arena, so that each one
+  // stays in one piece.  If it doesn't fit, the end of the arena goes
+  // unused until we come round again.
+  size_t offset = history->arenaHead;
+  if (offset + length > history->arenaSize) {
+    evictOverlapping(history, offset, history->arenaSize);
+    offset = 0;
+  }
+  evictOverlapping(history, offset, offset + length);
+  if (history->numEntries == history->maxEntries) {
+    history->firstEntry = (history->firstEntry + 1) % history->maxEntries;
+    --history->numEntries;
+  }
+
+  char *destination = history->arena + offset;
+  for (int i = 0; i < numParts; ++i) {
+    memcpy(destination, parts[i].iov_base, parts[i].iov_len);
+    destination += parts[i].iov_len;
+  }
+
+  struct history_entry_t *entry = entryAt(history, history->numEntries++);
+  entry->offset = offset;
+  entry->length = length;
+  entry->timestamp = nowMillis();
+  entry->sequence = sequence;
+  history->arenaHead = offset + length;
+}
+
+int history_gather(struct history_t *history, size_t maxMessages, long maxAgeMs, struct iovec *iov) {
+  size_t first = firstOfLast(history, maxMessages);
+  // Entries are in the order they were added, so the ones that are too
+  // old all come first.
+  if (maxAgeMs > 0) {
+    long oldest = nowMillis() - maxAgeMs;
+    while (first < history->numEntries && entryAt(history, first)->timestamp < oldest) {
+      ++first;
+    }
+  }
+  return gatherFrom(history, first, iov);
+}
+
+int history_gather_since(struct history_t *history, size_t maxMessages, uint64_t sequence, struct iovec *iov) {
+  // Messages are numbered as they are sent, so they are in order here
+  // too, except that with several workers a message forwarded from
+  // another one can arrive after a later one.
+  size_t first = firstOfLast(history, maxMessages);
+  while (first < history->numEntries && entryAt(history, first)->sequence <= sequence) {
+    ++first;
+  }
+  return gatherFrom(history, first, iov);
+}
+
+static int gatherFrom(struct history_t *history, size_t first, struct iovec *iov) {
+  // Merge neighbouring messages.  The only break is where the arena
+  // wrapped around.
+  int numIov = 0;
+  for (size_t i = first; i < history->numEntries; ++i) {
+    struct history_entry_t *entry = entryAt(history, i);
+    char *start = history->arena + entry->offset;
+    if (numIov > 0 && (char *)iov[numIov - 1].iov_base + iov[numIov - 1].iov_len == start) {
+      iov[numIov - 1].iov_len += entry->length;
+    } else {
+      iov[numIov].iov_base = start;
+      iov[numIov].iov_len = entry->length;
+      ++numIov;
+    }
+  }
+  return numIov;
+}
+
+static size_t firstOfLast(struct history_t *history, size_t maxMessages) {
+  if (history->numEntries > maxMessages) {
+    return history->numEntries - maxMessages;
+  }
+  return 0;
+}
+
+static long nowMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static struct history_entry_t *entryAt(struct history_t *history, size_t index) {
+  return &history->entries[(history->firstEntry + index) % history->maxEntries];
+}
+
+static void evictOverlapping(struct history_t *history, size_t start, size_t end) {
+  // The bytes after the newest message always belong to the oldest
+  // ones, so we can stop at the first message that is out of the way.
+  while (history->numEntries > 0) {
+    struct history_entry_t *oldest = entryAt(history, 0);
+    if (oldest->offset >= end || oldest->offset + oldest->length <= start) {
+      return;
+    }
+    history->firstEntry = (history->firstEntry + 1) % history->maxEntries;
+    --history->numEntries;
+  }
+}
@@ -0,0 +1,90 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A room's recent messages, kept so they can be replayed to clients
+  that join later.  Messages are copied, exactly as they went out on
+  the wire, into a single circular byte arena, with a ring of entries
+  recording where each one starts, how long it is and when it was
+  added.  The oldest messages are thrown away to make room.
+
+  Since consecutive messages sit next to each other in the arena, any
+  run of recent messages is at most two ranges of bytes: one before the
+  arena wraps around and one after.  A replay is a single writev.
+
+  A history is not thread safe; it belongs to whoever owns its room.
+
+*/
+
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// The most iovecs history_gather can need.
+#define HISTORY_MAX_IOV 2
+
+struct history_entry_t {
+  size_t offset;
+  size_t length;
+  // When it was added, in milliseconds on the monotonic clock.
+  long timestamp;
+  // The message's sequence number, or 0 if it doesn't have one.
+  uint64_t sequence;
+};
+
+struct history_t {
+  // arenaSize bytes, allocated with the first message.  NULL until then.
+  char *arena;
+  size_t arenaSize;
+  // Where the next message goes.
+  size_t arenaHead;
+
+  // A ring of maxEntries entries, oldest first from firstEntry.
+  struct history_entry_t *entries;
+  size_t maxEntries;
+  size_t firstEntry;
+  size_t numEntries;
+};
+
+/*
+  Initializes an empty history of up to maxEntries messages, taking up
+  to arenaSize bytes between them.  Nothing is allocated until the first
+  message is added, so idle rooms cost nothing.  A maxEntries of 0 turns
+  the history off.
+*/
+void history_init(struct history_t *history, size_t maxEntries, size_t arenaSize);
+
+/*
+  Frees everything history holds.
+*/
+void history_cleanup(struct history_t *history);
+
+/*
+  Adds a message, made of numParts pieces, with its sequence number,
+  throwing away the oldest messages as needed.  A message bigger than
+  the whole arena is not kept.
+*/
+void history_append(struct history_t *history, const struct iovec *parts, int numParts,
+  uint64_t sequence);
+
+/*
+  Points iov at the newest messages, up to maxMessages of them, that are
+  no more than maxAgeMs old (any age if maxAgeMs is 0), oldest first.
+  iov must have room for HISTORY_MAX_IOV entries.
+
+  Returns how many iovecs were filled in.  They point into history, so
+  they must be written before anything else is added to it.
+*/
+int history_gather(struct history_t *history, size_t maxMessages, long maxAgeMs, struct iovec *iov);
+
+/*
+  Like history_gather, but points iov at every message from the first
+  one numbered after sequence onwards, among the last maxMessages.
+*/
+int history_gather_since(struct history_t *history, size_t maxMessages, uint64_t sequence, struct iovec *iov);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Prints the records of a message log written by server --log, one per
+  line as
+    sequence time [room] text
+
+  Usage:
+    log_dump [--sequence number | --since seconds] directory
+
+  --sequence starts at that sequence number, and --since at that many
+  seconds after the epoch.  Both use the log's index, so only the
+  records that are printed are read.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+#include "message_log.h"
+
+char *PROG_NAME;
+bool DEBUG = false;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+void displayUsageString();
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+
+  bool seekSequence = false;
+  bool seekTime = false;
+  unsigned long long sequence = 0;
+  double since = 0;
+
+  // Skip the first item, since that points to the executable.
+  for (--argc, ++argv; argc > 1; --argc, ++argv) {
+    if (strcmp(*argv, "--sequence") == 0) {
+      seekSequence = true;
+      sequence = strtoull(*(++argv), NULL, 10);
+      --argc;
+    } else if (strcmp(*argv, "--since") == 0) {
+      seekTime = true;
+      since = strtod(*(++argv), NULL);
+      --argc;
+    } else {
+      break;
+    }
+  }
+  if (argc != 1) {
+    displayUsageString();
+    return EXIT_ERROR_ARGUMENT;
+  }
+
+  struct log_reader_t reader;
+  if (!log_reader_open(&reader, *argv)) {
+    fprintf(stderr, "%s: No log in '%s'\n", PROG_NAME, *argv);
+    return EXIT_ERROR_IO;
+  }
+  if (seekSequence) {
+    log_reader_seek_sequence(&reader, sequence);
+  } else if (seekTime) {
+    log_reader_seek_time(&reader, (int64_t)(since * 1e9));
+  }
+
+  struct log_entry_t entry;
+  while (log_reader_next(&reader, &entry)) {
+    time_t seconds = entry.timestamp / 1000000000LL;
+    struct tm utc;
+    char timeString[32];
+    gmtime_r(&seconds, &utc);
+    strftime(timeString, sizeof(timeString), "%Y-%m-%dT%H:%M:%S", &utc);
+    fprintf(stdout, "%llu %s.%06ldZ [%s] %.*s\n",
+      (unsigned long long)entry.sequence, timeString,
+      (long)(entry.timestamp % 1000000000LL / 1000), entry.room,
+      (int)entry.length, entry.text);
+  }
+
+  log_reader_close(&reader);
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void displayUsageString() {
+  fputs("Usage:\n\
+    log_dump [--sequence number | --since seconds] directory\n", stderr);
+}
@@ -0,0 +1,291 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Reference counted message buffers.  See message.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "server.h"
+#include "message.h"
+
+// Message blocks are aligned so that two messages never share a cache
+// line.
+const size_t MESSAGE_ALIGNMENT = 64;
+
+// Each thread keeps up to MESSAGE_CACHE_SIZE free messages of its own,
+// and trades them with the pool's free list MESSAGE_CACHE_BATCH at a
+// time, so the pool's lock is taken once a batch rather than once a
+// message.
+const int MESSAGE_CACHE_SIZE = 32;
+const int MESSAGE_CACHE_BATCH = 16;
+
+// The free messages a thread keeps to itself.  It only ever holds
+// messages of one pool; a thread that moves on to another pool gives
+// them back first.
+struct message_cache_t {
+  struct message_pool_t *pool;
+  struct message_t *freeList;
+  int numFree;
+};
+
+static __thread struct message_cache_t t_cache;
+
+// Gives a thread's cache back to its pool when the thread exits.
+static pthread_key_t g_cacheKey;
+static pthread_once_t g_cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Allocates a new slab and puts all of its messages on the free list.
+
+  Assumes pool->lock is held.
+*/
+static void addSlab(struct message_pool_t *pool);
+
+/*
+  Gets a message that was just allocated ready for use.
+*/
+static void resetMessage(struct message_t *message);
+
+/*
+  Returns the calling thread's cache, ready to hold messages of pool.
+*/
+static struct message_cache_t *getCache(struct message_pool_t *pool);
+
+/*
+  Moves up to MESSAGE_CACHE_BATCH messages from the pool's free list to
+  cache, adding a slab if the free list is empty.
+*/
+static void fillCache(struct message_cache_t *cache);
+
+/*
+  Moves up to count messages from cache back to the pool's free list.
+*/
+static void drainCache(struct message_cache_t *cache, int count);
+
+/*
+  The destructor of g_cacheKey: drains a thread's cache as it exits.
+*/
+static void releaseCache(void *cache);
+
+static void createCacheKey(void);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void message_pool_init(struct message_pool_t *pool, size_t messageSize, size_t messagesPerSlab) {
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+
+  pool->maxMessageSize = messageSize;
+  pool->blockSize = sizeof(struct message_t) + messageSize;
+  pool->blockSize = (pool->blockSize + MESSAGE_ALIGNMENT - 1) / MESSAGE_ALIGNMENT * MESSAGE_ALIGNMENT;
+  pool->messagesPerSlab = messagesPerSlab;
+
+  pool->slabs = NULL;
+  pool->numSlabs = 0;
+  pool->maxNumSlabs = 0;
+  pool->freeList = NULL;
+}
+
+void message_pool_cleanup(struct message_pool_t *pool) {
+  // The caller's cache goes with the slabs.  Any other thread that used
+  // the pool must have exited by now, giving its cache back.
+  if (t_cache.pool == pool) {
+    t_cache.pool = NULL;
+    t_cache.freeList = NULL;
+    t_cache.numFree = 0;
+  }
+
+  if (pthread_mutex_destroy(&pool->lock) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+  for (size_t i = 0; i < pool->numSlabs; ++i) {
+    free(pool->slabs[i]);
+  }
+  free(pool->slabs);
+  pool->freeList = NULL;
+}
+
+struct message_t *message_alloc(struct message_pool_t *pool) {
+  struct message_cache_t *cache = getCache(pool);
+  if (cache->freeList == NULL) {
+    fillCache(cache);
+  }
+  struct message_t *message = cache->freeList;
+  cache->freeList = message->nextFree;
+  --cache->numFree;
+
+  resetMessage(message);
+  message->large = false;
+  return message;
+}
+
+struct message_t *message_alloc_large(struct message_pool_t *pool, size_t messageSize) {
+  struct message_t *message = malloc(sizeof(struct message_t) + messageSize);
+  if (message == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  message->pool = pool;
+  resetMessage(message);
+  message->large = true;
+  return message;
+}
+
+static void resetMessage(struct message_t *message) {
+  message->nextFree = NULL;
+  message->refcount = 1;
+  message->sender = 0;
+  message->senderSlot = 0;
+  message->kind = MESSAGE_CHAT;
+  message->room[0] = '\0';
+  message->forgotten = NULL;
+  message->sequence = 0;
+  message->length = 0;
+  message->wire = message->data;
+  message->wireLength = 0;
+  message->compressedWire = NULL;
+  message->compressedWireLength = 0;
+  message->compressedBuffer = NULL;
+  message->data[0] = '\0';
+}
+
+void message_ref(struct message_t *message) {
+  __atomic_add_fetch(&message->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void message_unref(struct message_t *message) {
+  // Whoever drops the last reference must see every write made by the
+  // other holders, hence ACQ_REL.
+  if (__atomic_sub_fetch(&message->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  free(message->compressedBuffer);
+  if (message->large) {
+    free(message);
+    return;
+  }
+
+  struct message_cache_t *cache = getCache(message->pool);
+  message->nextFree = cache->freeList;
+  cache->freeList = message;
+  if (++cache->numFree > MESSAGE_CACHE_SIZE) {
+    drainCache(cache, MESSAGE_CACHE_BATCH);
+  }
+}
+
+static struct message_cache_t *getCache(struct message_pool_t *pool) {
+  struct message_cache_t *cache = &t_cache;
+  if (cache->pool != pool) {
+    if (cache->pool == NULL) {
+      // The thread's first message: have its cache given back when it
+      // exits.
+      pthread_once(&g_cacheKeyOnce, createCacheKey);
+      if (pthread_setspecific(g_cacheKey, cache) != 0) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_MEMORY);
+      }
+    } else {
+      drainCache(cache, cache->numFree);
+    }
+    cache->pool = pool;
+  }
+  return cache;
+}
+
+static void fillCache(struct message_cache_t *cache) {
+  struct message_pool_t *pool = cache->pool;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->freeList == NULL) {
+    addSlab(pool);
+  }
+  while (cache->numFree < MESSAGE_CACHE_BATCH && pool->freeList != NULL) {
+    struct message_t *message = pool->freeList;
+    pool->freeList = message->nextFree;
+    message->nextFree = cache->freeList;
+    cache->freeList = message;
+    ++cache->numFree;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void drainCache(struct message_cache_t *cache, int count) {
+  if (count == 0) {
+    return;
+  }
+
+  // Cut the first count messages off the cache, and splice them onto
+  // the front of the pool's free list.
+  struct message_t *first = cache->freeList;
+  struct message_t *last = first;
+  for (int i = 1; i < count; ++i) {
+    last = last->nextFree;
+  }
+  cache->freeList = last->nextFree;
+  cache->numFree -= count;
+
+  struct message_pool_t *pool = cache->pool;
+  pthread_mutex_lock(&pool->lock);
+  last->nextFree = pool->freeList;
+  pool->freeList = first;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void releaseCache(void *cache) {
+  struct message_cache_t *threadCache = cache;
+  if (threadCache->pool != NULL) {
+    drainCache(threadCache, threadCache->numFree);
+    threadCache->pool = NULL;
+  }
+}
+
+static void createCacheKey(void) {
+  if (pthread_key_create(&g_cacheKey, releaseCache) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+}
+
+static void addSlab(struct message_pool_t *pool) {
+  if (pool->numSlabs == pool->maxNumSlabs) {
+    size_t maxNumSlabs = pool->maxNumSlabs == 0 ? 16 : pool->maxNumSlabs * 2;
+    void **slabs = realloc(pool->slabs, maxNumSlabs * sizeof(void *));
+    if (slabs == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    pool->slabs = slabs;
+    pool->maxNumSlabs = maxNumSlabs;
+  }
+
+  char *slab;
+  if (posix_memalign((void **)&slab, MESSAGE_ALIGNMENT,
+    pool->blockSize * pool->messagesPerSlab) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  pool->slabs[pool->numSlabs++] = slab;
+
+  // Thread the new messages onto the free list in address order.
+  for (size_t i = pool->messagesPerSlab; i > 0; --i) {
+    struct message_t *message = (struct message_t *)(slab + (i - 1) * pool->blockSize);
+    message->pool = pool;
+    message->nextFree = pool->freeList;
+    pool->freeList = message;
+  }
+}
@@ -0,0 +1,188 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Reference counted message buffers, handed out from a slab pool.
+
+  A message is read straight off the socket into its buffer, and from
+  then on only the pointer moves: through the message queue and out to
+  every recipient.  Whoever holds a pointer holds a reference, and the
+  buffer goes back to the pool when the last reference is dropped.
+
+  Each thread keeps a few free messages of its own, so allocating and
+  freeing only takes the pool's lock when a thread's cache runs dry or
+  overflows.  A thread gives its cache back to the pool when it exits.
+
+*/
+
+#ifndef CHAT_MESSAGE_H
+#define CHAT_MESSAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "frame.h"
+
+struct message_pool_t;
+
+// What a message asks the room it is addressed to to do.
+enum MESSAGE_KIND_T {
+  // Send data to everyone else in the room.
+  MESSAGE_CHAT,
+  // Add the sender to the room.
+  MESSAGE_JOIN,
+  // Remove the sender from the room.
+  MESSAGE_LEAVE,
+  // The sender hung up: remove it from every room.
+  MESSAGE_DISCONNECT,
+  // Nothing for the room; in thread mode, the room shard posts
+  // forgotten once it has carried out everything queued before this.
+  MESSAGE_BARRIER,
+  // Add the sender to the room, and resend it the room's messages
+  // after sequence.
+  MESSAGE_RESYNC,
+};
+
+struct message_t {
+  // The pool this message returns to once refcount reaches 0.
+  struct message_pool_t *pool;
+  // Links free messages together while they are in the pool.
+  struct message_t *nextFree;
+
+  int refcount;
+  // A unique ID identifying who sent the message.
+  int sender;
+  // The sender's slot in the server's client table, which is how rooms
+  // know their members.
+  int senderSlot;
+
+  enum MESSAGE_KIND_T kind;
+  // The room this message is for.  Unused for MESSAGE_DISCONNECT and
+  // MESSAGE_BARRIER.
+  char room[FRAME_MAX_ROOM_NAME_LENGTH + 1];
+  // For MESSAGE_DISCONNECT and MESSAGE_BARRIER in thread mode: posted
+  // by every room shard once it has forgotten the sender, or caught up.
+  sem_t *forgotten;
+
+  // For MESSAGE_CHAT in framed mode, its number in the room once the
+  // room's owner has sent it out, and 0 before.  For MESSAGE_RESYNC,
+  // the last message the sender saw.
+  uint64_t sequence;
+
+  // The number of bytes in data, not including the null terminator.
+  size_t length;
+
+  // What is written to recipients.  This is data itself, or in framed
+  // mode data with its frame header and room name in front, starting
+  // in frameHeader.
+  char *wire;
+  size_t wireLength;
+
+  // In framed mode, a FRAME_ROOM_MESSAGE_DEFLATE frame of the same
+  // message for the recipients that can take one, or NULL if it wasn't
+  // worth compressing.  It lives in compressedBuffer, which is freed
+  // along with the message.
+  char *compressedWire;
+  size_t compressedWireLength;
+  char *compressedBuffer;
+
+  // Set if the message was too long for its pool and was allocated on
+  // its own by message_alloc_large.  It is freed, rather than returned
+  // to the pool, once done with.
+  bool large;
+
+  // Room for a sequence frame, a frame header and a room name with its
+  // terminator.  Since it is made of chars, it runs straight into data
+  // without any padding.
+  char frameHeader[FRAME_MAX_SEQUENCE_LENGTH + FRAME_MAX_HEADER_LENGTH + FRAME_MAX_ROOM_NAME_LENGTH + 1];
+  // The message itself.  This is always null terminated, and can hold
+  // up to pool->maxMessageSize bytes including the terminator.
+  char data[];
+};
+
+struct message_pool_t {
+  // Every message's data holds this many bytes.
+  size_t maxMessageSize;
+  // The size of one message including its header, rounded up to a
+  // cache line.
+  size_t blockSize;
+  // How many messages are carved out of each slab.
+  size_t messagesPerSlab;
+
+  // Every slab that was allocated, so they can be freed on cleanup.
+  void **slabs;
+  size_t numSlabs;
+  size_t maxNumSlabs;
+
+  // The free messages no thread has cached.
+  struct message_t *freeList;
+
+  // Controls simultaneous access to freeList and slabs.
+  pthread_mutex_t lock;
+};
+
+/*
+  Initializes a message pool.
+
+  messageSize is the capacity of each message, including the null
+  terminator.  messagesPerSlab controls how many messages are allocated
+  at once whenever the pool runs dry.
+*/
+void message_pool_init(struct message_pool_t *pool, size_t messageSize, size_t messagesPerSlab);
+
+/*
+  Cleans up a message pool, freeing every message it ever handed out.
+
+  You should make sure that no one is using it anymore before cleaning
+  up, and that every other thread that used it has exited.
+*/
+void message_pool_cleanup(struct message_pool_t *pool);
+
+/*
+  Takes a message out of the pool.  The caller holds the only reference
+  to it.  The message is empty, with no sender.
+
+  Terminates the program if memory runs out.
+*/
+struct message_t *message_alloc(struct message_pool_t *pool);
+
+/*
+  Like message_alloc, but for a message whose data holds messageSize
+  bytes including the null terminator, which may be more than the pool
+  allows.  The message doesn't come from the pool's slabs, so this is
+  for the odd long message only.
+
+  Terminates the program if memory runs out.
+*/
+struct message_t *message_alloc_large(struct message_pool_t *pool, size_t messageSize);
+
+/*
+  Adds a reference to message.
+*/
+void message_ref(struct message_t *message);
+
+/*
+  Drops a reference to message, returning it to its pool if that was
+  the last one.
+*/
+void message_unref(struct message_t *message);
+
+/*
+  Returns what to write to a recipient of message, and sets *length to
+  its length: the compressed frame if there is one and the recipient
+  takes them, the usual one otherwise.
+*/
+static inline char *message_wire(struct message_t *message, bool compressed, size_t *length) {
+  if (compressed && message->compressedWire != NULL) {
+    *length = message->compressedWireLength;
+    return message->compressedWire;
+  }
+  *length = message->wireLength;
+  return message->wire;
+}
+
+#endif
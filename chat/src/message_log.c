@@ -0,0 +1,640 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  The message log.  See message_log.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "server.h"
+#include "message_log.h"
+
+// How many records may be waiting for the log's thread.
+const int LOG_QUEUE_LENGTH = 65536;
+
+// The most records the log's thread takes off its queue at a time.
+#define LOG_BATCH_SIZE 256
+
+// The smallest segment we allow.  Segments also grow to fit the longest
+// message; a record that still doesn't fit in an empty one is dropped.
+const size_t MIN_LOG_SEGMENT_SIZE = 65536;
+
+// How long the log's thread naps while it waits for the next sync.
+const long LOG_POLL_INTERVAL_NS = 1000000;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Runs the log's thread.  args is the struct message_log_t.
+*/
+static void *runLog(void *args);
+
+/*
+  Adds message to the current segment, starting a new one if it doesn't
+  fit.  A message too long for any segment is dropped and counted in
+  log->droppedRecords.
+*/
+static void writeRecord(struct message_log_t *log, struct message_t *message);
+
+/*
+  Returns whether anything has been written since the last sync.
+*/
+static bool isDirty(struct message_log_t *log);
+
+/*
+  Flushes the segment's new records to disk, then the index entries
+  that point at them.
+*/
+static void syncLog(struct message_log_t *log);
+
+/*
+  Creates the segment whose first record will be log->nextSequence.
+*/
+static void startSegment(struct message_log_t *log);
+
+/*
+  Syncs the current segment, trims it to the bytes used and closes it.
+*/
+static void finishSegment(struct message_log_t *log);
+
+/*
+  Returns the bytes a record with length bytes after its header takes
+  up, padding included.
+*/
+static size_t recordSize(size_t length);
+
+/*
+  Returns the path of a segment, or its index if suffix is ".idx".  The
+  caller frees it.
+*/
+static char *segmentPath(const char *directory, uint64_t firstSequence, const char *suffix);
+
+/*
+  Sets *segments to the first sequence number of every segment in
+  directory, sorted, and returns how many there are.
+*/
+static size_t listSegments(const char *directory, uint64_t **segments);
+
+/*
+  Maps segment number index for reading, at its first record.
+*/
+static void openSegment(struct log_reader_t *reader, size_t index);
+static void closeSegment(struct log_reader_t *reader);
+
+/*
+  Returns the time of segment number index's first record, or INT64_MAX
+  if it has none.
+*/
+static int64_t segmentStartTime(struct log_reader_t *reader, size_t index);
+
+/*
+  Moves to the last indexed record that comes no later than key, which
+  is a sequence number if bySequence is set and a time otherwise.
+*/
+static void seekIndexed(struct log_reader_t *reader, bool bySequence, int64_t key);
+
+/*
+  Moves past every record that comes before key.
+*/
+static void skipBefore(struct log_reader_t *reader, bool bySequence, int64_t key);
+
+static long nowMillis();
+static int64_t wallNanos();
+static int compareSequences(const void *a, const void *b);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void message_log_open(struct message_log_t *log, const char *directory,
+  size_t segmentSize, size_t maxMessageLength, long fsyncInterval) {
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  log->directory = strdup(directory);
+  if (log->directory == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  // Make sure a segment can take at least the longest message.
+  size_t longestRecord = recordSize(FRAME_MAX_ROOM_NAME_LENGTH + 1 + maxMessageLength);
+  log->segmentSize = segmentSize < MIN_LOG_SEGMENT_SIZE ? MIN_LOG_SEGMENT_SIZE : segmentSize;
+  if (log->segmentSize < longestRecord) {
+    log->segmentSize = longestRecord;
+  }
+  log->fsyncInterval = fsyncInterval;
+  log->segmentFd = -1;
+  log->segment = NULL;
+  log->segmentOffset = 0;
+  log->syncedOffset = 0;
+  log->indexFd = -1;
+  log->numPendingIndex = 0;
+  log->maxPendingIndex = 64;
+  log->pendingIndex = calloc(log->maxPendingIndex, sizeof(struct log_index_entry_t));
+  if (log->pendingIndex == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  log->lastIndexedOffset = 0;
+  log->lastSync = nowMillis();
+  log->droppedRecords = 0;
+
+  // Carry on from the end of whatever is already there.  Only the tail
+  // of the last segment is read.
+  log->nextSequence = 0;
+  struct log_reader_t reader;
+  if (log_reader_open(&reader, directory)) {
+    log->nextSequence = reader.segments[reader.numSegments - 1];
+    seekIndexed(&reader, true, INT64_MAX);
+    struct log_entry_t entry;
+    while (log_reader_next(&reader, &entry)) {
+      log->nextSequence = entry.sequence + 1;
+    }
+    log_reader_close(&reader);
+  }
+
+  mpsc_queue_init(&log->queue, LOG_QUEUE_LENGTH);
+  if (pthread_create(&log->thread, NULL, runLog, (void *)log) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+}
+
+bool message_log_append(struct message_log_t *log, struct message_t *message) {
+  message_ref(message);
+  if (!mpsc_queue_try_put(&log->queue, message)) {
+    message_unref(message);
+    __atomic_add_fetch(&log->droppedRecords, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  return true;
+}
+
+void message_log_close(struct message_log_t *log) {
+  // NULL tells the thread to stop once it has written everything before
+  // it.
+  mpsc_queue_put(&log->queue, NULL);
+  pthread_join(log->thread, NULL);
+
+  mpsc_queue_cleanup(&log->queue);
+  free(log->pendingIndex);
+  free(log->directory);
+}
+
+bool log_reader_open(struct log_reader_t *reader, const char *directory) {
+  reader->numSegments = listSegments(directory, &reader->segments);
+  if (reader->numSegments == 0) {
+    free(reader->segments);
+    return false;
+  }
+  reader->directory = strdup(directory);
+  if (reader->directory == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  reader->segmentFd = -1;
+  reader->map = NULL;
+  reader->mapSize = 0;
+  openSegment(reader, 0);
+  return true;
+}
+
+void log_reader_close(struct log_reader_t *reader) {
+  closeSegment(reader);
+  free(reader->segments);
+  free(reader->directory);
+}
+
+void log_reader_seek_sequence(struct log_reader_t *reader, uint64_t sequence) {
+  int64_t key = sequence > INT64_MAX ? INT64_MAX : (int64_t)sequence;
+  seekIndexed(reader, true, key);
+  skipBefore(reader, true, key);
+}
+
+void log_reader_seek_time(struct log_reader_t *reader, int64_t timestamp) {
+  seekIndexed(reader, false, timestamp);
+  skipBefore(reader, false, timestamp);
+}
+
+bool log_reader_next(struct log_reader_t *reader, struct log_entry_t *entry) {
+  while (reader->segment < reader->numSegments) {
+    size_t offset = reader->offset;
+    if (offset + sizeof(struct log_record_header_t) <= reader->mapSize) {
+      struct log_record_header_t *header = (struct log_record_header_t *)(reader->map + offset);
+      size_t length = __atomic_load_n(&header->length, __ATOMIC_ACQUIRE);
+      if (length != 0 && offset + recordSize(length) <= reader->mapSize) {
+        const char *room = (const char *)(header + 1);
+        size_t roomLength = strnlen(room, length);
+        entry->sequence = header->sequence;
+        entry->timestamp = header->timestamp;
+        entry->room = room;
+        entry->text = room + roomLength + 1;
+        entry->length = (roomLength < length) ? length - roomLength - 1 : 0;
+        reader->offset = offset + recordSize(length);
+        return true;
+      }
+    }
+
+    // The end of this segment.  The last one may still be growing, so
+    // stay on it.
+    if (reader->segment + 1 == reader->numSegments) {
+      return false;
+    }
+    openSegment(reader, reader->segment + 1);
+  }
+  return false;
+}
+
+static void *runLog(void *args) {
+  struct message_log_t *log = args;
+  struct message_t *messages[LOG_BATCH_SIZE];
+  bool stopping = false;
+
+  while (!stopping) {
+    size_t numMessages;
+    if (isDirty(log)) {
+      // Something is waiting to be synced, so we can't sleep on the
+      // queue for long.
+      numMessages = mpsc_queue_poll_batch(&log->queue, messages, LOG_BATCH_SIZE);
+      if (numMessages == 0) {
+        if (nowMillis() - log->lastSync >= log->fsyncInterval) {
+          syncLog(log);
+        } else {
+          struct timespec nap = {0, LOG_POLL_INTERVAL_NS};
+          nanosleep(&nap, NULL);
+        }
+        continue;
+      }
+    } else {
+      numMessages = mpsc_queue_get_batch(&log->queue, messages, LOG_BATCH_SIZE);
+    }
+
+    for (size_t i = 0; i < numMessages; ++i) {
+      if (messages[i] == NULL) {
+        stopping = true;
+        continue;
+      }
+      writeRecord(log, messages[i]);
+      message_unref(messages[i]);
+    }
+
+    // Group commit: one sync covers everything that piled up.
+    if (nowMillis() - log->lastSync >= log->fsyncInterval) {
+      syncLog(log);
+    }
+  }
+
+  if (log->segment != NULL) {
+    finishSegment(log);
+  }
+  return NULL;
+}
+
+static void writeRecord(struct message_log_t *log, struct message_t *message) {
+  size_t roomLength = strlen(message->room);
+  size_t length = roomLength + 1 + message->length;
+  size_t size = recordSize(length);
+  if (size > log->segmentSize) {
+    __atomic_add_fetch(&log->droppedRecords, 1, __ATOMIC_RELAXED);
+    if (DEBUG) {
+      fprintf(stderr, "Dropped a %zu byte record, longer than a log segment\n", size);
+    }
+    return;
+  }
+
+  if (log->segment == NULL || log->segmentOffset + size > log->segmentSize) {
+    if (log->segment != NULL) {
+      finishSegment(log);
+    }
+    startSegment(log);
+  }
+
+  size_t offset = log->segmentOffset;
+  struct log_record_header_t *header = (struct log_record_header_t *)(log->segment + offset);
+  char *body = (char *)(header + 1);
+  memcpy(body, message->room, roomLength + 1);
+  memcpy(body + roomLength + 1, message->data, message->length);
+  header->reserved = 0;
+  header->sequence = log->nextSequence;
+  header->timestamp = wallNanos();
+  // The length goes in last, so a reader never sees half a record.
+  __atomic_store_n(&header->length, (uint32_t)length, __ATOMIC_RELEASE);
+
+  if (offset == 0 || offset - log->lastIndexedOffset >= LOG_INDEX_INTERVAL) {
+    if (log->numPendingIndex == log->maxPendingIndex) {
+      size_t maxPendingIndex = log->maxPendingIndex * 2;
+      struct log_index_entry_t *pendingIndex = realloc(log->pendingIndex,
+        maxPendingIndex * sizeof(struct log_index_entry_t));
+      if (pendingIndex == NULL) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_MEMORY);
+      }
+      log->pendingIndex = pendingIndex;
+      log->maxPendingIndex = maxPendingIndex;
+    }
+    struct log_index_entry_t *entry = &log->pendingIndex[log->numPendingIndex++];
+    entry->sequence = header->sequence;
+    entry->timestamp = header->timestamp;
+    entry->offset = offset;
+    log->lastIndexedOffset = offset;
+  }
+
+  log->segmentOffset += size;
+  ++log->nextSequence;
+}
+
+static bool isDirty(struct message_log_t *log) {
+  return log->segmentOffset > log->syncedOffset || log->numPendingIndex > 0;
+}
+
+static void syncLog(struct message_log_t *log) {
+  if (log->segment != NULL && log->segmentOffset > log->syncedOffset) {
+    // msync wants a page aligned start.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t start = log->syncedOffset / pageSize * pageSize;
+    if (msync(log->segment + start, log->segmentOffset - start, MS_SYNC) != 0) {
+      perror(PROG_NAME);
+    }
+    log->syncedOffset = log->segmentOffset;
+  }
+
+  if (log->numPendingIndex > 0) {
+    const char *pending = (const char *)log->pendingIndex;
+    size_t remaining = log->numPendingIndex * sizeof(struct log_index_entry_t);
+    while (remaining > 0) {
+      ssize_t written = write(log->indexFd, pending, remaining);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror(PROG_NAME);
+        break;
+      }
+      pending += written;
+      remaining -= written;
+    }
+    if (fdatasync(log->indexFd) != 0) {
+      perror(PROG_NAME);
+    }
+    log->numPendingIndex = 0;
+  }
+
+  log->lastSync = nowMillis();
+}
+
+static void startSegment(struct message_log_t *log) {
+  char *path = segmentPath(log->directory, log->nextSequence, ".log");
+  char *indexPath = segmentPath(log->directory, log->nextSequence, ".idx");
+
+  // A segment with this name can only be one that was left empty.
+  log->segmentFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  log->indexFd = open(indexPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (log->segmentFd < 0 || log->indexFd < 0 ||
+    ftruncate(log->segmentFd, log->segmentSize) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  log->segment = mmap(NULL, log->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, log->segmentFd, 0);
+  if (log->segment == MAP_FAILED) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  log->segmentOffset = 0;
+  log->syncedOffset = 0;
+  log->lastIndexedOffset = 0;
+
+  // Make sure the new files survive a crash too.
+  int directoryFd = open(log->directory, O_RDONLY | O_DIRECTORY);
+  if (directoryFd >= 0) {
+    fsync(directoryFd);
+    close(directoryFd);
+  }
+
+  if (DEBUG) {
+    fprintf(stderr, "Started log segment %s\n", path);
+  }
+  free(indexPath);
+  free(path);
+}
+
+static void finishSegment(struct message_log_t *log) {
+  syncLog(log);
+  munmap(log->segment, log->segmentSize);
+  if (ftruncate(log->segmentFd, log->segmentOffset) != 0 || fsync(log->segmentFd) != 0) {
+    perror(PROG_NAME);
+  }
+  close(log->segmentFd);
+  close(log->indexFd);
+  log->segment = NULL;
+  log->segmentFd = -1;
+  log->indexFd = -1;
+}
+
+static size_t recordSize(size_t length) {
+  return (sizeof(struct log_record_header_t) + length + 7) & ~(size_t)7;
+}
+
+static char *segmentPath(const char *directory, uint64_t firstSequence, const char *suffix) {
+  size_t length = strlen(directory) + 32;
+  char *path = malloc(length);
+  if (path == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  snprintf(path, length, "%s/%020llu%s", directory, (unsigned long long)firstSequence, suffix);
+  return path;
+}
+
+static size_t listSegments(const char *directory, uint64_t **segments) {
+  size_t numSegments = 0;
+  size_t maxSegments = 16;
+  *segments = calloc(maxSegments, sizeof(uint64_t));
+  if (*segments == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    return 0;
+  }
+  struct dirent *file;
+  while ((file = readdir(dir)) != NULL) {
+    // Segments are 20 digits and ".log".
+    char *end;
+    unsigned long long firstSequence = strtoull(file->d_name, &end, 10);
+    if (end - file->d_name != 20 || strcmp(end, ".log") != 0) {
+      continue;
+    }
+    if (numSegments == maxSegments) {
+      maxSegments *= 2;
+      uint64_t *grown = realloc(*segments, maxSegments * sizeof(uint64_t));
+      if (grown == NULL) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_MEMORY);
+      }
+      *segments = grown;
+    }
+    (*segments)[numSegments++] = firstSequence;
+  }
+  closedir(dir);
+
+  qsort(*segments, numSegments, sizeof(uint64_t), compareSequences);
+  return numSegments;
+}
+
+static void openSegment(struct log_reader_t *reader, size_t index) {
+  closeSegment(reader);
+  reader->segment = index;
+  reader->offset = 0;
+
+  char *path = segmentPath(reader->directory, reader->segments[index], ".log");
+  reader->segmentFd = open(path, O_RDONLY);
+  free(path);
+  struct stat status;
+  if (reader->segmentFd < 0 || fstat(reader->segmentFd, &status) != 0 || status.st_size == 0) {
+    return;
+  }
+  reader->map = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, reader->segmentFd, 0);
+  if (reader->map == MAP_FAILED) {
+    perror(PROG_NAME);
+    reader->map = NULL;
+    return;
+  }
+  reader->mapSize = status.st_size;
+}
+
+static void closeSegment(struct log_reader_t *reader) {
+  if (reader->map != NULL) {
+    munmap(reader->map, reader->mapSize);
+  }
+  if (reader->segmentFd >= 0) {
+    close(reader->segmentFd);
+  }
+  reader->map = NULL;
+  reader->mapSize = 0;
+  reader->segmentFd = -1;
+}
+
+static int64_t segmentStartTime(struct log_reader_t *reader, size_t index) {
+  char *path = segmentPath(reader->directory, reader->segments[index], ".log");
+  int fd = open(path, O_RDONLY);
+  free(path);
+
+  struct log_record_header_t header;
+  int64_t timestamp = INT64_MAX;
+  if (fd >= 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.length != 0) {
+    timestamp = header.timestamp;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return timestamp;
+}
+
+static void seekIndexed(struct log_reader_t *reader, bool bySequence, int64_t key) {
+  // Find the last segment that starts no later than key.
+  size_t low = 0;
+  size_t high = reader->numSegments;
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    int64_t start = bySequence ? (int64_t)reader->segments[middle] : segmentStartTime(reader, middle);
+    if (start <= key) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  openSegment(reader, low);
+
+  // Then the last index entry in it that comes no later than key.
+  char *path = segmentPath(reader->directory, reader->segments[low], ".idx");
+  int fd = open(path, O_RDONLY);
+  free(path);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  size_t numEntries = status.st_size / sizeof(struct log_index_entry_t);
+  struct log_index_entry_t *entries = calloc(numEntries + 1, sizeof(struct log_index_entry_t));
+  if (entries == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  if (pread(fd, entries, numEntries * sizeof(struct log_index_entry_t), 0) !=
+    (ssize_t)(numEntries * sizeof(struct log_index_entry_t))) {
+    numEntries = 0;
+  }
+  close(fd);
+
+  low = 0;
+  high = numEntries;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    int64_t entryKey = bySequence ? (int64_t)entries[middle].sequence : entries[middle].timestamp;
+    if (entryKey <= key) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low > 0 && entries[low - 1].offset < reader->mapSize) {
+    reader->offset = entries[low - 1].offset;
+  }
+  free(entries);
+}
+
+static void skipBefore(struct log_reader_t *reader, bool bySequence, int64_t key) {
+  while (true) {
+    size_t segment = reader->segment;
+    size_t offset = reader->offset;
+    struct log_entry_t entry;
+    if (!log_reader_next(reader, &entry)) {
+      return;
+    }
+    int64_t entryKey = bySequence ? (int64_t)entry.sequence : entry.timestamp;
+    if (entryKey >= key) {
+      // Step back so that it is read again.  If it was the first record
+      // of the next segment, that is where we are now.
+      reader->offset = (reader->segment == segment) ? offset : 0;
+      return;
+    }
+  }
+}
+
+static long nowMillis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static int64_t wallNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int compareSequences(const void *a, const void *b) {
+  uint64_t first = *(const uint64_t *)a;
+  uint64_t second = *(const uint64_t *)b;
+  return (first > second) - (first < second);
+}
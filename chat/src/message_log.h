@@ -0,0 +1,165 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  An append-only log of every chat message the server passes on.
+
+  The log is a directory of segment files, each named after the
+  sequence number of its first record and written through a shared
+  mmap.  When a segment fills up it is trimmed to the bytes actually
+  used and a new one is started.  Every record is
+    struct log_record_header_t, room name, NUL, text
+  padded to 8 bytes.  A header with a length of 0 marks the end of a
+  segment that is still being written.
+
+  Next to each segment is a sparse index: a file of
+  struct log_index_entry_t, one for the segment's first record and one
+  every LOG_INDEX_INTERVAL bytes after that.  A reader can binary
+  search it for a sequence number or a time and only scan a few
+  kilobytes of records from there.
+
+  Message threads never touch the files.  message_log_append hands the
+  message to the log's own thread through an MPSC queue and returns
+  straight away; if the queue is full the record is dropped and
+  counted rather than making the sender wait.  The log thread writes
+  whatever has piled up and syncs it to disk at most once every
+  fsyncInterval milliseconds (group commit), or after every batch if
+  fsyncInterval is 0.
+
+*/
+
+#ifndef CHAT_MESSAGE_LOG_H
+#define CHAT_MESSAGE_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "message.h"
+#include "mpsc_queue.h"
+
+// How far apart, in bytes of log, index entries are.
+#define LOG_INDEX_INTERVAL 4096
+
+struct log_record_header_t {
+  // The bytes after the header: room name, NUL and text.  0 marks the
+  // end of the segment.
+  uint32_t length;
+  uint32_t reserved;
+  uint64_t sequence;
+  // When the record was written, in nanoseconds since the epoch.
+  int64_t timestamp;
+};
+
+struct log_index_entry_t {
+  uint64_t sequence;
+  int64_t timestamp;
+  // Where the record starts in its segment.
+  uint64_t offset;
+};
+
+struct message_log_t {
+  char *directory;
+  size_t segmentSize;
+  long fsyncInterval;
+
+  pthread_t thread;
+  struct mpsc_queue_t queue;
+
+  // The segment being written, only touched by the log's thread.
+  int segmentFd;
+  char *segment;
+  size_t segmentOffset;
+  // How much of the segment is known to be on disk.
+  size_t syncedOffset;
+  int indexFd;
+  // Index entries not yet written to indexFd.
+  struct log_index_entry_t *pendingIndex;
+  size_t numPendingIndex;
+  size_t maxPendingIndex;
+  size_t lastIndexedOffset;
+  long lastSync;
+
+  uint64_t nextSequence;
+
+  // Records that were dropped because the queue was full, or because
+  // they were too long for a segment.
+  unsigned long droppedRecords;
+};
+
+// One record, as read back.
+struct log_entry_t {
+  uint64_t sequence;
+  int64_t timestamp;
+  const char *room;
+  const char *text;
+  size_t length;
+};
+
+struct log_reader_t {
+  char *directory;
+
+  // The first sequence number of every segment, in order.
+  uint64_t *segments;
+  size_t numSegments;
+
+  // The segment being read, or numSegments if we ran off the end.
+  size_t segment;
+  int segmentFd;
+  char *map;
+  size_t mapSize;
+  size_t offset;
+};
+
+/*
+  Opens the log in directory, creating the directory if needed, and
+  starts its thread.  Records carry on from the last sequence number
+  already in the directory, in a new segment.
+
+  Segments are segmentSize bytes, or more if that is needed to hold a
+  message of maxMessageLength bytes in a room with the longest name.
+
+  Terminates the program on failure.
+*/
+void message_log_open(struct message_log_t *log, const char *directory,
+  size_t segmentSize, size_t maxMessageLength, long fsyncInterval);
+
+/*
+  Queues message to be logged.  Never blocks.  Returns false if the
+  record had to be dropped.
+*/
+bool message_log_append(struct message_log_t *log, struct message_t *message);
+
+/*
+  Writes and syncs everything queued so far, then stops the log's
+  thread and closes its files.
+*/
+void message_log_close(struct message_log_t *log);
+
+/*
+  Opens the log in directory for reading, positioned at its first
+  record.  Returns false if there is no log there.
+*/
+bool log_reader_open(struct log_reader_t *reader, const char *directory);
+
+void log_reader_close(struct log_reader_t *reader);
+
+/*
+  Moves to the first record with a sequence number of at least
+  sequence, or a timestamp of at least timestamp.  Only one segment's
+  index and a few kilobytes of records are read.
+*/
+void log_reader_seek_sequence(struct log_reader_t *reader, uint64_t sequence);
+void log_reader_seek_time(struct log_reader_t *reader, int64_t timestamp);
+
+/*
+  Reads the next record into entry.  Its strings point into the log
+  and stay valid until the next call.
+
+  Returns false at the end of the log.
+*/
+bool log_reader_next(struct log_reader_t *reader, struct log_entry_t *entry);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A bounded, blocking queue of messages.  See message_queue.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "server.h"
+#include "message_queue.h"
+
+// How many times a thread that finds the queue full or empty yields
+// before it goes to sleep.  Waking a sleeping thread costs a system
+// call on both sides and a trip through the scheduler, which is most
+// of the latency when messages trickle in.
+const int QUEUE_SPIN_LIMIT = 64;
+
+/*
+  Whether there is no room for another message, and whether there is no
+  message to get.
+*/
+static bool isFull(struct message_queue_t *messageQueue);
+static bool isEmpty(struct message_queue_t *messageQueue);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+
+void message_queue_init(struct message_queue_t *messageQueue, size_t bufferSize) {
+  if (pthread_mutex_init(&messageQueue->lock, NULL) != 0 ||
+    pthread_cond_init(&messageQueue->notFull, NULL) != 0 ||
+    pthread_cond_init(&messageQueue->notEmpty, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+
+  messageQueue->messages = calloc(bufferSize, sizeof(struct message_t *));
+  if (messageQueue->messages == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  messageQueue->pushOffset = 0;
+  messageQueue->popOffset = 0;
+
+  messageQueue->maxNumMessages = bufferSize;
+  messageQueue->numWaitingPutters = 0;
+  messageQueue->numWaitingGetters = 0;
+
+}
+
+void message_queue_cleanup(struct message_queue_t *messageQueue) {
+  if (pthread_mutex_destroy(&messageQueue->lock) != 0 ||
+    pthread_cond_destroy(&messageQueue->notFull) != 0 ||
+    pthread_cond_destroy(&messageQueue->notEmpty) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+  free(messageQueue->messages);
+}
+
+void message_queue_put(struct message_queue_t *messageQueue, struct message_t *message) {
+  pthread_mutex_lock(&messageQueue->lock);
+
+  if (isFull(messageQueue)) {
+    // Give the getter a chance to make room before going to sleep.
+    pthread_mutex_unlock(&messageQueue->lock);
+    for (int spins = 0; spins < QUEUE_SPIN_LIMIT && isFull(messageQueue); ++spins) {
+      sched_yield();
+    }
+    pthread_mutex_lock(&messageQueue->lock);
+  }
+  while (isFull(messageQueue)) {
+    // Sleep until the getter makes room.  The mutex is released while
+    // we wait.
+    ++messageQueue->numWaitingPutters;
+    pthread_cond_wait(&messageQueue->notFull, &messageQueue->lock);
+    --messageQueue->numWaitingPutters;
+  }
+
+  messageQueue->messages[messageQueue->pushOffset] = message;
+  // Go back to the front if we hit the end
+  __atomic_store_n(&messageQueue->pushOffset,
+    (messageQueue->pushOffset + 1) % messageQueue->maxNumMessages, __ATOMIC_RELAXED);
+
+  if (messageQueue->numWaitingGetters > 0) {
+    pthread_cond_signal(&messageQueue->notEmpty);
+  }
+  pthread_mutex_unlock(&messageQueue->lock);
+}
+
+struct message_t *message_queue_get(struct message_queue_t *messageQueue) {
+  pthread_mutex_lock(&messageQueue->lock);
+
+  // Is there anything to get?
+  if (isEmpty(messageQueue)) {
+    // A message is often on its way; yield for it before sleeping.
+    pthread_mutex_unlock(&messageQueue->lock);
+    for (int spins = 0; spins < QUEUE_SPIN_LIMIT && isEmpty(messageQueue); ++spins) {
+      sched_yield();
+    }
+    pthread_mutex_lock(&messageQueue->lock);
+  }
+  while (isEmpty(messageQueue)) {
+    // Sleep until a putter adds something.
+    ++messageQueue->numWaitingGetters;
+    pthread_cond_wait(&messageQueue->notEmpty, &messageQueue->lock);
+    --messageQueue->numWaitingGetters;
+  }
+
+  struct message_t *message = messageQueue->messages[messageQueue->popOffset];
+
+  // Advance to the next message
+  // If we're at the last index, go back to the front of the queue.
+  __atomic_store_n(&messageQueue->popOffset,
+    (messageQueue->popOffset + 1) % messageQueue->maxNumMessages, __ATOMIC_RELAXED);
+
+  if (messageQueue->numWaitingPutters > 0) {
+    pthread_cond_signal(&messageQueue->notFull);
+  }
+  pthread_mutex_unlock(&messageQueue->lock);
+  return message;
+}
+
+static bool isFull(struct message_queue_t *messageQueue) {
+  // One slot is always left empty so that a full queue can be told
+  // apart from an empty one.  This is also checked without the lock
+  // while yielding, so the offsets are read atomically.
+  size_t pushOffset = __atomic_load_n(&messageQueue->pushOffset, __ATOMIC_RELAXED);
+  size_t popOffset = __atomic_load_n(&messageQueue->popOffset, __ATOMIC_RELAXED);
+  return (pushOffset + 1) % messageQueue->maxNumMessages == popOffset;
+}
+
+static bool isEmpty(struct message_queue_t *messageQueue) {
+  size_t pushOffset = __atomic_load_n(&messageQueue->pushOffset, __ATOMIC_RELAXED);
+  size_t popOffset = __atomic_load_n(&messageQueue->popOffset, __ATOMIC_RELAXED);
+  return pushOffset == popOffset;
+}
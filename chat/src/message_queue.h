@@ -0,0 +1,85 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A bounded, blocking queue of messages.  Threads that find the queue
+  full (or empty) first yield for a little while, in case another
+  thread is about to make room (or add a message), and then sleep on a
+  condition variable until it does.  A condition variable is only
+  signalled when some thread is asleep on it.
+
+*/
+
+#ifndef CHAT_MESSAGE_QUEUE_H
+#define CHAT_MESSAGE_QUEUE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "message.h"
+
+struct message_queue_t {
+  // The ring of queued messages.  There are maxNumMessages slots.
+  struct message_t **messages;
+
+  // Where the next push will be.
+  size_t pushOffset;
+  // Where the next pop will be.
+  size_t popOffset;
+
+  size_t maxNumMessages;
+
+  // Controls simultaneous access to messages
+  pthread_mutex_t lock;
+
+  // Signalled whenever a message is removed, so blocked putters can
+  // try again.
+  pthread_cond_t notFull;
+  // Signalled whenever a message is added, so blocked getters can try
+  // again.
+  pthread_cond_t notEmpty;
+  // How many threads are asleep on each.
+  int numWaitingPutters;
+  int numWaitingGetters;
+};
+
+/*
+  Initializes a message queue.
+
+  bufferSize controls how many messages will fit into the queue at any
+  given time.
+*/
+void message_queue_init(struct message_queue_t *messageQueue, size_t bufferSize);
+
+/*
+  Cleans up a message queue.
+
+  Frees up the internal memory buffer.  Messages still in the queue are
+  not released.
+
+  You should make sure that no one is using it anymore before cleaning
+  up.
+*/
+void message_queue_cleanup(struct message_queue_t *messageQueue);
+
+/*
+  Puts a message into the message queue.
+
+  message is the message to store.  The queue takes over the caller's
+  reference to it.
+
+  Blocks while the queue is full.
+*/
+void message_queue_put(struct message_queue_t *messageQueue, struct message_t *message);
+
+/*
+  Gets a message from the message queue.
+
+  The caller takes over the queue's reference to the message.
+
+  Blocks while the queue is empty.
+*/
+struct message_t *message_queue_get(struct message_queue_t *messageQueue);
+
+#endif
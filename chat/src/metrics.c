@@ -0,0 +1,249 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Runtime metrics.  See metrics.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "metrics.h"
+
+// How long we wait for a scraper to send its request before answering
+// anyway.
+const int METRICS_REQUEST_TIMEOUT_MS = 100;
+
+struct metric_info_t {
+  const char *name;
+  const char *help;
+  // What the counter is divided by when it is reported, to turn
+  // nanoseconds into seconds.
+  double scale;
+};
+
+static const struct metric_info_t METRIC_INFO[NUM_METRICS] = {
+  [METRIC_MESSAGES_IN] = {"chat_messages_in_total", "Chat messages read from clients.", 1},
+  [METRIC_BYTES_IN] = {"chat_bytes_in_total", "Bytes of chat messages read from clients.", 1},
+  [METRIC_MESSAGES_OUT] = {"chat_messages_out_total", "Chat messages written to clients.", 1},
+  [METRIC_BYTES_OUT] = {"chat_bytes_out_total", "Bytes written to clients.", 1},
+  [METRIC_CLIENTS_CONNECTED] = {"chat_clients_connected_total", "Clients that connected.", 1},
+  [METRIC_CLIENTS_DISCONNECTED] = {"chat_clients_disconnected_total", "Clients that disconnected.", 1},
+  [METRIC_DROPPED_MESSAGES] = {"chat_dropped_messages_total",
+    "Messages thrown away because a client's send queue was full.", 1},
+  [METRIC_SLOW_CLIENTS_DISCONNECTED] = {"chat_slow_clients_disconnected_total",
+    "Clients disconnected for not keeping up.", 1},
+  [METRIC_SOCKET_MUTEX_ACQUISITIONS] = {"chat_socket_mutex_acquisitions_total",
+    "Times clientSocketMutex was taken.", 1},
+  [METRIC_SOCKET_MUTEX_HOLD_NANOS] = {"chat_socket_mutex_hold_seconds_total",
+    "Time spent holding clientSocketMutex.", 1e9},
+  [METRIC_MESSAGES_COMPRESSED] = {"chat_messages_compressed_total",
+    "Chat messages compressed for the clients that take them.", 1},
+  [METRIC_COMPRESSED_BYTES_SAVED] = {"chat_compressed_bytes_saved_total",
+    "How much shorter compressed messages were, summed once per message.", 1},
+  [METRIC_RATE_LIMITED_MESSAGES] = {"chat_rate_limited_messages_total",
+    "Messages, joins and leaves thrown away for being over a client's rate limit.", 1},
+  [METRIC_CLIENTS_MUTED] = {"chat_clients_muted_total",
+    "Times a client was muted for going over its rate limit.", 1},
+  [METRIC_FLOODING_CLIENTS_DISCONNECTED] = {"chat_flooding_clients_disconnected_total",
+    "Clients disconnected for going over their rate limit.", 1},
+};
+
+__thread struct metrics_t *t_metrics = NULL;
+
+// Every registered thread's metrics, and what exited threads counted.
+// The lock is only taken to register, unregister and read.
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_t *registeredThreads = NULL;
+static unsigned long retiredCounters[NUM_METRICS];
+
+static const char *socketPath;
+static int metricsSocket;
+static void (*gaugeWriter)(FILE *out);
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Accepts scrapers forever.
+*/
+static void *serveMetrics(void *args);
+
+/*
+  Sends the metrics to one scraper and hangs up.
+*/
+static void answerScrape(int fd);
+
+/*
+  Removes the socket file on the way out.
+*/
+static void removeSocket();
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void metrics_register_thread() {
+  struct metrics_t *metrics;
+  if (posix_memalign((void **)&metrics, 64, sizeof(struct metrics_t)) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  memset(metrics, 0, sizeof(struct metrics_t));
+
+  pthread_mutex_lock(&registryLock);
+  metrics->next = registeredThreads;
+  if (registeredThreads != NULL) {
+    registeredThreads->prev = metrics;
+  }
+  registeredThreads = metrics;
+  pthread_mutex_unlock(&registryLock);
+
+  t_metrics = metrics;
+}
+
+void metrics_unregister_thread() {
+  struct metrics_t *metrics = t_metrics;
+  if (metrics == NULL) {
+    return;
+  }
+  t_metrics = NULL;
+
+  pthread_mutex_lock(&registryLock);
+  for (int i = 0; i < NUM_METRICS; ++i) {
+    retiredCounters[i] += metrics->counters[i];
+  }
+  if (metrics->prev != NULL) {
+    metrics->prev->next = metrics->next;
+  } else {
+    registeredThreads = metrics->next;
+  }
+  if (metrics->next != NULL) {
+    metrics->next->prev = metrics->prev;
+  }
+  pthread_mutex_unlock(&registryLock);
+
+  free(metrics);
+}
+
+void metrics_write(FILE *out) {
+  unsigned long totals[NUM_METRICS];
+
+  pthread_mutex_lock(&registryLock);
+  memcpy(totals, retiredCounters, sizeof(totals));
+  for (struct metrics_t *metrics = registeredThreads; metrics != NULL; metrics = metrics->next) {
+    for (int i = 0; i < NUM_METRICS; ++i) {
+      totals[i] += __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&registryLock);
+
+  for (int i = 0; i < NUM_METRICS; ++i) {
+    const struct metric_info_t *info = &METRIC_INFO[i];
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", info->name, info->help, info->name);
+    if (info->scale == 1) {
+      fprintf(out, "%s %lu\n", info->name, totals[i]);
+    } else {
+      fprintf(out, "%s %.9f\n", info->name, totals[i] / info->scale);
+    }
+  }
+}
+
+void metrics_serve(const char *path, void (*writeGauges)(FILE *out)) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: Metrics socket path is too long: %s\n", PROG_NAME, path);
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  strcpy(address.sun_path, path);
+
+  metricsSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (metricsSocket < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  // A socket file left behind by an earlier run would stop bind.
+  unlink(path);
+  if (bind(metricsSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    listen(metricsSocket, SOMAXCONN) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  socketPath = path;
+  atexit(removeSocket);
+  gaugeWriter = writeGauges;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, serveMetrics, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_THREAD);
+  }
+  pthread_detach(thread);
+}
+
+static void *serveMetrics(void *args) {
+  while (true) {
+    int fd = accept(metricsSocket, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror(PROG_NAME);
+      }
+      continue;
+    }
+    answerScrape(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static void answerScrape(int fd) {
+  // Whatever was asked, the answer is the same, so just wait for the
+  // request to arrive before we answer and hang up.
+  struct pollfd request = {fd, POLLIN, 0};
+  if (poll(&request, 1, METRICS_REQUEST_TIMEOUT_MS) > 0) {
+    char discard[1024];
+    if (read(fd, discard, sizeof(discard)) < 0) {
+      return;
+    }
+  }
+
+  char *body = NULL;
+  size_t bodyLength = 0;
+  FILE *out = open_memstream(&body, &bodyLength);
+  if (out == NULL) {
+    perror(PROG_NAME);
+    return;
+  }
+  metrics_write(out);
+  if (gaugeWriter != NULL) {
+    gaugeWriter(out);
+  }
+  fclose(out);
+
+  char header[128];
+  int headerLength = snprintf(header, sizeof(header),
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+    bodyLength);
+  struct iovec iov[2] = {{header, headerLength}, {body, bodyLength}};
+  if (writevToFile(fd, iov, 2) != 0 && DEBUG) {
+    perror(PROG_NAME);
+  }
+  free(body);
+}
+
+static void removeSocket() {
+  unlink(socketPath);
+}
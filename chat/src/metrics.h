@@ -0,0 +1,94 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Runtime counters, served in the Prometheus text format.
+
+  Every thread that counts anything registers its own struct metrics_t
+  and only ever writes to that one, so counting is a plain add with no
+  lock and no shared cache line.  Reading the metrics adds up every
+  registered thread, plus whatever threads that have since exited left
+  behind.
+
+  metrics_serve listens on a UNIX socket.  Anything that connects is
+  sent the current metrics, as a plain HTTP response, so that
+    curl --unix-socket path http://localhost/metrics
+  works, and so does anything that can scrape through a socket.
+
+*/
+
+#ifndef CHAT_METRICS_H
+#define CHAT_METRICS_H
+
+#include <stdio.h>
+
+enum METRIC_T {
+  METRIC_MESSAGES_IN,
+  METRIC_BYTES_IN,
+  METRIC_MESSAGES_OUT,
+  METRIC_BYTES_OUT,
+  METRIC_CLIENTS_CONNECTED,
+  METRIC_CLIENTS_DISCONNECTED,
+  METRIC_DROPPED_MESSAGES,
+  METRIC_SLOW_CLIENTS_DISCONNECTED,
+  METRIC_SOCKET_MUTEX_ACQUISITIONS,
+  METRIC_SOCKET_MUTEX_HOLD_NANOS,
+  METRIC_MESSAGES_COMPRESSED,
+  METRIC_COMPRESSED_BYTES_SAVED,
+  METRIC_RATE_LIMITED_MESSAGES,
+  METRIC_CLIENTS_MUTED,
+  METRIC_FLOODING_CLIENTS_DISCONNECTED,
+  NUM_METRICS
+};
+
+struct metrics_t {
+  unsigned long counters[NUM_METRICS];
+
+  // Every registered thread's metrics are on one list.
+  struct metrics_t *next;
+  struct metrics_t *prev;
+} __attribute__((aligned(64)));
+
+// The calling thread's metrics, or NULL if it didn't register.
+extern __thread struct metrics_t *t_metrics;
+
+/*
+  Adds amount to one of the calling thread's counters.  Does nothing if
+  the thread isn't registered.
+*/
+static inline void metrics_add(enum METRIC_T metric, unsigned long amount) {
+  struct metrics_t *metrics = t_metrics;
+  if (metrics != NULL) {
+    // Only this thread writes the counter, so a relaxed store of the
+    // sum is enough; readers may just see it a little late.
+    __atomic_store_n(&metrics->counters[metric], metrics->counters[metric] + amount, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+  Gives the calling thread its own metrics.
+*/
+void metrics_register_thread();
+
+/*
+  Folds the calling thread's metrics into the totals and forgets them.
+  Must be called before a registered thread exits.
+*/
+void metrics_unregister_thread();
+
+/*
+  Writes every counter, summed over all threads, to out.
+*/
+void metrics_write(FILE *out);
+
+/*
+  Starts a thread that serves the metrics on a UNIX socket at path,
+  replacing any stale socket file.  writeGauges, if not NULL, is called
+  to add whatever else should be reported, such as queue depths.
+
+  Terminates the program if the socket can't be opened.
+*/
+void metrics_serve(const char *path, void (*writeGauges)(FILE *out));
+
+#endif
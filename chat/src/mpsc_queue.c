@@ -0,0 +1,277 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A bounded, lock-free queue for many producers and a single consumer.
+  See mpsc_queue.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "server.h"
+#include "mpsc_queue.h"
+
+// How many times to re-check the queue before going to sleep.  Most
+// waits are over within a few hundred nanoseconds, which is far cheaper
+// than a trip through the condition variable.
+const int MPSC_SPIN_LIMIT = 128;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Hints to the CPU that we are busy waiting.
+*/
+static inline void cpuRelax();
+
+/*
+  Returns how far slot's sequence is from position.  See mpsc_queue.h
+  for what the sequence numbers mean.
+*/
+static inline intptr_t sequenceDistance(struct mpsc_slot_t *slot, size_t position);
+
+/*
+  Stores message in slot, which was claimed at position, and wakes the
+  consumer if it is asleep.
+*/
+static void publish(struct mpsc_queue_t *queue, struct mpsc_slot_t *slot,
+  size_t position, struct message_t *message);
+
+/*
+  Takes up to maxMessages messages, starting with the one at popOffset,
+  which must be ready.  Returns how many were taken.
+*/
+static size_t takeReady(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages);
+
+/*
+  Sleeps until the slot at position has been freed by the consumer.
+*/
+static void waitUntilNotFull(struct mpsc_queue_t *queue, size_t position);
+
+/*
+  Sleeps until the slot at position has been filled by a producer.
+*/
+static void waitUntilNotEmpty(struct mpsc_queue_t *queue, size_t position);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+void mpsc_queue_init(struct mpsc_queue_t *queue, size_t bufferSize) {
+  size_t capacity = 1;
+  while (capacity < bufferSize) {
+    capacity <<= 1;
+  }
+
+  if (pthread_mutex_init(&queue->waitLock, NULL) != 0 ||
+    pthread_cond_init(&queue->notFull, NULL) != 0 ||
+    pthread_cond_init(&queue->notEmpty, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+
+  if (posix_memalign((void **)&queue->slots, CACHE_LINE_SIZE,
+    capacity * sizeof(struct mpsc_slot_t)) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  for (size_t i = 0; i < capacity; ++i) {
+    queue->slots[i].sequence = i;
+    queue->slots[i].message = NULL;
+  }
+
+  queue->maxNumMessages = capacity;
+  queue->positionMask = capacity - 1;
+  queue->pushOffset = 0;
+  queue->popOffset = 0;
+  queue->consumerWaiting = 0;
+  queue->producersWaiting = 0;
+}
+
+void mpsc_queue_cleanup(struct mpsc_queue_t *queue) {
+  if (pthread_mutex_destroy(&queue->waitLock) != 0 ||
+    pthread_cond_destroy(&queue->notFull) != 0 ||
+    pthread_cond_destroy(&queue->notEmpty) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+  free(queue->slots);
+}
+
+void mpsc_queue_put(struct mpsc_queue_t *queue, struct message_t *message) {
+  size_t position = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+  struct mpsc_slot_t *slot;
+  int spins = 0;
+
+  // Claim a position.
+  while (true) {
+    slot = &queue->slots[position & queue->positionMask];
+    intptr_t distance = sequenceDistance(slot, position);
+    if (distance == 0) {
+      // The slot is free; try to take it before another producer does.
+      // On failure position is reloaded with the current value.
+      if (__atomic_compare_exchange_n(&queue->pushOffset, &position, position + 1,
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (distance < 0) {
+      // The consumer hasn't freed this slot yet, so the queue is full.
+      if (++spins < MPSC_SPIN_LIMIT) {
+        cpuRelax();
+      } else {
+        waitUntilNotFull(queue, position);
+        spins = 0;
+      }
+      position = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+    } else {
+      // Another producer got here first.
+      position = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+    }
+  }
+
+  publish(queue, slot, position, message);
+}
+
+bool mpsc_queue_try_put(struct mpsc_queue_t *queue, struct message_t *message) {
+  size_t position = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+  struct mpsc_slot_t *slot;
+
+  while (true) {
+    slot = &queue->slots[position & queue->positionMask];
+    intptr_t distance = sequenceDistance(slot, position);
+    if (distance == 0) {
+      if (__atomic_compare_exchange_n(&queue->pushOffset, &position, position + 1,
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (distance < 0) {
+      return false;
+    } else {
+      position = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+    }
+  }
+
+  publish(queue, slot, position, message);
+  return true;
+}
+
+struct message_t *mpsc_queue_get(struct mpsc_queue_t *queue) {
+  struct message_t *message;
+  mpsc_queue_get_batch(queue, &message, 1);
+  return message;
+}
+
+size_t mpsc_queue_get_batch(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages) {
+  size_t position = queue->popOffset;
+  struct mpsc_slot_t *slot = &queue->slots[position & queue->positionMask];
+
+  for (int spins = 0; sequenceDistance(slot, position + 1) != 0; ++spins) {
+    if (spins < MPSC_SPIN_LIMIT) {
+      cpuRelax();
+    } else {
+      waitUntilNotEmpty(queue, position);
+    }
+  }
+
+  return takeReady(queue, messages, maxMessages);
+}
+
+size_t mpsc_queue_poll_batch(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages) {
+  size_t position = queue->popOffset;
+  struct mpsc_slot_t *slot = &queue->slots[position & queue->positionMask];
+  if (sequenceDistance(slot, position + 1) != 0) {
+    return 0;
+  }
+  return takeReady(queue, messages, maxMessages);
+}
+
+size_t mpsc_queue_depth(struct mpsc_queue_t *queue) {
+  size_t popOffset = __atomic_load_n(&queue->popOffset, __ATOMIC_RELAXED);
+  size_t pushOffset = __atomic_load_n(&queue->pushOffset, __ATOMIC_RELAXED);
+  // The two loads aren't taken together, so the consumer may look ahead.
+  return (pushOffset > popOffset) ? pushOffset - popOffset : 0;
+}
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static inline intptr_t sequenceDistance(struct mpsc_slot_t *slot, size_t position) {
+  return (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)position;
+}
+
+static void publish(struct mpsc_queue_t *queue, struct mpsc_slot_t *slot,
+  size_t position, struct message_t *message) {
+  slot->message = message;
+
+  // Hand the slot to the consumer.  This has to be ordered before we
+  // check consumerWaiting, hence SEQ_CST rather than RELEASE.
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&queue->consumerWaiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&queue->waitLock);
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->waitLock);
+  }
+}
+
+static size_t takeReady(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages) {
+  size_t position = queue->popOffset;
+  struct mpsc_slot_t *slot = &queue->slots[position & queue->positionMask];
+
+  // Take every message that is ready, stopping at the first slot a
+  // producer has claimed but not filled yet.
+  size_t numMessages = 0;
+  do {
+    messages[numMessages++] = slot->message;
+
+    // Free the slot for the producer that will claim it on the next lap
+    // around the ring.
+    __atomic_store_n(&slot->sequence, position + queue->maxNumMessages, __ATOMIC_SEQ_CST);
+    ++position;
+    slot = &queue->slots[position & queue->positionMask];
+  } while (numMessages < maxMessages && sequenceDistance(slot, position + 1) == 0);
+  queue->popOffset = position;
+
+  if (__atomic_load_n(&queue->producersWaiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&queue->waitLock);
+    pthread_cond_broadcast(&queue->notFull);
+    pthread_mutex_unlock(&queue->waitLock);
+  }
+  return numMessages;
+}
+
+static void waitUntilNotFull(struct mpsc_queue_t *queue, size_t position) {
+  struct mpsc_slot_t *slot = &queue->slots[position & queue->positionMask];
+
+  pthread_mutex_lock(&queue->waitLock);
+  __atomic_add_fetch(&queue->producersWaiting, 1, __ATOMIC_SEQ_CST);
+  // Check again now that the consumer is guaranteed to see us waiting;
+  // otherwise we could miss its wake-up.
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) < position) {
+    pthread_cond_wait(&queue->notFull, &queue->waitLock);
+  }
+  __atomic_sub_fetch(&queue->producersWaiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&queue->waitLock);
+}
+
+static void waitUntilNotEmpty(struct mpsc_queue_t *queue, size_t position) {
+  struct mpsc_slot_t *slot = &queue->slots[position & queue->positionMask];
+
+  pthread_mutex_lock(&queue->waitLock);
+  __atomic_store_n(&queue->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+  // Check again now that producers are guaranteed to see us waiting.
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != position + 1) {
+    pthread_cond_wait(&queue->notEmpty, &queue->waitLock);
+  }
+  __atomic_store_n(&queue->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&queue->waitLock);
+}
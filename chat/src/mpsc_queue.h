@@ -0,0 +1,132 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A bounded, lock-free queue of messages for many producers and a
+  single consumer.  It has the same interface as message_queue_t, so it
+  can be dropped in wherever there is exactly one thread getting
+  messages.  Only message pointers are queued; the messages themselves
+  are never copied.
+
+  Every slot carries a sequence number that tells whose turn it is:
+    sequence == position      the slot is free for the producer that
+                              claimed position.
+    sequence == position + 1  the slot holds a message for the consumer.
+  Producers claim positions with a compare-and-swap on pushOffset, so
+  they never take a lock unless the queue is full.  Each slot sits on
+  its own cache line so producers writing neighbouring slots don't
+  contend.
+
+  Threads only take waitLock to sleep when the queue is full (or empty)
+  and someone has to be woken up.
+
+*/
+
+#ifndef CHAT_MPSC_QUEUE_H
+#define CHAT_MPSC_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "message.h"
+
+#define CACHE_LINE_SIZE 64
+
+struct mpsc_slot_t {
+  size_t sequence;
+  struct message_t *message;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct mpsc_queue_t {
+  struct mpsc_slot_t *slots;
+
+  // maxNumMessages is always a power of two, so that positions can be
+  // mapped to slots with positionMask.
+  size_t maxNumMessages;
+  size_t positionMask;
+
+  // Where the next push will be.  Shared by all producers.
+  size_t pushOffset __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  // Where the next pop will be.  Only touched by the consumer.
+  size_t popOffset __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  // The slow path, used only to sleep and wake.
+  int consumerWaiting __attribute__((aligned(CACHE_LINE_SIZE)));
+  int producersWaiting;
+  pthread_mutex_t waitLock;
+  pthread_cond_t notFull;
+  pthread_cond_t notEmpty;
+};
+
+/*
+  Initializes a queue.
+
+  bufferSize controls how many messages will fit into the queue at any
+  given time.  It is rounded up to a power of two.
+*/
+void mpsc_queue_init(struct mpsc_queue_t *queue, size_t bufferSize);
+
+/*
+  Cleans up a queue.
+
+  You should make sure that no one is using it anymore before cleaning
+  up.
+*/
+void mpsc_queue_cleanup(struct mpsc_queue_t *queue);
+
+/*
+  Puts a message into the queue.  Safe to call from any number of
+  threads at once.
+
+  message is the message to store.  The queue takes over the caller's
+  reference to it.
+
+  Blocks while the queue is full.
+*/
+void mpsc_queue_put(struct mpsc_queue_t *queue, struct message_t *message);
+
+/*
+  Like mpsc_queue_put, but returns false instead of blocking if the
+  queue is full.  The caller keeps its reference in that case.
+*/
+bool mpsc_queue_try_put(struct mpsc_queue_t *queue, struct message_t *message);
+
+/*
+  Gets a message from the queue.  Only one thread may call this.
+
+  The caller takes over the queue's reference to the message.
+
+  Blocks while the queue is empty.
+*/
+struct message_t *mpsc_queue_get(struct mpsc_queue_t *queue);
+
+/*
+  Gets up to maxMessages messages from the queue at once.  Only one
+  thread may call this.
+
+  messages receives the messages, oldest first.  The caller takes over
+  the queue's reference to each of them.
+
+  Blocks while the queue is empty, but otherwise only takes what is
+  already there.  Returns how many messages were stored in messages,
+  which is always at least one.
+*/
+size_t mpsc_queue_get_batch(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages);
+
+/*
+  Like mpsc_queue_get_batch, but returns 0 instead of blocking if the
+  queue is empty.
+*/
+size_t mpsc_queue_poll_batch(struct mpsc_queue_t *queue, struct message_t **messages, size_t maxMessages);
+
+/*
+  Returns roughly how many messages are in the queue.  Safe to call from
+  any thread, but only a snapshot: it may count messages that are still
+  being put in.
+*/
+size_t mpsc_queue_depth(struct mpsc_queue_t *queue);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  A token bucket for each client, so that one client can't flood the
+  rooms for everyone else.  The bucket holds up to burst tokens and
+  gains rate tokens a second; every message a client sends takes one,
+  and a message that finds the bucket empty is over the limit.
+
+  Tokens are counted in thousandths, so that refilling is a multiply
+  by the milliseconds that have passed.  The time comes from the coarse
+  monotonic clock, which is read from the vDSO without a system call
+  and is good to a few milliseconds - plenty for a limit in messages a
+  second.
+
+  A bucket belongs to the thread reading its client, so nothing here
+  takes a lock.
+
+*/
+
+#ifndef CHAT_RATE_LIMIT_H
+#define CHAT_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <time.h>
+
+// What a token is worth.
+#define RATE_LIMIT_TOKEN 1000L
+
+struct rate_limit_t {
+  // In thousandths of a token.
+  long tokens;
+  // When tokens was last topped up, in milliseconds.
+  long refilledAt;
+  // Until when everything the client sends is dropped, in milliseconds,
+  // once it is muted.
+  long mutedUntil;
+};
+
+/*
+  Returns the coarse monotonic time in milliseconds.
+*/
+static inline long rate_limit_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/*
+  Starts limit out with a full bucket of burst tokens.
+*/
+static inline void rate_limit_init(struct rate_limit_t *limit, long burst) {
+  limit->tokens = burst * RATE_LIMIT_TOKEN;
+  limit->refilledAt = rate_limit_now();
+  limit->mutedUntil = 0;
+}
+
+/*
+  Takes a token for a message sent at now, after topping the bucket up
+  at rate tokens a second, to at most burst.  Returns false, taking
+  nothing, if there isn't a whole token.
+*/
+static inline bool rate_limit_take(struct rate_limit_t *limit, long rate, long burst, long now) {
+  long elapsed = now - limit->refilledAt;
+  if (elapsed > 0) {
+    long full = burst * RATE_LIMIT_TOKEN;
+    // Past a full bucket's worth, the time doesn't matter, and
+    // multiplying it could overflow.
+    if (elapsed >= full / rate + 1) {
+      limit->tokens = full;
+    } else {
+      limit->tokens += elapsed * rate;
+      if (limit->tokens > full) {
+        limit->tokens = full;
+      }
+    }
+    limit->refilledAt = now;
+  }
+  if (limit->tokens < RATE_LIMIT_TOKEN) {
+    return false;
+  }
+  limit->tokens -= RATE_LIMIT_TOKEN;
+  return true;
+}
+
+#endif
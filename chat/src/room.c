@@ -0,0 +1,187 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Chat rooms.  See room.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "room.h"
+
+// How many members a new room has room for before it has to grow.
+const size_t INITIAL_ROOM_SIZE = 8;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Returns where the pointer to the room called name is, or would be, in
+  its bucket's chain.
+*/
+static struct room_t **findRoomLink(struct room_table_t *table, const char *name);
+
+/*
+  Removes the member at index from room, freeing the room if it is now
+  empty.  link is where the pointer to room is kept.
+*/
+static void removeMember(struct room_table_t *table, struct room_t **link, size_t index);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+unsigned long room_hash(const char *name) {
+  // FNV-1a
+  unsigned long hash = 2166136261UL;
+  for (; *name != '\0'; ++name) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+bool room_is_valid_name(const char *name, size_t length) {
+  return length > 0 && length <= MAX_ROOM_NAME_LENGTH && memchr(name, '\0', length) == NULL;
+}
+
+void room_table_init(struct room_table_t *table, size_t numBuckets,
+  size_t historyLength, size_t historyArenaSize) {
+  table->buckets = calloc(numBuckets, sizeof(struct room_t *));
+  if (table->buckets == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  table->numBuckets = numBuckets;
+  table->numRooms = 0;
+  table->historyLength = historyLength;
+  table->historyArenaSize = historyArenaSize;
+}
+
+void room_table_cleanup(struct room_table_t *table) {
+  for (size_t i = 0; i < table->numBuckets; ++i) {
+    struct room_t *room = table->buckets[i];
+    while (room != NULL) {
+      struct room_t *next = room->next;
+      history_cleanup(&room->history);
+      free(room->members);
+      free(room);
+      room = next;
+    }
+  }
+  free(table->buckets);
+  table->buckets = NULL;
+  table->numRooms = 0;
+}
+
+struct room_t *room_table_find(struct room_table_t *table, const char *name) {
+  return *findRoomLink(table, name);
+}
+
+void room_table_for_each(struct room_table_t *table,
+  void (*visit)(struct room_t *room, void *context), void *context) {
+  for (size_t bucket = 0; bucket < table->numBuckets; ++bucket) {
+    for (struct room_t *room = table->buckets[bucket]; room != NULL; room = room->next) {
+      visit(room, context);
+    }
+  }
+}
+
+bool room_join(struct room_table_t *table, const char *name, int member) {
+  struct room_t **link = findRoomLink(table, name);
+  struct room_t *room = *link;
+
+  if (room == NULL) {
+    room = calloc(1, sizeof(struct room_t));
+    if (room == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    strncpy(room->name, name, MAX_ROOM_NAME_LENGTH);
+    history_init(&room->history, table->historyLength, table->historyArenaSize);
+    *link = room;
+    ++table->numRooms;
+  }
+
+  for (size_t i = 0; i < room->numMembers; ++i) {
+    if (room->members[i] == member) {
+      return false;
+    }
+  }
+
+  if (room->numMembers == room->maxMembers) {
+    size_t maxMembers = room->maxMembers == 0 ? INITIAL_ROOM_SIZE : room->maxMembers * 2;
+    int *members = realloc(room->members, maxMembers * sizeof(int));
+    if (members == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    room->members = members;
+    room->maxMembers = maxMembers;
+  }
+  room->members[room->numMembers++] = member;
+  return true;
+}
+
+void room_leave(struct room_table_t *table, const char *name, int member) {
+  struct room_t **link = findRoomLink(table, name);
+  struct room_t *room = *link;
+  if (room == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < room->numMembers; ++i) {
+    if (room->members[i] == member) {
+      removeMember(table, link, i);
+      return;
+    }
+  }
+}
+
+void room_leave_all(struct room_table_t *table, int member) {
+  for (size_t bucket = 0; bucket < table->numBuckets; ++bucket) {
+    struct room_t **link = &table->buckets[bucket];
+    while (*link != NULL) {
+      struct room_t *room = *link;
+      bool freed = false;
+      for (size_t i = 0; i < room->numMembers; ++i) {
+        if (room->members[i] == member) {
+          freed = (room->numMembers == 1);
+          removeMember(table, link, i);
+          break;
+        }
+      }
+      // If the room was freed, link already points at the next one.
+      if (!freed) {
+        link = &room->next;
+      }
+    }
+  }
+}
+
+static struct room_t **findRoomLink(struct room_table_t *table, const char *name) {
+  struct room_t **link = &table->buckets[room_hash(name) % table->numBuckets];
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static void removeMember(struct room_table_t *table, struct room_t **link, size_t index) {
+  struct room_t *room = *link;
+
+  // Order doesn't matter, so fill the gap with the last member.
+  room->members[index] = room->members[--room->numMembers];
+
+  if (room->numMembers == 0) {
+    *link = room->next;
+    history_cleanup(&room->history);
+    free(room->members);
+    free(room);
+    --table->numRooms;
+  }
+}
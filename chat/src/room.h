@@ -0,0 +1,109 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Chat rooms.  A room table maps room names to the clients that joined
+  them, and keeps each room's recent history.  Clients are identified by their slot in the server's client
+  table, which stays the same for as long as they are connected.
+
+  A room table is not thread safe.  Every table is owned by a single
+  thread: one room shard in thread mode, or the event loop.  Rooms are
+  created when someone joins them and freed when the last member
+  leaves.
+
+*/
+
+#ifndef CHAT_ROOM_H
+#define CHAT_ROOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "frame.h"
+#include "history.h"
+
+#define MAX_ROOM_NAME_LENGTH FRAME_MAX_ROOM_NAME_LENGTH
+
+struct room_t {
+  // The next room in the same bucket.
+  struct room_t *next;
+
+  // The slots of every member, in no particular order.
+  int *members;
+  size_t numMembers;
+  size_t maxMembers;
+
+  // The room's recent messages, for replaying to new members.
+  struct history_t history;
+
+  char name[MAX_ROOM_NAME_LENGTH + 1];
+};
+
+struct room_table_t {
+  // Rooms are chained in buckets by room_hash.
+  struct room_t **buckets;
+  size_t numBuckets;
+  size_t numRooms;
+
+  // How big each new room's history is.  See history_init.
+  size_t historyLength;
+  size_t historyArenaSize;
+};
+
+/*
+  Returns a hash of a room's name.  Also used to decide which shard
+  owns a room.
+*/
+unsigned long room_hash(const char *name);
+
+/*
+  Returns whether the length bytes at name can be used as a room name.
+*/
+bool room_is_valid_name(const char *name, size_t length);
+
+/*
+  Initializes an empty room table with numBuckets hash buckets.  Each
+  room keeps up to historyLength messages of history, in an arena of
+  historyArenaSize bytes.
+*/
+void room_table_init(struct room_table_t *table, size_t numBuckets,
+  size_t historyLength, size_t historyArenaSize);
+
+/*
+  Frees every room in table.
+*/
+void room_table_cleanup(struct room_table_t *table);
+
+/*
+  Returns the room called name, or NULL if nobody is in it.
+*/
+struct room_t *room_table_find(struct room_table_t *table, const char *name);
+
+/*
+  Calls visit on every room in table, in no particular order, passing
+  context along.  visit must not join or leave rooms.
+*/
+void room_table_for_each(struct room_table_t *table,
+  void (*visit)(struct room_t *room, void *context), void *context);
+
+/*
+  Adds member to the room called name, creating the room if needed.
+  Does nothing if member is already in it.
+
+  Returns whether member was added.
+*/
+bool room_join(struct room_table_t *table, const char *name, int member);
+
+/*
+  Removes member from the room called name, if it is there.
+*/
+void room_leave(struct room_table_t *table, const char *name, int member);
+
+/*
+  Removes member from every room in table.  This looks at every room,
+  so it is meant for disconnects rather than for every message.
+*/
+void room_leave_all(struct room_table_t *table, int member);
+
+#endif
@@ -7,21 +7,39 @@ Purpose:
   with each other.
 
   Usage:
-    server [--debug] [interface] port
+    server [options] [interface] port
+
+  The options are listed in displayUsageString, which is printed when
+  they don't parse, and explained in the README.
 
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "server.h"
+#include "event_loop.h"
+#include "metrics.h"
 
 char *PROG_NAME;
 bool DEBUG = false;
@@ -29,30 +47,86 @@ bool DEBUG = false;
 const int MAX_CLIENTS = 32;
 const int MAX_NUM_MESSAGES = 256;
 const int MAX_MESSAGE_LENGTH = 1024;
-
-struct message_queue_t {
-  // The array of all messages.  This list is null terminated.
-  char **messages;
-  int *senders;
-
-  // Where the next push will be.
-  size_t pushOffset;
-  // Where the next pop will be.
-  size_t popOffset;
-
-  size_t maxMessageSize;
-  size_t maxNumMessages;
-
-  // Controls simultaneous access to messages
-  pthread_mutex_t lock;
+// The longest framed chat message accepted by default.
+const size_t MAX_LARGE_MESSAGE_LENGTH = 1024 * 1024;
+
+// Messages shorter than this aren't worth compressing by default.
+const size_t DEFAULT_COMPRESS_ABOVE = 512;
+// Messages are compressed on the thread that read them, so favour
+// speed.
+const int COMPRESSION_LEVEL = Z_BEST_SPEED;
+
+// How much is read from a client at a time in framed mode.  A single
+// read may hold many frames.
+const int FRAMED_READ_BUFFER_SIZE = 4096;
+
+// How many hash buckets each room table has.
+const int ROOM_TABLE_BUCKETS = 1024;
+
+// How many messages the pool allocates at a time.
+const int MESSAGES_PER_SLAB = 256;
+
+const int DEFAULT_SEND_QUEUE_LENGTH = 64;
+// A partly written message always stays at the head of its queue, so
+// dropping the oldest message needs room for one more behind it.
+const int MIN_SEND_QUEUE_LENGTH = 2;
+const int DEFAULT_PROPAGATION_BATCH_SIZE = 64;
+
+const long DEFAULT_LOG_FSYNC_INTERVAL = 100;
+const size_t DEFAULT_LOG_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+// How long --flood mute silences a client for, in seconds, unless
+// given on the command line.
+const long DEFAULT_MUTE_SECONDS = 10;
+
+// How many messages are kept when only --history-seconds is given.
+const int DEFAULT_HISTORY_LENGTH = 100;
+
+// How much arena a room's history gets per message it keeps.  Longer
+// messages push out more of the older ones.
+const size_t HISTORY_BYTES_PER_MESSAGE = 128;
+
+struct server_options_t g_options = {
+  .eventLoop = false,
+  .ioUring = false,
+  .maxClients = 0,
+  .framed = false,
+  .maxMessageLength = MAX_LARGE_MESSAGE_LENGTH,
+  .compressAbove = DEFAULT_COMPRESS_ABOVE,
+  .sendQueueLength = DEFAULT_SEND_QUEUE_LENGTH,
+  .slowClientPolicy = SLOW_CLIENT_DROP_OLDEST,
+  .propagationBatchSize = DEFAULT_PROPAGATION_BATCH_SIZE,
+  // Chosen in main, one per CPU, unless given on the command line.
+  .numRoomShards = 0,
+  .numWorkers = 1,
+  .historyLength = 0,
+  .historyMaxAge = 0,
+  // Set to historyLength in main, unless given on the command line.
+  .resyncLength = -1,
+  .keptLength = 0,
+  .logDirectory = NULL,
+  .logFsyncInterval = DEFAULT_LOG_FSYNC_INTERVAL,
+  .logSegmentSize = DEFAULT_LOG_SEGMENT_SIZE,
+  .rateLimit = 0,
+  // Chosen in main, a second's worth, unless given on the command line.
+  .rateBurst = 0,
+  .floodPolicy = FLOOD_DROP,
+  .muteDuration = DEFAULT_MUTE_SECONDS * 1000,
+  .metricsPath = NULL,
+  .handoffPath = NULL,
 };
 
-// The file descriptors for client sockets.  0 indicates an empty slot.
-// This is a **SHARED RESOURCE*.  Its access is controlled by
-// clientSocketMutex.
-int *clientSockets;
+struct message_log_t g_messageLog;
+
+// Every client in thread mode.
+// This is a **SHARED RESOURCE*.  See server.h.
+struct connection_table_t clientSockets;
 pthread_mutex_t clientSocketMutex = PTHREAD_MUTEX_INITIALIZER;
 
+// When clientSocketMutex was last taken, if it is being timed.  Only
+// touched while holding it.
+static struct timespec clientSocketsLockedAt;
+
 char *SEPARATOR = ": ";
 size_t SEPARATOR_LENGTH = 2;
 
@@ -60,21 +134,49 @@ size_t SEPARATOR_LENGTH = 2;
 // descriptor.
 const int FD_NULL = -1;
 
-// The set of valid exit values.
-enum EXIT_T {
-  EXIT_NORMAL = 0,
-  EXIT_ERROR_ARGUMENT,
-  EXIT_ERROR_SOCKET,
-  EXIT_ERROR_MEMORY,
-  EXIT_ERROR_IO,
-  EXIT_ERROR_THREAD,
-  EXIT_ERROR_LOCK,
-};
-
 // The socket to the remote server/client.
 static int remoteSocket;
 
-static struct message_queue_t g_messageQueue;
+struct room_shard_t *g_roomShards;
+struct message_pool_t g_messagePool;
+
+// How many clients take compressed messages.  Nothing is compressed
+// while there are none.
+static int numCompressingClients = 0;
+
+// The last sequence number given to a chat message.  It starts out at
+// the time the server started in microseconds, so that numbers keep
+// going up across restarts and handoffs unless more than a million
+// messages a second were sent.
+static uint64_t lastSequence = 0;
+
+// The socket thread mode accepts clients on.
+static int serverSocket;
+
+// Set once we start handing our clients over to a newer server.
+static bool handingOff = false;
+
+// In thread mode, readers blocked in read, and the listener blocked in
+// accept, are woken with this signal when handing over, and park once
+// they see handingOff.  It is sent again every HANDOFF_POLL_MICROS
+// until they have, in case it came just before they blocked.
+const int HANDOFF_SIGNAL = SIGUSR1;
+const int HANDOFF_POLL_MICROS = 1000;
+static pthread_t listenerThread;
+static bool listenerParked = false;
+
+// How many readers of clients taken over from another server have yet
+// to put them back in their rooms.  None of them reads until all have,
+// so nobody misses a message another sent first.
+static int numResuming = 0;
+static pthread_mutex_t resumingMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t allResumed = PTHREAD_COND_INITIALIZER;
+
+// What saveRoomMembers needs to know.
+struct room_saver_t {
+  struct handoff_state_t *state;
+  int *indices;
+};
 
 /* --------------------------------------------------------------------
 Function declarations
@@ -87,29 +189,63 @@ Function declarations
 
   progName is the string pointer that should hold the executable's name.
   debug corresponds to whether the user is requesting debug output.
+  options receives every other setting given on the command line.
 
   If there is an unexpected argument in argv, this will cause the
   program to *TERMINATE*.
 */
 void parseArguments(
   int argc, char **argv, char **progName,
-  struct sockaddr_in *socketAddress, bool *debug);
+  struct sockaddr_in *socketAddress, bool *debug,
+  struct server_options_t *options);
+
+/*
+  Parses the value of a command line option that must be a positive
+  integer.
+
+  option is the name of the option, used in error messages.
+
+  Terminates the program if value is not a positive integer.
+*/
+int parsePositiveOption(char *option, char *value);
 
 
 /*
   Waits for a client to connect to us.
 
-  socketAddress is the address where we should listen on.
+  socketAddress is the address where we should listen on, unless
+  inherited holds a listening socket taken over from another server.
+  Every client in inherited is served first.
 
-  clientSockets are file descriptors used to communicate to/from the
-  remote client.  This is treated as a circular buffer.
-
-  numClients are the maximum number of clients.
+  Every client that connects is given a slot in clientSockets, and
+  turned away if there are already g_options.maxClients.
 
   clientSockets is a **SHARED RESOURCE**.
   clientSocketMutex is used to control access to it.
 */
-void listenForClients(struct sockaddr_in socketAddress, int *clientSockets, int numClients);
+void listenForClients(struct sockaddr_in socketAddress, struct handoff_state_t *inherited);
+
+/*
+  Gives the client on socket fd a slot in clientSockets and starts its
+  reader.  handoff is what was carried over for it, if it was taken over
+  from another server, or NULL.
+
+  Must be called holding clientSocketMutex.
+*/
+void startReader(int fd, struct handoff_client_t *handoff);
+
+/*
+  Counts off a client taken over from another server, once it is back
+  in its rooms or has been turned away.  If wait is set, blocks until
+  every client taken over has been counted off.
+*/
+void finishResuming(bool wait);
+
+/*
+  Sets up a new struct client_socket_t.  Called on every element of
+  clientSockets when it is allocated.
+*/
+void initClientSocket(void *element);
 
 /*
   Close any remote connections before exiting.
@@ -123,86 +259,173 @@ void displayUsageString();
 
 
 /*
-  Returns the next available socket position.
+  Handles a single client connection.
 
-  begin and end are the beginning and end positions of the socket array,
-  respectively.
+  args should be the client's slot in clientSockets, cast to a
+  pointer.
 
-  Returns a pointer if one is found, and NULL otherwise.
+  It will read messages that the client connection sends to us straight
+  into buffers from g_messagePool, and hand them to the shards that own
+  the rooms they are for.
 
-  Assumes that there is **no simultaneous access** to the socket array.
-  Be sure to lock it beforehand!
 */
-int *getNextUnusedSocket(int *begin, int *end);
+void * handleConnection(void *args);
 
 /*
-  Handles a single client connection.
+  Reads messages from session's client until it hangs up, treating each
+  read as a message.
 
-  *args should be a int *fd
+  Returns true if it stopped because we are handing over instead.
+*/
+bool handleRawConnection(struct session_t *session);
 
-  fd is a file descriptor used to communicate with a chat client.
+/*
+  Reads frames from session's client until it hangs up, or sends
+  something that isn't a valid frame.
 
-  It will messages that the client connection sends to us into the
-  circular queue g_messages.
+  Returns true if it stopped because we are handing over instead.
+*/
+bool handleFramedConnection(struct session_t *session);
 
+/*
+  Blocks the calling thread for good, once it has stopped for a
+  handoff.  Waking it up with HANDOFF_SIGNAL does nothing.
 */
-void * handleConnection(void *args);
+void park();
 
 /*
-  Sends messages received to clients.
+  Does nothing; only there so that HANDOFF_SIGNAL interrupts blocking
+  calls instead of killing us.
+*/
+void wakeUp(int signal);
 
-  *args should be a int *fd.
+/*
+  Runs a room shard: carries out the joins, leaves and disconnects for
+  its rooms, and sends chat messages to their members.
 
-  fd is an array of file descriptors, of length MAX_CLIENTS.
+  *args should be the struct room_shard_t to run.
 */
 void * propagateMessages(void *args);
 
 /*
-  Starts a thread that handles message propagation.
+  Sends numMessages chat messages, all for room, to every member of room
+  but their senders.  Each member gets them all in a single writev.
+
+  iov must have room for numMessages entries.
+*/
+void sendToRoom(struct room_t *room, struct message_t **messages, size_t numMessages,
+  struct iovec *iov);
+
+/*
+  Sends room's history to the new member in slot, in a single writev.
+*/
+void replayHistory(struct room_t *room, int slot);
+
+/*
+  Sends the sender of a MESSAGE_RESYNC request for room everything
+  gatherResync says to, in a single writev.
+*/
+void resync(struct room_t *room, struct message_t *request);
+
+/*
+  Writes numIov buffers of replayed messages to the client in slot.
+*/
+void writeReplay(int slot, struct iovec *iov, int numIov);
+
+/*
+  Sets up g_options.numRoomShards room shards and starts their threads.
 */
-void startMessagePropagationThread(int *clientSockets);
+void startRoomShards();
 
 /*
-  Initializes a message queue.
+  Puts message in every room shard's queue, and waits until each has
+  posted message->forgotten.  This takes over the caller's reference to
+  message.
+*/
+void broadcastToShards(struct message_t *message);
 
-  bufferSize controls how many messages will fit into the queue at any
-  given time.
+/*
+  Stops serving clients and fills in state with everything a newer
+  server needs to carry on serving them.  Called by the handoff thread.
+*/
+void handOffClients(struct handoff_state_t *state);
 
-  Memory is allocated to hold the messages.
+/*
+  Interrupts the listener and every reader in thread mode until they
+  have all parked.
 */
-void message_queue_init(struct message_queue_t *messageQueue, size_t bufferSize, size_t messageLength);
+void stopReaders();
 
 /*
-  Cleans up a message queue.
+  Adds room to the handoff state of each of its members.  Called by
+  room_table_for_each, with a struct room_saver_t as context.
+*/
+static void saveRoomMembers(struct room_t *room, void *context);
 
-  Frees up the internal memory buffer.
+/*
+  Sets up the parts of session that are the same for new clients and
+  ones taken over from another server.
+*/
+void initSession(struct session_t *session, int fd, int slot);
 
-  You should make sure that no one is using it anymore before cleaning
-  up.
+/*
+  Sends a message read from a client to whoever owns its room: the
+  room's shard in thread mode, or the event loop.  This takes over the
+  caller's reference to message.
 */
-void message_queue_cleanup(struct message_queue_t *messageQueue);
+void deliverMessage(struct message_t *message);
 
 /*
-  Puts a message into the message queue.
+  Asks for session's client to join, leave or resync room, as kind
+  says.  since is the last message the client saw, for a resync.
+*/
+void sendRoomRequest(struct session_t *session, enum MESSAGE_KIND_T kind, const char *room,
+  uint64_t since);
 
-  message is the message to store.
-  sender is a unique ID to identify sender is associated with the message.
+/*
+  Carries out a FRAME_RESYNC from session's client, whose payload is in
+  message.  Requests that don't parse are skipped.
+*/
+void ingestResync(struct session_t *session, struct message_t *message);
 
-  May block if the queue is currently full.
+/*
+  Takes a token from session's client's rate limit for something it
+  sent, and returns whether it may go on.  If not, it is counted as
+  dropped, and the client is muted under FLOOD_MUTE; under
+  FLOOD_DISCONNECT the caller closes the connection.
 */
-void message_queue_put(struct message_queue_t *messageQueue, char *message, int sender);
+bool withinRateLimit(struct session_t *session);
 
 /*
-  Gets a message and its sender from the message queue.
+  Takes up whichever of the features listed in a FRAME_HELLO payload
+  the server knows about for session's client.
+*/
+void acceptFeatures(struct session_t *session, const char *features);
+
+/*
+  Gets session's parser ready for a new frame, to be read into message.
+  Frames up to g_options.maxMessageLength long are allowed.
+*/
+void resetParser(struct session_t *session, struct message_t *message);
+
+/*
+  Adds a compressed copy of a framed chat message's wire frame to it,
+  if that comes out shorter.
+*/
+void compressMessage(struct message_t *message);
 
-  May block if the queue is currently empty.
+/*
+  Take and give back clientSocketMutex, counting how often it is taken
+  and for how long it is held if the calling thread keeps metrics.
 */
-void message_queue_get(struct message_queue_t *messageQueue, char *message, int *sender);
+void lockClientSockets();
+void unlockClientSockets();
 
 /*
-  Terminates a string at the first trailing whitespace character.
+  Writes the queue depths, and anything else that is measured rather
+  than counted, to out.  Called for every metrics scrape.
 */
-void nullifyTrailingWhitespace(char *string);
+void writeGauges(FILE *out);
 
 /* --------------------------------------------------------------------
 Main
@@ -213,27 +436,77 @@ int main(int argc, char **argv) {
   // not end up with a socket stuck in TIME_WAIT.
   atexit(closeRemoteConnection);
 
+  // A client that hangs up while we are writing to it should only cost
+  // us that client, not the whole server.
+  signal(SIGPIPE, SIG_IGN);
+
   // This is where the program will connect to/bind to.
   struct sockaddr_in socketAddress;
   socketAddress.sin_family = AF_INET;
 
-
-  clientSockets = calloc(MAX_CLIENTS, sizeof(int));
-  if (clientSockets == NULL) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_MEMORY);
+  parseArguments(argc, argv, &PROG_NAME, &socketAddress, &DEBUG, &g_options);
+  if (g_options.rateBurst == 0) {
+    g_options.rateBurst = g_options.rateLimit;
+  }
+  if (g_options.resyncLength < 0) {
+    g_options.resyncLength = g_options.historyLength;
+  }
+  g_options.keptLength = g_options.historyLength;
+  if (g_options.keptLength < g_options.resyncLength) {
+    g_options.keptLength = g_options.resyncLength;
+  }
+  struct timespec startedAt;
+  clock_gettime(CLOCK_REALTIME, &startedAt);
+  lastSequence = startedAt.tv_sec * 1000000ULL + startedAt.tv_nsec / 1000;
+
+  message_pool_init(&g_messagePool, MAX_MESSAGE_LENGTH, MESSAGES_PER_SLAB);
+
+  // This has to come before anything the old server still has open,
+  // like the message log, is opened.
+  struct handoff_state_t inherited;
+  handoff_state_init(&inherited);
+  if (g_options.handoffPath != NULL) {
+    // Every client taken over comes with its socket.
+    raiseFileLimit();
+    handoff_receive(g_options.handoffPath, g_options.framed, &inherited);
   }
 
-  parseArguments(argc, argv, &PROG_NAME, &socketAddress, &DEBUG);
+  if (g_options.metricsPath != NULL) {
+    metrics_serve(g_options.metricsPath, writeGauges);
+  }
 
-  message_queue_init(&g_messageQueue, MAX_NUM_MESSAGES, MAX_MESSAGE_LENGTH);
+  // Make sure the arena can take at least the longest message.
+  size_t longestMessage = g_messagePool.maxMessageSize + FRAME_MAX_SEQUENCE_LENGTH +
+    FRAME_MAX_HEADER_LENGTH + MAX_ROOM_NAME_LENGTH + 1;
+  g_options.historyArenaSize = g_options.keptLength * HISTORY_BYTES_PER_MESSAGE;
+  if (g_options.keptLength > 0 && g_options.historyArenaSize < longestMessage) {
+    g_options.historyArenaSize = longestMessage;
+  }
 
-  startMessagePropagationThread(clientSockets);
+  if (g_options.logDirectory != NULL) {
+    message_log_open(&g_messageLog, g_options.logDirectory,
+      g_options.logSegmentSize, g_options.maxMessageLength, g_options.logFsyncInterval);
+  }
 
-  listenForClients(socketAddress, clientSockets, MAX_CLIENTS);
+  if (g_options.eventLoop) {
+    // The event loops own every room and send messages themselves, so
+    // there are no room shards or shared client table.
+    if (g_options.maxClients == 0) {
+      g_options.maxClients = MAX_EVENT_LOOP_CLIENTS;
+    }
+    runEventLoop(socketAddress, &inherited);
+  } else {
+    if (g_options.maxClients == 0) {
+      g_options.maxClients = MAX_CLIENTS;
+    }
+    connection_table_init(&clientSockets, sizeof(struct client_socket_t),
+      g_options.maxClients, initClientSocket);
+    startRoomShards();
+    listenForClients(socketAddress, &inherited);
+  }
 
-  message_queue_cleanup(&g_messageQueue);
-  free(clientSockets);
+  message_pool_cleanup(&g_messagePool);
+  connection_table_cleanup(&clientSockets);
   return 0;
 }
 
@@ -242,22 +515,156 @@ Function definitions
 -------------------------------------------------------------------- */
 void parseArguments(
   int argc, char **argv, char **progName,
-  struct sockaddr_in *socketAddress, bool *debug) {
+  struct sockaddr_in *socketAddress, bool *debug,
+  struct server_options_t *options) {
 
   *progName = *(argv++);
 
+  // The last option given that only applies to the event loops.
+  char *eventLoopOnlyOption = NULL;
+
   // Skip the first item, since that points to the executable.
   for (--argc; argc > 0; --argc, ++argv) {
     if (strcmp(*argv, "--debug") == 0) {
       *debug = true;
+    } else if (strcmp(*argv, "--epoll") == 0) {
+      options->eventLoop = true;
+    } else if (strcmp(*argv, "--io-uring") == 0) {
+      options->eventLoop = true;
+      options->ioUring = true;
+    } else if (strcmp(*argv, "--framed") == 0) {
+      options->framed = true;
+    } else if (strcmp(*argv, "--batch") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->propagationBatchSize = parsePositiveOption("--batch", *argv);
+      // Every message in a batch may need its own iovec.
+      if (options->propagationBatchSize > IOV_MAX) {
+        options->propagationBatchSize = IOV_MAX;
+      }
+    } else if (strcmp(*argv, "--room-shards") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->numRoomShards = parsePositiveOption("--room-shards", *argv);
+    } else if (strcmp(*argv, "--workers") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->numWorkers = parsePositiveOption("--workers", *argv);
+    } else if (strcmp(*argv, "--log") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->logDirectory = *argv;
+    } else if (strcmp(*argv, "--log-fsync") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      // 0 syncs after every batch.
+      options->logFsyncInterval = (strcmp(*argv, "0") == 0) ? 0 : parsePositiveOption("--log-fsync", *argv);
+    } else if (strcmp(*argv, "--log-segment") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->logSegmentSize = (size_t)parsePositiveOption("--log-segment", *argv) * 1024 * 1024;
+    } else if (strcmp(*argv, "--max-clients") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->maxClients = parsePositiveOption("--max-clients", *argv);
+    } else if (strcmp(*argv, "--metrics") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->metricsPath = *argv;
+    } else if (strcmp(*argv, "--handoff") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->handoffPath = *argv;
+    } else if (strcmp(*argv, "--history") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->historyLength = parsePositiveOption("--history", *argv);
+    } else if (strcmp(*argv, "--history-seconds") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->historyMaxAge = parsePositiveOption("--history-seconds", *argv) * 1000L;
+      if (options->historyLength == 0) {
+        options->historyLength = DEFAULT_HISTORY_LENGTH;
+      }
+    } else if (strcmp(*argv, "--resync") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->resyncLength = (strcmp(*argv, "0") == 0) ? 0 : parsePositiveOption("--resync", *argv);
+    } else if (strcmp(*argv, "--max-message") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->maxMessageLength = parsePositiveOption("--max-message", *argv);
+    } else if (strcmp(*argv, "--compress-above") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->compressAbove = parsePositiveOption("--compress-above", *argv);
+    } else if (strcmp(*argv, "--rate-limit") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->rateLimit = parsePositiveOption("--rate-limit", *argv);
+    } else if (strcmp(*argv, "--rate-burst") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->rateBurst = parsePositiveOption("--rate-burst", *argv);
+    } else if (strcmp(*argv, "--mute-seconds") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->muteDuration = parsePositiveOption("--mute-seconds", *argv) * 1000L;
+    } else if (strcmp(*argv, "--flood") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      if (strcmp(*argv, "drop") == 0) {
+        options->floodPolicy = FLOOD_DROP;
+      } else if (strcmp(*argv, "mute") == 0) {
+        options->floodPolicy = FLOOD_MUTE;
+      } else if (strcmp(*argv, "disconnect") == 0) {
+        options->floodPolicy = FLOOD_DISCONNECT;
+      } else {
+        fprintf(stderr, "%s: Unknown flood policy '%s'\n", *progName, *argv);
+        displayUsageString();
+        exit(EXIT_ERROR_ARGUMENT);
+      }
+    } else if (strcmp(*argv, "--send-queue") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      options->sendQueueLength = parsePositiveOption("--send-queue", *argv);
+      if (options->sendQueueLength < MIN_SEND_QUEUE_LENGTH) {
+        fprintf(stderr, "%s: --send-queue must be at least %d\n", *progName, MIN_SEND_QUEUE_LENGTH);
+        displayUsageString();
+        exit(EXIT_ERROR_ARGUMENT);
+      }
+      eventLoopOnlyOption = "--send-queue";
+    } else if (strcmp(*argv, "--slow-clients") == 0 && argc > 1) {
+      --argc;
+      ++argv;
+      eventLoopOnlyOption = "--slow-clients";
+      if (strcmp(*argv, "drop") == 0) {
+        options->slowClientPolicy = SLOW_CLIENT_DROP_OLDEST;
+      } else if (strcmp(*argv, "disconnect") == 0) {
+        options->slowClientPolicy = SLOW_CLIENT_DISCONNECT;
+      } else if (strcmp(*argv, "block") == 0) {
+        options->slowClientPolicy = SLOW_CLIENT_BACKPRESSURE;
+      } else {
+        fprintf(stderr, "%s: Unknown slow client policy '%s'\n", *progName, *argv);
+        displayUsageString();
+        exit(EXIT_ERROR_ARGUMENT);
+      }
     } else {
       // This is not a valid option... maybe its an expected argument.
       break;
     }
   }
 
+  // Thread mode writes to every member of a room in turn, blocking on
+  // each, so it has no queue for a slow client policy to act on.
+  if (eventLoopOnlyOption != NULL && !options->eventLoop) {
+    fprintf(stderr, "%s: %s needs --epoll or --io-uring\n", *progName, eventLoopOnlyOption);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+
   // Did the user enter an IP address?
-  if (argc == 3) {
+  if (argc == 2) {
     // User entered a pair of IP port values.
     struct in_addr ipv4Address;
     switch (inet_pton(AF_INET, *argv, &ipv4Address)) {
@@ -322,35 +729,58 @@ void parseArguments(
 
 }
 
+int parsePositiveOption(char *option, char *value) {
+  char *afterValue = value;
+  long parsed = strtol(value, &afterValue, 10);
+  if (*value == '\0' || *afterValue != '\0' || parsed <= 0 || parsed > INT_MAX) {
+    fprintf(stderr, "%s: %s expects a positive number, not '%s'\n", PROG_NAME, option, value);
+    displayUsageString();
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+  return parsed;
+}
+
 void * handleConnection(void *args) {
+  int slot = (int)(intptr_t)args;
+  // The element doesn't move, so it can be used without the lock.
+  struct client_socket_t *client = connection_table_get(&clientSockets, slot);
   // The file descriptor of the remote socket.
-  int *socket = (int *)(args);
+  int *socket = &client->fd;
   if (DEBUG) {
     fprintf(stdout, "Listening on FD: %d\n", *socket);
   }
-  // This is where we will store the remote client's sent message.
-  char messageBuf[256];
-  // This should be the same size as messageBuf's size.
-  const size_t messageBufsize = 256;
-
-  int chars;
-  while ((chars = read(*socket, messageBuf, messageBufsize)) > 0) {
-    if (chars < 0) {
+  if (g_options.metricsPath != NULL) {
+    metrics_register_thread();
+  }
+  struct session_t session;
+  client->session = &session;
+  if (client->handoff != NULL) {
+    // Whatever the client is owed goes out before it is back in any
+    // room, so nothing can get in ahead of it.
+    struct iovec iov = {client->handoff->output, client->handoff->outputLength};
+    if (iov.iov_len > 0 && writevToFile(*socket, &iov, 1) != 0) {
       perror(PROG_NAME);
-      pthread_exit(NULL);
-    }
-    messageBuf[chars] = '\0';
-    if (DEBUG) {
-      fprintf(stderr, "Socket #%d said: '%s'\n", *socket, messageBuf);
     }
-    message_queue_put(&g_messageQueue, messageBuf, *socket);
+    resumeSession(&session, *socket, slot, client->handoff);
+    handoff_client_cleanup(client->handoff);
+    client->handoff = NULL;
+    finishResuming(true);
+  } else {
+    startSession(&session, *socket, slot);
+  }
+  bool handedOff = g_options.framed ? handleFramedConnection(&session) : handleRawConnection(&session);
+  if (handedOff) {
+    __atomic_store_n(&client->parked, true, __ATOMIC_RELEASE);
+    park();
   }
+  // Once this returns, no shard will write to the socket again.
+  endSession(&session);
 
   // ****************************************************************
   // CRITICAL REGION: MODIFYING CLIENT SOCKETS
 
   // Mark this socket as unusable
-  pthread_mutex_lock(&clientSocketMutex);
+  lockClientSockets();
   if (DEBUG) {
     fprintf(stderr, "Closing socket. FD: %d\n", *socket);
   }
@@ -360,92 +790,269 @@ void * handleConnection(void *args) {
     perror(PROG_NAME);
   }
   *socket = 0;
-  pthread_mutex_unlock(&clientSocketMutex);
+  connection_table_remove(&clientSockets, slot);
+  unlockClientSockets();
 
   // CRITICAL REGION: MODIFYING CLIENT SOCKETS
   // ****************************************************************
+  metrics_unregister_thread();
   pthread_exit(NULL);
 }
 
+bool handleRawConnection(struct session_t *session) {
+  while (!__atomic_load_n(&handingOff, __ATOMIC_ACQUIRE)) {
+    // Read straight into a pooled message so that it never has to be
+    // copied on its way to the other clients.
+    struct message_t *message = message_alloc(&g_messagePool);
+    ssize_t chars = read(session->fd, message->data, g_messagePool.maxMessageSize - 1);
+    if (chars < 0 && errno == EINTR) {
+      message_unref(message);
+      continue;
+    }
+    if (chars <= 0) {
+      if (chars < 0) {
+        perror(PROG_NAME);
+      }
+      message_unref(message);
+      return false;
+    }
+    message->data[chars] = '\0';
+    message->length = chars;
+    if (!ingestMessage(session, message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool handleFramedConnection(struct session_t *session) {
+  char *readBuffer = malloc(FRAMED_READ_BUFFER_SIZE);
+  if (readBuffer == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  bool handedOff = false;
+  while (!(handedOff = __atomic_load_n(&handingOff, __ATOMIC_ACQUIRE))) {
+    ssize_t chars = read(session->fd, readBuffer, FRAMED_READ_BUFFER_SIZE);
+    if (chars < 0 && errno == EINTR) {
+      continue;
+    }
+    if (chars <= 0) {
+      if (chars < 0) {
+        perror(PROG_NAME);
+      }
+      break;
+    }
+    if (!ingestFrames(session, readBuffer, chars)) {
+      if (DEBUG) {
+        fprintf(stderr, "Bad frame from socket #%d.\n", session->fd);
+      }
+      break;
+    }
+  }
+  free(readBuffer);
+  return handedOff;
+}
+
+void park() {
+  while (true) {
+    pause();
+  }
+}
+
+void wakeUp(int signal) {
+}
+
 void * propagateMessages(void *args) {
-  int *sockets = (int *)args;
-  int originalSender;
+  struct room_shard_t *shard = (struct room_shard_t *)args;
+  int batchSize = g_options.propagationBatchSize;
+  if (g_options.metricsPath != NULL) {
+    metrics_register_thread();
+  }
 
-  char *message = calloc(MAX_MESSAGE_LENGTH, sizeof(char));
-  if (message == NULL) {
+  struct message_t **messages = calloc(batchSize, sizeof(struct message_t *));
+  struct iovec *iov = calloc(batchSize, sizeof(struct iovec));
+  if (messages == NULL || iov == NULL) {
     perror(PROG_NAME);
     exit(EXIT_ERROR_MEMORY);
   }
 
   while (true) {
-    message_queue_get(&g_messageQueue, message, &originalSender);
-    nullifyTrailingWhitespace(message);
-    // Print out locally so that server can see what is going on.
-    // Maybe can be used to ban foul-mouthed people? :)
-    fprintf(stdout, "%s\n", message);
+    // Take everything that piled up while we were busy, so that each
+    // client gets the whole lot in a single writev.
+    size_t numMessages = mpsc_queue_get_batch(&shard->queue, messages, batchSize);
+
+    // Requests have to be carried out in order, but runs of chat
+    // messages for the same room are sent together.
+    size_t next;
+    for (size_t first = 0; first < numMessages; first = next) {
+      struct message_t *message = messages[first];
+      next = first + 1;
+
+      switch (message->kind) {
+        case MESSAGE_JOIN:
+          if (room_join(&shard->rooms, message->room, message->senderSlot)) {
+            replayHistory(room_table_find(&shard->rooms, message->room), message->senderSlot);
+          }
+          break;
+        case MESSAGE_RESYNC:
+          room_join(&shard->rooms, message->room, message->senderSlot);
+          resync(room_table_find(&shard->rooms, message->room), message);
+          break;
+        case MESSAGE_LEAVE:
+          room_leave(&shard->rooms, message->room, message->senderSlot);
+          break;
+        case MESSAGE_DISCONNECT:
+          room_leave_all(&shard->rooms, message->senderSlot);
+          sem_post(message->forgotten);
+          break;
+        case MESSAGE_BARRIER:
+          sem_post(message->forgotten);
+          break;
+        case MESSAGE_CHAT:
+          while (next < numMessages && messages[next]->kind == MESSAGE_CHAT &&
+            strcmp(messages[next]->room, message->room) == 0) {
+            ++next;
+          }
+          for (size_t i = first; i < next; ++i) {
+            // Print out locally so that server can see what is going on.
+            // Maybe can be used to ban foul-mouthed people? :)
+            fprintf(stdout, "%s\n", messages[i]->data);
+            logMessage(messages[i]);
+          }
+          struct room_t *room = room_table_find(&shard->rooms, message->room);
+          if (room != NULL) {
+            for (size_t i = first; i < next; ++i) {
+              stampSequence(messages[i]);
+            }
+            sendToRoom(room, messages + first, next - first, iov);
+            for (size_t i = first; i < next; ++i) {
+              recordHistory(room, messages[i]);
+            }
+          }
+          break;
+      }
+    }
 
-    // ****************************************************************
-    // CRITICAL REGION: READING CLIENT SOCKETS
+    // Every recipient was sent the same buffers; hand them back.
+    for (size_t i = 0; i < numMessages; ++i) {
+      message_unref(messages[i]);
+    }
+  }
+
+  free(iov);
+  free(messages);
+  pthread_exit(NULL);
+}
+
+void sendToRoom(struct room_t *room, struct message_t **messages, size_t numMessages,
+  struct iovec *iov) {
+  for (size_t i = 0; i < room->numMembers; ++i) {
+    int slot = room->members[i];
+    struct client_socket_t *client = connection_table_get(&clientSockets, slot);
 
-    pthread_mutex_lock(&clientSocketMutex);
-    for (size_t i = 0; i < MAX_CLIENTS; ++i) {
+    bool compression = __atomic_load_n(&client->compression, __ATOMIC_RELAXED);
+    int numIov = 0;
+    size_t numBytes = 0;
+    for (size_t j = 0; j < numMessages; ++j) {
       // Don't send a message back to the same client we received it
       // from
-      if (sockets[i] != 0 && sockets[i] != originalSender) {
-        if (write(sockets[i], message, strlen(message)) < 0) {
-          perror(PROG_NAME);
-        }
+      if (messages[j]->senderSlot != slot) {
+        iov[numIov].iov_base = message_wire(messages[j], compression, &iov[numIov].iov_len);
+        numBytes += iov[numIov].iov_len;
+        ++numIov;
       }
     }
-    pthread_mutex_unlock(&clientSocketMutex);
+    if (numIov == 0) {
+      continue;
+    }
 
-    // CRITICAL REGION: READING CLIENT SOCKETS
-    // ****************************************************************
+    pthread_mutex_lock(&client->writeLock);
+    if (writevToFile(client->fd, iov, numIov) != 0) {
+      perror(PROG_NAME);
+    } else {
+      metrics_add(METRIC_MESSAGES_OUT, numIov);
+      metrics_add(METRIC_BYTES_OUT, numBytes);
+    }
+    pthread_mutex_unlock(&client->writeLock);
   }
-  free(message);
-  pthread_exit(NULL);
 }
 
 
-void listenForClients(struct sockaddr_in socketAddress, int *clientSockets, int numClients) {
+void listenForClients(struct sockaddr_in socketAddress, struct handoff_state_t *inherited) {
   // Used only if we're in server mode. This is where we'll listen for
   // incoming connections.
   if (DEBUG) {
     fputs("Running in server mode.\n", stdout);
   }
-  int serversocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (serversocket < 0) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_SOCKET);
-  }
+  if (inherited->numListeners > 0) {
+    // Only one is needed; event loop workers may have had one each.
+    serverSocket = inherited->listeners[0];
+    for (int i = 1; i < inherited->numListeners; ++i) {
+      close(inherited->listeners[i]);
+    }
+    int flags = fcntl(serverSocket, F_GETFL);
+    if (flags < 0 || fcntl(serverSocket, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+  } else {
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
 
-  socklen_t addrlen = sizeof(socketAddress);
+    socklen_t addrlen = sizeof(socketAddress);
 
-  if (DEBUG) {
-    fputs("Binding to socket.\n", stdout);
+    if (DEBUG) {
+      fputs("Binding to socket.\n", stdout);
+    }
+    if (bind(serverSocket, (struct sockaddr *)(&socketAddress), addrlen) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+
+    if (listen(serverSocket, g_options.maxClients) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
   }
-  if (bind(serversocket, (struct sockaddr *)(&socketAddress), addrlen) != 0) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_SOCKET);
+
+  if (g_options.metricsPath != NULL) {
+    metrics_register_thread();
   }
 
-  if (listen(serversocket, MAX_CLIENTS) != 0) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_SOCKET);
+  numResuming = inherited->numClients;
+  lockClientSockets();
+  for (int i = 0; i < inherited->numClients; ++i) {
+    struct handoff_client_t *client = &inherited->clients[i];
+    // Thread mode reads block.
+    int flags = fcntl(client->fd, F_GETFL);
+    if (flags >= 0) {
+      fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    startReader(client->fd, client);
   }
+  unlockClientSockets();
+
+  listenerThread = pthread_self();
+  listenForHandoff();
 
   struct sockaddr remoteAddress;
   socklen_t remoteAddrLen = sizeof(remoteAddress);
 
-  int *nextSocket = clientSockets;
-  int *afterLastSocket = clientSockets + MAX_CLIENTS;
-
-  pthread_t threadId;
-  int pthreadErrno;
-
   while (true) {
-    int acceptedSocket = accept(serversocket, &remoteAddress, &remoteAddrLen);
+    int acceptedSocket = accept(serverSocket, &remoteAddress, &remoteAddrLen);
     if (acceptedSocket < 0) {
+      if (errno == EINTR) {
+        if (__atomic_load_n(&handingOff, __ATOMIC_ACQUIRE)) {
+          __atomic_store_n(&listenerParked, true, __ATOMIC_RELEASE);
+          park();
+        }
+        continue;
+      }
       perror(PROG_NAME);
       exit(EXIT_ERROR_SOCKET);
     }
@@ -456,24 +1063,9 @@ void listenForClients(struct sockaddr_in socketAddress, int *clientSockets, int
     // ****************************************************************
     // CRITICAL REGION: MODIFYING CLIENT SOCKETS
 
-    pthread_mutex_lock(&clientSocketMutex);
-    if ((nextSocket = getNextUnusedSocket(clientSockets, afterLastSocket)) == NULL) {
-      // We couldn't find an open slot... reject this client.
-      if (DEBUG) {
-        fprintf(stderr, "No more free slots.\n");
-      }
-      close(acceptedSocket);
-    } else {
-      // An open socket was found!
-      if ((pthreadErrno = pthread_create(&threadId, NULL, handleConnection, (void *)(nextSocket))) != 0) {
-        fputs("Could not create new thread to handle request.", stderr);
-      } else {
-        // Everything is successful, let's add it to the active clients
-        // list and wait for the next client.
-        *nextSocket = acceptedSocket;
-      }
-    }
-    pthread_mutex_unlock(&clientSocketMutex);
+    lockClientSockets();
+    startReader(acceptedSocket, NULL);
+    unlockClientSockets();
 
     // END CRITICAL REGION: MODIFYING CLIENT SOCKETS
     // ****************************************************************
@@ -481,7 +1073,57 @@ void listenForClients(struct sockaddr_in socketAddress, int *clientSockets, int
   }
 
   // Got a connection, exit.
-  close(serversocket);
+  close(serverSocket);
+}
+
+void startReader(int fd, struct handoff_client_t *handoff) {
+  int slot = connection_table_add(&clientSockets);
+  if (slot < 0) {
+    // Already serving as many clients as we may... reject this client.
+    if (DEBUG) {
+      fprintf(stderr, "No more free slots.\n");
+    }
+    close(fd);
+    if (handoff != NULL) {
+      handoff_client_cleanup(handoff);
+      finishResuming(false);
+    }
+    return;
+  }
+
+  // Fill the slot in before the thread starts, since the thread reads
+  // it straight away.
+  struct client_socket_t *client = connection_table_get(&clientSockets, slot);
+  client->fd = fd;
+  client->compression = false;
+  client->session = NULL;
+  client->handoff = handoff;
+  client->parked = false;
+  int pthreadErrno;
+  if ((pthreadErrno = pthread_create(&client->thread, NULL, handleConnection, (void *)(intptr_t)slot)) != 0) {
+    fputs("Could not create new thread to handle request.", stderr);
+    client->fd = 0;
+    connection_table_remove(&clientSockets, slot);
+    close(fd);
+    if (handoff != NULL) {
+      handoff_client_cleanup(handoff);
+      finishResuming(false);
+    }
+  } else {
+    // Nobody waits for the thread; let it clean up after itself.
+    pthread_detach(client->thread);
+  }
+}
+
+void finishResuming(bool wait) {
+  pthread_mutex_lock(&resumingMutex);
+  if (--numResuming == 0) {
+    pthread_cond_broadcast(&allResumed);
+  }
+  while (wait && numResuming > 0) {
+    pthread_cond_wait(&allResumed, &resumingMutex);
+  }
+  pthread_mutex_unlock(&resumingMutex);
 }
 
 int writeToFile(int file, char *message, size_t chars) {
@@ -494,6 +1136,57 @@ int writeToFile(int file, char *message, size_t chars) {
   return 0;
 }
 
+void replayHistory(struct room_t *room, int slot) {
+  struct iovec iov[HISTORY_MAX_IOV];
+  writeReplay(slot, iov, gatherHistory(room, iov));
+}
+
+void resync(struct room_t *room, struct message_t *request) {
+  struct iovec iov[RESYNC_MAX_IOV];
+  writeReplay(request->senderSlot, iov, gatherResync(room, request, iov));
+}
+
+void writeReplay(int slot, struct iovec *iov, int numIov) {
+  if (numIov == 0) {
+    return;
+  }
+  size_t numBytes = 0;
+  for (int i = 0; i < numIov; ++i) {
+    numBytes += iov[i].iov_len;
+  }
+  struct client_socket_t *client = connection_table_get(&clientSockets, slot);
+  pthread_mutex_lock(&client->writeLock);
+  if (writevToFile(client->fd, iov, numIov) != 0) {
+    perror(PROG_NAME);
+  } else {
+    metrics_add(METRIC_BYTES_OUT, numBytes);
+  }
+  pthread_mutex_unlock(&client->writeLock);
+}
+
+int writevToFile(int file, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t bytesWritten = writev(file, iov, iovcnt);
+    if (bytesWritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    // Skip past whatever was written, and retry the rest.
+    while (iovcnt > 0 && (size_t)bytesWritten >= iov->iov_len) {
+      bytesWritten -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytesWritten;
+      iov->iov_len -= bytesWritten;
+    }
+  }
+  return 0;
+}
+
 void connectToServer(struct sockaddr_in *socketAddress, int *remotesocket) {
   // Used only if we're in client mode. Connect to the remote server.
   if (DEBUG) {
@@ -532,127 +1225,630 @@ void closeRemoteConnection() {
 
 void displayUsageString() {
   fputs("Usage:\n\
-    server [--debug] [interface] port\n", stdout);
+    server [--debug] [--framed [--max-message bytes] [--compress-above bytes]\n\
+      [--resync messages]] [--batch messages] [--room-shards count]\n\
+      [--history messages] [--history-seconds seconds]\n\
+      [--log directory [--log-fsync ms] [--log-segment MB]]\n\
+      [--metrics socket-path] [--handoff socket-path] [--max-clients count]\n\
+      [--rate-limit messages/s [--rate-burst messages]\n\
+      [--flood drop|mute|disconnect] [--mute-seconds seconds]]\n\
+      [--epoll | --io-uring [--workers count] [--send-queue length]\n\
+      [--slow-clients drop|disconnect|block]] [interface] port\n", stdout);
 }
 
-int *getNextUnusedSocket(int *begin, int *end) {
-  for (; begin != end; ++begin) {
-    if (*begin == 0) {
-      return begin;
-    }
+void initClientSocket(void *element) {
+  struct client_socket_t *client = element;
+  if (pthread_mutex_init(&client->writeLock, NULL) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
   }
-  return NULL;
 }
 
 
-void startMessagePropagationThread(int *clientSockets) {
-  pthread_t threadId;
-  int pthreadErrno;
+void startRoomShards() {
+  if (g_options.numRoomShards == 0) {
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    g_options.numRoomShards = (numCpus > 0) ? numCpus : 1;
+  }
 
   if (DEBUG) {
-    fprintf(stderr, "Starting message propagation thread.\n");
+    fprintf(stderr, "Starting %d room shard(s).\n", g_options.numRoomShards);
+  }
+  g_roomShards = calloc(g_options.numRoomShards, sizeof(struct room_shard_t));
+  if (g_roomShards == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
   }
-  if ((pthreadErrno = pthread_create(&threadId, NULL, propagateMessages, (void *)(clientSockets))) != 0) {
-    perror("PROG_NAME");
-    exit(EXIT_ERROR_THREAD);
+
+  for (int i = 0; i < g_options.numRoomShards; ++i) {
+    struct room_shard_t *shard = &g_roomShards[i];
+    mpsc_queue_init(&shard->queue, MAX_NUM_MESSAGES);
+    room_table_init(&shard->rooms, ROOM_TABLE_BUCKETS,
+      g_options.keptLength, g_options.historyArenaSize);
+    if (pthread_create(&shard->thread, NULL, propagateMessages, (void *)shard) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_THREAD);
+    }
   }
 }
 
+void startSession(struct session_t *session, int fd, int slot) {
+  initSession(session, fd, slot);
+  sendRoomRequest(session, MESSAGE_JOIN, FRAME_DEFAULT_ROOM, 0);
+}
 
-void message_queue_init(struct message_queue_t *messageQueue, size_t bufferSize, size_t messageSize) {
-  if (pthread_mutex_init(&messageQueue->lock, NULL) != 0) {
+void resumeSession(struct session_t *session, int fd, int slot, struct handoff_client_t *handoff) {
+  initSession(session, fd, slot);
+  if (handoff->compression) {
+    acceptFeatures(session, FRAME_FEATURE_DEFLATE);
+  }
+  const char *end = handoff->rooms + handoff->roomsLength;
+  for (const char *room = handoff->rooms; room != NULL && room < end; room += strlen(room) + 1) {
+    sendRoomRequest(session, MESSAGE_JOIN, room, 0);
+  }
+  // Joining moved the client's messages to the last room.
+  strcpy(session->room, handoff->room);
+  if (handoff->inputLength > 0 && !ingestFrames(session, handoff->input, handoff->inputLength)) {
+    // It was fine when the old server read it.
     perror(PROG_NAME);
-    exit(EXIT_ERROR_LOCK);
   }
+}
 
-  messageQueue->messages = calloc(bufferSize, sizeof(char *));
-  if (messageQueue->messages == NULL) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_MEMORY);
+void initSession(struct session_t *session, int fd, int slot) {
+  // Chat messages are small and go out as soon as they arrive, so don't
+  // let Nagle's algorithm hold them back waiting for an ACK.  This
+  // covers every way a client comes in: accepted in any mode, or taken
+  // over from another server.
+  int noDelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  session->fd = fd;
+  session->slot = slot;
+  session->room[0] = '\0';
+  session->partialMessage = NULL;
+  session->compression = false;
+  if (g_options.rateLimit > 0) {
+    rate_limit_init(&session->rateLimit, g_options.rateBurst);
   }
+  metrics_add(METRIC_CLIENTS_CONNECTED, 1);
+}
 
-  messageQueue->senders = calloc(bufferSize, sizeof(int));
-  if (messageQueue->senders == NULL) {
-    perror(PROG_NAME);
-    exit(EXIT_ERROR_MEMORY);
+void saveSession(struct session_t *session, struct handoff_client_t *handoff) {
+  handoff->compression = session->compression;
+  strcpy(handoff->room, session->room);
+  if (session->partialMessage != NULL) {
+    char header[FRAME_MAX_HEADER_LENGTH];
+    size_t headerLength = frame_parser_encode_partial(&session->parser, header);
+    handoff_add_input(handoff, header, headerLength);
+    handoff_add_input(handoff, session->parser.payload, session->parser.received);
+  }
+}
+
+static void saveRoomMembers(struct room_t *room, void *context) {
+  struct room_saver_t *saver = context;
+  for (size_t i = 0; i < room->numMembers; ++i) {
+    handoff_add_room(&saver->state->clients[saver->indices[room->members[i]]], room->name);
   }
+}
+
+void saveRooms(struct room_table_t *rooms, struct handoff_state_t *state, int *indices) {
+  struct room_saver_t saver = {state, indices};
+  room_table_for_each(rooms, saveRoomMembers, &saver);
+}
 
-  for (size_t i = 0; i < bufferSize - 1; ++i) {
-    char *message = calloc(messageSize, sizeof(char));
-    if (message == NULL) {
+void listenForHandoff() {
+  if (g_options.handoffPath == NULL) {
+    return;
+  }
+  if (!g_options.eventLoop) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wakeUp;
+    sigemptyset(&action.sa_mask);
+    // No SA_RESTART, so that read and accept give up with EINTR.
+    action.sa_flags = 0;
+    if (sigaction(HANDOFF_SIGNAL, &action, NULL) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_ARGUMENT);
+    }
+  }
+  handoff_listen(g_options.handoffPath, g_options.framed, handOffClients);
+}
+
+void handOffClients(struct handoff_state_t *state) {
+  __atomic_store_n(&handingOff, true, __ATOMIC_SEQ_CST);
+
+  if (g_options.eventLoop) {
+    eventLoopHandOff(state);
+  } else {
+    stopReaders();
+
+    // Let every shard send what the readers gave it.  They are idle from
+    // then on, so their rooms can be read from here.
+    struct message_t *barrier = message_alloc(&g_messagePool);
+    barrier->kind = MESSAGE_BARRIER;
+    broadcastToShards(barrier);
+
+    handoff_add_listener(state, serverSocket);
+    int *indices = calloc(clientSockets.numSlots, sizeof(int));
+    if (indices == NULL) {
       perror(PROG_NAME);
       exit(EXIT_ERROR_MEMORY);
     }
-    messageQueue->messages[i] = message;
+    for (int i = 0; i < clientSockets.numActive; ++i) {
+      int slot = clientSockets.active[i];
+      struct client_socket_t *client = connection_table_get(&clientSockets, slot);
+      indices[slot] = state->numClients;
+      saveSession(client->session, handoff_add_client(state, client->fd));
+    }
+    for (int i = 0; i < g_options.numRoomShards; ++i) {
+      saveRooms(&g_roomShards[i].rooms, state, indices);
+    }
+    free(indices);
   }
-  messageQueue->pushOffset = 0;
-  messageQueue->popOffset = 0;
 
-  messageQueue->maxMessageSize = messageSize;
-  messageQueue->maxNumMessages = bufferSize;
+  // Nothing more will be logged, and the new server opens the log once
+  // we are gone.
+  if (g_options.logDirectory != NULL) {
+    message_log_close(&g_messageLog);
+  }
+}
 
+void stopReaders() {
+  while (true) {
+    bool waiting = false;
+    if (!__atomic_load_n(&listenerParked, __ATOMIC_ACQUIRE)) {
+      pthread_kill(listenerThread, HANDOFF_SIGNAL);
+      waiting = true;
+    }
+    // Readers that are on their way out take their slot back under the
+    // lock, so every thread signalled here is still running.
+    lockClientSockets();
+    for (int i = 0; i < clientSockets.numActive; ++i) {
+      struct client_socket_t *client = connection_table_get(&clientSockets, clientSockets.active[i]);
+      if (!__atomic_load_n(&client->parked, __ATOMIC_ACQUIRE)) {
+        pthread_kill(client->thread, HANDOFF_SIGNAL);
+        waiting = true;
+      }
+    }
+    unlockClientSockets();
+    if (!waiting) {
+      return;
+    }
+    usleep(HANDOFF_POLL_MICROS);
+  }
 }
 
-void message_queue_cleanup(struct message_queue_t *messageQueue) {
-  if (pthread_mutex_destroy(&messageQueue->lock) != 0) {
+void raiseFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
     perror(PROG_NAME);
-    exit(EXIT_ERROR_LOCK);
   }
-  // Free up all the individual messages first...
-  for (; *messageQueue->messages != NULL; ++messageQueue->messages) {
-    free(*messageQueue->messages);
+  if (DEBUG) {
+    fprintf(stdout, "Open file limit: %lu\n", (unsigned long)limit.rlim_cur);
   }
-  free(messageQueue->messages);
-  free(messageQueue->senders);
 }
 
-void message_queue_put(struct message_queue_t *messageQueue, char *message, int sender) {
-  pthread_mutex_lock(&messageQueue->lock);
+void endSession(struct session_t *session) {
+  metrics_add(METRIC_CLIENTS_DISCONNECTED, 1);
+  if (session->partialMessage != NULL) {
+    message_unref(session->partialMessage);
+    session->partialMessage = NULL;
+  }
+  if (session->compression) {
+    __atomic_sub_fetch(&numCompressingClients, 1, __ATOMIC_RELAXED);
+  }
 
-  // Is there space to write to?
-  while (messageQueue->pushOffset + 1 == messageQueue->popOffset) {
-  // while (messageQueue->nextMessageSlot + 1 == messageQueue->nextMessageToRead) {
-    pthread_mutex_unlock(&messageQueue->lock);
-    pthread_yield();
+  struct message_t *message = message_alloc(&g_messagePool);
+  message->kind = MESSAGE_DISCONNECT;
+  message->sender = session->fd;
+  message->senderSlot = session->slot;
 
-    // Try again!
-    pthread_mutex_lock(&messageQueue->lock);
+  if (g_options.eventLoop) {
+    deliverMessage(message);
+    return;
   }
-  if (!strncpy(messageQueue->messages[messageQueue->pushOffset], message,
-    messageQueue->maxMessageSize)) {
+
+  // The client may be in rooms on any shard, so they all have to hear
+  // about it, and we have to wait until they all have.
+  broadcastToShards(message);
+}
+
+void broadcastToShards(struct message_t *message) {
+  sem_t forgotten;
+  if (sem_init(&forgotten, 0, 0) != 0) {
     perror(PROG_NAME);
+    exit(EXIT_ERROR_LOCK);
+  }
+  message->forgotten = &forgotten;
+  for (int i = 0; i < g_options.numRoomShards; ++i) {
+    message_ref(message);
+    mpsc_queue_put(&g_roomShards[i].queue, message);
   }
-  messageQueue->senders[messageQueue->pushOffset] = sender;
-  // Go back to the front if we hit the end
-  messageQueue->pushOffset =
-    (messageQueue->pushOffset + 1) % messageQueue->maxNumMessages;
-  pthread_mutex_unlock(&messageQueue->lock);
+  message_unref(message);
+
+  for (int i = 0; i < g_options.numRoomShards; ++i) {
+    while (sem_wait(&forgotten) != 0) {
+      // Interrupted; try again.
+    }
+  }
+  sem_destroy(&forgotten);
 }
 
-void message_queue_get(struct message_queue_t *messageQueue, char *message, int *sender) {
-  pthread_mutex_lock(&messageQueue->lock);
+void deliverMessage(struct message_t *message) {
+  if (g_options.eventLoop) {
+    routeMessage(message);
+  } else {
+    struct room_shard_t *shard = &g_roomShards[room_hash(message->room) % g_options.numRoomShards];
+    mpsc_queue_put(&shard->queue, message);
+  }
+}
 
-  // Is there anything to get?
-  while (messageQueue->popOffset == messageQueue->pushOffset) {
-    pthread_mutex_unlock(&messageQueue->lock);
-    pthread_yield();
+void sendRoomRequest(struct session_t *session, enum MESSAGE_KIND_T kind, const char *room,
+  uint64_t since) {
+  if (DEBUG) {
+    fprintf(stderr, "Socket #%d %s room '%s'\n", session->fd,
+      (kind == MESSAGE_JOIN) ? "joined" : (kind == MESSAGE_LEAVE) ? "left" : "resynced", room);
+  }
+  struct message_t *message = message_alloc(&g_messagePool);
+  message->kind = kind;
+  message->sender = session->fd;
+  message->senderSlot = session->slot;
+  strncpy(message->room, room, MAX_ROOM_NAME_LENGTH);
+  message->room[MAX_ROOM_NAME_LENGTH] = '\0';
+
+  if (kind == MESSAGE_RESYNC) {
+    // The answer that goes out after whatever is resent.
+    message->sequence = since;
+    size_t roomLength = strlen(message->room);
+    size_t headerLength = frame_encode_header(message->data, FRAME_RESYNC, roomLength);
+    memcpy(message->data + headerLength, message->room, roomLength);
+    message->wireLength = headerLength + roomLength;
+  }
 
-    // Try again!
-    pthread_mutex_lock(&messageQueue->lock);
+  if (kind == MESSAGE_JOIN || kind == MESSAGE_RESYNC) {
+    // Messages go to the room joined last.
+    strcpy(session->room, message->room);
+  } else if (strcmp(session->room, message->room) == 0) {
+    session->room[0] = '\0';
   }
+  deliverMessage(message);
+}
 
-  if (!strncpy(message, messageQueue->messages[messageQueue->popOffset],
-    messageQueue->maxMessageSize)) {
+bool withinRateLimit(struct session_t *session) {
+  if (g_options.rateLimit == 0) {
+    return true;
+  }
+  struct rate_limit_t *limit = &session->rateLimit;
+  long now = rate_limit_now();
+  if (now < limit->mutedUntil) {
+    metrics_add(METRIC_RATE_LIMITED_MESSAGES, 1);
+    return false;
+  }
+  if (rate_limit_take(limit, g_options.rateLimit, g_options.rateBurst, now)) {
+    return true;
+  }
+
+  metrics_add(METRIC_RATE_LIMITED_MESSAGES, 1);
+  if (g_options.floodPolicy == FLOOD_MUTE) {
+    if (DEBUG) {
+      fprintf(stderr, "Muting socket #%d for flooding.\n", session->fd);
+    }
+    limit->mutedUntil = now + g_options.muteDuration;
+    metrics_add(METRIC_CLIENTS_MUTED, 1);
+  } else if (g_options.floodPolicy == FLOOD_DISCONNECT) {
+    if (DEBUG) {
+      fprintf(stderr, "Disconnecting socket #%d for flooding.\n", session->fd);
+    }
+    metrics_add(METRIC_FLOODING_CLIENTS_DISCONNECTED, 1);
+  }
+  return false;
+}
+
+bool ingestMessage(struct session_t *session, struct message_t *message) {
+  if (DEBUG) {
+    fprintf(stderr, "Socket #%d said: '%s'\n", session->fd, message->data);
+  }
+  metrics_add(METRIC_MESSAGES_IN, 1);
+  metrics_add(METRIC_BYTES_IN, message->length);
+  if (!withinRateLimit(session)) {
+    message_unref(message);
+    return g_options.floodPolicy != FLOOD_DISCONNECT;
+  }
+  if (session->room[0] == '\0') {
+    // Not in a room, so there is nobody to send it to.
+    message_unref(message);
+    return true;
+  }
+  message->kind = MESSAGE_CHAT;
+  message->sender = session->fd;
+  message->senderSlot = session->slot;
+  strcpy(message->room, session->room);
+
+  if (g_options.framed) {
+    // Frames arrive exactly as they were sent, so they are passed on as
+    // they are.  The header and the room name go right in front of
+    // data.
+    size_t roomLength = strlen(message->room) + 1;
+    char header[FRAME_MAX_HEADER_LENGTH];
+    size_t headerLength = frame_encode_header(header, FRAME_ROOM_MESSAGE,
+      roomLength + message->length);
+    message->wire = message->data - roomLength - headerLength;
+    memcpy(message->wire, header, headerLength);
+    memcpy(message->wire + headerLength, message->room, roomLength);
+    message->wireLength = headerLength + roomLength + message->length;
+
+    if (message->length >= g_options.compressAbove &&
+      __atomic_load_n(&numCompressingClients, __ATOMIC_RELAXED) > 0) {
+      compressMessage(message);
+    }
+  } else {
+    nullifyTrailingWhitespace(message->data);
+    message->length = strlen(message->data);
+    message->wire = message->data;
+    message->wireLength = message->length;
+  }
+  deliverMessage(message);
+  return true;
+}
+
+bool ingestFrames(struct session_t *session, const char *data, size_t length) {
+  struct frame_parser_t *parser = &session->parser;
+
+  while (length > 0) {
+    if (session->partialMessage == NULL) {
+      session->partialMessage = message_alloc(&g_messagePool);
+      resetParser(session, session->partialMessage);
+    }
+    struct message_t *message = session->partialMessage;
+
+    size_t consumed;
+    enum FRAME_RESULT_T result = frame_parse(parser, data, length, &consumed);
+    data += consumed;
+    length -= consumed;
+
+    if (result == FRAME_ERROR) {
+      return false;
+    }
+    if (result == FRAME_NEEDS_BUFFER) {
+      // Too long for the pool; give this one a buffer of its own.
+      message_unref(message);
+      message = message_alloc_large(&g_messagePool, parser->length + 1);
+      session->partialMessage = message;
+      frame_parser_move(parser, message->data, parser->length);
+      continue;
+    }
+    if (result != FRAME_COMPLETE) {
+      continue;
+    }
+
+    message->data[parser->length] = '\0';
+    message->length = parser->length;
+    if (parser->type == FRAME_MESSAGE) {
+      session->partialMessage = NULL;
+      if (!ingestMessage(session, message)) {
+        return false;
+      }
+      continue;
+    }
+
+    if (parser->type == FRAME_JOIN || parser->type == FRAME_LEAVE) {
+      // Joins and leaves cost the shards as much as messages do.
+      if (!withinRateLimit(session)) {
+        if (g_options.floodPolicy == FLOOD_DISCONNECT) {
+          return false;
+        }
+      } else if (room_is_valid_name(message->data, message->length)) {
+        sendRoomRequest(session, (parser->type == FRAME_JOIN) ? MESSAGE_JOIN : MESSAGE_LEAVE,
+          message->data, 0);
+      } else if (DEBUG) {
+        fprintf(stderr, "Socket #%d sent an invalid room name.\n", session->fd);
+      }
+    } else if (parser->type == FRAME_RESYNC) {
+      if (withinRateLimit(session)) {
+        ingestResync(session, message);
+      } else if (g_options.floodPolicy == FLOOD_DISCONNECT) {
+        return false;
+      }
+    } else if (parser->type == FRAME_HELLO) {
+      acceptFeatures(session, message->data);
+    }
+    if (message->large) {
+      // Only chat messages need the room.
+      message_unref(message);
+      session->partialMessage = NULL;
+      continue;
+    }
+    // Nothing was ingested, so reuse the buffer for the next frame.
+    resetParser(session, message);
+  }
+
+  // A client that is between frames goes back to holding no buffer at
+  // all, since most connections sit idle most of the time.
+  if (session->partialMessage != NULL && frame_parser_is_idle(parser)) {
+    message_unref(session->partialMessage);
+    session->partialMessage = NULL;
+  }
+  return true;
+}
+
+void ingestResync(struct session_t *session, struct message_t *message) {
+  uint64_t since;
+  size_t sinceLength = frame_decode_varint(message->data, message->length, &since);
+  const char *room = message->data + sinceLength;
+  if (sinceLength == 0 || !room_is_valid_name(room, message->length - sinceLength)) {
+    if (DEBUG) {
+      fprintf(stderr, "Socket #%d sent an invalid resync.\n", session->fd);
+    }
+    return;
+  }
+  sendRoomRequest(session, MESSAGE_RESYNC, room, since);
+}
+
+void acceptFeatures(struct session_t *session, const char *features) {
+  size_t length = strlen(FRAME_FEATURE_DEFLATE);
+  for (const char *feature = features; *feature != '\0'; ) {
+    size_t featureLength = strcspn(feature, " ");
+    if (featureLength == length && strncmp(feature, FRAME_FEATURE_DEFLATE, length) == 0 &&
+      !session->compression) {
+      session->compression = true;
+      __atomic_add_fetch(&numCompressingClients, 1, __ATOMIC_RELAXED);
+      if (!g_options.eventLoop) {
+        struct client_socket_t *client = connection_table_get(&clientSockets, session->slot);
+        __atomic_store_n(&client->compression, true, __ATOMIC_RELAXED);
+      }
+    }
+    feature += featureLength;
+    feature += strspn(feature, " ");
+  }
+  if (DEBUG) {
+    fprintf(stderr, "Socket #%d said hello: '%s'\n", session->fd, features);
+  }
+}
+
+void resetParser(struct session_t *session, struct message_t *message) {
+  // Leave room for the null terminator.
+  frame_parser_reset(&session->parser, message->data, g_messagePool.maxMessageSize - 1);
+  frame_parser_set_limit(&session->parser, g_options.maxMessageLength);
+}
+
+void compressMessage(struct message_t *message) {
+  // The room name goes in front of the compressed message as it is, and
+  // the header in front of that once the length is known, leaving room
+  // for stampSequence.
+  size_t roomLength = strlen(message->room) + 1;
+  uLongf compressedLength = compressBound(message->length);
+  size_t prefixLength = FRAME_MAX_SEQUENCE_LENGTH + FRAME_MAX_HEADER_LENGTH;
+  char *buffer = malloc(prefixLength + roomLength + compressedLength);
+  if (buffer == NULL) {
     perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  char *room = buffer + prefixLength;
+  memcpy(room, message->room, roomLength);
+  if (compress2((Bytef *)room + roomLength, &compressedLength,
+    (const Bytef *)message->data, message->length, COMPRESSION_LEVEL) != Z_OK) {
+    free(buffer);
+    return;
+  }
+
+  char header[FRAME_MAX_HEADER_LENGTH];
+  size_t headerLength = frame_encode_header(header, FRAME_ROOM_MESSAGE_DEFLATE,
+    roomLength + compressedLength);
+  size_t wireLength = headerLength + roomLength + compressedLength;
+  if (wireLength >= message->wireLength) {
+    // Not worth it.
+    free(buffer);
+    return;
+  }
+  message->compressedBuffer = buffer;
+  message->compressedWire = room - headerLength;
+  memcpy(message->compressedWire, header, headerLength);
+  message->compressedWireLength = wireLength;
+  metrics_add(METRIC_MESSAGES_COMPRESSED, 1);
+  metrics_add(METRIC_COMPRESSED_BYTES_SAVED, message->wireLength - wireLength);
+}
+
+void lockClientSockets() {
+  pthread_mutex_lock(&clientSocketMutex);
+  if (t_metrics != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &clientSocketsLockedAt);
+  }
+}
+
+void unlockClientSockets() {
+  if (t_metrics != NULL) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metrics_add(METRIC_SOCKET_MUTEX_ACQUISITIONS, 1);
+    metrics_add(METRIC_SOCKET_MUTEX_HOLD_NANOS,
+      (now.tv_sec - clientSocketsLockedAt.tv_sec) * 1000000000L +
+      (now.tv_nsec - clientSocketsLockedAt.tv_nsec));
+  }
+  pthread_mutex_unlock(&clientSocketMutex);
+}
+
+void writeGauges(FILE *out) {
+  if (!g_options.eventLoop && g_roomShards != NULL) {
+    fputs("# HELP chat_room_shard_queue_depth Messages waiting for a room shard.\n"
+      "# TYPE chat_room_shard_queue_depth gauge\n", out);
+    for (int i = 0; i < g_options.numRoomShards; ++i) {
+      fprintf(out, "chat_room_shard_queue_depth{shard=\"%d\"} %zu\n",
+        i, mpsc_queue_depth(&g_roomShards[i].queue));
+    }
+  }
+  if (g_options.eventLoop) {
+    fputs("# HELP chat_worker_inbox_depth Messages waiting in an event loop worker's inbox.\n"
+      "# TYPE chat_worker_inbox_depth gauge\n", out);
+    for (int i = 0; i < g_options.numWorkers; ++i) {
+      fprintf(out, "chat_worker_inbox_depth{worker=\"%d\"} %zu\n", i, eventLoopInboxDepth(i));
+    }
   }
+  if (g_options.logDirectory != NULL) {
+    fprintf(out, "# HELP chat_log_queue_depth Messages waiting to be written to the message log.\n"
+      "# TYPE chat_log_queue_depth gauge\n"
+      "chat_log_queue_depth %zu\n"
+      "# HELP chat_log_dropped_records_total Messages left out of the log because it was behind.\n"
+      "# TYPE chat_log_dropped_records_total counter\n"
+      "chat_log_dropped_records_total %lu\n",
+      mpsc_queue_depth(&g_messageLog.queue),
+      __atomic_load_n(&g_messageLog.droppedRecords, __ATOMIC_RELAXED));
+  }
+}
+
+void logMessage(struct message_t *message) {
+  if (g_options.logDirectory == NULL) {
+    return;
+  }
+  if (!message_log_append(&g_messageLog, message) && DEBUG) {
+    fputs("Message log is behind; dropped a record.\n", stderr);
+  }
+}
 
-  *sender = messageQueue->senders[messageQueue->popOffset];
+void recordHistory(struct room_t *room, struct message_t *message) {
+  struct iovec parts[2];
+  parts[0].iov_base = message->wire;
+  parts[0].iov_len = message->wireLength;
+  // Raw messages go out without anything between them, which is fine
+  // one write at a time but not when the history is replayed in one go.
+  parts[1].iov_base = "\n";
+  parts[1].iov_len = 1;
+  history_append(&room->history, parts, g_options.framed ? 1 : 2, message->sequence);
+}
+
+int gatherHistory(struct room_t *room, struct iovec *iov) {
+  return history_gather(&room->history, g_options.historyLength, g_options.historyMaxAge, iov);
+}
 
-  // Advance to the next message
-  // If we're at the last index, go back to the front of the queue.
-  messageQueue->popOffset = (messageQueue->popOffset + 1) % messageQueue->maxNumMessages;
+int gatherResync(struct room_t *room, struct message_t *request, struct iovec *iov) {
+  int numIov = history_gather_since(&room->history, g_options.resyncLength, request->sequence, iov);
+  iov[numIov].iov_base = request->wire;
+  iov[numIov].iov_len = request->wireLength;
+  return numIov + 1;
+}
 
-  pthread_mutex_unlock(&messageQueue->lock);
+void stampSequence(struct message_t *message) {
+  if (!g_options.framed) {
+    return;
+  }
+  message->sequence = __atomic_add_fetch(&lastSequence, 1, __ATOMIC_RELAXED);
+  char frame[FRAME_MAX_SEQUENCE_LENGTH];
+  size_t frameLength = frame_encode_sequence(frame, message->sequence);
+
+  // Both wire frames were built with room for this in front.
+  message->wire -= frameLength;
+  memcpy(message->wire, frame, frameLength);
+  message->wireLength += frameLength;
+  if (message->compressedWire != NULL) {
+    message->compressedWire -= frameLength;
+    memcpy(message->compressedWire, frame, frameLength);
+    message->compressedWireLength += frameLength;
+  }
 }
 
 void nullifyTrailingWhitespace(char *string) {
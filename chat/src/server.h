@@ -0,0 +1,346 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Declarations shared between the chat server's source files.
+
+*/
+
+#ifndef CHAT_SERVER_H
+#define CHAT_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "connection_table.h"
+#include "frame.h"
+#include "handoff.h"
+#include "message.h"
+#include "message_log.h"
+#include "mpsc_queue.h"
+#include "rate_limit.h"
+#include "room.h"
+
+extern char *PROG_NAME;
+extern bool DEBUG;
+
+// How many clients are served at once by default in thread mode.
+extern const int MAX_CLIENTS;
+extern const int MAX_NUM_MESSAGES;
+extern const int MAX_MESSAGE_LENGTH;
+extern const size_t MAX_LARGE_MESSAGE_LENGTH;
+extern const int ROOM_TABLE_BUCKETS;
+
+// The set of valid exit values.
+enum EXIT_T {
+  EXIT_NORMAL = 0,
+  EXIT_ERROR_ARGUMENT,
+  EXIT_ERROR_SOCKET,
+  EXIT_ERROR_MEMORY,
+  EXIT_ERROR_IO,
+  EXIT_ERROR_THREAD,
+  EXIT_ERROR_LOCK,
+};
+
+// What the event loop does with a client whose send queue is full.
+enum SLOW_CLIENT_POLICY_T {
+  // Throw away the oldest message that hasn't been sent yet.
+  SLOW_CLIENT_DROP_OLDEST,
+  // Close the client's connection.
+  SLOW_CLIENT_DISCONNECT,
+  // Stop reading from every client until the slow one catches up.
+  SLOW_CLIENT_BACKPRESSURE,
+};
+
+// What happens to a client that sends faster than its rate limit.
+enum FLOOD_POLICY_T {
+  // Throw away each message over the limit.
+  FLOOD_DROP,
+  // Throw away everything it sends for a while.
+  FLOOD_MUTE,
+  // Close the client's connection.
+  FLOOD_DISCONNECT,
+};
+
+// Settings chosen on the command line.
+struct server_options_t {
+  // Serve clients from an epoll event loop instead of a thread each.
+  bool eventLoop;
+  // Have the event loop do its socket I/O through io_uring, if the
+  // kernel allows it, rather than epoll.
+  bool ioUring;
+
+  // How many clients may be connected at once.  Unless given on the
+  // command line, main picks MAX_CLIENTS or MAX_EVENT_LOOP_CLIENTS
+  // depending on the mode.
+  int maxClients;
+
+  // Speak the framed protocol (see frame.h) rather than passing on raw
+  // reads.
+  bool framed;
+
+  // The longest chat message accepted in framed mode.  Messages longer
+  // than MAX_MESSAGE_LENGTH are allocated on their own rather than
+  // taken from the pool.
+  size_t maxMessageLength;
+  // Chat messages at least this long are compressed, once, for every
+  // client that said it takes FRAME_ROOM_MESSAGE_DEFLATE.
+  size_t compressAbove;
+
+  // How many messages may be waiting to be sent to a single client in
+  // event loop mode.
+  int sendQueueLength;
+  enum SLOW_CLIENT_POLICY_T slowClientPolicy;
+
+  // The most messages a room shard takes off its queue and writes to
+  // each client in one go, in thread mode.
+  int propagationBatchSize;
+
+  // How many room shards, each with its own thread, share the rooms
+  // in thread mode.
+  int numRoomShards;
+
+  // How many event loops, each with its own thread and listening
+  // socket, share the clients in event loop mode.
+  int numWorkers;
+
+  // How many of a room's latest messages are replayed to new members,
+  // and how old they may be in milliseconds (0 for any age).  A
+  // historyLength of 0 keeps no history.
+  int historyLength;
+  long historyMaxAge;
+  // How many of a room's latest messages are resent to clients that
+  // resync (see FRAME_RESYNC); 0 resends none.  Unless given on the
+  // command line, main sets it to historyLength.
+  int resyncLength;
+  // How many of its latest messages every room keeps: the larger of
+  // historyLength and resyncLength.  Worked out in main, along with the
+  // size of each room's history arena.
+  int keptLength;
+  size_t historyArenaSize;
+
+  // Where every chat message is logged, or NULL for no log.  See
+  // message_log.h.
+  const char *logDirectory;
+  long logFsyncInterval;
+  size_t logSegmentSize;
+
+  // How many messages, joins and leaves a second each client may send,
+  // on average, and in a burst; 0 for no limit.  See rate_limit.h.
+  long rateLimit;
+  long rateBurst;
+  enum FLOOD_POLICY_T floodPolicy;
+  // How long FLOOD_MUTE mutes a client for, in milliseconds.
+  long muteDuration;
+
+  // The UNIX socket the metrics are served on, or NULL for none.  See
+  // metrics.h.
+  const char *metricsPath;
+
+  // The UNIX socket the server takes over from an older one on, and
+  // then listens on for a newer one, or NULL for none.  See handoff.h.
+  const char *handoffPath;
+};
+
+extern struct server_options_t g_options;
+
+// What thread mode keeps for each client.
+struct client_socket_t {
+  int fd;
+  // A client can be in rooms on several shards, so this keeps their
+  // writes from interleaving.
+  pthread_mutex_t writeLock;
+  // Whether the client takes compressed messages.  Set by its reader
+  // once it says hello, and read by the shards without a lock.
+  bool compression;
+
+  // The client's reader, and the session it keeps.
+  pthread_t thread;
+  struct session_t *session;
+  // What was carried over for the client from the server we took over
+  // from, or NULL if it connected to us.  Taken up by its reader.
+  struct handoff_client_t *handoff;
+  // Set by the reader once it has stopped for a handoff.  From then on
+  // session belongs to whoever is handing over.
+  bool parked;
+};
+
+// Every client in thread mode, as struct client_socket_t.
+// This is a **SHARED RESOURCE*.  Slots are taken and given back under
+// clientSocketMutex.  Room shards look up the slots of their members
+// without it, since a slot is only given back once every shard has
+// forgotten about it, and elements never move.
+extern struct connection_table_t clientSockets;
+extern pthread_mutex_t clientSocketMutex;
+
+// In thread mode, rooms are spread over g_options.numRoomShards shards
+// by the hash of their names.  Each shard's thread owns its rooms
+// outright, and everything that touches them - chat messages, joins,
+// leaves and disconnects - goes through the shard's queue, so rooms on
+// different shards never share a lock.
+struct room_shard_t {
+  pthread_t thread;
+  struct mpsc_queue_t queue;
+  struct room_table_t rooms;
+};
+
+extern struct room_shard_t *g_roomShards;
+
+// Every message read from a client comes from this pool.
+extern struct message_pool_t g_messagePool;
+
+// What the server keeps track of while reading from a client.
+struct session_t {
+  int fd;
+  // The client's slot in the client table.
+  int slot;
+  // The room the client's messages go to.  Empty if it has left it.
+  char room[MAX_ROOM_NAME_LENGTH + 1];
+  // Whether the client said it takes compressed messages.
+  bool compression;
+
+  // In framed mode, the frame that is being read, and the message its
+  // payload goes into.  That is borrowed from the pool when a frame
+  // starts arriving, and NULL between frames, so an idle client holds
+  // no buffer.
+  struct frame_parser_t parser;
+  struct message_t *partialMessage;
+
+  // How much more the client may send, if there is a rate limit.
+  struct rate_limit_t rateLimit;
+};
+
+/*
+  Starts keeping track of the client on socket fd, which sits in slot
+  of the client table, and puts it in FRAME_DEFAULT_ROOM.
+*/
+void startSession(struct session_t *session, int fd, int slot);
+
+/*
+  Like startSession, for a client taken over from another server: puts
+  it back in the rooms it was in, and picks up where it left off
+  sending, as handoff says.
+*/
+void resumeSession(struct session_t *session, int fd, int slot, struct handoff_client_t *handoff);
+
+/*
+  Fills in what is carried over to a new server for session's client,
+  except for its rooms and anything it is owed.
+*/
+void saveSession(struct session_t *session, struct handoff_client_t *handoff);
+
+/*
+  Adds every room in rooms to the handoff state of each of its members.
+  The member in slot is state->clients[indices[slot]].
+*/
+void saveRooms(struct room_table_t *rooms, struct handoff_state_t *state, int *indices);
+
+/*
+  Starts listening for a newer server to hand over to, if there is a
+  g_options.handoffPath.  Called once clients are being served.
+*/
+void listenForHandoff();
+
+/*
+  Raises the soft limit on open files up to the hard limit, since each
+  client needs its own file descriptor.
+*/
+void raiseFileLimit();
+
+/*
+  Takes the client out of every room, and drops anything it was in the
+  middle of sending.
+
+  In thread mode this waits until every room shard has forgotten the
+  client, after which its slot and socket can be reused.
+*/
+void endSession(struct session_t *session);
+
+/*
+  Takes a message that was just read from session's client and sends it
+  on its way to the others in the client's room: through the room's
+  shard in thread mode, or straight to the event loop in event loop
+  mode.  The message is dropped if the client isn't in a room.
+
+  In framed mode the message is sent as is, in a frame that says which
+  room it came from.  Otherwise its trailing whitespace is stripped
+  first.
+
+  message must have its data and length filled in, and data must be
+  null terminated.  This takes over the caller's reference to it.
+
+  Messages over the client's rate limit are dealt with as
+  g_options.floodPolicy says.  Returns false if the connection should
+  be closed for it.
+*/
+bool ingestMessage(struct session_t *session, struct message_t *message);
+
+/*
+  Parses length bytes that were read from session's client in framed
+  mode, ingesting every message and carrying out every join and leave
+  that they complete.  Frames of unknown types are skipped.
+
+  Returns false if the stream is corrupt, or the client is disconnected
+  for flooding, in which case the connection should be closed.
+*/
+bool ingestFrames(struct session_t *session, const char *data, size_t length);
+
+// Every chat message passed on, if g_options.logDirectory is set.
+extern struct message_log_t g_messageLog;
+
+/*
+  Adds a chat message to the message log, if there is one.  Never
+  blocks.
+*/
+void logMessage(struct message_t *message);
+
+/*
+  Adds a chat message to its room's history.
+*/
+void recordHistory(struct room_t *room, struct message_t *message);
+
+/*
+  Points iov, which must have room for HISTORY_MAX_IOV entries, at the
+  part of room's history a new member should be sent.  Returns how many
+  iovecs were filled in.
+*/
+int gatherHistory(struct room_t *room, struct iovec *iov);
+
+// The most iovecs gatherResync can need.
+#define RESYNC_MAX_IOV (HISTORY_MAX_IOV + 1)
+
+/*
+  Points iov, which must have room for RESYNC_MAX_IOV entries, at what
+  the sender of a MESSAGE_RESYNC request should be sent: every message
+  after request->sequence among the last g_options.resyncLength of
+  room's history, and then the request's
+  wire, which is the FRAME_RESYNC frame that says that was all.
+  Returns how many iovecs were filled in.
+*/
+int gatherResync(struct room_t *room, struct message_t *request, struct iovec *iov);
+
+/*
+  Gives a framed chat message the next sequence number, and puts a
+  FRAME_SEQUENCE frame with it in front of each of its wire frames.
+  Called by whoever owns the message's room right before sending it
+  out, so that the room's members get its messages in order.
+*/
+void stampSequence(struct message_t *message);
+
+/*
+  Writes every buffer in iov to file, in order.  Unlike a single call to
+  writev, this carries on after a partial write.  iov is modified.
+
+  Returns 0 on success, or 1 if writing failed.
+*/
+int writevToFile(int file, struct iovec *iov, int iovcnt);
+
+/*
+  Terminates a string at the first trailing whitespace character.
+*/
+void nullifyTrailingWhitespace(char *string);
+
+#endif
@@ -0,0 +1,801 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Soak mode for the chat client: one process plays many users, for as
+  long as it is left running, and checks every message the server
+  delivers.
+
+  Users are spread over the rooms round robin, join their room at the
+  start and stay there.  They send in the framed protocol, either at
+  random with the given average rate between them (a Poisson process)
+  or by going through a script over and over.  A script is a text file
+  with one message per line, each optionally preceded by how many
+  milliseconds to wait before sending it:
+
+    250 hello there
+    1000 /me is thinking
+    and another one, right away
+
+  Every message carries its sender, the sender's sequence number and
+  when it was sent, so each user can tell whether the messages from the
+  others in its room arrive exactly once and in order, and how long
+  they took.  A message that turns up after later ones from the same
+  sender counts as reordered; one that never turns up, by the time the
+  run has ended and the stragglers have been waited for, counts as
+  lost.
+
+  Progress is reported every --report seconds, with the latency over
+  that interval.  Interrupting the client ends the run early, with the
+  usual final report.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "client.h"
+#include "frame.h"
+
+// How long the server gets to take everyone's joins before we start
+// sending, and to deliver the stragglers once we stop.
+const int SOAK_SETTLE_MS = 1000;
+const int SOAK_DRAIN_TIMEOUT_MS = 5000;
+
+const int SOAK_MAX_EPOLL_EVENTS = 256;
+
+// Received payloads carry the room name and a null byte ahead of a
+// message of up to MESSAGE_BUFSIZE - 1 bytes.
+#define SOAK_PAYLOAD_SIZE (FRAME_MAX_ROOM_NAME_LENGTH + 1 + MESSAGE_BUFSIZE)
+
+// Latencies are counted in SOAK_LATENCY_BUCKET_US buckets, up to
+// SOAK_MAX_LATENCY_US.  Anything slower lands in the last one.
+#define SOAK_LATENCY_BUCKET_US 10
+#define SOAK_MAX_LATENCY_US 10000000
+#define SOAK_LATENCY_BUCKETS (SOAK_MAX_LATENCY_US / SOAK_LATENCY_BUCKET_US + 1)
+
+// How many gaps in one sender's messages a user keeps track of, in case
+// they are filled in later.  Past that, they are counted as lost for
+// good.
+const int SOAK_MAX_MISSING = 1024;
+
+// What one user knows about another in its room.
+struct soak_peer_t {
+  // The sequence number of the next message expected.
+  unsigned long next;
+  // Sequence numbers before next that haven't arrived yet.
+  unsigned long *missing;
+  int numMissing;
+  int missingCapacity;
+};
+
+struct soak_user_t {
+  int fd;
+  int room;
+  // How many messages this user has sent, and so the sequence number
+  // of the next one.
+  unsigned long sent;
+  // The line of the script to send next.
+  int scriptLine;
+
+  // Frames the socket hasn't taken yet.
+  char *pending;
+  size_t pendingLength;
+  size_t pendingCapacity;
+  bool watchingWrites;
+
+  struct frame_parser_t parser;
+  char *payload;
+
+  // Everyone in the room, indexed by their user number / numRooms.
+  struct soak_peer_t *peers;
+};
+
+struct soak_line_t {
+  long delayMs;
+  char *text;
+};
+
+// When a user is next due to send.
+struct soak_event_t {
+  long due;
+  int user;
+};
+
+struct soak_stats_t {
+  unsigned long sent;
+  // Deliveries the sends so far should lead to.
+  unsigned long expected;
+  // Each message delivered to each user counts once, however it came.
+  unsigned long delivered;
+  unsigned long duplicated;
+  unsigned long reordered;
+  // Gaps not yet filled in, and ones that never will be.
+  unsigned long missing;
+  unsigned long lost;
+  unsigned long corrupt;
+
+  unsigned long *latencies;
+  unsigned long *intervalLatencies;
+  unsigned long numIntervalLatencies;
+  long maxLatency;
+  long intervalMaxLatency;
+};
+
+static struct soak_options_t *options;
+static struct soak_user_t *users;
+static const char *usernamePrefix;
+
+static struct soak_line_t *script;
+static int numScriptLines;
+
+// A min-heap of everyone's next send.
+static struct soak_event_t *schedule;
+static int scheduleLength;
+
+static struct soak_stats_t stats;
+
+static int epollFd;
+static struct epoll_event *events;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+static long nowNanos();
+
+/*
+  Raises the soft limit on open files up to the hard limit, since every
+  user needs a connection of its own.
+*/
+static void raiseFileLimit();
+
+static void handleStop(int signal);
+
+/*
+  Reads options->script into script.
+
+  Terminates the program if it can't be read or is empty.
+*/
+static void loadScript();
+
+/*
+  Connects user number index to the server and puts it in its room.
+*/
+static void startUser(int index, struct sockaddr_in *socketAddress);
+
+/*
+  Works out when user number index next sends, given that it last did
+  at last, and adds that to the schedule.
+*/
+static void scheduleUser(int index, long last);
+static struct soak_event_t popSchedule();
+
+/*
+  Sends the next message of user number index.
+*/
+static void sendMessage(int index, long now);
+
+/*
+  Writes as much of user's pending frames as its socket will take,
+  watching for it to have room again if that isn't all of them.
+*/
+static void flushUser(struct soak_user_t *user);
+
+/*
+  Reads what has arrived for user and checks every message in it.
+
+  Returns false if the server closed the connection.
+*/
+static bool readUser(struct soak_user_t *user);
+
+/*
+  Checks one message delivered to user against what it has seen from
+  the sender so far.
+*/
+static void checkMessage(struct soak_user_t *user, const char *text, long now);
+
+/*
+  Handles whatever is ready within timeoutMs.
+
+  Returns false if the server closed a connection.
+*/
+static bool pollUsers(int timeoutMs);
+
+/*
+  Returns the latency, in microseconds, under which fraction of the
+  count latencies in histogram fall.
+*/
+static long latencyPercentile(unsigned long *histogram, unsigned long count, double fraction);
+
+/*
+  Prints a line of progress, with the latencies since the last one.
+*/
+static void reportProgress(long elapsed);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+int runSoak(struct sockaddr_in *socketAddress, const char *username,
+  struct soak_options_t *soakOptions) {
+  options = soakOptions;
+  usernamePrefix = username;
+  if (options->numRooms > options->numUsers) {
+    options->numRooms = options->numUsers;
+  }
+  if (options->messageSize >= MESSAGE_BUFSIZE) {
+    options->messageSize = MESSAGE_BUFSIZE - 1;
+  }
+  if (options->script != NULL) {
+    loadScript();
+  }
+
+  // A server that disconnects us should show up in the report.
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = handleStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  raiseFileLimit();
+  users = calloc(options->numUsers, sizeof(struct soak_user_t));
+  schedule = calloc(options->numUsers, sizeof(struct soak_event_t));
+  stats.latencies = calloc(SOAK_LATENCY_BUCKETS, sizeof(unsigned long));
+  stats.intervalLatencies = calloc(SOAK_LATENCY_BUCKETS, sizeof(unsigned long));
+  events = calloc(SOAK_MAX_EPOLL_EVENTS, sizeof(struct epoll_event));
+  if (users == NULL || schedule == NULL || stats.latencies == NULL ||
+    stats.intervalLatencies == NULL || events == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+
+  epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  for (int i = 0; i < options->numUsers; ++i) {
+    startUser(i, socketAddress);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &users[i];
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, users[i].fd, &event) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+
+  // There is no reply to a join, so give the server a moment with them.
+  bool connected = pollUsers(SOAK_SETTLE_MS);
+
+  if (options->script != NULL) {
+    fprintf(stdout, "%d users in %d rooms, going through a script of %d lines",
+      options->numUsers, options->numRooms, numScriptLines);
+  } else {
+    fprintf(stdout, "%d users in %d rooms, %d messages/s of %d bytes",
+      options->numUsers, options->numRooms, options->rate, options->messageSize);
+  }
+  if (options->duration > 0) {
+    fprintf(stdout, " for %ds\n", options->duration);
+  } else {
+    fputs(" until interrupted\n", stdout);
+  }
+  fflush(stdout);
+
+  long start = nowNanos();
+  for (int i = 0; i < options->numUsers; ++i) {
+    scheduleUser(i, start);
+  }
+  long end = start + options->duration * 1000000000L;
+  long nextReport = start + options->reportInterval * 1000000000L;
+
+  while (connected && !stopRequested) {
+    long now = nowNanos();
+    if (options->duration > 0 && now >= end) {
+      break;
+    }
+    while (schedule[0].due <= now) {
+      struct soak_event_t event = popSchedule();
+      sendMessage(event.user, event.due);
+      scheduleUser(event.user, event.due);
+    }
+    if (now >= nextReport) {
+      reportProgress(now - start);
+      nextReport += options->reportInterval * 1000000000L;
+    }
+
+    long wait = schedule[0].due;
+    if (nextReport < wait) {
+      wait = nextReport;
+    }
+    int timeoutMs = (wait > now) ? (int)((wait - now + 999999) / 1000000) : 0;
+    connected = pollUsers(timeoutMs);
+  }
+
+  // Wait for what is still on its way.
+  long drainStart = nowNanos();
+  while (connected && stats.delivered + stats.missing < stats.expected &&
+    nowNanos() - drainStart < SOAK_DRAIN_TIMEOUT_MS * 1000000L) {
+    connected = pollUsers(10);
+  }
+  reportProgress(nowNanos() - start);
+
+  // Whatever hasn't come by now is lost, whether it left a gap or was
+  // at the end.
+  for (int i = 0; i < options->numUsers; ++i) {
+    struct soak_user_t *user = &users[i];
+    for (int sender = user->room; sender < options->numUsers; sender += options->numRooms) {
+      struct soak_peer_t *peer = &user->peers[sender / options->numRooms];
+      if (sender != i) {
+        stats.lost += peer->numMissing + (users[sender].sent - peer->next);
+      }
+      free(peer->missing);
+    }
+  }
+
+  fprintf(stdout, "sent %lu messages, delivered %lu of %lu: %lu lost, %lu duplicated, %lu reordered, %lu corrupt\n",
+    stats.sent, stats.delivered, stats.expected, stats.lost, stats.duplicated,
+    stats.reordered, stats.corrupt);
+  fprintf(stdout, "latency p50 %ldus  p99 %ldus  p999 %ldus  max %ldus\n",
+    latencyPercentile(stats.latencies, stats.delivered, 0.50),
+    latencyPercentile(stats.latencies, stats.delivered, 0.99),
+    latencyPercentile(stats.latencies, stats.delivered, 0.999),
+    stats.maxLatency);
+  if (!connected) {
+    fputs("The server closed a connection.\n", stdout);
+  }
+
+  for (int i = 0; i < options->numUsers; ++i) {
+    close(users[i].fd);
+    free(users[i].pending);
+    free(users[i].payload);
+    free(users[i].peers);
+  }
+  for (int i = 0; i < numScriptLines; ++i) {
+    free(script[i].text);
+  }
+  close(epollFd);
+  free(script);
+  free(events);
+  free(stats.intervalLatencies);
+  free(stats.latencies);
+  free(schedule);
+  free(users);
+
+  if (!connected || stats.lost > 0 || stats.duplicated > 0 || stats.reordered > 0 ||
+    stats.corrupt > 0) {
+    return EXIT_ERROR_DELIVERY;
+  }
+  return EXIT_NORMAL;
+}
+
+static long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void raiseFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    perror(PROG_NAME);
+  }
+}
+
+static void handleStop(int signal) {
+  stopRequested = 1;
+}
+
+static void loadScript() {
+  FILE *file = fopen(options->script, "r");
+  if (file == NULL) {
+    perror(options->script);
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+
+  int capacity = 0;
+  char line[MESSAGE_BUFSIZE];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char *text = line;
+    long delayMs = strtol(line, &text, 10);
+    if (text == line || delayMs < 0) {
+      delayMs = 0;
+      text = line;
+    }
+    text += strspn(text, " \t");
+    if (*text == '\0') {
+      continue;
+    }
+
+    if (numScriptLines == capacity) {
+      capacity = (capacity > 0) ? capacity * 2 : 64;
+      struct soak_line_t *grown = realloc(script, capacity * sizeof(struct soak_line_t));
+      if (grown == NULL) {
+        perror(PROG_NAME);
+        exit(EXIT_ERROR_MEMORY);
+      }
+      script = grown;
+    }
+    script[numScriptLines].delayMs = delayMs;
+    script[numScriptLines].text = strdup(text);
+    if (script[numScriptLines].text == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    ++numScriptLines;
+  }
+  fclose(file);
+
+  long totalDelayMs = 0;
+  for (int i = 0; i < numScriptLines; ++i) {
+    totalDelayMs += script[i].delayMs;
+  }
+  if (numScriptLines == 0 || totalDelayMs == 0) {
+    // Without a delay somewhere, users would send as fast as they could
+    // go through it.
+    fprintf(stderr, "%s: The script '%s' needs a message and a delay\n", PROG_NAME, options->script);
+    exit(EXIT_ERROR_ARGUMENT);
+  }
+}
+
+static void startUser(int index, struct sockaddr_in *socketAddress) {
+  struct soak_user_t *user = &users[index];
+  connectToServer(socketAddress, &user->fd);
+  user->room = index % options->numRooms;
+
+  int roomSize = (options->numUsers - user->room + options->numRooms - 1) / options->numRooms;
+  user->peers = calloc(roomSize, sizeof(struct soak_peer_t));
+  user->payload = malloc(SOAK_PAYLOAD_SIZE);
+  if (user->peers == NULL || user->payload == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  // Leave room for a null terminator after the payload.
+  frame_parser_reset(&user->parser, user->payload, SOAK_PAYLOAD_SIZE - 1);
+
+  // Start everyone at a different point in the script.
+  if (numScriptLines > 0) {
+    user->scriptLine = index % numScriptLines;
+  }
+
+  char frame[FRAME_MAX_HEADER_LENGTH + FRAME_MAX_ROOM_NAME_LENGTH + 1];
+  char *room = frame + FRAME_MAX_HEADER_LENGTH;
+  int roomLength = snprintf(room, FRAME_MAX_ROOM_NAME_LENGTH + 1, "soak-%d", user->room);
+  char header[FRAME_MAX_HEADER_LENGTH];
+  size_t headerLength = frame_encode_header(header, FRAME_JOIN, roomLength);
+  memcpy(room - headerLength, header, headerLength);
+  if (writeToFile(user->fd, room - headerLength, headerLength + roomLength) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+
+  if (fcntl(user->fd, F_SETFL, O_NONBLOCK) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+}
+
+static void scheduleUser(int index, long last) {
+  long delay;
+  if (numScriptLines > 0) {
+    delay = script[users[index].scriptLine].delayMs * 1000000L;
+  } else {
+    // Everyone sends at rate / numUsers on average, with exponentially
+    // distributed gaps.
+    double perUser = (double)options->rate / options->numUsers;
+    delay = (long)(-log(1.0 - drand48()) / perUser * 1e9);
+  }
+
+  // Sift the new event up from the bottom of the heap.
+  struct soak_event_t event = {last + delay, index};
+  int child = scheduleLength++;
+  while (child > 0) {
+    int parent = (child - 1) / 2;
+    if (schedule[parent].due <= event.due) {
+      break;
+    }
+    schedule[child] = schedule[parent];
+    child = parent;
+  }
+  schedule[child] = event;
+}
+
+static struct soak_event_t popSchedule() {
+  struct soak_event_t top = schedule[0];
+  struct soak_event_t last = schedule[--scheduleLength];
+
+  // Sift the last event down from the top.
+  int parent = 0;
+  while (true) {
+    int child = 2 * parent + 1;
+    if (child >= scheduleLength) {
+      break;
+    }
+    if (child + 1 < scheduleLength && schedule[child + 1].due < schedule[child].due) {
+      ++child;
+    }
+    if (last.due <= schedule[child].due) {
+      break;
+    }
+    schedule[parent] = schedule[child];
+    parent = child;
+  }
+  schedule[parent] = last;
+  return top;
+}
+
+static void sendMessage(int index, long now) {
+  struct soak_user_t *user = &users[index];
+
+  char text[MESSAGE_BUFSIZE];
+  int length = snprintf(text, sizeof(text), "%s-%d: %d %lu %ld ",
+    usernamePrefix, index, index, user->sent, now);
+  if (numScriptLines > 0) {
+    length += snprintf(text + length, sizeof(text) - length, "%s",
+      script[user->scriptLine].text);
+    user->scriptLine = (user->scriptLine + 1) % numScriptLines;
+  }
+  if (length >= MESSAGE_BUFSIZE) {
+    length = MESSAGE_BUFSIZE - 1;
+  }
+  if (length < options->messageSize) {
+    memset(text + length, 'x', options->messageSize - length);
+    length = options->messageSize;
+  }
+
+  size_t needed = user->pendingLength + FRAME_MAX_HEADER_LENGTH + length;
+  if (needed > user->pendingCapacity) {
+    size_t capacity = (user->pendingCapacity > 0) ? user->pendingCapacity : MESSAGE_BUFSIZE;
+    while (needed > capacity) {
+      capacity *= 2;
+    }
+    char *grown = realloc(user->pending, capacity);
+    if (grown == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+    user->pending = grown;
+    user->pendingCapacity = capacity;
+  }
+  user->pendingLength += frame_encode_header(user->pending + user->pendingLength,
+    FRAME_MESSAGE, length);
+  memcpy(user->pending + user->pendingLength, text, length);
+  user->pendingLength += length;
+
+  ++user->sent;
+  ++stats.sent;
+  int roomSize = (options->numUsers - user->room + options->numRooms - 1) / options->numRooms;
+  stats.expected += roomSize - 1;
+
+  if (!user->watchingWrites) {
+    flushUser(user);
+  }
+}
+
+static void flushUser(struct soak_user_t *user) {
+  size_t written = 0;
+  while (written < user->pendingLength) {
+    ssize_t chars = write(user->fd, user->pending + written, user->pendingLength - written);
+    if (chars < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // The read side will notice the connection is gone.
+        written = user->pendingLength;
+      }
+      break;
+    }
+    written += chars;
+  }
+  memmove(user->pending, user->pending + written, user->pendingLength - written);
+  user->pendingLength -= written;
+
+  bool watchWrites = user->pendingLength > 0;
+  if (watchWrites != user->watchingWrites) {
+    user->watchingWrites = watchWrites;
+    struct epoll_event event;
+    event.events = watchWrites ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = user;
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, user->fd, &event) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+}
+
+static bool readUser(struct soak_user_t *user) {
+  static char *buffer = NULL;
+  if (buffer == NULL) {
+    buffer = malloc(RECEIVE_BUFSIZE);
+    if (buffer == NULL) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_MEMORY);
+    }
+  }
+
+  ssize_t chars = read(user->fd, buffer, RECEIVE_BUFSIZE);
+  if (chars < 0) {
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  if (chars == 0) {
+    return false;
+  }
+
+  long now = nowNanos();
+  const char *data = buffer;
+  size_t length = chars;
+  while (length > 0) {
+    size_t consumed;
+    enum FRAME_RESULT_T result = frame_parse(&user->parser, data, length, &consumed);
+    data += consumed;
+    length -= consumed;
+    if (result == FRAME_ERROR) {
+      fprintf(stderr, "%s: Received a corrupt frame.\n", PROG_NAME);
+      return false;
+    }
+    if (result == FRAME_INCOMPLETE) {
+      break;
+    }
+    if (user->parser.type == FRAME_ROOM_MESSAGE) {
+      // Skip the room name.
+      user->payload[user->parser.length] = '\0';
+      checkMessage(user, user->payload + strlen(user->payload) + 1, now);
+    }
+    frame_parser_reset(&user->parser, user->payload, SOAK_PAYLOAD_SIZE - 1);
+  }
+  return true;
+}
+
+static void checkMessage(struct soak_user_t *user, const char *text, long now) {
+  // Skip the sender's name.
+  const char *fields = strstr(text, ": ");
+  int sender;
+  unsigned long sequence;
+  long sentAt;
+  if (fields == NULL || sscanf(fields + 2, "%d %lu %ld", &sender, &sequence, &sentAt) != 3 ||
+    sender < 0 || sender >= options->numUsers || users[sender].room != user->room ||
+    &users[sender] == user || sequence >= users[sender].sent) {
+    // Not one of ours, or not from this room.
+    ++stats.corrupt;
+    return;
+  }
+
+  struct soak_peer_t *peer = &user->peers[sender / options->numRooms];
+  if (sequence == peer->next) {
+    ++peer->next;
+  } else if (sequence > peer->next) {
+    // Everything in between is missing, for now.
+    for (unsigned long missing = peer->next; missing < sequence; ++missing) {
+      if (peer->numMissing == SOAK_MAX_MISSING) {
+        ++stats.lost;
+        continue;
+      }
+      if (peer->numMissing == peer->missingCapacity) {
+        int capacity = (peer->missingCapacity > 0) ? peer->missingCapacity * 2 : 8;
+        unsigned long *grown = realloc(peer->missing, capacity * sizeof(unsigned long));
+        if (grown == NULL) {
+          perror(PROG_NAME);
+          exit(EXIT_ERROR_MEMORY);
+        }
+        peer->missing = grown;
+        peer->missingCapacity = capacity;
+      }
+      peer->missing[peer->numMissing++] = missing;
+      ++stats.missing;
+    }
+    peer->next = sequence + 1;
+  } else {
+    // Either it fills in a gap, or we have seen it before.
+    int i = 0;
+    while (i < peer->numMissing && peer->missing[i] != sequence) {
+      ++i;
+    }
+    if (i == peer->numMissing) {
+      ++stats.duplicated;
+      return;
+    }
+    peer->missing[i] = peer->missing[--peer->numMissing];
+    --stats.missing;
+    ++stats.reordered;
+  }
+  ++stats.delivered;
+
+  long latency = (now - sentAt) / 1000;
+  if (latency < 0) {
+    latency = 0;
+  }
+  long bucket = latency / SOAK_LATENCY_BUCKET_US;
+  if (bucket >= SOAK_LATENCY_BUCKETS) {
+    bucket = SOAK_LATENCY_BUCKETS - 1;
+  }
+  ++stats.latencies[bucket];
+  ++stats.intervalLatencies[bucket];
+  ++stats.numIntervalLatencies;
+  if (latency > stats.maxLatency) {
+    stats.maxLatency = latency;
+  }
+  if (latency > stats.intervalMaxLatency) {
+    stats.intervalMaxLatency = latency;
+  }
+}
+
+static bool pollUsers(int timeoutMs) {
+  long giveUp = nowNanos() + timeoutMs * 1000000L;
+  do {
+    int ready = epoll_wait(epollFd, events, SOAK_MAX_EPOLL_EVENTS, timeoutMs);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        return true;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    for (int i = 0; i < ready; ++i) {
+      struct soak_user_t *user = events[i].data.ptr;
+      if ((events[i].events & EPOLLOUT) != 0) {
+        flushUser(user);
+      }
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 && !readUser(user)) {
+        return false;
+      }
+    }
+    if (ready < SOAK_MAX_EPOLL_EVENTS) {
+      return true;
+    }
+  } while (nowNanos() < giveUp);
+  return true;
+}
+
+static long latencyPercentile(unsigned long *histogram, unsigned long count, double fraction) {
+  unsigned long target = (unsigned long)(count * fraction);
+  unsigned long seen = 0;
+  for (long i = 0; i < SOAK_LATENCY_BUCKETS; ++i) {
+    seen += histogram[i];
+    if (seen > target) {
+      return i * SOAK_LATENCY_BUCKET_US;
+    }
+  }
+  return SOAK_MAX_LATENCY_US;
+}
+
+static void reportProgress(long elapsed) {
+  unsigned long count = stats.numIntervalLatencies;
+  fprintf(stdout, "[%5lds] sent %lu delivered %lu missing %lu lost %lu duplicated %lu reordered %lu"
+    "  latency p50 %ldus p99 %ldus p999 %ldus max %ldus\n",
+    elapsed / 1000000000L, stats.sent, stats.delivered, stats.missing, stats.lost,
+    stats.duplicated, stats.reordered,
+    latencyPercentile(stats.intervalLatencies, count, 0.50),
+    latencyPercentile(stats.intervalLatencies, count, 0.99),
+    latencyPercentile(stats.intervalLatencies, count, 0.999),
+    stats.intervalMaxLatency);
+  fflush(stdout);
+
+  memset(stats.intervalLatencies, 0, SOAK_LATENCY_BUCKETS * sizeof(unsigned long));
+  stats.numIntervalLatencies = 0;
+  stats.intervalMaxLatency = 0;
+}
@@ -0,0 +1,246 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Just enough of io_uring.  See uring.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+#include "uring.h"
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Submits everything filled in so far, and waits for waitFor
+  completions if waitFor is not 0.  Returns 0, or -errno.
+*/
+static int enter(struct uring_t *ring, unsigned waitFor);
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+bool uring_init(struct uring_t *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Recvs can be left pending on every client, so there can be many
+  // more completions than requests in flight.
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = entries * 4;
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0 && errno == EINVAL) {
+    // Older kernels don't know about the last two; they are only an
+    // optimisation.
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (ring->fd < 0) {
+    return false;
+  }
+  // Without these, completions could be lost when the queue overflows
+  // and buffer selection doesn't work the way we need.
+  if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_FAST_POLL)) {
+    close(ring->fd);
+    errno = ENOTSUP;
+    return false;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize) {
+      ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->cqRingSize = ring->sqRingSize;
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    close(ring->fd);
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+      munmap(ring->sqRing, ring->sqRingSize);
+      close(ring->fd);
+      return false;
+    }
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cqRing != ring->sqRing) {
+      munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    return false;
+  }
+
+  char *sq = ring->sqRing;
+  ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+  // Request i always goes in sqes[i], so the array can be filled in
+  // once.
+  for (unsigned i = 0; i <= ring->sqMask; ++i) {
+    ring->sqArray[i] = i;
+  }
+
+  char *cq = ring->cqRing;
+  ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return true;
+}
+
+void uring_cleanup(struct uring_t *ring) {
+  munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing != ring->sqRing) {
+    munmap(ring->cqRing, ring->cqRingSize);
+  }
+  munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring) {
+  // Only the kernel moves the head, and only we move the tail.
+  while (*ring->sqTail + ring->sqePending - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask) {
+    if (enter(ring, 0) != 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[(*ring->sqTail + ring->sqePending) & ring->sqMask];
+  ++ring->sqePending;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_submit_and_wait(struct uring_t *ring, unsigned waitFor) {
+  int result = enter(ring, waitFor);
+  return (result == -EINTR) ? 0 : result;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cqMask];
+}
+
+void uring_cqe_seen(struct uring_t *ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+bool uring_buffers_init(struct uring_buffers_t *buffers, struct uring_t *ring,
+  unsigned short group, unsigned numBuffers, size_t bufferSize) {
+  buffers->ringSize = numBuffers * sizeof(struct io_uring_buf);
+  buffers->ring = mmap(NULL, buffers->ringSize, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers->ring == MAP_FAILED) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  buffers->data = malloc(numBuffers * bufferSize);
+  if (buffers->data == NULL) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_MEMORY);
+  }
+  buffers->mask = numBuffers - 1;
+  buffers->tail = 0;
+  buffers->group = group;
+  buffers->bufferSize = bufferSize;
+  buffers->numBuffers = numBuffers;
+
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (unsigned long)buffers->ring;
+  registration.ring_entries = numBuffers;
+  registration.bgid = group;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+    munmap(buffers->ring, buffers->ringSize);
+    free(buffers->data);
+    return false;
+  }
+
+  for (unsigned i = 0; i < numBuffers; ++i) {
+    struct io_uring_buf *buffer = &buffers->ring->bufs[i];
+    buffer->addr = (unsigned long)(buffers->data + i * bufferSize);
+    buffer->len = bufferSize;
+    buffer->bid = i;
+  }
+  buffers->tail = numBuffers;
+  __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+  return true;
+}
+
+void uring_buffers_cleanup(struct uring_buffers_t *buffers, struct uring_t *ring) {
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.bgid = buffers->group;
+  syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+  munmap(buffers->ring, buffers->ringSize);
+  free(buffers->data);
+}
+
+void uring_buffers_recycle(struct uring_buffers_t *buffers, struct io_uring_cqe *cqe) {
+  unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  struct io_uring_buf *buffer = &buffers->ring->bufs[buffers->tail & buffers->mask];
+  buffer->addr = (unsigned long)(buffers->data + (size_t)id * buffers->bufferSize);
+  buffer->len = buffers->bufferSize;
+  buffer->bid = id;
+  ++buffers->tail;
+  __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+static int enter(struct uring_t *ring, unsigned waitFor) {
+  // Publish the requests, then tell the kernel about them, along with
+  // any it didn't take last time.
+  __atomic_store_n(ring->sqTail, *ring->sqTail + ring->sqePending, __ATOMIC_RELEASE);
+  ring->sqePending = 0;
+
+  unsigned flags = (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    unsigned toSubmit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    long result = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor, flags, NULL, _NSIG / 8);
+    if (result < 0) {
+      if (errno == EINTR) {
+        return -EINTR;
+      }
+      if (errno == EAGAIN || errno == EBUSY) {
+        // Out of room for completions; the caller has to reap some, and
+        // the rest are submitted next time.
+        return 0;
+      }
+      return -errno;
+    }
+    if ((unsigned)result >= toSubmit) {
+      return 0;
+    }
+  }
+}
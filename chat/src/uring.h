@@ -0,0 +1,131 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Just enough of io_uring for the event loop, on top of the raw system
+  calls, since liburing isn't always installed.
+
+  A ring has a submission queue that we fill with requests and a
+  completion queue that the kernel fills with their results, both
+  shared with the kernel through mmap.  Many requests can be submitted,
+  and many completions waited for, with a single io_uring_enter call.
+
+  A buffer group is a set of equally sized buffers that the kernel picks
+  from when data arrives for a recv that asked for one, so that a recv
+  can be left pending on every socket without a buffer tied up in each.
+  The buffers are handed to the kernel through a ring of their own, and
+  given back with uring_buffers_recycle once we are done with them.
+
+  None of this is thread safe; each worker has its own ring.
+
+*/
+
+#ifndef CHAT_URING_H
+#define CHAT_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring_t {
+  int fd;
+
+  // The submission queue.  Requests are written to sqes, and their
+  // indices published through sqArray and *sqTail.
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  struct io_uring_sqe *sqes;
+  // Requests handed out by uring_get_sqe but not yet submitted.
+  unsigned sqePending;
+
+  // The completion queue.
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  // What was mapped, to be unmapped.
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+};
+
+struct uring_buffers_t {
+  struct io_uring_buf_ring *ring;
+  size_t ringSize;
+  unsigned short mask;
+  unsigned short tail;
+  unsigned short group;
+
+  char *data;
+  size_t bufferSize;
+  unsigned numBuffers;
+};
+
+/*
+  Sets up a ring with room for entries requests at a time, and
+  completions for several times that.
+
+  Returns false if io_uring isn't available, leaving errno set.
+*/
+bool uring_init(struct uring_t *ring, unsigned entries);
+
+void uring_cleanup(struct uring_t *ring);
+
+/*
+  Returns a zeroed request to fill in.  If the submission queue is full,
+  what is in it is submitted first.
+*/
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+
+/*
+  Submits every request filled in so far and waits until there are at
+  least waitFor completions.
+
+  Returns 0, or -errno on failure.  Being interrupted by a signal isn't
+  a failure.
+*/
+int uring_submit_and_wait(struct uring_t *ring, unsigned waitFor);
+
+/*
+  Returns the oldest completion, or NULL if there is none.  It stays in
+  the queue until uring_cqe_seen.
+*/
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring);
+
+/*
+  Takes the oldest completion off the queue.
+*/
+void uring_cqe_seen(struct uring_t *ring);
+
+/*
+  Sets up numBuffers buffers of bufferSize bytes as buffer group group
+  of ring, and hands them all to the kernel.  numBuffers must be a power
+  of two no more than 32768.
+
+  Returns false if the kernel doesn't support buffer rings, leaving
+  errno set.
+*/
+bool uring_buffers_init(struct uring_buffers_t *buffers, struct uring_t *ring,
+  unsigned short group, unsigned numBuffers, size_t bufferSize);
+
+void uring_buffers_cleanup(struct uring_buffers_t *buffers, struct uring_t *ring);
+
+/*
+  Returns the buffer the kernel picked for a completion.
+*/
+static inline char *uring_buffer(struct uring_buffers_t *buffers, struct io_uring_cqe *cqe) {
+  return buffers->data + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * buffers->bufferSize;
+}
+
+/*
+  Gives the buffer used by a completion back to the kernel.
+*/
+void uring_buffers_recycle(struct uring_buffers_t *buffers, struct io_uring_cqe *cqe);
+
+#endif
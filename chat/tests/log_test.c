@@ -0,0 +1,410 @@
+/*
+Programmer: Leonard Law
+Purpose:
+  Class project for CS 239.
+
+  Tests the server's message log with the longest message it takes.
+  Starts the server built by the makefile in framed event loop mode
+  with --log in a fresh directory and the smallest --log-segment, and
+  has one client send a message of the maximum size to another.  The
+  message has to arrive whole, the server has to still be up and
+  passing on messages afterwards, and the message has to be in the log.
+
+  Usage:
+    log_test [server path]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "../src/server.h"
+#include "../src/frame.h"
+#include "../src/message_log.h"
+
+char *PROG_NAME;
+bool DEBUG = false;
+
+const char *DEFAULT_SERVER = "./server";
+
+// The longest message the server takes by default, and the smallest
+// segment --log-segment allows, in MB.
+const int MAX_MESSAGE_SIZE = 1024 * 1024;
+const char *LOG_SEGMENT_MB = "1";
+
+// Big enough for the longest message with its room name in front.
+#define MAX_PAYLOAD_SIZE (1024 * 1024 + FRAME_MAX_ROOM_NAME_LENGTH + 2)
+
+#define READ_BUFFER_SIZE 65536
+
+// How long the server gets to start listening, to take both clients
+// before the first message, and to log the last one.
+const int SERVER_START_TIMEOUT_MS = 5000;
+const int SETTLE_MS = 200;
+
+// How long a message gets to arrive.
+const int DELIVERY_TIMEOUT_MS = 5000;
+
+struct receiver_t {
+  int fd;
+  struct frame_parser_t parser;
+  char *payload;
+};
+
+static pid_t serverPid = 0;
+static int serverPort;
+static char logDirectory[] = "/tmp/chat_log_test.XXXXXX";
+
+/* --------------------------------------------------------------------
+Function declarations
+-------------------------------------------------------------------- */
+
+/*
+  Returns a monotonic timestamp in nanoseconds.
+*/
+long nowNanos();
+
+/*
+  Asks the kernel for a port nobody is listening on.
+*/
+int findFreePort();
+
+/*
+  Starts the server with the log in logDirectory.
+*/
+void startServer(const char *server);
+void killServer();
+
+/*
+  Returns true if the server hasn't exited.
+*/
+bool serverIsRunning();
+
+/*
+  Removes logDirectory and everything the server wrote to it.
+*/
+void removeLog();
+
+/*
+  Returns true if the log in logDirectory has a record of text.
+*/
+bool isLogged(const char *text, size_t length);
+
+/*
+  Connects to the server, retrying for up to timeoutMs while it starts.
+*/
+int connectToServer(int timeoutMs);
+
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length);
+
+/*
+  Waits for the next chat message to reach receiver, and returns true
+  if it is text.
+*/
+bool expectMessage(struct receiver_t *receiver, const char *text, size_t length);
+
+/* --------------------------------------------------------------------
+Main
+-------------------------------------------------------------------- */
+int main(int argc, char **argv) {
+  PROG_NAME = argv[0];
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc > 2) {
+    fputs("Usage: log_test [server path]\n", stderr);
+    return EXIT_ERROR_ARGUMENT;
+  }
+  const char *server = (argc > 1) ? argv[1] : DEFAULT_SERVER;
+
+  if (mkdtemp(logDirectory) == NULL) {
+    perror(PROG_NAME);
+    return EXIT_ERROR_IO;
+  }
+  atexit(removeLog);
+  atexit(killServer);
+  startServer(server);
+
+  // Both start out in the lobby.
+  int sender = connectToServer(SERVER_START_TIMEOUT_MS);
+  struct receiver_t receiver;
+  receiver.fd = connectToServer(0);
+  receiver.payload = malloc(MAX_PAYLOAD_SIZE);
+  char *text = malloc(MAX_MESSAGE_SIZE);
+  if (receiver.payload == NULL || text == NULL) {
+    perror(PROG_NAME);
+    return EXIT_ERROR_MEMORY;
+  }
+  frame_parser_reset(&receiver.parser, receiver.payload, MAX_PAYLOAD_SIZE - 1);
+  usleep(SETTLE_MS * 1000);
+
+  for (int i = 0; i < MAX_MESSAGE_SIZE; ++i) {
+    text[i] = 'a' + i % 26;
+  }
+  sendFrame(sender, FRAME_MESSAGE, text, MAX_MESSAGE_SIZE);
+  if (!expectMessage(&receiver, text, MAX_MESSAGE_SIZE)) {
+    fprintf(stdout, "FAIL: the %d byte message didn't arrive whole\n", MAX_MESSAGE_SIZE);
+    return 1;
+  }
+
+  // The log is written on a thread of its own, so give it time to get
+  // to the message before checking on the server.
+  const char *after = "still here";
+  sendFrame(sender, FRAME_MESSAGE, after, strlen(after));
+  bool delivered = expectMessage(&receiver, after, strlen(after));
+  usleep(SETTLE_MS * 1000);
+  if (!delivered || !serverIsRunning()) {
+    fputs("FAIL: the server stopped passing on messages\n", stdout);
+    return 1;
+  }
+  if (!isLogged(text, MAX_MESSAGE_SIZE)) {
+    fprintf(stdout, "FAIL: the %d byte message isn't in the log\n", MAX_MESSAGE_SIZE);
+    return 1;
+  }
+
+  fprintf(stdout, "a %d byte message went through and was logged with --log-segment %s\n",
+    MAX_MESSAGE_SIZE, LOG_SEGMENT_MB);
+  close(sender);
+  close(receiver.fd);
+  free(receiver.payload);
+  free(text);
+  return EXIT_NORMAL;
+}
+
+/* --------------------------------------------------------------------
+Function definitions
+-------------------------------------------------------------------- */
+long nowNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+int findFreePort() {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+
+  // Let the kernel pick one.
+  socklen_t addressLength = sizeof(address);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    getsockname(fd, (struct sockaddr *)&address, &addressLength) != 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_SOCKET);
+  }
+  close(fd);
+  return ntohs(address.sin_port);
+}
+
+void startServer(const char *server) {
+  serverPort = findFreePort();
+  char port[16];
+  snprintf(port, sizeof(port), "%d", serverPort);
+  char *argv[] = {
+    (char *)server, "--epoll", "--framed", "--log", logDirectory,
+    "--log-segment", (char *)LOG_SEGMENT_MB, port, NULL
+  };
+
+  serverPid = fork();
+  if (serverPid < 0) {
+    perror(PROG_NAME);
+    exit(EXIT_ERROR_IO);
+  }
+  if (serverPid == 0) {
+    // The server prints every message it passes on.
+    int devNull = open("/dev/null", O_WRONLY);
+    if (devNull >= 0) {
+      dup2(devNull, STDOUT_FILENO);
+      close(devNull);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(EXIT_ERROR_ARGUMENT);
+  }
+}
+
+void killServer() {
+  if (serverPid > 0) {
+    kill(serverPid, SIGKILL);
+    waitpid(serverPid, NULL, 0);
+    serverPid = 0;
+  }
+}
+
+bool serverIsRunning() {
+  if (serverPid > 0 && waitpid(serverPid, NULL, WNOHANG) == serverPid) {
+    serverPid = 0;
+  }
+  return serverPid > 0;
+}
+
+void removeLog() {
+  DIR *directory = opendir(logDirectory);
+  if (directory == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char path[sizeof(logDirectory) + 256];
+    snprintf(path, sizeof(path), "%s/%s", logDirectory, entry->d_name);
+    unlink(path);
+  }
+  closedir(directory);
+  rmdir(logDirectory);
+}
+
+bool isLogged(const char *text, size_t length) {
+  struct log_reader_t reader;
+  if (!log_reader_open(&reader, logDirectory)) {
+    return false;
+  }
+  bool found = false;
+  struct log_entry_t entry;
+  while (!found && log_reader_next(&reader, &entry)) {
+    found = entry.length == length && memcmp(entry.text, text, length) == 0;
+  }
+  log_reader_close(&reader);
+  return found;
+}
+
+int connectToServer(int timeoutMs) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(serverPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  long giveUp = nowNanos() + timeoutMs * 1000000L;
+  while (true) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+      return fd;
+    }
+    int connectErrno = errno;
+    close(fd);
+    if (connectErrno != ECONNREFUSED || nowNanos() > giveUp) {
+      errno = connectErrno;
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    // The server may not be listening yet; it may also have died.
+    if (!serverIsRunning()) {
+      fprintf(stderr, "%s: The server exited\n", PROG_NAME);
+      exit(EXIT_ERROR_SOCKET);
+    }
+    usleep(10000);
+  }
+}
+
+void sendFrame(int fd, enum FRAME_TYPE_T type, const char *payload, size_t length) {
+  char header[FRAME_MAX_HEADER_LENGTH];
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = frame_encode_header(header, type, length);
+  iov[1].iov_base = (char *)payload;
+  iov[1].iov_len = length;
+
+  int numIov = 2;
+  struct iovec *next = iov;
+  while (numIov > 0) {
+    ssize_t written = writev(fd, next, numIov);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROG_NAME);
+      exit(EXIT_ERROR_IO);
+    }
+    while (numIov > 0 && (size_t)written >= next->iov_len) {
+      written -= next->iov_len;
+      ++next;
+      --numIov;
+    }
+    if (numIov > 0) {
+      next->iov_base = (char *)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+}
+
+bool expectMessage(struct receiver_t *receiver, const char *text, size_t length) {
+  // Whatever was read past the message is kept for the next call.
+  static char buffer[READ_BUFFER_SIZE];
+  static size_t buffered = 0;
+
+  long giveUp = nowNanos() + DELIVERY_TIMEOUT_MS * 1000000L;
+  while (true) {
+    size_t consumed = 0;
+    while (consumed < buffered) {
+      size_t used;
+      enum FRAME_RESULT_T parsed = frame_parse(&receiver->parser, buffer + consumed,
+        buffered - consumed, &used);
+      consumed += used;
+      if (parsed == FRAME_ERROR) {
+        fprintf(stderr, "%s: Bad frame from the server\n", PROG_NAME);
+        return false;
+      }
+      if (parsed == FRAME_INCOMPLETE) {
+        break;
+      }
+
+      struct frame_parser_t *parser = &receiver->parser;
+      enum FRAME_TYPE_T type = parser->type;
+      size_t payloadLength = parser->length;
+      frame_parser_reset(&receiver->parser, receiver->payload, MAX_PAYLOAD_SIZE - 1);
+      if (type != FRAME_ROOM_MESSAGE) {
+        continue;
+      }
+
+      // Skip the room name.
+      const char *room = receiver->payload;
+      size_t roomLength = strnlen(room, payloadLength);
+      if (roomLength == payloadLength) {
+        return false;
+      }
+      buffered -= consumed;
+      memmove(buffer, buffer + consumed, buffered);
+      return payloadLength - roomLength - 1 == length &&
+        memcmp(room + roomLength + 1, text, length) == 0;
+    }
+    buffered = 0;
+
+    long left = (giveUp - nowNanos()) / 1000000L;
+    struct pollfd readable = {.fd = receiver->fd, .events = POLLIN};
+    if (left <= 0 || poll(&readable, 1, left) <= 0) {
+      return false;
+    }
+    ssize_t chars = read(receiver->fd, buffer, READ_BUFFER_SIZE);
+    if (chars < 0 && errno == EINTR) {
+      continue;
+    }
+    if (chars <= 0) {
+      return false;
+    }
+    buffered = chars;
+  }
+}
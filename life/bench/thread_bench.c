@@ -0,0 +1,199 @@
+/*
+File name:  thread_bench.c
+Programmer: Leonard Law
+Class:      CS 239
+Semester:   Fall 2013
+
+Purpose:
+    Times a life_pool_t with 1, 2, 4 and so on threads, up to one for
+    each CPU, on a square board filled a quarter full at random, and
+    reports generations a second for each. Every thread count has to
+    end up with the same board as one thread does.
+
+    Then, however many CPUs there are, a few boards that aren't square
+    or whose rows end partway through a word are run with a handful of
+    thread counts, and have to come out the same as with one thread.
+
+    thread_bench [side [most threads]]
+
+*/
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/board.h"
+
+const int DEFAULT_SIDE = 8192;
+
+// Each thread count runs for about this many cell updates in all, and
+// at least MIN_GENERATIONS generations.
+const double CELLS_PER_RUN = 1L << 33;
+const int MIN_GENERATIONS = 4;
+
+// The boards, width by height, and the thread counts, that are checked
+// against one thread, and for how many generations. Uneven thread
+// counts give bands of uneven height.
+const int CHECK_BOARDS[][2] = {
+	{1000, 777},
+	{37, 1001},
+	{4100, 130},
+};
+const int NUM_CHECK_BOARDS = sizeof(CHECK_BOARDS) / sizeof(CHECK_BOARDS[0]);
+const int CHECK_THREADS[] = {2, 3, 7};
+const int NUM_CHECK_THREADS = sizeof(CHECK_THREADS) / sizeof(CHECK_THREADS[0]);
+const int CHECK_GENERATIONS = 50;
+
+
+double getSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+int parseArgument(char *argument, const char *name) {
+	char *after;
+	int value = strtol(argument, &after, 10);
+	if (after[0] != '\0' || value < 1) {
+		fprintf(stderr, "%s must be a positive int.\n", name);
+		exit(1);
+	}
+	return value;
+}
+
+
+// Fills a width by height board a quarter full at random.
+void fillBoard(uint64_t *board, int width, int height) {
+	srand(width * 31 + height);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x)
+			setCellState(board, x, y, width, rand() % 4 == 0 ? CELL_ALIVE : CELL_DEAD);
+	}
+}
+
+
+// Times generations generations of the width by height board start
+// with numThreads threads, leaving the final board in result. Returns
+// generations a second.
+double timeThreads(int numThreads, int width, int height, int generations,
+		const uint64_t *start, uint64_t *result) {
+	size_t numWords = (size_t)getWordsPerRow(width) * height;
+	struct life_pool_t pool;
+	uint64_t *lifeState = malloc(sizeof(uint64_t) * numWords);
+	uint64_t *nextState = malloc(sizeof(uint64_t) * numWords);
+	if (!lifeState || !nextState || startLifePool(&pool, numThreads, width, height) != 0) {
+		fputs("Out of memory.\n", stderr);
+		exit(1);
+	}
+
+	clearBoards(&pool, lifeState, nextState);
+	memcpy(lifeState, start, numWords * sizeof(uint64_t));
+
+	double startTime = getSeconds();
+	runLifePool(&pool, &lifeState, &nextState, generations);
+	double rate = generations / (getSeconds() - startTime);
+
+	memcpy(result, lifeState, numWords * sizeof(uint64_t));
+	stopLifePool(&pool);
+	free(lifeState);
+	free(nextState);
+	return rate;
+}
+
+
+// Runs a width by height board with every count in CHECK_THREADS.
+// Returns false if one disagrees with a single thread.
+bool checkThreads(int width, int height) {
+	size_t numWords = (size_t)getWordsPerRow(width) * height;
+	uint64_t *start = calloc(sizeof(uint64_t), numWords);
+	uint64_t *expected = calloc(sizeof(uint64_t), numWords);
+	uint64_t *result = calloc(sizeof(uint64_t), numWords);
+	if (!start || !expected || !result) {
+		fputs("Out of memory.\n", stderr);
+		exit(1);
+	}
+
+	fillBoard(start, width, height);
+	timeThreads(1, width, height, CHECK_GENERATIONS, start, expected);
+	bool agreed = true;
+	printf("%dx%d board agrees with 1 thread at", width, height);
+	for (int i = 0; i < NUM_CHECK_THREADS && agreed; ++i) {
+		timeThreads(CHECK_THREADS[i], width, height, CHECK_GENERATIONS, start, result);
+		if (memcmp(expected, result, numWords * sizeof(uint64_t)) != 0) {
+			fprintf(stderr, "\n%d threads disagree with 1 on a %dx%d board.\n",
+				CHECK_THREADS[i], width, height);
+			agreed = false;
+		} else {
+			printf(" %d", CHECK_THREADS[i]);
+		}
+	}
+	if (agreed)
+		printf(" threads\n");
+
+	free(start);
+	free(expected);
+	free(result);
+	return agreed;
+}
+
+
+int main(int argc, char **argv) {
+	int side = DEFAULT_SIDE;
+	int maxThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		side = parseArgument(argv[1], "Side");
+	if (argc > 2)
+		maxThreads = parseArgument(argv[2], "Most threads");
+
+	size_t numWords = (size_t)getWordsPerRow(side) * side;
+	uint64_t *start = calloc(sizeof(uint64_t), numWords);
+	uint64_t *expected = calloc(sizeof(uint64_t), numWords);
+	uint64_t *result = calloc(sizeof(uint64_t), numWords);
+	if (!start || !expected || !result) {
+		fputs("Out of memory.\n", stderr);
+		return 1;
+	}
+
+	fillBoard(start, side, side);
+
+	int generations = CELLS_PER_RUN / ((double)side * side);
+	if (generations < MIN_GENERATIONS)
+		generations = MIN_GENERATIONS;
+
+	printf("%dx%d board, %d generations with %s\n", side, side, generations, pickUpdateKernel()->name);
+	printf("%-8s %14s %10s %11s\n", "threads", "generations/s", "speedup", "efficiency");
+
+	double oneThreadRate = 0;
+	for (int numThreads = 1; numThreads <= maxThreads; ) {
+		double rate = timeThreads(numThreads, side, side, generations, start, result);
+		if (numThreads == 1) {
+			memcpy(expected, result, numWords * sizeof(uint64_t));
+			oneThreadRate = rate;
+		} else if (memcmp(expected, result, numWords * sizeof(uint64_t)) != 0) {
+			fprintf(stderr, "%d threads disagree with 1.\n", numThreads);
+			return 1;
+		}
+		printf("%-8d %14.1f %9.2fx %10.0f%%\n", numThreads, rate, rate / oneThreadRate,
+			100 * rate / oneThreadRate / numThreads);
+
+		// Powers of two, and then the most there is.
+		if (numThreads < maxThreads && numThreads * 2 > maxThreads)
+			numThreads = maxThreads;
+		else
+			numThreads *= 2;
+	}
+
+	free(start);
+	free(expected);
+	free(result);
+
+	for (int i = 0; i < NUM_CHECK_BOARDS; ++i) {
+		if (!checkThreads(CHECK_BOARDS[i][0], CHECK_BOARDS[i][1]))
+			return 1;
+	}
+	return 0;
+}
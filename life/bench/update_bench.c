@@ -0,0 +1,141 @@
+/*
+File name:  update_bench.c
+Programmer: Leonard Law
+Class:      CS 239
+Semester:   Fall 2013
+
+Purpose:
+    Times gameOfLifeUpdate with every kernel this CPU supports, on
+    square boards from 64x64 up to 16384x16384 filled a quarter full at
+    random, and then on a few boards that aren't square or whose rows
+    end partway through a word. Each kernel runs the same number of
+    generations from the same board, and has to end up with the same
+    board as the scalar one.
+
+    update_bench [largest side]
+
+*/
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/board.h"
+
+const int SMALLEST_SIDE = 64;
+const int DEFAULT_LARGEST_SIDE = 16384;
+
+// Boards, width by height, that catch a kernel mishandling the last
+// word of a row or the last rows of the board.
+const int ODD_BOARDS[][2] = {
+	{100, 100},
+	{1000, 37},
+	{37, 1000},
+	{4100, 3001},
+};
+const int NUM_ODD_BOARDS = sizeof(ODD_BOARDS) / sizeof(ODD_BOARDS[0]);
+
+// Each board runs for about this many cell updates in all, and at least
+// MIN_GENERATIONS generations.
+const double CELLS_PER_RUN = 1 << 30;
+const int MIN_GENERATIONS = 4;
+
+
+double getSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// Times every supported kernel on a width by height board and prints a
+// line for each. Returns false if one disagrees with the scalar kernel.
+bool timeKernels(int width, int height) {
+	size_t numWords = (size_t)getWordsPerRow(width) * height;
+	uint64_t *start = calloc(sizeof(uint64_t), numWords);
+	uint64_t *expected = calloc(sizeof(uint64_t), numWords);
+	uint64_t *lifeState = calloc(sizeof(uint64_t), numWords);
+	uint64_t *nextState = calloc(sizeof(uint64_t), numWords);
+	if (!start || !expected || !lifeState || !nextState) {
+		fputs("Out of memory.\n", stderr);
+		exit(1);
+	}
+
+	srand(width * 31 + height);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x)
+			setCellState(start, x, y, width, rand() % 4 == 0 ? CELL_ALIVE : CELL_DEAD);
+	}
+
+	double cells = (double)width * height;
+	int generations = CELLS_PER_RUN / cells;
+	if (generations < MIN_GENERATIONS)
+		generations = MIN_GENERATIONS;
+
+	bool agreed = true;
+	double scalarRate = 0;
+	for (int k = 0; k < NUM_UPDATE_KERNELS; ++k) {
+		const struct update_kernel_t *kernel = &UPDATE_KERNELS[k];
+		if (!kernel->isSupported())
+			continue;
+
+		memcpy(lifeState, start, numWords * sizeof(uint64_t));
+		double startTime = getSeconds();
+		for (int i = 0; i < generations; ++i) {
+			gameOfLifeUpdateWith(kernel, lifeState, nextState, width, height);
+			swapPointers(&lifeState, &nextState);
+		}
+		double rate = cells * generations / (getSeconds() - startTime);
+
+		// The scalar kernel comes first, and the others are checked
+		// against it.
+		if (k == 0) {
+			memcpy(expected, lifeState, numWords * sizeof(uint64_t));
+			scalarRate = rate;
+		} else if (memcmp(expected, lifeState, numWords * sizeof(uint64_t)) != 0) {
+			fprintf(stderr, "%s disagrees with scalar on a %dx%d board.\n", kernel->name, width, height);
+			agreed = false;
+			break;
+		}
+
+		char board[32];
+		snprintf(board, sizeof(board), "%dx%d", width, height);
+		printf("%-12s %-8s %12d %12.0f %9.2fx\n", board, kernel->name, generations,
+			rate / 1e6, rate / scalarRate);
+	}
+
+	free(start);
+	free(expected);
+	free(lifeState);
+	free(nextState);
+	return agreed;
+}
+
+
+int main(int argc, char **argv) {
+	int largestSide = DEFAULT_LARGEST_SIDE;
+	if (argc > 1) {
+		char *after;
+		largestSide = strtol(argv[1], &after, 10);
+		if (after[0] != '\0' || largestSide < SMALLEST_SIDE) {
+			fprintf(stderr, "Largest side must be an int of at least %d.\n", SMALLEST_SIDE);
+			return 1;
+		}
+	}
+
+	printf("Using %s by default\n", pickUpdateKernel()->name);
+	printf("%-12s %-8s %12s %12s %10s\n", "board", "kernel", "generations", "Mcells/s", "speedup");
+
+	for (int side = SMALLEST_SIDE; side <= largestSide; side *= 2) {
+		if (!timeKernels(side, side))
+			return 1;
+	}
+	for (int i = 0; i < NUM_ODD_BOARDS; ++i) {
+		if (!timeKernels(ODD_BOARDS[i][0], ODD_BOARDS[i][1]))
+			return 1;
+	}
+
+	return 0;
+}
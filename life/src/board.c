@@ -0,0 +1,447 @@
+/*
+File name:  board.c
+Programmer: Leonard Law
+Class:      CS 239
+Semester:   Fall 2013
+
+Purpose:
+    The game of life board and the rules that advance it a generation.
+    See board.h.
+
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LIFE_X86
+#include <immintrin.h>
+#endif
+
+#include "board.h"
+
+const int CELL_DEAD = 0;
+const int CELL_ALIVE = 1;
+
+const int CELLS_PER_WORD = 64;
+
+const int MIN_ROWS_PER_THREAD = 256;
+const int MAX_THREADS = 256;
+
+
+int getWordsPerRow(int width) {
+	return (width + CELLS_PER_WORD - 1) / CELLS_PER_WORD;
+}
+
+
+int getCellState(uint64_t *lifeState, int x, int y, int width) {
+	uint64_t word = lifeState[y * getWordsPerRow(width) + x / CELLS_PER_WORD];
+	return (word >> (x % CELLS_PER_WORD)) & 1;
+}
+
+
+void setCellState(uint64_t *lifeState, int x, int y, int width, int state) {
+	uint64_t *word = &lifeState[y * getWordsPerRow(width) + x / CELLS_PER_WORD];
+	uint64_t bit = (uint64_t)1 << (x % CELLS_PER_WORD);
+	*word = state ? (*word | bit) : (*word & ~bit);
+}
+
+
+// Adds up bits a, b and c in each of the 64 positions at once: sum gets
+// the ones and carry the twos.
+static inline void addBits(uint64_t a, uint64_t b, uint64_t c, uint64_t *sum, uint64_t *carry) {
+	*sum = a ^ b ^ c;
+	*carry = (a & b) | (c & (a ^ b));
+}
+
+
+// Word w of a row as seen from the cell to its left or right: each cell's
+// bit replaced by its west or east neighbor's, bringing in the bit
+// across the word boundary. Cells off the edge of the board are dead.
+static inline uint64_t westNeighbors(const uint64_t *row, int w) {
+	return (row[w] << 1) | (w > 0 ? row[w - 1] >> (CELLS_PER_WORD - 1) : 0);
+}
+
+static inline uint64_t eastNeighbors(const uint64_t *row, int w, int wordsPerRow) {
+	return (row[w] >> 1) | (w + 1 < wordsPerRow ? row[w + 1] << (CELLS_PER_WORD - 1) : 0);
+}
+
+
+// The next generation of word w of the row in the middle. above and
+// below are NULL at the top and bottom of the board.
+static inline uint64_t updateWord(const uint64_t *above, const uint64_t *row, const uint64_t *below,
+		int w, int wordsPerRow) {
+	// Count the neighbors in binary, each row of three first.
+	uint64_t aboveOnes = 0, aboveTwos = 0, belowOnes = 0, belowTwos = 0;
+	if (above) {
+		addBits(westNeighbors(above, w), above[w], eastNeighbors(above, w, wordsPerRow),
+			&aboveOnes, &aboveTwos);
+	}
+	if (below) {
+		addBits(westNeighbors(below, w), below[w], eastNeighbors(below, w, wordsPerRow),
+			&belowOnes, &belowTwos);
+	}
+	uint64_t sideOnes, sideTwos;
+	addBits(westNeighbors(row, w), eastNeighbors(row, w, wordsPerRow), 0, &sideOnes, &sideTwos);
+
+	uint64_t ones, onesCarry;
+	addBits(aboveOnes, belowOnes, sideOnes, &ones, &onesCarry);
+	uint64_t twos, twosCarry, fours;
+	addBits(aboveTwos, belowTwos, sideTwos, &twos, &twosCarry);
+	fours = twosCarry | (twos & onesCarry);
+	twos ^= onesCarry;
+
+	// Alive with 3 neighbors, or with 2 if it already was. 4 or more
+	// leaves something in fours.
+	return twos & ~fours & (ones | row[w]);
+}
+
+
+static void updateRowScalar(const uint64_t *above, const uint64_t *row, const uint64_t *below,
+		uint64_t *next, int wordsPerRow, uint64_t lastWordMask) {
+	for (int w = 0; w < wordsPerRow; ++w)
+		next[w] = updateWord(above, row, below, w, wordsPerRow);
+	next[wordsPerRow - 1] &= lastWordMask;
+}
+
+
+static bool isScalarSupported(void) {
+	return true;
+}
+
+
+#ifdef LIFE_X86
+
+// The vector kernels run the same adders as updateWord on several words
+// at once. Loading the words one to either side, unaligned, brings in
+// the bits across each word boundary, so only the first and last words
+// of a row, which have nothing on one side, are left to updateWord.
+
+__attribute__((target("sse2")))
+static inline void addBitsSse2(__m128i a, __m128i b, __m128i c, __m128i *sum, __m128i *carry) {
+	__m128i halfSum = _mm_xor_si128(a, b);
+	*sum = _mm_xor_si128(halfSum, c);
+	*carry = _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, halfSum));
+}
+
+// Like westNeighbors and eastNeighbors, for the words from w on.
+__attribute__((target("sse2")))
+static inline __m128i westNeighborsSse2(const uint64_t *row, int w) {
+	return _mm_or_si128(_mm_slli_epi64(_mm_loadu_si128((const __m128i *)(row + w)), 1),
+		_mm_srli_epi64(_mm_loadu_si128((const __m128i *)(row + w - 1)), CELLS_PER_WORD - 1));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i eastNeighborsSse2(const uint64_t *row, int w) {
+	return _mm_or_si128(_mm_srli_epi64(_mm_loadu_si128((const __m128i *)(row + w)), 1),
+		_mm_slli_epi64(_mm_loadu_si128((const __m128i *)(row + w + 1)), CELLS_PER_WORD - 1));
+}
+
+__attribute__((target("sse2")))
+static void updateRowSse2(const uint64_t *above, const uint64_t *row, const uint64_t *below,
+		uint64_t *next, int wordsPerRow, uint64_t lastWordMask) {
+	const int step = sizeof(__m128i) / sizeof(uint64_t);
+	next[0] = updateWord(above, row, below, 0, wordsPerRow);
+
+	int w = 1;
+	for (; w + step < wordsPerRow; w += step) {
+		__m128i aboveOnes, aboveTwos, belowOnes, belowTwos, sideOnes, sideTwos;
+		addBitsSse2(westNeighborsSse2(above, w), _mm_loadu_si128((const __m128i *)(above + w)),
+			eastNeighborsSse2(above, w), &aboveOnes, &aboveTwos);
+		addBitsSse2(westNeighborsSse2(below, w), _mm_loadu_si128((const __m128i *)(below + w)),
+			eastNeighborsSse2(below, w), &belowOnes, &belowTwos);
+		addBitsSse2(westNeighborsSse2(row, w), eastNeighborsSse2(row, w), _mm_setzero_si128(),
+			&sideOnes, &sideTwos);
+
+		__m128i ones, onesCarry, twos, twosCarry;
+		addBitsSse2(aboveOnes, belowOnes, sideOnes, &ones, &onesCarry);
+		addBitsSse2(aboveTwos, belowTwos, sideTwos, &twos, &twosCarry);
+		__m128i fours = _mm_or_si128(twosCarry, _mm_and_si128(twos, onesCarry));
+		twos = _mm_xor_si128(twos, onesCarry);
+
+		__m128i cells = _mm_loadu_si128((const __m128i *)(row + w));
+		__m128i alive = _mm_andnot_si128(fours, _mm_and_si128(twos, _mm_or_si128(ones, cells)));
+		_mm_storeu_si128((__m128i *)(next + w), alive);
+	}
+
+	for (; w < wordsPerRow; ++w)
+		next[w] = updateWord(above, row, below, w, wordsPerRow);
+	next[wordsPerRow - 1] &= lastWordMask;
+}
+
+
+__attribute__((target("avx2")))
+static inline void addBitsAvx2(__m256i a, __m256i b, __m256i c, __m256i *sum, __m256i *carry) {
+	__m256i halfSum = _mm256_xor_si256(a, b);
+	*sum = _mm256_xor_si256(halfSum, c);
+	*carry = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, halfSum));
+}
+
+// Like westNeighbors and eastNeighbors, for the words from w on.
+__attribute__((target("avx2")))
+static inline __m256i westNeighborsAvx2(const uint64_t *row, int w) {
+	return _mm256_or_si256(_mm256_slli_epi64(_mm256_loadu_si256((const __m256i *)(row + w)), 1),
+		_mm256_srli_epi64(_mm256_loadu_si256((const __m256i *)(row + w - 1)), CELLS_PER_WORD - 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i eastNeighborsAvx2(const uint64_t *row, int w) {
+	return _mm256_or_si256(_mm256_srli_epi64(_mm256_loadu_si256((const __m256i *)(row + w)), 1),
+		_mm256_slli_epi64(_mm256_loadu_si256((const __m256i *)(row + w + 1)), CELLS_PER_WORD - 1));
+}
+
+__attribute__((target("avx2")))
+static void updateRowAvx2(const uint64_t *above, const uint64_t *row, const uint64_t *below,
+		uint64_t *next, int wordsPerRow, uint64_t lastWordMask) {
+	const int step = sizeof(__m256i) / sizeof(uint64_t);
+	next[0] = updateWord(above, row, below, 0, wordsPerRow);
+
+	int w = 1;
+	for (; w + step < wordsPerRow; w += step) {
+		__m256i aboveOnes, aboveTwos, belowOnes, belowTwos, sideOnes, sideTwos;
+		addBitsAvx2(westNeighborsAvx2(above, w), _mm256_loadu_si256((const __m256i *)(above + w)),
+			eastNeighborsAvx2(above, w), &aboveOnes, &aboveTwos);
+		addBitsAvx2(westNeighborsAvx2(below, w), _mm256_loadu_si256((const __m256i *)(below + w)),
+			eastNeighborsAvx2(below, w), &belowOnes, &belowTwos);
+		addBitsAvx2(westNeighborsAvx2(row, w), eastNeighborsAvx2(row, w), _mm256_setzero_si256(),
+			&sideOnes, &sideTwos);
+
+		__m256i ones, onesCarry, twos, twosCarry;
+		addBitsAvx2(aboveOnes, belowOnes, sideOnes, &ones, &onesCarry);
+		addBitsAvx2(aboveTwos, belowTwos, sideTwos, &twos, &twosCarry);
+		__m256i fours = _mm256_or_si256(twosCarry, _mm256_and_si256(twos, onesCarry));
+		twos = _mm256_xor_si256(twos, onesCarry);
+
+		__m256i cells = _mm256_loadu_si256((const __m256i *)(row + w));
+		__m256i alive = _mm256_andnot_si256(fours, _mm256_and_si256(twos, _mm256_or_si256(ones, cells)));
+		_mm256_storeu_si256((__m256i *)(next + w), alive);
+	}
+
+	for (; w < wordsPerRow; ++w)
+		next[w] = updateWord(above, row, below, w, wordsPerRow);
+	next[wordsPerRow - 1] &= lastWordMask;
+}
+
+
+// These ask CPUID, through the compiler's runtime.
+static bool isSse2Supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool isAvx2Supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+
+const struct update_kernel_t UPDATE_KERNELS[] = {
+	{ "scalar", updateRowScalar, isScalarSupported },
+#ifdef LIFE_X86
+	{ "sse2", updateRowSse2, isSse2Supported },
+	{ "avx2", updateRowAvx2, isAvx2Supported },
+#endif
+};
+const int NUM_UPDATE_KERNELS = sizeof(UPDATE_KERNELS) / sizeof(UPDATE_KERNELS[0]);
+
+
+const struct update_kernel_t *pickUpdateKernel(void) {
+	const struct update_kernel_t *kernel = &UPDATE_KERNELS[0];
+	for (int i = 1; i < NUM_UPDATE_KERNELS; ++i) {
+		if (UPDATE_KERNELS[i].isSupported())
+			kernel = &UPDATE_KERNELS[i];
+	}
+	return kernel;
+}
+
+
+// Works out the next generation of rows from up to, but not including,
+// to.
+static void updateRows(const struct update_kernel_t *kernel, uint64_t *lifeState, uint64_t *nextState,
+		int width, int height, int from, int to) {
+	int wordsPerRow = getWordsPerRow(width);
+	if (wordsPerRow <= 0)
+		return;
+	int lastWordCells = width - (wordsPerRow - 1) * CELLS_PER_WORD;
+	uint64_t lastWordMask = (lastWordCells == CELLS_PER_WORD) ? ~(uint64_t)0 :
+		((uint64_t)1 << lastWordCells) - 1;
+
+	for (int y = from; y < to; ++y) {
+		uint64_t *row = lifeState + (size_t)y * wordsPerRow;
+		uint64_t *next = nextState + (size_t)y * wordsPerRow;
+		if (y > 0 && y + 1 < height) {
+			kernel->updateRow(row - wordsPerRow, row, row + wordsPerRow, next, wordsPerRow, lastWordMask);
+		} else {
+			updateRowScalar(y > 0 ? row - wordsPerRow : NULL, row, y + 1 < height ? row + wordsPerRow : NULL,
+				next, wordsPerRow, lastWordMask);
+		}
+	}
+}
+
+
+void gameOfLifeUpdateWith(const struct update_kernel_t *kernel,
+		uint64_t *lifeState, uint64_t *nextState, int width, int height) {
+	updateRows(kernel, lifeState, nextState, width, height, 0, height);
+}
+
+
+void gameOfLifeUpdate(uint64_t *lifeState, uint64_t *nextState, int width, int height) {
+	static const struct update_kernel_t *kernel = NULL;
+	if (!kernel)
+		kernel = pickUpdateKernel();
+	gameOfLifeUpdateWith(kernel, lifeState, nextState, width, height);
+}
+
+
+void swapPointers(uint64_t **a, uint64_t **b) {
+	uint64_t *temp = *a;
+	*a = *b;
+	*b = temp;
+}
+
+
+int pickNumThreads(int height) {
+	long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int numThreads = height / MIN_ROWS_PER_THREAD;
+	if (numThreads > numCpus)
+		numThreads = numCpus;
+	if (numThreads > MAX_THREADS)
+		numThreads = MAX_THREADS;
+	return numThreads < 1 ? 1 : numThreads;
+}
+
+
+// The rows thread index works on: the board split into numThreads
+// bands, as even as they come.
+static int getBandStart(const struct life_pool_t *pool, int index) {
+	return (int)((long)pool->height * index / pool->numThreads);
+}
+
+
+// Waits for every thread to be done with its band.
+static void waitForBands(struct life_pool_t *pool) {
+	if (pool->numThreads > 1)
+		pthread_barrier_wait(&pool->bandsDone);
+}
+
+
+// What thread index does with each job: every generation of its band,
+// waiting after each for the other bands to be done, so that nobody
+// reads a row of the next generation before it has been written. Every
+// thread swaps its own copy of the pointers. Once the last wait is over
+// the caller may hand out the next job, so nothing in pool is looked at
+// after it.
+static void runBand(struct life_pool_t *pool, int index) {
+	int from = getBandStart(pool, index);
+	int to = getBandStart(pool, index + 1);
+	uint64_t *lifeState = pool->lifeState;
+	uint64_t *nextState = pool->nextState;
+	int generations = pool->generations;
+
+	if (generations == 0) {
+		// Clearing the boards, so that the pages of each band are first
+		// touched by, and so allocated near, the thread that updates it.
+		size_t wordsPerRow = getWordsPerRow(pool->width);
+		memset(lifeState + from * wordsPerRow, 0, (to - from) * wordsPerRow * sizeof(uint64_t));
+		memset(nextState + from * wordsPerRow, 0, (to - from) * wordsPerRow * sizeof(uint64_t));
+		waitForBands(pool);
+		return;
+	}
+
+	for (int i = 0; i < generations; ++i) {
+		updateRows(pool->kernel, lifeState, nextState, pool->width, pool->height, from, to);
+		waitForBands(pool);
+		swapPointers(&lifeState, &nextState);
+	}
+}
+
+
+static void *runWorker(void *arg) {
+	struct life_worker_t *worker = arg;
+	struct life_pool_t *pool = worker->pool;
+	while (true) {
+		pthread_barrier_wait(&pool->jobStart);
+		if (pool->stopping)
+			return NULL;
+		runBand(pool, worker->index);
+	}
+}
+
+
+// Hands the job in pool to every thread, the caller included as thread
+// 0, and returns once it is done.
+static void runJob(struct life_pool_t *pool) {
+	if (pool->numThreads > 1)
+		pthread_barrier_wait(&pool->jobStart);
+	runBand(pool, 0);
+}
+
+
+int startLifePool(struct life_pool_t *pool, int numThreads, int width, int height) {
+	pool->numThreads = numThreads < 1 ? 1 : numThreads;
+	pool->width = width;
+	pool->height = height;
+	pool->kernel = pickUpdateKernel();
+	pool->stopping = false;
+	pool->workers = NULL;
+	if (pool->numThreads == 1)
+		return 0;
+
+	pool->workers = calloc(pool->numThreads, sizeof(struct life_worker_t));
+	if (!pool->workers)
+		return -1;
+	if (pthread_barrier_init(&pool->jobStart, NULL, pool->numThreads) != 0 ||
+			pthread_barrier_init(&pool->bandsDone, NULL, pool->numThreads) != 0) {
+		free(pool->workers);
+		return -1;
+	}
+
+	for (int i = 1; i < pool->numThreads; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i;
+		if (pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]) != 0) {
+			fputs("Could not start a thread.\n", stderr);
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+
+void clearBoards(struct life_pool_t *pool, uint64_t *lifeState, uint64_t *nextState) {
+	pool->lifeState = lifeState;
+	pool->nextState = nextState;
+	pool->generations = 0;
+	runJob(pool);
+}
+
+
+void runLifePool(struct life_pool_t *pool, uint64_t **lifeState, uint64_t **nextState, int generations) {
+	if (generations <= 0)
+		return;
+	pool->lifeState = *lifeState;
+	pool->nextState = *nextState;
+	pool->generations = generations;
+	runJob(pool);
+	for (int i = 0; i < generations; ++i)
+		swapPointers(lifeState, nextState);
+}
+
+
+void stopLifePool(struct life_pool_t *pool) {
+	if (pool->numThreads == 1)
+		return;
+	pool->stopping = true;
+	pthread_barrier_wait(&pool->jobStart);
+	for (int i = 1; i < pool->numThreads; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+	pthread_barrier_destroy(&pool->jobStart);
+	pthread_barrier_destroy(&pool->bandsDone);
+	free(pool->workers);
+}
@@ -0,0 +1,133 @@
+/*
+File name:  board.h
+Programmer: Leonard Law
+Class:      CS 239
+Semester:   Fall 2013
+
+Purpose:
+    The game of life board and the rules that advance it a generation.
+
+    The board is kept as a bitboard: one bit per cell, 64 cells to a
+    uint64_t, with every row starting on a word of its own. A
+    generation is worked out a word at a time, by adding up the
+    neighbors of all 64 cells at once with bitwise adders.
+
+    On x86, the same adders also run on SSE2 and AVX2 registers, 2 and
+    4 words at a time. The widest kernel the CPU supports is picked the
+    first time gameOfLifeUpdate is called.
+
+    Big boards are split into bands of rows, one for each thread of a
+    life_pool_t. The threads wait for each other at a barrier after
+    every generation.
+
+*/
+#ifndef LIFE_BOARD_H
+#define LIFE_BOARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+extern const int CELL_DEAD;
+extern const int CELL_ALIVE;
+
+extern const int CELLS_PER_WORD;
+
+// pickNumThreads gives each thread at least this many rows, and uses no
+// more than this many threads.
+extern const int MIN_ROWS_PER_THREAD;
+extern const int MAX_THREADS;
+
+
+// Each row takes up this many words. Cell x of a row is bit x % 64 of
+// word x / 64; the bits past the last cell are always 0.
+int getWordsPerRow(int width);
+
+int getCellState(uint64_t *lifeState, int x, int y, int width);
+void setCellState(uint64_t *lifeState, int x, int y, int width, int state);
+
+
+// Works out the next generation of the row in the middle. above and
+// below are the rows around it, which a kernel may count on being there;
+// the top and bottom rows of the board always go through the scalar
+// kernel. The bits past the last cell are cleared with lastWordMask.
+typedef void (*row_update_t)(const uint64_t *above, const uint64_t *row, const uint64_t *below,
+	uint64_t *next, int wordsPerRow, uint64_t lastWordMask);
+
+struct update_kernel_t {
+	const char *name;
+	row_update_t updateRow;
+	// Whether this CPU can run it.
+	bool (*isSupported)(void);
+};
+
+// Every kernel built in, narrowest first. The scalar one always comes
+// first and is always supported.
+extern const struct update_kernel_t UPDATE_KERNELS[];
+extern const int NUM_UPDATE_KERNELS;
+
+// The widest kernel this CPU supports.
+const struct update_kernel_t *pickUpdateKernel(void);
+
+
+// Writes the generation after lifeState to nextState, with the kernel
+// from pickUpdateKernel.
+void gameOfLifeUpdate(uint64_t *lifeState, uint64_t *nextState, int width, int height);
+
+// Like gameOfLifeUpdate, with the given kernel.
+void gameOfLifeUpdateWith(const struct update_kernel_t *kernel,
+	uint64_t *lifeState, uint64_t *nextState, int width, int height);
+
+void swapPointers(uint64_t **a, uint64_t **b);
+
+
+struct life_worker_t {
+	struct life_pool_t *pool;
+	int index;
+	pthread_t thread;
+};
+
+// Threads that update a board of width by height cells together, each
+// its own band of rows. The thread that calls clearBoards and
+// runLifePool works on the first band.
+struct life_pool_t {
+	int numThreads;
+	int width;
+	int height;
+	const struct update_kernel_t *kernel;
+
+	// workers[0] is the caller, and has no thread of its own.
+	struct life_worker_t *workers;
+	pthread_barrier_t jobStart;
+	pthread_barrier_t bandsDone;
+
+	// The job being done: generations of the board in lifeState, or,
+	// if generations is 0, clearing the boards. stopping tells the
+	// threads to exit instead.
+	uint64_t *lifeState;
+	uint64_t *nextState;
+	int generations;
+	bool stopping;
+};
+
+// How many threads to update a board of height rows with: one for each
+// CPU, as long as each gets MIN_ROWS_PER_THREAD rows.
+int pickNumThreads(int height);
+
+// Starts numThreads - 1 threads. Returns -1 if there isn't the memory.
+int startLifePool(struct life_pool_t *pool, int numThreads, int width, int height);
+
+// Zeroes both boards, each thread its own band, so that on a NUMA
+// machine the memory of each band ends up on the node that updates it.
+// Boards should be allocated with malloc and cleared with this before
+// anything else touches them.
+void clearBoards(struct life_pool_t *pool, uint64_t *lifeState, uint64_t *nextState);
+
+// Advances lifeState by generations generations, swapping it with
+// nextState after each, as gameOfLifeUpdate and swapPointers would.
+void runLifePool(struct life_pool_t *pool, uint64_t **lifeState, uint64_t **nextState, int generations);
+
+// Stops the threads.
+void stopLifePool(struct life_pool_t *pool);
+
+#endif
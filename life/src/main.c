@@ -13,9 +13,14 @@ Purpose:
 
     [rows columns [filename [generations]]]
 
+    The board and the rules live in board.c.
+
 */
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+
+#include "board.h"
 
 char *DEFAULT_STATE_FILENAME = "life.txt";
 const char *DEFAULT_OUTPUT_FILENAME = "output.txt";
@@ -24,53 +29,15 @@ const int DEFAULT_WIDTH = 10;
 const int DEFAULT_HEIGHT = 10;
 const int DEFAULT_ITERATIONS = 10;
 
-const int CELL_DEAD = 0;
-const int CELL_ALIVE = 1;
+// Exit status when the board or its threads can't be allocated. Bad
+// arguments and files exit with 1.
+const int EXIT_ERROR_MEMORY = 2;
 
 const char CELL_ALIVE_CHAR = '*';
 const char CELL_DEAD_CHAR = '-';
 
 
-int getCellState(int *lifeState, int x, int y, int width, int height) {
-	if (x < 0 || x >= width || y < 0 || y >= height)
-		return CELL_DEAD;
-	return lifeState[y * height + x];
-}
-
-
-int getNumAliveNeighbors(int *lifeState, int x, int y, int width, int height) {
-	size_t cellsToCheck = 8;
-	int dx[] = {-1, 0, 1, -1, 1, -1, 0, 1};
-	int dy[] = {-1, -1, -1, 0, 0, 1, 1, 1};
-
-	int neighbors = 0;
-	for (size_t i = 0; i < cellsToCheck; ++i) {
-		// Alive is 1, dead is 0. Therefore we can get the # of alive
-		// neighbors simply by summing their states.
-		neighbors += getCellState(lifeState, x + dx[i], y + dy[i], width, height);
-	}
-
-	return neighbors;
-}
-
-
-void gameOfLifeUpdate(int *lifeState, int *nextState, int width, int height) {
-	int aliveNeighbors;
-	for (int y = 0, i = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x, ++i) {
-			aliveNeighbors = getNumAliveNeighbors(lifeState, x, y, width, height);
-			if ((lifeState[i] && (aliveNeighbors == 2 || aliveNeighbors == 3)) ||
-					((!lifeState[i]) && (aliveNeighbors == 3))) {
-				nextState[i] = CELL_ALIVE;
-			} else {
-				nextState[i] = CELL_DEAD;
-			}
-		}
-	}
-}
-
-
-int loadLifeState(FILE *filePointer, int *lifeState, int width, int height) {
+int loadLifeState(FILE *filePointer, uint64_t *lifeState, int width, int height) {
 	// Read the life grid
 
 	int x = 0;
@@ -79,7 +46,7 @@ int loadLifeState(FILE *filePointer, int *lifeState, int width, int height) {
 
 	while ((c = fgetc(filePointer)) != EOF && y < height) {
 		if (c == '*') {
-			lifeState[y * width + x] = CELL_ALIVE;
+			setCellState(lifeState, x, y, width, CELL_ALIVE);
 		}
 
 		// We are done with this cell. Update!
@@ -102,12 +69,12 @@ int loadLifeState(FILE *filePointer, int *lifeState, int width, int height) {
 	return 0;
 }
 
-// Grids are stored flat as a 1D array of ints.
-int printLifeState(FILE *filePointer, int *gameState, int width, int height) {
+// Grids are stored as bitboards; see getWordsPerRow.
+int printLifeState(FILE *filePointer, uint64_t *gameState, int width, int height) {
 	// Unwrap the grid into 2D.
-	for (int i = 0, y = 0; y < height; ++y) {
-		for (int x = 0; x < width; ++x, ++i) {
-			fprintf(filePointer, "%c", gameState[i] ? CELL_ALIVE_CHAR : CELL_DEAD_CHAR);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			fprintf(filePointer, "%c", getCellState(gameState, x, y, width) ? CELL_ALIVE_CHAR : CELL_DEAD_CHAR);
 		}
 		fprintf(filePointer, "\n");
 	}
@@ -115,13 +82,6 @@ int printLifeState(FILE *filePointer, int *gameState, int width, int height) {
 }
 
 
-void swapPointers(int **a, int **b) {
-	int *temp = *a;
-	*a = *b;
-	*b = temp;
-}
-
-
 int overwriteArgumentsFromCommandline(
 	int *width,
 	int *height,
@@ -219,8 +179,22 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	int *lifeState = calloc(sizeof(int), width * height);
-	int *nextState = calloc(sizeof(int), width * height);
+	struct life_pool_t pool;
+	if (startLifePool(&pool, pickNumThreads(height), width, height) != 0) {
+		perror(argv[0]);
+		return EXIT_ERROR_MEMORY;
+	}
+
+	// Left for the pool to clear, so that each thread's rows are close
+	// to it.
+	size_t numWords = (size_t)getWordsPerRow(width) * height;
+	uint64_t *lifeState = malloc(sizeof(uint64_t) * numWords);
+	uint64_t *nextState = malloc(sizeof(uint64_t) * numWords);
+	if (!lifeState || !nextState) {
+		perror(argv[0]);
+		return EXIT_ERROR_MEMORY;
+	}
+	clearBoards(&pool, lifeState, nextState);
 
 	loadLifeState(stateFilePointer, lifeState, width, height);
 	fclose(stateFilePointer);
@@ -230,11 +204,11 @@ int main(int argc, char **argv) {
 		printLifeState(outputFilePointer, lifeState, width, height);
 		fputs(divider, outputFilePointer);
 
-		gameOfLifeUpdate(lifeState, nextState, width, height);
-		swapPointers(&lifeState, &nextState);
+		runLifePool(&pool, &lifeState, &nextState, 1);
 	}
 
 	fclose(outputFilePointer);
+	stopLifePool(&pool);
 
 	// Cleanup anything dynamically allocated in this function
 	free(lifeState);